@@ -0,0 +1,381 @@
+/* Compile-time benchmarks of the quantum pipeline on generated workloads of increasing size */
+
+#include "mlir/IR/MLIRContext.h"
+#include "mlir/IR/Module.h"
+#include "mlir/InitAllDialects.h"
+#include "mlir/Parser.h"
+#include "mlir/Pass/PassManager.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "QuantumPipeline.h"
+#include "PassReport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static llvm::cl::list<std::string> workloads("workloads", llvm::cl::desc("Workloads to run (default: all)"),
+                                             llvm::cl::ZeroOrMore, llvm::cl::MiscFlags::CommaSeparated);
+static llvm::cl::list<unsigned> sizes("sizes", llvm::cl::desc("Workload sizes to run, in increasing order (default: 4,8,16,32)"),
+                                      llvm::cl::ZeroOrMore, llvm::cl::MiscFlags::CommaSeparated);
+static llvm::cl::opt<std::string> jsonFile("json", llvm::cl::desc("Also write the pass reports of all runs to a JSON file"),
+                                           llvm::cl::value_desc("filename"));
+static llvm::cl::opt<bool> dumpInput("dump", llvm::cl::desc("Print the generated workloads instead of compiling them"));
+
+//===------------------------------------------------------------------------------------------===//
+// Workload generators
+//===------------------------------------------------------------------------------------------===//
+//
+// All workloads are written in the input dialect with a `mlir_main` entry circuit, so that they
+// run through the same pipeline as `run-jit -lower -strip -inline -qopt -emit=mlir-scf`.
+
+namespace {
+
+std::string reg(unsigned idx) {
+    return "%r[" + std::to_string(idx) + "]";
+}
+
+// float literal in exponent notation, to keep precision for small angles
+std::string angle(double val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6e", val);
+    return buf;
+}
+
+// unrolled QFT on n qubits: O(n^2) controlled rotations
+void writeQFTCircuit(llvm::raw_ostream &os, unsigned n) {
+    os << "q.circ @qft(%r: !q.qureg<>) {\n";
+    for (unsigned k = n; k-- > 0;) {
+        os << "    q.H " << reg(k) << " : !q.qureg<>\n";
+        for (unsigned j = 0; j < k; j++) {
+            std::string op = "%R" + std::to_string(k) + "_" + std::to_string(j);
+            os << "    " << op << " = q.R(" << angle(std::ldexp(M_PI, -(int) j - 1)) << ") -> !q.u1\n";
+            os << "    q.ctrl " << op << ", " << reg(k - j - 1) << ", " << reg(k)
+               << " : !q.u1, !q.qureg<>, !q.qureg<>\n";
+        }
+    }
+    for (unsigned i = 0; i < n / 2; i++)
+        os << "    q.SWAP " << reg(i) << ", " << reg(n - i - 1) << " : !q.qureg<>, !q.qureg<>\n";
+    os << "}\n\n";
+}
+
+void writeMainHeader(llvm::raw_ostream &os, unsigned nqubits) {
+    os << "q.circ @mlir_main() {\n";
+    os << "    %n = constant " << nqubits << " : index\n";
+    os << "    %r = q.allocreg(%n) -> !q.qureg<>\n";
+}
+
+void writeMainFooter(llvm::raw_ostream &os) {
+    os << "    q.freereg %r : !q.qureg<>\n";
+    os << "}\n";
+}
+
+void generateQFT(llvm::raw_ostream &os, unsigned n) {
+    writeQFTCircuit(os, n);
+    writeMainHeader(os, n);
+    os << "    q.call @qft(%r) : !q.qureg<>\n";
+    writeMainFooter(os);
+}
+
+// modular exponentiation skeleton: n controlled QFT adders, with an adjoint QFT in each adder
+void generateModExp(llvm::raw_ostream &os, unsigned n) {
+    writeQFTCircuit(os, n);
+    os << "q.circ @add(%r: !q.qureg<>) {\n";
+    os << "    q.call @qft(%r) : !q.qureg<>\n";
+    for (unsigned k = 0; k < n; k++)
+        os << "    q.R(" << angle(M_PI / (k + 1)) << ") " << reg(k) << " : !q.qureg<>\n";
+    os << "    %qft = q.getval @qft -> !q.circ\n";
+    os << "    %qft_inv = q.adj %qft : !q.circ -> !q.circ\n";
+    os << "    q.apply %qft_inv(%r) : !q.circ(!q.qureg<>)\n";
+    os << "}\n\n";
+
+    writeMainHeader(os, n);
+    os << "    %c = q.allocreg(%n) -> !q.qureg<>\n";
+    os << "    %add = q.getval @add -> !q.circ\n";
+    for (unsigned i = 0; i < n; i++) {
+        std::string op = "%cadd" + std::to_string(i);
+        os << "    " << op << " = q.ctrl %add, %c[" << i << "] : !q.circ, !q.qureg<> -> !q.cop<1, !q.circ>\n";
+        os << "    q.apply " << op << "(%r) : !q.cop<1, !q.circ>(!q.qureg<>)\n";
+    }
+    os << "    q.freereg %c : !q.qureg<>\n";
+    writeMainFooter(os);
+}
+
+// scf.for nest of the given depth with gates at every level
+void generateLoops(llvm::raw_ostream &os, unsigned depth) {
+    writeMainHeader(os, 2);
+    os << "    %c0 = constant 0 : index\n";
+    os << "    %c1 = constant 1 : index\n";
+    os << "    %c2 = constant 2 : index\n";
+    std::string indent = "    ";
+    for (unsigned d = 0; d < depth; d++) {
+        std::string iv = "%i" + std::to_string(d);
+        os << indent << "scf.for " << iv << " = %c0 to %c2 step %c1 {\n";
+        indent += "    ";
+        os << indent << "q.H %r[" << iv << "] : !q.qureg<>\n";
+        os << indent << "q.X %r[" << iv << "] : !q.qureg<>\n";
+    }
+    os << indent << "q.CX " << reg(0) << ", " << reg(1) << " : !q.qureg<>, !q.qureg<>\n";
+    for (unsigned d = 0; d < depth; d++) {
+        indent.resize(indent.size() - 4);
+        os << indent << "}\n";
+    }
+    writeMainFooter(os);
+}
+
+// binary tree of n small circuits calling each other
+void generateCallGraph(llvm::raw_ostream &os, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        os << "q.circ @c" << i << "(%r: !q.qureg<>) {\n";
+        os << "    q.H " << reg(0) << " : !q.qureg<>\n";
+        os << "    q.CX " << reg(0) << ", " << reg(1) << " : !q.qureg<>, !q.qureg<>\n";
+        for (unsigned callee = 2 * i + 1; callee <= 2 * i + 2 && callee < n; callee++)
+            os << "    q.call @c" << callee << "(%r) : !q.qureg<>\n";
+        os << "    q.RZ(0.25) " << reg(1) << " : !q.qureg<>\n";
+        os << "}\n\n";
+    }
+    writeMainHeader(os, 2);
+    os << "    q.call @c0(%r) : !q.qureg<>\n";
+    writeMainFooter(os);
+}
+
+// n rounds of circuit calls with their adjoints, controlled circuits, and adjoint gates
+void generateMetaOps(llvm::raw_ostream &os, unsigned n) {
+    os << "q.circ @u(%r: !q.qureg<>) {\n";
+    os << "    q.H " << reg(0) << " : !q.qureg<>\n";
+    os << "    q.CX " << reg(0) << ", " << reg(1) << " : !q.qureg<>, !q.qureg<>\n";
+    os << "    q.RZ(0.3) " << reg(1) << " : !q.qureg<>\n";
+    os << "}\n\n";
+
+    writeMainHeader(os, 2);
+    os << "    %q = q.alloc -> !q.qubit\n";
+    os << "    %u = q.getval @u -> !q.circ\n";
+    os << "    %ua = q.adj %u : !q.circ -> !q.circ\n";
+    os << "    %cu = q.ctrl %u, %q : !q.circ, !q.qubit -> !q.cop<1, !q.circ>\n";
+    for (unsigned i = 0; i < n; i++) {
+        std::string x = "%x" + std::to_string(i), ax = "%ax" + std::to_string(i);
+        os << "    q.apply %u(%r) : !q.circ(!q.qureg<>)\n";
+        os << "    q.apply %cu(%r) : !q.cop<1, !q.circ>(!q.qureg<>)\n";
+        os << "    " << x << " = q.X -> !q.u1\n";
+        os << "    " << ax << " = q.adj " << x << " : !q.u1 -> !q.u1\n";
+        os << "    q.ctrl " << ax << ", %q, " << reg(0) << " : !q.u1, !q.qubit, !q.qureg<>\n";
+        os << "    q.apply %ua(%r) : !q.circ(!q.qureg<>)\n";
+    }
+    os << "    q.free %q : !q.qubit\n";
+    writeMainFooter(os);
+}
+
+struct Workload {
+    const char *name;
+    void (*generate)(llvm::raw_ostream &os, unsigned size);
+};
+
+const Workload allWorkloads[] = {
+    {"qft", generateQFT},
+    {"modexp", generateModExp},
+    {"loops", generateLoops},
+    {"callgraph", generateCallGraph},
+    {"metaops", generateMetaOps},
+};
+
+//===------------------------------------------------------------------------------------------===//
+// Driver
+//===------------------------------------------------------------------------------------------===//
+
+// the quantum pipeline of `run-jit -lower -strip -inline -qopt -emit=mlir-scf`
+mlir::quantum::QuantumPipelineOptions getPipelineOptions() {
+    mlir::quantum::QuantumPipelineOptions options;
+    options.lowerControls = true;
+    options.strip = true;
+    options.inlineCircuits = true;
+    options.optimize = true;
+    options.lowering = mlir::quantum::QuantumPipelineOptions::Lowering::ResourceCounting;
+    return options;
+}
+
+// current resident set size of the process in MiB
+double getCurrentMemory() {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return resident * (double) sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+// Reset the peak resident set size of the process to its current size, so that the peak of each
+// workload can be measured on its own. Only supported on Linux, elsewhere the peak of the process
+// so far is kept.
+void resetPeakMemory() {
+    if (FILE *clearRefs = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", clearRefs);
+        fclose(clearRefs);
+    }
+}
+
+// peak resident set size of the process since the last reset in MiB
+double getPeakMemory() {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+        char line[128];
+        long peakKiB = -1;
+        while (fgets(line, sizeof(line), status))
+            if (sscanf(line, "VmHWM: %ld kB", &peakKiB) == 1)
+                break;
+        fclose(status);
+        if (peakKiB >= 0)
+            return peakKiB / 1024.0;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+// one line of the result table, the memory is only shown if given
+void printRow(llvm::StringRef workload, unsigned size, llvm::StringRef pass, double seconds,
+              uint64_t ops, llvm::Optional<double> memory = llvm::None) {
+    llvm::outs() << llvm::format("%-10s %6u  %-28s %10.3f %10llu %12.0f",
+                                 workload.str().c_str(), size, pass.str().c_str(), seconds * 1000,
+                                 (unsigned long long) ops, seconds > 0 ? ops / seconds : 0.0);
+    if (memory)
+        llvm::outs() << llvm::format(" %10.1f", *memory);
+    llvm::outs() << "\n";
+}
+
+uint64_t countOps(mlir::ModuleOp module) {
+    uint64_t count = 0;
+    module.walk([&](mlir::Operation *) { count++; });
+    return count;
+}
+
+// compile one workload, returns false if the pipeline failed
+bool runWorkload(mlir::MLIRContext &context, const Workload &workload, unsigned size,
+                 llvm::json::OStream *json) {
+    // the memory of a workload is its peak over the memory in use before it
+    resetPeakMemory();
+    double baseMemory = getCurrentMemory();
+
+    std::string source;
+    llvm::raw_string_ostream os(source);
+    workload.generate(os, size);
+    os.flush();
+
+    if (dumpInput) {
+        llvm::outs() << "// " << workload.name << " " << size << "\n" << source << "\n";
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    llvm::SourceMgr sourceMgr;
+    sourceMgr.AddNewSourceBuffer(llvm::MemoryBuffer::getMemBuffer(source, workload.name), llvm::SMLoc());
+    mlir::OwningModuleRef module = mlir::parseSourceFile(sourceMgr, &context);
+    double parseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!module) {
+        llvm::errs() << "Could not parse generated workload " << workload.name << "\n";
+        return false;
+    }
+    uint64_t numOps = countOps(*module);
+    printRow(workload.name, size, "(parse)", parseTime, numOps);
+
+    mlir::quantum::PassReport report;
+    mlir::quantum::QuantumPipeline pipeline(context, getPipelineOptions());
+    pipeline.forEachPassManager([&](mlir::PassManager &pm) { report.instrument(pm); });
+    bool succeeded = mlir::succeeded(pipeline.run(*module));
+
+    // memory is only reported per workload, as the peak usage is not tracked per pass
+    double totalTime = parseTime;
+    for (auto &record : report.getRecords()) {
+        printRow(workload.name, size, record.name, record.seconds, record.opsBefore);
+        totalTime += record.seconds;
+    }
+    double peakMemory = std::max(getPeakMemory() - baseMemory, 0.0);
+    printRow(workload.name, size, "(total)", totalTime, numOps, peakMemory);
+
+    if (json) {
+        json->object([&] {
+            json->attribute("workload", workload.name);
+            json->attribute("size", (int64_t) size);
+            json->attribute("parse-time-ms", parseTime * 1000);
+            json->attribute("peak-memory-mb", peakMemory);
+            json->attributeBegin("report");
+            report.writeJSON(*json);
+            json->attributeEnd();
+        });
+    }
+
+    if (!succeeded)
+        llvm::errs() << "Pipeline failed on workload " << workload.name << " " << size << "\n";
+    return succeeded;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    llvm::InitLLVM y(argc, argv);
+    mlir::registerPassManagerCLOptions();
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Quantum compiler benchmarks\n");
+
+    mlir::MLIRContext context(/*loadAllDialects=*/false);
+    context.getOrLoadDialect<mlir::StandardOpsDialect>();
+    context.getOrLoadDialect<mlir::scf::SCFDialect>();
+    context.getOrLoadDialect<mlir::vector::VectorDialect>();
+    context.getOrLoadDialect<mlir::quantum::QuantumDialect>();
+    context.getOrLoadDialect<mlir::quantumssa::QuantumSSADialect>();
+
+    std::vector<const Workload*> selected;
+    for (const Workload &workload : allWorkloads)
+        if (workloads.empty() || llvm::is_contained(workloads, workload.name))
+            selected.push_back(&workload);
+    for (const std::string &name : workloads) {
+        if (llvm::none_of(allWorkloads, [&](const Workload &w) { return name == w.name; })) {
+            llvm::errs() << "Unknown workload " << name << "\n";
+            return 1;
+        }
+    }
+    std::vector<unsigned> runSizes(sizes.begin(), sizes.end());
+    if (runSizes.empty())
+        runSizes = {4, 8, 16, 32};
+
+    std::unique_ptr<llvm::raw_fd_ostream> jsonStream;
+    std::unique_ptr<llvm::json::OStream> json;
+    if (!jsonFile.empty()) {
+        std::error_code EC;
+        jsonStream = std::make_unique<llvm::raw_fd_ostream>(jsonFile, EC);
+        if (EC) {
+            llvm::errs() << "Could not open output file: " << EC.message() << "\n";
+            return 1;
+        }
+        json = std::make_unique<llvm::json::OStream>(*jsonStream, /*IndentSize=*/2);
+        json->arrayBegin();
+    }
+
+    if (!dumpInput)
+        llvm::outs() << llvm::format("%-10s %6s  %-28s %10s %10s %12s %10s\n", "workload", "size", "pass",
+                                     "time [ms]", "ops", "ops/s", "peak [MiB]");
+    bool succeeded = true;
+    for (const Workload *workload : selected)
+        for (unsigned size : runSizes)
+            succeeded &= runWorkload(context, *workload, size, json.get());
+
+    if (json) {
+        json->arrayEnd();
+        *jsonStream << "\n";
+    }
+    return succeeded ? 0 : 1;
+}
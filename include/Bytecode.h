@@ -0,0 +1,28 @@
+#ifndef MLIR_QUANTUM_BYTECODE_H
+#define MLIR_QUANTUM_BYTECODE_H
+
+#include "mlir/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace mlir {
+namespace quantum {
+
+// Compact binary encoding of modules, as an alternative to the textual format between
+// pipeline stages. Operations are stored generically (name, operands, attributes, regions),
+// so that no custom parsers or printers are involved. Types and attributes of the quantum
+// dialects and common builtin ones are encoded directly, any other ones in textual form.
+// Types and attributes are uniqued in tables and only materialized when first referenced.
+
+// check whether the buffer starts with the bytecode magic number
+bool isBytecode(llvm::MemoryBufferRef buffer);
+
+void writeBytecode(ModuleOp module, llvm::raw_ostream &os);
+
+// returns null and emits an error for malformed inputs, the buffer must outlive the call
+OwningModuleRef readBytecode(llvm::MemoryBufferRef buffer, MLIRContext *context);
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_BYTECODE_H
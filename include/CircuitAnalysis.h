@@ -0,0 +1,48 @@
+#ifndef MLIR_QUANTUM_CIRCUIT_ANALYSIS_H
+#define MLIR_QUANTUM_CIRCUIT_ANALYSIS_H
+
+#include "mlir/IR/Operation.h"
+#include "llvm/ADT/StringMap.h"
+
+#include "QuantumSSADialect.h"
+
+#include <string>
+#include <vector>
+
+namespace mlir {
+namespace quantum {
+
+// Symbol table of the circuits of a module with the number of symbol references to each of
+// them (calls and circuit values), built in a single walk over the module. This is a module
+// analysis (getAnalysis<CircuitUseAnalysis>()): passes which add or remove circuits or
+// references either keep it up to date and mark it preserved, or let it be invalidated.
+class CircuitUseAnalysis {
+public:
+    explicit CircuitUseAnalysis(Operation *module);
+
+    // circuit with the given name, null if there is none
+    quantumssa::CircuitOp lookup(StringRef name) const {
+        return circuits.lookup(name);
+    }
+
+    // number of references to the symbol from within the module
+    unsigned getNumUses(StringRef name) const {
+        return numUses.lookup(name);
+    }
+
+    // add a circuit that was inserted into the module, with the references in its body
+    void insert(quantumssa::CircuitOp circ);
+
+    // erase a circuit and drop the references in its body, returns the referenced symbols
+    // which are no longer used afterwards
+    std::vector<std::string> erase(quantumssa::CircuitOp circ);
+
+private:
+    llvm::StringMap<quantumssa::CircuitOp> circuits;
+    llvm::StringMap<unsigned> numUses;
+};
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_CIRCUIT_ANALYSIS_H
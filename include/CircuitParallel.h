@@ -0,0 +1,19 @@
+#ifndef MLIR_QUANTUM_CIRCUIT_PARALLEL_H
+#define MLIR_QUANTUM_CIRCUIT_PARALLEL_H
+
+#include "llvm/ADT/STLExtras.h"
+
+#include "QuantumSSADialect.h"
+
+namespace mlir {
+namespace quantum {
+
+// Call fn(index) for each of the given circuits, on all cores if multithreading is enabled in
+// their context. Circuits are isolated from above, so each call may modify its own circuit
+// (circuits[index]), but no other ops of the module. Diagnostics are reported in circuit order.
+void forEachCircuitParallel(ArrayRef<quantumssa::CircuitOp> circuits, function_ref<void(size_t index)> fn);
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_CIRCUIT_PARALLEL_H
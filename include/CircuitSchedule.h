@@ -0,0 +1,52 @@
+#ifndef MLIR_QUANTUM_CIRCUIT_SCHEDULE_H
+#define MLIR_QUANTUM_CIRCUIT_SCHEDULE_H
+
+#include "mlir/IR/Operation.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace mlir {
+namespace quantum {
+
+// ASAP schedule of the quantum ops of a block on their qubit wires. An op starts as soon as all
+// qubits it acts on are available and occupies them for its latency. The qubits of static
+// registers are tracked individually through extractions and insertions, while ops on whole
+// registers occupy every qubit of the register.
+//
+// Ops with regions, circuit calls, terminators and classical ops with side effects are
+// barriers: the block is split into segments at barriers, and each segment is scheduled
+// on its own, starting at time 0 (see isScheduleBarrier).
+class WireSchedule {
+public:
+    // schedule a quantum op after its quantum operands, returns its start time
+    int64_t schedule(Operation *op, int64_t latency);
+
+    // start time the op would get, without scheduling it
+    int64_t getStart(Operation *op) const;
+
+    // finish time of the last scheduled op, i.e. the critical path length
+    int64_t getDepth() const {
+        return depth;
+    }
+
+    void clear() {
+        times.clear();
+        depth = 0;
+    }
+
+private:
+    // time from which each qubit of a state is available, one entry per qubit of static
+    // registers, a single entry for qubits and registers of dynamic size
+    llvm::DenseMap<Value, llvm::SmallVector<int64_t, 1>> times;
+    int64_t depth = 0;
+
+    llvm::SmallVector<int64_t, 1> getTimes(Value state) const;
+};
+
+// whether an op ends a segment of the schedule
+bool isScheduleBarrier(Operation *op);
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_CIRCUIT_SCHEDULE_H
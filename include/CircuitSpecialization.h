@@ -0,0 +1,49 @@
+#ifndef MLIR_QUANTUM_CIRCUIT_SPECIALIZATION_H
+#define MLIR_QUANTUM_CIRCUIT_SPECIALIZATION_H
+
+#include "mlir/IR/Operation.h"
+#include "llvm/ADT/STLExtras.h"
+
+#include <map>
+#include <string>
+#include <tuple>
+
+namespace mlir {
+namespace quantum {
+
+// Cache of specialized copies of circuits, as created when propagating control or adjoint
+// modifiers into the circuit body. Entries are keyed on the symbol of the original circuit,
+// the number of controls, and whether the adjoint was taken, so that each specialization
+// is only materialized once per module regardless of the number of call sites.
+class CircuitSpecializationCache {
+public:
+    Operation* lookup(StringRef circ, int64_t nctrls, bool adjoint) const {
+        auto it = cache.find(Key(circ.str(), nctrls, adjoint));
+        return it != cache.end() ? it->second : nullptr;
+    }
+
+    void insert(StringRef circ, int64_t nctrls, bool adjoint, Operation *specialized) {
+        cache[Key(circ.str(), nctrls, adjoint)] = specialized;
+    }
+
+    void clear() {
+        cache.clear();
+    }
+
+private:
+    using Key = std::tuple<std::string, int64_t, bool>;
+    std::map<Key, Operation*> cache;
+};
+
+// Clone a circuit under a new name in a single walk over its body. The attributes of every op
+// are copied into the attribute list of its operation state and passed to `amendAttrs` before
+// the copy is created, so that specializations which only change attributes (such as control
+// counts) need no second walk setting the attributes of the created ops. The clone is not
+// inserted anywhere.
+Operation* cloneSpecialized(Operation *circ, StringRef name,
+                            llvm::function_ref<void(Operation *op, NamedAttrList &attrs)> amendAttrs);
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_CIRCUIT_SPECIALIZATION_H
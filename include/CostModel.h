@@ -0,0 +1,68 @@
+#ifndef MLIR_QUANTUM_COST_MODEL_H
+#define MLIR_QUANTUM_COST_MODEL_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+#include <string>
+#include <vector>
+
+namespace mlir {
+namespace quantum {
+
+// Cost of the quantum gates after decomposition into a target gate set, in terms of a number of
+// metrics such as the count of R rotations, T gates or CNOTs. For every metric, a gate has a
+// cost with zero, one and two controls, and a cost for each further control (typically a
+// Toffoli pair computing the conjunction of two controls into an ancilla). Count metrics are
+// additive, while the cost of a gate in a depth metric (`depth` or `<name>-depth`) is its
+// latency, which is used to schedule the gates on their qubits.
+class CostModel {
+public:
+    // Clifford+T decomposition with the metrics R, T, CNOT, T-depth and depth (one step per gate)
+    static CostModel getDefault();
+
+    // parse a model in the JSON format described in lib/Transforms/README.md
+    static llvm::Expected<CostModel> parse(llvm::StringRef json);
+    static llvm::Expected<CostModel> loadFile(llvm::StringRef path);
+    // the model of a JSON file, or the default model for an empty path, with only the given metrics
+    static llvm::Expected<CostModel> load(llvm::StringRef path, llvm::ArrayRef<std::string> metrics);
+
+    // only keep the given metrics, in the given order
+    llvm::Error selectMetrics(llvm::ArrayRef<std::string> names);
+
+    llvm::ArrayRef<std::string> getMetrics() const {
+        return metrics;
+    }
+
+    unsigned getNumMetrics() const {
+        return metrics.size();
+    }
+
+    // whether the i-th metric is a depth, i.e. given by a critical path instead of a sum
+    bool isDepthMetric(unsigned i) const {
+        llvm::StringRef name = metrics[i];
+        return name == "depth" || name.endswith("-depth");
+    }
+
+    // cost in every metric of a gate (op name without dialect prefix) with n controls,
+    // gates missing from the model are free
+    void getCost(llvm::StringRef gate, int64_t n, llvm::SmallVectorImpl<int64_t> &cost) const;
+
+private:
+    struct MetricCost {
+        int64_t controls[3];
+        int64_t extraControl;
+    };
+
+    std::vector<std::string> metrics;
+    // cost of each gate in every metric
+    llvm::StringMap<llvm::SmallVector<MetricCost, 4>> gates;
+};
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_COST_MODEL_H
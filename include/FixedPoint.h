@@ -0,0 +1,27 @@
+#ifndef MLIR_QUANTUM_FIXED_POINT_H
+#define MLIR_QUANTUM_FIXED_POINT_H
+
+#include "mlir/IR/Module.h"
+#include "mlir/Pass/PassManager.h"
+
+namespace mlir {
+namespace quantum {
+
+// Run a group of optimization passes repeatedly until no circuit changes any more, or the
+// budget of rounds is spent. The passes of the group report the circuits they changed with
+// markChanged. Circuits that were not changed in a round are marked converged and skipped by
+// the passes in later rounds (isConverged), except for patterns spanning several circuits.
+// Passes that report nothing are run every round, but don't keep the loop going on their own.
+LogicalResult runToFixedPoint(PassManager &group, ModuleOp module, unsigned maxRounds,
+                              unsigned *numRounds = nullptr);
+
+// whether a circuit can be skipped by the passes of a fixed-point group
+bool isConverged(Operation *circ);
+
+// report a change to a circuit to the fixed-point driver, has no effect outside of it
+void markChanged(Operation *circ);
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_FIXED_POINT_H
@@ -0,0 +1,67 @@
+#ifndef MLIR_QUANTUM_PASS_REPORT_H
+#define MLIR_QUANTUM_PASS_REPORT_H
+
+#include "mlir/Pass/PassManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mlir {
+namespace quantum {
+
+// Machine-readable summary of the passes run by one or more pass managers. For every pass the
+// number of runs, the wall time, the number of ops in the IR before and after the pass, and
+// the pass statistics are recorded. Repeated runs of the same pass (e.g. when compiling one
+// top-level op at a time) are accumulated into a single entry.
+class PassReport {
+public:
+    // record all passes run by the pass manager
+    void instrument(PassManager &pm);
+
+    void writeJSON(llvm::raw_ostream &os) const;
+    // write the report as a single value into a larger document
+    void writeJSON(llvm::json::OStream &json) const;
+
+    struct PassRecord {
+        std::string name;
+        unsigned runs = 0;
+        unsigned failures = 0;
+        double seconds = 0;
+        uint64_t opsBefore = 0;
+        uint64_t opsAfter = 0;
+        std::vector<std::pair<std::string, uint64_t>> statistics;
+    };
+
+    // passes in the order of their first execution
+    llvm::ArrayRef<PassRecord> getRecords() const {
+        return records;
+    }
+
+    // forget all recorded passes
+    void clear();
+
+    // called by the instrumentation around each pass execution
+    void beforePass(unsigned pipeline, Pass *pass, Operation *op);
+    void afterPass(unsigned pipeline, Pass *pass, Operation *op, bool failed);
+
+private:
+    // passes are identified by their pipeline, as pass instances don't outlive their manager
+    using PassKey = std::pair<unsigned, Pass*>;
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mutex;
+    unsigned numPipelines = 0;
+    std::vector<PassRecord> records;
+    llvm::DenseMap<PassKey, unsigned> recordIds;
+    llvm::DenseMap<PassKey, Clock::time_point> startTimes;
+};
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_PASS_REPORT_H
@@ -1,15 +1,60 @@
 #ifndef MLIR_QUANTUM_PASSES_H
 #define MLIR_QUANTUM_PASSES_H
 
+#include <string>
+
 namespace mlir {
 namespace quantum {
 
+struct ResourceCounterOptions {
+    // count loops and circuit calls via closed-form cost summaries where possible
+    bool summarize = false;
+    // JSON file with the gate decomposition costs, empty for the built-in Clifford+T model
+    std::string costModel;
+    // comma separated metrics of the cost model to count, printed in this order
+    std::string metrics = "R,T";
+    // also count the peak number of live qubits, printed after the metrics
+    bool peakQubits = false;
+    // record the calls and cost of each circuit in the profiling runtime (run-jit/lib/qprof.cpp)
+    bool profile = false;
+};
+
+struct GateFusionOptions {
+    // maximum number of qubits of a fused unitary
+    unsigned maxQubits = 3;
+};
+
+struct SchedulingOptions {
+    // JSON file with the gate latencies, empty for the built-in Clifford+T model
+    std::string costModel;
+    // depth metric of the cost model whose latencies are scheduled
+    std::string metric = "depth";
+};
+
+struct CircuitInlinerOptions {
+    // maximum gate cost of a callee to be inlined, 0 for no limit
+    unsigned threshold = 0;
+    // maximum growth of the module gate count due to inlining in percent, 0 for no limit
+    unsigned growthBudget = 0;
+};
+
 std::unique_ptr<Pass> createMemToValPass();
 std::unique_ptr<Pass> createQuantumGateOptimizationPass();
-std::unique_ptr<Pass> createCircuitInlinerPass();
-std::unique_ptr<Pass> createResourceCounterPass();
+std::unique_ptr<Pass> createCommutationCancelPass();
+std::unique_ptr<Pass> createRegisterConsolidationPass();
+std::unique_ptr<Pass> createQubitReusePass();
+std::unique_ptr<Pass> createGateSchedulingPass(const SchedulingOptions &options = {});
+std::unique_ptr<Pass> createGateFusionPass(const GateFusionOptions &options = {});
+std::unique_ptr<Pass> createCircuitInlinerPass(const CircuitInlinerOptions &options = {});
+std::unique_ptr<Pass> createResourceCounterPass(const ResourceCounterOptions &options = {});
 std::unique_ptr<Pass> createStripUnusedCircuitPass();
+std::unique_ptr<Pass> createCircuitDeduplicationPass();
 std::unique_ptr<Pass> createLowerControlledCircuitsPass();
+std::unique_ptr<Pass> createAdjointMaterializationPass();
+std::unique_ptr<Pass> createSimulationLoweringPass();
+
+// make the passes above available to textual pass pipelines
+void registerQuantumPasses();
 
 } // end namespace quantum
 } // end namespace mlir
@@ -0,0 +1,61 @@
+#ifndef MLIR_QUANTUM_PIPELINE_H
+#define MLIR_QUANTUM_PIPELINE_H
+
+#include "mlir/IR/Module.h"
+#include "mlir/Pass/PassManager.h"
+
+#include "Passes.h"
+
+namespace mlir {
+namespace quantum {
+
+struct QuantumPipelineOptions {
+    // convert the input to value semantics and consolidate its register accesses
+    bool memToVal = true;
+    bool lowerControls = false;
+    // merge structurally identical circuits, e.g. the controlled copies of different circuits
+    bool dedup = false;
+    // remove unused circuit definitions, before and after inlining and in the optimizations
+    bool strip = false;
+    bool inlineCircuits = false;
+    CircuitInlinerOptions inliner;
+    // run the quantum optimizations as a group until they reach a fixed point
+    bool optimize = false;
+    unsigned optRounds = 4;
+
+    bool materializeAdjoints = false;
+    bool reuseQubits = false;
+    bool schedule = false;
+    SchedulingOptions scheduling;
+
+    // the last stage, which replaces the quantum operations of the program
+    enum class Lowering { None, ResourceCounting, Simulation };
+    Lowering lowering = Lowering::None;
+    ResourceCounterOptions counting;
+    // fuse gates into unitaries on up to this number of qubits before simulating (0: no fusion)
+    unsigned fuseQubits = 0;
+};
+
+// The quantum pipeline of run-jit (and qiro-bench), split around the quantum optimizations,
+// which are run as a group until they reach a fixed point (see runToFixedPoint).
+struct QuantumPipeline {
+    QuantumPipeline(MLIRContext &context, const QuantumPipelineOptions &options);
+
+    LogicalResult run(ModuleOp module);
+
+    // apply fn to all pass managers of the pipeline, e.g. to instrument them
+    void forEachPassManager(function_ref<void(PassManager &)> fn);
+
+    PassManager pm;
+    PassManager optPM;
+    PassManager lateStagePM;
+
+private:
+    bool optimize;
+    unsigned optRounds;
+};
+
+} // end namespace quantum
+} // end namespace mlir
+
+#endif // MLIR_QUANTUM_PIPELINE_H
@@ -0,0 +1,872 @@
+#include "mlir/IR/Attributes.h"
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/Location.h"
+#include "mlir/IR/StandardTypes.h"
+#include "mlir/IR/Verifier.h"
+#include "mlir/Parser.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Bytecode.h"
+
+#include <cstring>
+
+using namespace mlir;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Bytecode format
+//===------------------------------------------------------------------------------------------===//
+//
+// file    := magic version strings types attrs op
+// strings := count (len bytes)*
+// types   := count (len payload)*          payload := kind fields, nested types as indices
+// attrs   := count (len payload)*
+// op      := name loc count type* count operand* count (name attr)* count block* count region*
+// region  := count (count type*)* (count op*)*  (all block arguments first, then the blocks)
+// operand := (id << 1 | forward) type?     (forward references carry their type)
+//
+// All integers are LEB128 encoded, signed ones zigzag encoded, doubles as 8 raw bytes.
+// Values are numbered in the order they are created when reading: the arguments of all blocks
+// of a region, then the ops of each block, with the results of an op numbered after its regions.
+
+namespace {
+
+constexpr char magic[] = {'Q', 'I', 'R', 'B'};
+constexpr uint64_t version = 1;
+
+enum class TypeKind : uint64_t {
+    Text, Index, Integer, Float, Function, Vector, Tensor, MemRef, None,
+    Qubit = 16, Qureg, U1, U2, COp, Circ,
+    Qstate = 32, Rstate, SSAU1, SSAU2, SSACOp, SSACirc
+};
+
+enum class AttrKind : uint64_t {
+    Text, Unit, Integer, Float, String, Type, SymbolRef, Array, DenseInt, DenseFloat
+};
+
+enum class LocKind : uint64_t {
+    Unknown, FileLineCol
+};
+
+void writeVarInt(std::string &out, uint64_t val) {
+    do {
+        uint8_t byte = val & 0x7f;
+        val >>= 7;
+        out.push_back(val ? byte | 0x80 : byte);
+    } while (val);
+}
+
+void writeSignedVarInt(std::string &out, int64_t val) {
+    writeVarInt(out, ((uint64_t) val << 1) ^ (uint64_t) (val >> 63));
+}
+
+void writeDouble(std::string &out, double val) {
+    char bytes[sizeof(double)];
+    std::memcpy(bytes, &val, sizeof(double));
+    out.append(bytes, sizeof(double));
+}
+
+void writeKind(std::string &out, TypeKind kind) { writeVarInt(out, (uint64_t) kind); }
+void writeKind(std::string &out, AttrKind kind) { writeVarInt(out, (uint64_t) kind); }
+
+void writeOptional(std::string &out, Optional<int> val) {
+    writeVarInt(out, val ? *val + 1 : 0);
+}
+
+unsigned getIntWidth(Type type) {
+    return type.isIndex() ? 64 : type.getIntOrFloatBitWidth();
+}
+
+bool isF32OrF64(Type type) {
+    return type.isF32() || type.isF64();
+}
+
+//===------------------------------------------------------------------------------------------===//
+// Writer
+//===------------------------------------------------------------------------------------------===//
+
+class BytecodeWriter {
+public:
+    void write(ModuleOp module, llvm::raw_ostream &os) {
+        numberOp(module.getOperation());
+
+        std::string body;
+        writeOp(body, module.getOperation(), {});
+
+        std::string header(magic, sizeof(magic));
+        writeVarInt(header, version);
+        writeVarInt(header, strings.size());
+        for (StringRef str : strings) {
+            writeVarInt(header, str.size());
+            header += str;
+        }
+        writeVarInt(header, numTypes);
+        header += typeSection;
+        writeVarInt(header, numAttrs);
+        header += attrSection;
+
+        os << header << body;
+    }
+
+private:
+    // the string map owns the text of printed types & attributes
+    llvm::StringMap<unsigned> stringIds;
+    std::vector<StringRef> strings;
+
+    DenseMap<Type, unsigned> typeIds;
+    std::string typeSection;
+    unsigned numTypes = 0;
+
+    DenseMap<Attribute, unsigned> attrIds;
+    std::string attrSection;
+    unsigned numAttrs = 0;
+
+    DenseMap<Value, uint64_t> valueIds;
+    uint64_t nextValueId = 0;
+    // number of values the reader has created at the current position
+    uint64_t numDefined = 0;
+
+    unsigned getStringId(StringRef str) {
+        auto it = stringIds.try_emplace(str, strings.size());
+        if (it.second)
+            strings.push_back(it.first->getKey());
+        return it.first->second;
+    }
+
+    template<class T> std::string print(T entity) {
+        std::string text;
+        llvm::raw_string_ostream os(text);
+        entity.print(os);
+        return os.str();
+    }
+
+    void writeShape(std::string &out, ArrayRef<int64_t> shape) {
+        writeVarInt(out, shape.size());
+        for (int64_t dim : shape)
+            writeVarInt(out, dim + 1);
+    }
+
+    void encodeType(std::string &out, Type type) {
+        if (type.isIndex()) {
+            writeKind(out, TypeKind::Index);
+        } else if (auto intType = type.dyn_cast<IntegerType>()) {
+            writeKind(out, TypeKind::Integer);
+            writeVarInt(out, intType.getWidth());
+            writeVarInt(out, intType.getSignedness());
+        } else if (type.isF16() || type.isBF16() || type.isF32() || type.isF64()) {
+            writeKind(out, TypeKind::Float);
+            writeVarInt(out, type.isF16() ? 0 : type.isBF16() ? 1 : type.isF32() ? 2 : 3);
+        } else if (auto funcType = type.dyn_cast<FunctionType>()) {
+            writeKind(out, TypeKind::Function);
+            writeVarInt(out, funcType.getNumInputs());
+            for (Type input : funcType.getInputs())
+                writeVarInt(out, getTypeId(input));
+            writeVarInt(out, funcType.getNumResults());
+            for (Type result : funcType.getResults())
+                writeVarInt(out, getTypeId(result));
+        } else if (auto vecType = type.dyn_cast<VectorType>()) {
+            writeKind(out, TypeKind::Vector);
+            writeShape(out, vecType.getShape());
+            writeVarInt(out, getTypeId(vecType.getElementType()));
+        } else if (auto tensorType = type.dyn_cast<RankedTensorType>()) {
+            writeKind(out, TypeKind::Tensor);
+            writeShape(out, tensorType.getShape());
+            writeVarInt(out, getTypeId(tensorType.getElementType()));
+        } else if (type.isa<MemRefType>() && type.cast<MemRefType>().getAffineMaps().empty() &&
+                   !type.cast<MemRefType>().getMemorySpace()) {
+            auto memrefType = type.cast<MemRefType>();
+            writeKind(out, TypeKind::MemRef);
+            writeShape(out, memrefType.getShape());
+            writeVarInt(out, getTypeId(memrefType.getElementType()));
+        } else if (type.isa<NoneType>()) {
+            writeKind(out, TypeKind::None);
+
+        } else if (type.isa<quantum::QubitType>()) {
+            writeKind(out, TypeKind::Qubit);
+        } else if (auto qureg = type.dyn_cast<quantum::QuregType>()) {
+            writeKind(out, TypeKind::Qureg);
+            writeOptional(out, qureg.getNumQubits());
+        } else if (type.isa<quantum::U1Type>()) {
+            writeKind(out, TypeKind::U1);
+        } else if (type.isa<quantum::U2Type>()) {
+            writeKind(out, TypeKind::U2);
+        } else if (auto cop = type.dyn_cast<quantum::COpType>()) {
+            unsigned baseId = getTypeId(cop.getBaseType());
+            writeKind(out, TypeKind::COp);
+            writeOptional(out, cop.getNumCtrls());
+            writeVarInt(out, baseId);
+        } else if (type.isa<quantum::CircType>()) {
+            writeKind(out, TypeKind::Circ);
+
+        } else if (type.isa<quantumssa::QstateType>()) {
+            writeKind(out, TypeKind::Qstate);
+        } else if (auto rstate = type.dyn_cast<quantumssa::RstateType>()) {
+            writeKind(out, TypeKind::Rstate);
+            writeOptional(out, rstate.getNumQubits());
+        } else if (type.isa<quantumssa::U1Type>()) {
+            writeKind(out, TypeKind::SSAU1);
+        } else if (type.isa<quantumssa::U2Type>()) {
+            writeKind(out, TypeKind::SSAU2);
+        } else if (auto cop = type.dyn_cast<quantumssa::COpType>()) {
+            unsigned baseId = getTypeId(cop.getBaseType());
+            writeKind(out, TypeKind::SSACOp);
+            writeOptional(out, cop.getNumCtrls());
+            writeVarInt(out, baseId);
+        } else if (type.isa<quantumssa::CircType>()) {
+            writeKind(out, TypeKind::SSACirc);
+
+        } else {
+            writeKind(out, TypeKind::Text);
+            writeVarInt(out, getStringId(print(type)));
+        }
+    }
+
+    // nested types are added to the table first, so that entries only refer to earlier ones
+    unsigned getTypeId(Type type) {
+        auto it = typeIds.find(type);
+        if (it != typeIds.end())
+            return it->second;
+
+        std::string payload;
+        encodeType(payload, type);
+        writeVarInt(typeSection, payload.size());
+        typeSection += payload;
+        return typeIds[type] = numTypes++;
+    }
+
+    void encodeAttr(std::string &out, Attribute attr) {
+        if (attr.isa<UnitAttr>()) {
+            writeKind(out, AttrKind::Unit);
+        } else if (attr.isa<IntegerAttr>() && getIntWidth(attr.getType()) <= 64) {
+            writeKind(out, AttrKind::Integer);
+            writeVarInt(out, getTypeId(attr.getType()));
+            writeSignedVarInt(out, attr.cast<IntegerAttr>().getValue().getSExtValue());
+        } else if (attr.isa<FloatAttr>() && isF32OrF64(attr.getType())) {
+            writeKind(out, AttrKind::Float);
+            writeVarInt(out, getTypeId(attr.getType()));
+            writeDouble(out, attr.cast<FloatAttr>().getValueAsDouble());
+        } else if (attr.isa<StringAttr>() && attr.getType().isa<NoneType>()) {
+            writeKind(out, AttrKind::String);
+            writeVarInt(out, getStringId(attr.cast<StringAttr>().getValue()));
+        } else if (auto typeAttr = attr.dyn_cast<TypeAttr>()) {
+            writeKind(out, AttrKind::Type);
+            writeVarInt(out, getTypeId(typeAttr.getValue()));
+        } else if (auto symRef = attr.dyn_cast<FlatSymbolRefAttr>()) {
+            writeKind(out, AttrKind::SymbolRef);
+            writeVarInt(out, getStringId(symRef.getValue()));
+        } else if (auto arrayAttr = attr.dyn_cast<ArrayAttr>()) {
+            SmallVector<unsigned, 8> elements;
+            for (Attribute element : arrayAttr)
+                elements.push_back(getAttrId(element));
+            writeKind(out, AttrKind::Array);
+            writeVarInt(out, elements.size());
+            for (unsigned id : elements)
+                writeVarInt(out, id);
+        } else if (attr.isa<DenseIntElementsAttr>() &&
+                   getIntWidth(attr.cast<DenseIntElementsAttr>().getType().getElementType()) <= 64) {
+            auto dense = attr.cast<DenseIntElementsAttr>();
+            writeKind(out, AttrKind::DenseInt);
+            writeVarInt(out, getTypeId(dense.getType()));
+            writeVarInt(out, dense.isSplat() ? 1 : dense.getNumElements());
+            for (APInt val : dense.getIntValues()) {
+                writeSignedVarInt(out, val.getSExtValue());
+                if (dense.isSplat())
+                    break;
+            }
+        } else if (attr.isa<DenseFPElementsAttr>() &&
+                   isF32OrF64(attr.cast<DenseFPElementsAttr>().getType().getElementType())) {
+            auto dense = attr.cast<DenseFPElementsAttr>();
+            writeKind(out, AttrKind::DenseFloat);
+            writeVarInt(out, getTypeId(dense.getType()));
+            writeVarInt(out, dense.isSplat() ? 1 : dense.getNumElements());
+            for (APFloat val : dense.getFloatValues()) {
+                writeDouble(out, dense.getType().getElementType().isF32() ? val.convertToFloat()
+                                                                          : val.convertToDouble());
+                if (dense.isSplat())
+                    break;
+            }
+        } else {
+            writeKind(out, AttrKind::Text);
+            writeVarInt(out, getStringId(print(attr)));
+        }
+    }
+
+    unsigned getAttrId(Attribute attr) {
+        auto it = attrIds.find(attr);
+        if (it != attrIds.end())
+            return it->second;
+
+        std::string payload;
+        encodeAttr(payload, attr);
+        writeVarInt(attrSection, payload.size());
+        attrSection += payload;
+        return attrIds[attr] = numAttrs++;
+    }
+
+    // only plain source locations are kept, all other locations become unknown
+    void writeLocation(std::string &out, Location loc) {
+        if (auto fileLoc = loc.dyn_cast<FileLineColLoc>()) {
+            writeVarInt(out, (uint64_t) LocKind::FileLineCol);
+            writeVarInt(out, getStringId(fileLoc.getFilename()));
+            writeVarInt(out, fileLoc.getLine());
+            writeVarInt(out, fileLoc.getColumn());
+        } else {
+            writeVarInt(out, (uint64_t) LocKind::Unknown);
+        }
+    }
+
+    // assign value ids in the order the reader creates the values
+    void numberOp(Operation *op) {
+        for (Region &region : op->getRegions()) {
+            for (Block &block : region)
+                for (BlockArgument arg : block.getArguments())
+                    valueIds[arg] = nextValueId++;
+            for (Block &block : region)
+                for (Operation &nested : block)
+                    numberOp(&nested);
+        }
+        for (Value res : op->getResults())
+            valueIds[res] = nextValueId++;
+    }
+
+    void writeOp(std::string &out, Operation *op, const DenseMap<Block*, unsigned> &blockIds) {
+        writeVarInt(out, getStringId(op->getName().getStringRef()));
+        writeLocation(out, op->getLoc());
+
+        writeVarInt(out, op->getNumResults());
+        for (Type type : op->getResultTypes())
+            writeVarInt(out, getTypeId(type));
+
+        writeVarInt(out, op->getNumOperands());
+        for (Value arg : op->getOperands()) {
+            uint64_t id = valueIds.lookup(arg);
+            bool forward = id >= numDefined;
+            writeVarInt(out, id << 1 | forward);
+            if (forward)
+                writeVarInt(out, getTypeId(arg.getType()));
+        }
+
+        auto attrs = op->getAttrs();
+        writeVarInt(out, attrs.size());
+        for (NamedAttribute attr : attrs) {
+            writeVarInt(out, getStringId(attr.first.strref()));
+            writeVarInt(out, getAttrId(attr.second));
+        }
+
+        writeVarInt(out, op->getNumSuccessors());
+        for (Block *succ : op->getSuccessors())
+            writeVarInt(out, blockIds.lookup(succ));
+
+        writeVarInt(out, op->getNumRegions());
+        for (Region &region : op->getRegions()) {
+            DenseMap<Block*, unsigned> nestedIds;
+            writeVarInt(out, llvm::size(region));
+            for (Block &block : region) {
+                nestedIds[&block] = nestedIds.size();
+                writeVarInt(out, block.getNumArguments());
+                for (Type type : block.getArgumentTypes())
+                    writeVarInt(out, getTypeId(type));
+                numDefined += block.getNumArguments();
+            }
+            for (Block &block : region) {
+                writeVarInt(out, llvm::size(block));
+                for (Operation &nested : block)
+                    writeOp(out, &nested, nestedIds);
+            }
+        }
+        numDefined += op->getNumResults();
+    }
+};
+
+//===------------------------------------------------------------------------------------------===//
+// Reader
+//===------------------------------------------------------------------------------------------===//
+
+class BytecodeReader {
+public:
+    BytecodeReader(StringRef data, MLIRContext *context)
+        : data(data), context(context), builder(context) {}
+
+    OwningModuleRef read() {
+        Operation *root = readFile();
+        if (!failed && !forwardRefs.empty())
+            fail("use of undefined value");
+        if (failed) {
+            // drop the ops read so far before the placeholders they may still use
+            if (root)
+                root->erase();
+            for (auto &ref : forwardRefs)
+                ref.second->erase();
+            forwardRefs.clear();
+            emitError(UnknownLoc::get(context)) << "malformed bytecode: " << error;
+            return nullptr;
+        }
+
+        auto module = dyn_cast<ModuleOp>(root);
+        if (!module) {
+            root->erase();
+            emitError(UnknownLoc::get(context)) << "bytecode does not contain a module";
+            return nullptr;
+        }
+        OwningModuleRef moduleRef(module);
+        if (mlir::failed(verify(module)))
+            return nullptr;
+        return moduleRef;
+    }
+
+private:
+    StringRef data;
+    size_t pos = 0;
+    MLIRContext *context;
+    Builder builder;
+
+    bool failed = false;
+    std::string error;
+
+    // strings point directly into the (memory mapped) input buffer
+    std::vector<StringRef> strings;
+
+    // raw table entries, materialized on first use
+    std::vector<StringRef> typeEntries;
+    std::vector<Type> types;
+    std::vector<StringRef> attrEntries;
+    std::vector<Attribute> attrs;
+    // entries currently being decoded, an entry referring back to one of them is a cycle
+    std::vector<bool> typesInProgress;
+    std::vector<bool> attrsInProgress;
+
+    std::vector<Value> values;
+    DenseMap<uint64_t, Operation*> forwardRefs;
+
+    void fail(const Twine &msg) {
+        if (!failed)
+            error = msg.str();
+        failed = true;
+    }
+
+    uint64_t readVarInt() {
+        uint64_t val = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (pos >= data.size()) {
+                fail("unexpected end of data");
+                return 0;
+            }
+            uint8_t byte = data[pos++];
+            val |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return val;
+        }
+        fail("invalid integer encoding");
+        return 0;
+    }
+
+    int64_t readSignedVarInt() {
+        uint64_t val = readVarInt();
+        return (int64_t) (val >> 1) ^ -(int64_t) (val & 1);
+    }
+
+    // a number of elements, each taking at least one byte
+    uint64_t readCount() {
+        uint64_t count = readVarInt();
+        if (count > data.size() - pos) {
+            fail("invalid element count");
+            return 0;
+        }
+        return count;
+    }
+
+    StringRef readBytes(uint64_t size) {
+        if (size > data.size() - pos) {
+            fail("unexpected end of data");
+            return "";
+        }
+        StringRef bytes = data.substr(pos, size);
+        pos += size;
+        return bytes;
+    }
+
+    double readDouble() {
+        StringRef bytes = readBytes(sizeof(double));
+        double val = 0;
+        if (!failed)
+            std::memcpy(&val, bytes.data(), sizeof(double));
+        return val;
+    }
+
+    StringRef readString() {
+        uint64_t id = readVarInt();
+        if (id >= strings.size()) {
+            fail("invalid string index");
+            return "";
+        }
+        return strings[id];
+    }
+
+    Optional<int> readOptional() {
+        uint64_t val = readVarInt();
+        return val ? Optional<int>(val - 1) : llvm::None;
+    }
+
+    // decode a table entry with `parse`, from the entry's own data
+    template<class T, class F> T materialize(uint64_t id, std::vector<StringRef> &entries,
+                                              std::vector<T> &cache, std::vector<bool> &inProgress,
+                                              F parse) {
+        if (id >= entries.size()) {
+            fail("invalid table index");
+            return nullptr;
+        }
+        if (cache[id])
+            return cache[id];
+        if (inProgress[id]) {
+            fail("cyclic table entry");
+            return nullptr;
+        }
+
+        StringRef savedData = data;
+        size_t savedPos = pos;
+        data = entries[id];
+        pos = 0;
+        inProgress[id] = true;
+        T entity = parse();
+        inProgress[id] = false;
+        data = savedData;
+        pos = savedPos;
+
+        if (!entity)
+            fail("invalid table entry");
+        return cache[id] = entity;
+    }
+
+    Type readType() {
+        return materialize(readVarInt(), typeEntries, types, typesInProgress,
+                           [this] { return parseType(); });
+    }
+
+    Attribute readAttr() {
+        return materialize(readVarInt(), attrEntries, attrs, attrsInProgress,
+                           [this] { return parseAttr(); });
+    }
+
+    bool readTypes(SmallVectorImpl<Type> &result) {
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+            result.push_back(readType());
+        return !failed;
+    }
+
+    bool readShape(SmallVectorImpl<int64_t> &shape) {
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+            shape.push_back((int64_t) readVarInt() - 1);
+        return !failed;
+    }
+
+    Type parseType() {
+        SmallVector<Type, 4> inputs, results;
+        SmallVector<int64_t, 4> shape;
+        Type elementType;
+
+        auto kind = (TypeKind) readVarInt();
+        // the dialects of the directly encoded types may not have been loaded by any op yet
+        if (kind >= TypeKind::Qstate)
+            context->getOrLoadDialect<quantumssa::QuantumSSADialect>();
+        else if (kind >= TypeKind::Qubit)
+            context->getOrLoadDialect<quantum::QuantumDialect>();
+
+        switch (kind) {
+        case TypeKind::Text:
+            return mlir::parseType(readString(), context);
+        case TypeKind::Index:
+            return builder.getIndexType();
+        case TypeKind::Integer: {
+            uint64_t width = readVarInt();
+            uint64_t signedness = readVarInt();
+            if (width > IntegerType::kMaxWidth || signedness > IntegerType::Unsigned)
+                return nullptr;
+            return IntegerType::get(width, (IntegerType::SignednessSemantics) signedness, context);
+        }
+        case TypeKind::Float:
+            switch (readVarInt()) {
+            case 0: return builder.getF16Type();
+            case 1: return builder.getBF16Type();
+            case 2: return builder.getF32Type();
+            case 3: return builder.getF64Type();
+            default: return nullptr;
+            }
+        case TypeKind::Function:
+            if (!readTypes(inputs) || !readTypes(results))
+                return nullptr;
+            return builder.getFunctionType(inputs, results);
+        case TypeKind::Vector:
+            if (!readShape(shape) || !(elementType = readType()))
+                return nullptr;
+            return VectorType::get(shape, elementType);
+        case TypeKind::Tensor:
+            if (!readShape(shape) || !(elementType = readType()))
+                return nullptr;
+            return RankedTensorType::get(shape, elementType);
+        case TypeKind::MemRef:
+            if (!readShape(shape) || !(elementType = readType()))
+                return nullptr;
+            return MemRefType::get(shape, elementType);
+        case TypeKind::None:
+            return builder.getNoneType();
+
+        case TypeKind::Qubit:
+            return quantum::QubitType::get(context);
+        case TypeKind::Qureg:
+            return quantum::QuregType::get(context, readOptional());
+        case TypeKind::U1:
+            return quantum::U1Type::get(context);
+        case TypeKind::U2:
+            return quantum::U2Type::get(context);
+        case TypeKind::COp: {
+            Optional<int> nctrl = readOptional();
+            if (!(elementType = readType()))
+                return nullptr;
+            return quantum::COpType::get(context, nctrl, elementType);
+        }
+        case TypeKind::Circ:
+            return quantum::CircType::get(context);
+
+        case TypeKind::Qstate:
+            return quantumssa::QstateType::get(context);
+        case TypeKind::Rstate:
+            return quantumssa::RstateType::get(context, readOptional());
+        case TypeKind::SSAU1:
+            return quantumssa::U1Type::get(context);
+        case TypeKind::SSAU2:
+            return quantumssa::U2Type::get(context);
+        case TypeKind::SSACOp: {
+            Optional<int> nctrl = readOptional();
+            if (!(elementType = readType()))
+                return nullptr;
+            return quantumssa::COpType::get(context, nctrl, elementType);
+        }
+        case TypeKind::SSACirc:
+            return quantumssa::CircType::get(context);
+        }
+        return nullptr;
+    }
+
+    Attribute parseAttr() {
+        Type type;
+        switch ((AttrKind) readVarInt()) {
+        case AttrKind::Text:
+            return mlir::parseAttribute(readString(), context);
+        case AttrKind::Unit:
+            return builder.getUnitAttr();
+        case AttrKind::Integer: {
+            // APInt has no zero width values
+            if (!(type = readType()) || !(type.isIndex() || type.isa<IntegerType>()) || !getIntWidth(type))
+                return nullptr;
+            int64_t val = readSignedVarInt();
+            return IntegerAttr::get(type, APInt(getIntWidth(type), (uint64_t) val, /*isSigned=*/true));
+        }
+        case AttrKind::Float:
+            if (!(type = readType()) || !isF32OrF64(type))
+                return nullptr;
+            return FloatAttr::get(type, readDouble());
+        case AttrKind::String:
+            return builder.getStringAttr(readString());
+        case AttrKind::Type:
+            if (!(type = readType()))
+                return nullptr;
+            return TypeAttr::get(type);
+        case AttrKind::SymbolRef:
+            return builder.getSymbolRefAttr(readString());
+        case AttrKind::Array: {
+            SmallVector<Attribute, 8> elements;
+            for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+                elements.push_back(readAttr());
+            if (failed)
+                return nullptr;
+            return builder.getArrayAttr(elements);
+        }
+        case AttrKind::DenseInt: {
+            auto shaped = readType().dyn_cast_or_null<ShapedType>();
+            if (!shaped || !shaped.hasStaticShape() || !(shaped.getElementType().isIndex() ||
+                                                         shaped.getElementType().isa<IntegerType>()) ||
+                    !getIntWidth(shaped.getElementType()))
+                return nullptr;
+            uint64_t count = readCount();
+            if (count != 1 && count != (uint64_t) shaped.getNumElements())
+                return nullptr;
+            unsigned width = getIntWidth(shaped.getElementType());
+            SmallVector<APInt, 8> elements;
+            for (uint64_t i = 0; i < count && !failed; i++)
+                elements.push_back(APInt(width, (uint64_t) readSignedVarInt(), /*isSigned=*/true));
+            if (failed)
+                return nullptr;
+            return DenseElementsAttr::get(shaped, elements);
+        }
+        case AttrKind::DenseFloat: {
+            auto shaped = readType().dyn_cast_or_null<ShapedType>();
+            if (!shaped || !shaped.hasStaticShape() || !isF32OrF64(shaped.getElementType()))
+                return nullptr;
+            uint64_t count = readCount();
+            if (count != 1 && count != (uint64_t) shaped.getNumElements())
+                return nullptr;
+            bool isF32 = shaped.getElementType().isF32();
+            SmallVector<APFloat, 8> elements;
+            for (uint64_t i = 0; i < count && !failed; i++) {
+                double val = readDouble();
+                elements.push_back(isF32 ? APFloat((float) val) : APFloat(val));
+            }
+            if (failed)
+                return nullptr;
+            return DenseElementsAttr::get(shaped, elements);
+        }
+        }
+        return nullptr;
+    }
+
+    Location readLocation() {
+        if ((LocKind) readVarInt() != LocKind::FileLineCol)
+            return UnknownLoc::get(context);
+        StringRef file = readString();
+        unsigned line = readVarInt();
+        unsigned col = readVarInt();
+        return FileLineColLoc::get(file, line, col, context);
+    }
+
+    // forward references are resolved to placeholders until the value is defined
+    Value getValue(uint64_t id, Type forwardType) {
+        if (id < values.size())
+            return values[id];
+        if (!forwardType) {
+            fail("use of undefined value");
+            return nullptr;
+        }
+
+        Operation *&placeholder = forwardRefs[id];
+        if (!placeholder) {
+            OperationState state(UnknownLoc::get(context), "qirb.placeholder");
+            state.addTypes(forwardType);
+            placeholder = Operation::create(state);
+        }
+        return placeholder->getResult(0);
+    }
+
+    void defineValue(Value val) {
+        auto it = forwardRefs.find(values.size());
+        if (it != forwardRefs.end()) {
+            it->second->getResult(0).replaceAllUsesWith(val);
+            it->second->erase();
+            forwardRefs.erase(it);
+        }
+        values.push_back(val);
+    }
+
+    bool readRegion(Region &region) {
+        SmallVector<Block*, 4> blocks;
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++) {
+            Block *block = new Block();
+            region.push_back(block);
+            blocks.push_back(block);
+
+            SmallVector<Type, 4> argTypes;
+            if (!readTypes(argTypes))
+                return false;
+            for (Type type : argTypes)
+                defineValue(block->addArgument(type));
+        }
+
+        for (Block *block : blocks) {
+            for (uint64_t i = 0, e = readCount(); i < e && !failed; i++) {
+                Operation *op = readOp(blocks);
+                if (!op)
+                    return false;
+                block->push_back(op);
+            }
+        }
+        return !failed;
+    }
+
+    Operation* readOp(ArrayRef<Block*> regionBlocks) {
+        StringRef name = readString();
+        Location loc = readLocation();
+        if (failed)
+            return nullptr;
+        // dialects are only loaded once their first op is read, as the textual parser does
+        context->getOrLoadDialect(name.split('.').first);
+        OperationState state(loc, name);
+
+        if (!readTypes(state.types))
+            return nullptr;
+
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++) {
+            uint64_t ref = readVarInt();
+            Type forwardType = (ref & 1) ? readType() : nullptr;
+            state.operands.push_back(getValue(ref >> 1, forwardType));
+        }
+
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++) {
+            StringRef attrName = readString();
+            Attribute attr = readAttr();
+            if (!failed)
+                state.addAttribute(attrName, attr);
+        }
+
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++) {
+            uint64_t id = readVarInt();
+            if (id >= regionBlocks.size())
+                fail("invalid successor");
+            else
+                state.addSuccessors(regionBlocks[id]);
+        }
+
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+            if (!readRegion(*state.addRegion()))
+                return nullptr;
+        if (failed)
+            return nullptr;
+
+        Operation *op = Operation::create(state);
+        for (Value res : op->getResults())
+            defineValue(res);
+        return op;
+    }
+
+    Operation* readFile() {
+        if (!data.startswith(StringRef(magic, sizeof(magic)))) {
+            fail("missing magic number");
+            return nullptr;
+        }
+        pos = sizeof(magic);
+        if (readVarInt() != version) {
+            fail("unsupported version");
+            return nullptr;
+        }
+
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+            strings.push_back(readBytes(readVarInt()));
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+            typeEntries.push_back(readBytes(readVarInt()));
+        for (uint64_t i = 0, e = readCount(); i < e && !failed; i++)
+            attrEntries.push_back(readBytes(readVarInt()));
+        types.resize(typeEntries.size());
+        attrs.resize(attrEntries.size());
+        typesInProgress.resize(typeEntries.size());
+        attrsInProgress.resize(attrEntries.size());
+        if (failed)
+            return nullptr;
+
+        return readOp({});
+    }
+};
+
+} // end anonymous namespace
+
+bool quantum::isBytecode(llvm::MemoryBufferRef buffer) {
+    return buffer.getBuffer().startswith(StringRef(magic, sizeof(magic)));
+}
+
+void quantum::writeBytecode(ModuleOp module, llvm::raw_ostream &os) {
+    BytecodeWriter().write(module, os);
+}
+
+OwningModuleRef quantum::readBytecode(llvm::MemoryBufferRef buffer, MLIRContext *context) {
+    return BytecodeReader(buffer.getBuffer(), context).read();
+}
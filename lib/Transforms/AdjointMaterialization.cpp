@@ -0,0 +1,465 @@
+#include "mlir/Dialect/StandardOps/IR/Ops.h"
+#include "mlir/IR/BlockAndValueMapping.h"
+#include "mlir/IR/Builders.h"
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringSet.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+#include "CircuitAnalysis.h"
+#include "CircuitSpecialization.h"
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Adjoint materialization pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+bool isQState(Type ty) {
+    return ty.isa<QstateType>() || ty.isa<RstateType>();
+}
+
+// classical ops are recomputed at the start of the adjoint body, in their original order
+bool isClassical(Operation *op) {
+    if (isa<QuantumSSADialect>(op->getDialect()) || op->getNumRegions() ||
+            !MemoryEffectOpInterface::hasNoEffect(op))
+        return false;
+    auto isClassicalType = [](Type ty) { return !isa<QuantumSSADialect>(&ty.getDialect()); };
+    return llvm::all_of(op->getOperandTypes(), isClassicalType) &&
+           llvm::all_of(op->getResultTypes(), isClassicalType);
+}
+
+// ops which are inverted by a single op, calls and applies are handled separately
+bool isInvertible(Operation *op) {
+    // gates on hold are only supported through the meta ops applying them
+    if (isa<HOp>(op) || isa<XOp>(op) || isa<RzOp>(op) || isa<ROp>(op) || isa<CNotOp>(op) || isa<SwapOp>(op))
+        return isQState(op->getResultTypes().back());
+    if (isa<FusedOp>(op) || isa<AllocOp>(op) || isa<AllocRegOp>(op) || isa<FreeOp>(op) || isa<CombineStatOp>(op))
+        return true;
+    // multiple dynamic indices don't have a unique inverse
+    if (auto extr = dyn_cast<ExtractOp>(op))
+        return extr.const_idx() || extr.dyn_idx().size() == 1;
+    if (auto comb = dyn_cast<CombineDynOp>(op))
+        return comb.dyn_idx().size() == 1;
+    if (auto free = dyn_cast<FreeRegOp>(op))
+        return free.reg().getType().cast<RstateType>().getNumQubits().hasValue();
+    return false;
+}
+
+// apply target of a circuit value, if it is a chain of adjoints on a circuit value, with the
+// parity of the chain in `adjoint`
+CircuitValueOp resolveAdjoints(Value circval, bool &adjoint) {
+    adjoint = false;
+    Operation *def = circval.getDefiningOp();
+    while (auto adj = dyn_cast_or_null<AdjointOp>(def)) {
+        adjoint = !adjoint;
+        def = adj.heldOp().getDefiningOp();
+    }
+    return dyn_cast_or_null<CircuitValueOp>(def);
+}
+
+// whether a circuit was materialized as the adjoint of `circ`, by this or an earlier run of the pass
+bool isAdjointOf(CircuitOp adj, CircuitOp circ) {
+    auto of = adj.getAttrOfType<StringAttr>("adjoint_of");
+    return of && of.getValue() == circ.getName() && adj.getType() == circ.getType();
+}
+
+// the compute and uncompute parts of a circuit swap roles in its adjoint
+void getInverseAttrs(Operation *op, NamedAttrList &attrs) {
+    for (NamedAttribute attr : op->getAttrs()) {
+        if (attr.first == "compute")
+            attrs.set("uncompute", attr.second);
+        else if (attr.first == "uncompute")
+            attrs.set("compute", attr.second);
+        else
+            attrs.push_back(attr);
+    }
+}
+
+// conjugate transpose of the unitary of a fused op
+DenseElementsAttr getAdjointMatrix(FusedOp fused) {
+    DenseElementsAttr matrix = fused.matrix();
+    int64_t dim = matrix.getType().getShape()[0];
+    SmallVector<double, 32> values;
+    for (APFloat val : matrix.getFloatValues())
+        values.push_back(val.convertToDouble());
+
+    SmallVector<double, 32> adjoint(values.size());
+    for (int64_t r = 0; r < dim; r++) {
+        for (int64_t c = 0; c < dim; c++) {
+            adjoint[2 * (r * dim + c)] = values[2 * (c * dim + r)];
+            adjoint[2 * (r * dim + c) + 1] = -values[2 * (c * dim + r) + 1];
+        }
+    }
+    return DenseElementsAttr::get(matrix.getType(), llvm::makeArrayRef(adjoint));
+}
+
+// negated rotation angle, folded for constants
+Value negate(OpBuilder &b, Location loc, Value phi) {
+    if (auto cst = dyn_cast_or_null<ConstantFloatOp>(phi.getDefiningOp())) {
+        APFloat val = cst.getValue();
+        val.changeSign();
+        OperationState cstState(loc, ConstantFloatOp::getOperationName());
+        ConstantFloatOp::build(b, cstState, val, phi.getType().cast<FloatType>());
+        return b.createOperation(cstState)->getResult(0);
+    }
+    OperationState negState(loc, NegFOp::getOperationName());
+    NegFOp::build(b, negState, phi);
+    return b.createOperation(negState)->getResult(0);
+}
+
+} // end anonymous namespace
+
+struct AdjointMaterializationPass : public OperationPass<ModuleOp> {
+    AdjointMaterializationPass()
+        : OperationPass<ModuleOp>(TypeID::get<AdjointMaterializationPass>()) {}
+    AdjointMaterializationPass(const AdjointMaterializationPass &)
+        : OperationPass<ModuleOp>(TypeID::get<AdjointMaterializationPass>()) {}
+
+    StringRef getName() const override {
+        return "AdjointMaterializationPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<AdjointMaterializationPass>(*this);
+    }
+
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<QuantumSSADialect,
+                        StandardOpsDialect>();
+    }
+
+private:
+    quantum::CircuitSpecializationCache specializations;
+    llvm::StringSet<> notInvertible;
+    quantum::CircuitUseAnalysis *circuits;
+
+    Statistic numMaterialized{this, "materialized-adjoints", "Number of adjoint circuits created"};
+    Statistic numDirectCalls{this, "direct-calls", "Number of applications of adjoint chains replaced by a call"};
+    Statistic numKept{this, "kept-adjoints", "Number of adjoint applications of circuits that can't be inverted"};
+
+    // Circuit called by the inverse of a call or apply, materializing the adjoint of the callee
+    // if needed. Null if the callee can't be inverted.
+    FlatSymbolRefAttr getInverseCallee(OpBuilder &b, Operation *op) {
+        FlatSymbolRefAttr callee;
+        bool adjoint = false;
+        if (auto call = dyn_cast<CallCircOp>(op)) {
+            callee = call.circrefAttr();
+        } else {
+            CircuitValueOp getval = resolveAdjoints(cast<ApplyCircOp>(op).circval(), adjoint);
+            if (!getval)
+                return nullptr;
+            callee = getval.circrefAttr();
+        }
+        if (adjoint)
+            return callee;
+
+        CircuitOp circ = circuits->lookup(callee.getValue());
+        Operation *adj = circ ? materializeAdjoint(b, circ) : nullptr;
+        return adj ? b.getSymbolRefAttr(cast<CircuitOp>(adj).getName()) : nullptr;
+    }
+
+    // Check that every op of a circuit body can be inverted, and get the circuits called by the
+    // inverses of its calls. Quantum states must be used exactly once, so that the states after
+    // each op are known when walking the body backwards.
+    LogicalResult prepareInverse(OpBuilder &b, Block &body, DenseMap<Operation*, FlatSymbolRefAttr> &callees) {
+        ReturnStateOp ret = dyn_cast<ReturnStateOp>(body.getTerminator());
+        if (!ret)
+            return failure();
+        unsigned numStates = 0;
+        for (BlockArgument arg : body.getArguments()) {
+            if (!isQState(arg.getType()))
+                continue;
+            if (!arg.hasOneUse() || numStates >= ret.getNumOperands() ||
+                    ret.getOperand(numStates++).getType() != arg.getType())
+                return failure();
+        }
+        if (numStates != ret.getNumOperands())
+            return failure();
+
+        for (Operation &op : body) {
+            for (Value res : op.getResults())
+                if (isQState(res.getType()) && !res.hasOneUse())
+                    return failure();
+
+            if (isClassical(&op) || isa<ReturnStateOp>(op) || isa<CircuitValueOp>(op))
+                continue;
+            // held circuits are resolved by their applications
+            if (auto adj = dyn_cast<AdjointOp>(op)) {
+                if (adj.qbs())
+                    return failure();
+                continue;
+            }
+            if (isa<CallCircOp>(op) || isa<ApplyCircOp>(op)) {
+                // circuit values are not recreated in the adjoint body, they can't be passed on
+                ValueRange args = isa<ApplyCircOp>(op) ? cast<ApplyCircOp>(op).args() : op.getOperands();
+                if (llvm::any_of(args, [](Value arg) { return arg.getType().isa<CircType>(); }))
+                    return failure();
+                FlatSymbolRefAttr callee = getInverseCallee(b, &op);
+                if (!callee)
+                    return failure();
+                callees[&op] = callee;
+                continue;
+            }
+            if (!isInvertible(&op))
+                return failure();
+        }
+        return success();
+    }
+
+    // Create the inverse of an op in front of the insertion point. `map` holds the states after
+    // the op, and is updated with the states before it.
+    void invertOp(OpBuilder &b, Operation *op, FlatSymbolRefAttr callee, BlockAndValueMapping &map) {
+        Location loc = op->getLoc();
+        if (isa<AllocOp>(op) || isa<AllocRegOp>(op)) {
+            OperationState freeState(loc, isa<AllocOp>(op) ? FreeOp::getOperationName()
+                                                           : FreeRegOp::getOperationName());
+            freeState.addOperands(map.lookup(op->getResult(0)));
+            b.createOperation(freeState);
+            return;
+        }
+        if (auto free = dyn_cast<FreeOp>(op)) {
+            OperationState allocState(loc, AllocOp::getOperationName());
+            allocState.addTypes(free.getOperand().getType());
+            map.map(free.getOperand(), b.createOperation(allocState)->getResult(0));
+            return;
+        }
+        if (auto free = dyn_cast<FreeRegOp>(op)) {
+            RstateType regType = free.reg().getType().cast<RstateType>();
+            OperationState allocState(loc, AllocRegOp::getOperationName());
+            allocState.addAttribute("static_size", b.getI64IntegerAttr(*regType.getNumQubits()));
+            allocState.addTypes(regType);
+            map.map(free.reg(), b.createOperation(allocState)->getResult(0));
+            return;
+        }
+        if (auto extr = dyn_cast<ExtractOp>(op)) {
+            // insert the qubits at the positions they were extracted from
+            OperationState combState(loc, extr.const_idx() ? CombineStatOp::getOperationName()
+                                                           : CombineDynOp::getOperationName());
+            combState.addOperands(map.lookup(extr.rem()));
+            for (Value idx : extr.dyn_idx())
+                combState.addOperands(map.lookup(idx));
+            for (Value qb : extr.qbs())
+                combState.addOperands(map.lookup(qb));
+            if (extr.const_idx())
+                combState.addAttribute("const_idx", *extr.const_idx());
+            combState.addTypes(extr.reg().getType());
+            map.map(extr.reg(), b.createOperation(combState)->getResult(0));
+            return;
+        }
+        if (isa<CombineStatOp>(op) || isa<CombineDynOp>(op)) {
+            Value reg = op->getOperand(0);
+            SmallVector<Value, 4> qbs;
+            OperationState extrState(loc, ExtractOp::getOperationName());
+            extrState.addOperands(map.lookup(op->getResult(0)));
+            if (auto comb = dyn_cast<CombineStatOp>(op)) {
+                extrState.addAttribute("const_idx", comb.const_idx());
+                qbs.append(comb.qbs().begin(), comb.qbs().end());
+            } else {
+                auto dcomb = cast<CombineDynOp>(op);
+                for (Value idx : dcomb.dyn_idx())
+                    extrState.addOperands(map.lookup(idx));
+                qbs.append(dcomb.qbs().begin(), dcomb.qbs().end());
+            }
+            for (Value qb : qbs)
+                extrState.addTypes(qb.getType());
+            extrState.addTypes(reg.getType());
+            Operation *extr = b.createOperation(extrState);
+            for (unsigned i = 0, e = qbs.size(); i < e; i++)
+                map.map(qbs[i], extr->getResult(i));
+            map.map(reg, extr->getResults().back());
+            return;
+        }
+
+        // remaining ops update their quantum operands in place, in the order of their results
+        OperationState state(loc, op->getName());
+        getInverseAttrs(op, state.attributes);
+        ValueRange operands = op->getOperands();
+        if (callee) {
+            state.name = OperationName(CallCircOp::getOperationName(), b.getContext());
+            state.attributes.set("circref", callee);
+            if (isa<ApplyCircOp>(op))
+                operands = operands.drop_front();
+        }
+        SmallVector<Value, 4> states;
+        for (Value operand : operands) {
+            if (isQState(operand.getType())) {
+                state.addOperands(map.lookup(op->getResult(states.size())));
+                state.addTypes(operand.getType());
+                states.push_back(operand);
+            } else {
+                state.addOperands(map.lookup(operand));
+            }
+        }
+        if (isa<RzOp>(op) || isa<ROp>(op))
+            state.operands[0] = negate(b, loc, state.operands[0]);
+        if (auto fused = dyn_cast<FusedOp>(op))
+            state.attributes.set("matrix", getAdjointMatrix(fused));
+
+        Operation *inverse = b.createOperation(state);
+        for (unsigned i = 0, e = states.size(); i < e; i++)
+            map.map(states[i], inverse->getResult(i));
+    }
+
+    // Build the adjoint body by inverting the ops of `body` in reverse order, starting from the
+    // states returned by the circuit.
+    void buildInverse(OpBuilder &b, Block &body, Block &adjBody,
+                      DenseMap<Operation*, FlatSymbolRefAttr> &callees) {
+        BlockAndValueMapping map;
+        Operation *ret = body.getTerminator();
+        unsigned numStates = 0;
+        for (unsigned i = 0, e = body.getNumArguments(); i < e; i++) {
+            if (isQState(body.getArgument(i).getType()))
+                map.map(ret->getOperand(numStates++), adjBody.getArgument(i));
+            else
+                map.map(body.getArgument(i), adjBody.getArgument(i));
+        }
+
+        b.setInsertionPointToEnd(&adjBody);
+        for (Operation &op : body)
+            if (isClassical(&op))
+                b.clone(op, map);
+
+        for (Operation &op : llvm::reverse(body)) {
+            if (isClassical(&op) || isa<ReturnStateOp>(op) || isa<CircuitValueOp>(op) || isa<AdjointOp>(op))
+                continue;
+            invertOp(b, &op, callees.lookup(&op), map);
+        }
+
+        // the states before the circuit, in the order of its arguments
+        SmallVector<Value, 4> retVals;
+        for (BlockArgument arg : body.getArguments())
+            if (isQState(arg.getType()))
+                retVals.push_back(map.lookup(arg));
+        OperationState retState(ret->getLoc(), ReturnStateOp::getOperationName());
+        ReturnStateOp::build(b, retState, retVals);
+        b.createOperation(retState);
+    }
+
+    CircuitOp buildAdjoint(OpBuilder &b, CircuitOp circ, StringRef adjName) {
+        Region &body = circ.getBody();
+        DenseMap<Operation*, FlatSymbolRefAttr> callees;
+        if (!llvm::hasSingleElement(body) || failed(prepareInverse(b, body.front(), callees)))
+            return nullptr;
+
+        OperationState state(circ.getLoc(), CircuitOp::getOperationName());
+        CircuitOp::build(b, state, adjName, circ.getType());
+        for (StringRef name : {"no_inline", "no_inline_target"})
+            if (Attribute attr = circ.getAttr(name))
+                state.addAttribute(name, attr);
+        // a string rather than a symbol reference, which would count as a use of the circuit
+        state.addAttribute("adjoint_of", b.getStringAttr(circ.getName()));
+        CircuitOp adj = cast<CircuitOp>(Operation::create(state));
+        Block *adjBody = new Block();
+        adj.getBody().push_back(adjBody);
+        for (Type ty : circ.getType().getInputs())
+            adjBody->addArgument(ty);
+        buildInverse(b, body.front(), *adjBody, callees);
+
+        b.setInsertionPointAfter(circ);
+        b.insert(adj);
+        circuits->insert(adj);
+        numMaterialized++;
+        return adj;
+    }
+
+    // The adjoint of a circuit as the circuit `<name>_adj`, or `<name>_adj_<n>` if that name is
+    // taken by another circuit, created on first use. Adjoints are marked with the name of their
+    // circuit (`adjoint_of`), so that only the adjoints of a previous run of the pass are reused.
+    // Null if the circuit can't be inverted op by op.
+    Operation* materializeAdjoint(OpBuilder &b, CircuitOp circ) {
+        StringRef name = circ.getName();
+        if (Operation *adj = specializations.lookup(name, 0, true))
+            return adj;
+        if (notInvertible.count(name))
+            return nullptr;
+
+        // the names are tried in the same order by every run, an earlier adjoint is found first
+        std::string adjName;
+        CircuitOp adj;
+        for (unsigned n = 0; ; n++) {
+            adjName = (name + "_adj").str();
+            if (n)
+                adjName += "_" + std::to_string(n);
+            adj = circuits->lookup(adjName);
+            if (!adj || isAdjointOf(adj, circ))
+                break;
+        }
+
+        // marked up front, so that recursive circuits are left alone
+        notInvertible.insert(name);
+        if (!adj)
+            adj = buildAdjoint(b, circ, adjName);
+        if (!adj)
+            return nullptr;
+        notInvertible.erase(name);
+        specializations.insert(name, 0, true, adj);
+        return adj;
+    }
+
+    // erase the ops of a circuit value chain which are no longer used
+    static void eraseDeadChain(Value circval) {
+        Operation *def = circval.getDefiningOp();
+        while (def && def->use_empty()) {
+            Operation *held = nullptr;
+            if (auto adj = dyn_cast<AdjointOp>(def))
+                held = adj.heldOp().getDefiningOp();
+            else if (!isa<CircuitValueOp>(def))
+                return;
+            def->erase();
+            def = held;
+        }
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        circuits = &getAnalysis<quantum::CircuitUseAnalysis>();
+        specializations.clear();
+        notInvertible.clear();
+        OpBuilder b(&getContext());
+
+        SmallVector<ApplyCircOp, 16> applies;
+        module.walk([&](ApplyCircOp apply) { applies.push_back(apply); });
+
+        for (ApplyCircOp apply : applies) {
+            bool adjoint;
+            CircuitValueOp getval = resolveAdjoints(apply.circval(), adjoint);
+            if (!getval)
+                continue;
+            // an even number of adjoints applies the circuit itself
+            Operation *callee = circuits->lookup(getval.circref()).getOperation();
+            if (callee && adjoint)
+                callee = materializeAdjoint(b, cast<CircuitOp>(callee));
+            if (!callee) {
+                numKept++;
+                continue;
+            }
+
+            b.setInsertionPoint(apply);
+            OperationState callState(apply.getLoc(), CallCircOp::getOperationName());
+            CallCircOp::build(b, callState, apply.getResultTypes(), cast<CircuitOp>(callee).getName(),
+                              apply.args());
+            Operation *call = b.createOperation(callState);
+            for (auto attr : apply.getAttrs())
+                call->setAttr(attr.first, attr.second);
+
+            Value circval = apply.circval();
+            apply.replaceAllUsesWith(call->getResults());
+            apply.erase();
+            eraseDeadChain(circval);
+            numDirectCalls++;
+        }
+        // not preserved, the use counts of the analysis don't include the new calls
+    }
+};
+
+std::unique_ptr<Pass> quantum::createAdjointMaterializationPass() {
+    return std::make_unique<AdjointMaterializationPass>();
+}
@@ -0,0 +1,40 @@
+#include "mlir/IR/Module.h"
+#include "mlir/IR/SymbolTable.h"
+
+#include "CircuitAnalysis.h"
+
+using namespace mlir;
+using namespace mlir::quantum;
+using namespace mlir::quantumssa;
+
+CircuitUseAnalysis::CircuitUseAnalysis(Operation *module) {
+    for (auto circ : cast<ModuleOp>(module).getOps<CircuitOp>())
+        circuits[circ.getName()] = circ;
+    // one walk over all nested ops, instead of one per queried symbol
+    if (auto uses = SymbolTable::getSymbolUses(module))
+        for (const SymbolTable::SymbolUse &use : *uses)
+            numUses[use.getSymbolRef().getRootReference()]++;
+}
+
+void CircuitUseAnalysis::insert(CircuitOp circ) {
+    circuits[circ.getName()] = circ;
+    if (auto uses = SymbolTable::getSymbolUses(circ.getOperation()))
+        for (const SymbolTable::SymbolUse &use : *uses)
+            numUses[use.getSymbolRef().getRootReference()]++;
+}
+
+std::vector<std::string> CircuitUseAnalysis::erase(CircuitOp circ) {
+    std::vector<std::string> unused;
+    if (auto uses = SymbolTable::getSymbolUses(circ.getOperation())) {
+        for (const SymbolTable::SymbolUse &use : *uses) {
+            StringRef name = use.getSymbolRef().getRootReference();
+            unsigned &count = numUses[name];
+            assert(count && "Symbol use missing from the analysis!");
+            if (!--count)
+                unused.push_back(name.str());
+        }
+    }
+    circuits.erase(circ.getName());
+    circ.erase();
+    return unused;
+}
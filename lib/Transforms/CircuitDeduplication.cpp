@@ -0,0 +1,225 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/Module.h"
+#include "mlir/IR/SymbolTable.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+
+#include <unordered_map>
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Circuit deduplication pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+// Structural hash of a region: ops are hashed by name, attributes and result types, values by
+// their position in the region instead of their identity, so that copies of a circuit body hash
+// alike. Circuits are isolated from above, every operand is defined within the region.
+struct StructuralHasher {
+    llvm::DenseMap<Value, unsigned> valueIds;
+    llvm::DenseMap<Block*, unsigned> blockIds;
+
+    llvm::hash_code hashRegion(Region &region) {
+        llvm::hash_code hash = llvm::hash_value(region.getBlocks().size());
+        for (Block &block : region) {
+            blockIds[&block] = blockIds.size();
+            for (BlockArgument arg : block.getArguments()) {
+                valueIds[arg] = valueIds.size();
+                hash = llvm::hash_combine(hash, arg.getType());
+            }
+        }
+        for (Block &block : region)
+            for (Operation &op : block)
+                hash = llvm::hash_combine(hash, hashOp(op));
+        return hash;
+    }
+
+    llvm::hash_code hashOp(Operation &op) {
+        llvm::hash_code hash = llvm::hash_combine(op.getName().getAsOpaquePointer(),
+                                                  op.getNumOperands(), op.getNumResults());
+        for (const NamedAttribute &attr : op.getAttrs())
+            hash = llvm::hash_combine(hash, attr.first.data(), attr.second);
+        for (Value operand : op.getOperands())
+            hash = llvm::hash_combine(hash, valueIds.lookup(operand));
+        for (Block *succ : op.getSuccessors())
+            hash = llvm::hash_combine(hash, blockIds.lookup(succ));
+        for (Value res : op.getResults()) {
+            valueIds[res] = valueIds.size();
+            hash = llvm::hash_combine(hash, res.getType());
+        }
+        for (Region &nested : op.getRegions())
+            hash = llvm::hash_combine(hash, hashRegion(nested));
+        return hash;
+    }
+};
+
+// Exact comparison of two regions up to the renaming of values and blocks, the counterpart of
+// StructuralHasher for circuits with the same hash.
+struct StructuralEquivalence {
+    llvm::DenseMap<Value, Value> values;
+    llvm::DenseMap<Block*, Block*> blocks;
+
+    bool isEquivalent(Region &lhs, Region &rhs) {
+        if (lhs.getBlocks().size() != rhs.getBlocks().size())
+            return false;
+        for (auto blockPair : llvm::zip(lhs, rhs)) {
+            Block &left = std::get<0>(blockPair), &right = std::get<1>(blockPair);
+            if (left.getNumArguments() != right.getNumArguments())
+                return false;
+            for (auto argPair : llvm::zip(left.getArguments(), right.getArguments())) {
+                if (std::get<0>(argPair).getType() != std::get<1>(argPair).getType())
+                    return false;
+                values[std::get<0>(argPair)] = std::get<1>(argPair);
+            }
+            blocks[&left] = &right;
+        }
+        for (auto blockPair : llvm::zip(lhs, rhs)) {
+            Block &left = std::get<0>(blockPair), &right = std::get<1>(blockPair);
+            auto leftIt = left.begin(), rightIt = right.begin();
+            for (; leftIt != left.end() && rightIt != right.end(); ++leftIt, ++rightIt)
+                if (!isEquivalent(*leftIt, *rightIt))
+                    return false;
+            if (leftIt != left.end() || rightIt != right.end())
+                return false;
+        }
+        return true;
+    }
+
+    bool isEquivalent(Operation &lhs, Operation &rhs) {
+        if (lhs.getName() != rhs.getName() || lhs.getAttrs() != rhs.getAttrs() ||
+                lhs.getNumOperands() != rhs.getNumOperands() || lhs.getNumResults() != rhs.getNumResults() ||
+                lhs.getNumSuccessors() != rhs.getNumSuccessors() || lhs.getNumRegions() != rhs.getNumRegions())
+            return false;
+        for (auto operands : llvm::zip(lhs.getOperands(), rhs.getOperands()))
+            if (values.lookup(std::get<0>(operands)) != std::get<1>(operands))
+                return false;
+        for (auto succs : llvm::zip(lhs.getSuccessors(), rhs.getSuccessors()))
+            if (blocks.lookup(std::get<0>(succs)) != std::get<1>(succs))
+                return false;
+        for (auto results : llvm::zip(lhs.getResults(), rhs.getResults())) {
+            if (std::get<0>(results).getType() != std::get<1>(results).getType())
+                return false;
+            values[std::get<0>(results)] = std::get<1>(results);
+        }
+        for (auto regions : llvm::zip(lhs.getRegions(), rhs.getRegions()))
+            if (!isEquivalent(std::get<0>(regions), std::get<1>(regions)))
+                return false;
+        return true;
+    }
+};
+
+// the attributes of a circuit other than its name, i.e. its type and inlining hints
+SmallVector<NamedAttribute, 4> getCircuitAttrs(CircuitOp circ) {
+    SmallVector<NamedAttribute, 4> attrs;
+    for (const NamedAttribute &attr : circ.getAttrs())
+        if (attr.first != SymbolTable::getSymbolAttrName())
+            attrs.push_back(attr);
+    return attrs;
+}
+
+bool isEntryPoint(CircuitOp circ) {
+    return circ.getName() == "mlir_main" || circ.getName() == "main";
+}
+
+} // end anonymous namespace
+
+struct CircuitDeduplicationPass : public OperationPass<ModuleOp> {
+    CircuitDeduplicationPass()
+        : OperationPass<ModuleOp>(TypeID::get<CircuitDeduplicationPass>()) {}
+    CircuitDeduplicationPass(const CircuitDeduplicationPass &)
+        : OperationPass<ModuleOp>(TypeID::get<CircuitDeduplicationPass>()) {}
+
+    StringRef getName() const override {
+        return "CircuitDeduplicationPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<CircuitDeduplicationPass>(*this);
+    }
+
+    // Map every circuit identical to an earlier one onto the earlier circuit. Circuits are
+    // bucketed by their structural hash, so only circuits with the same hash are compared.
+    void findDuplicates(ModuleOp module, llvm::StringMap<std::string> &replacements) {
+        std::unordered_map<size_t, SmallVector<CircuitOp, 1>> canonicals;
+        for (CircuitOp circ : module.getOps<CircuitOp>()) {
+            if (circ.isExternal() || isEntryPoint(circ) || merged.count(circ.getName()))
+                continue;
+
+            StructuralHasher hasher;
+            llvm::hash_code hash = hasher.hashRegion(circ.getBody());
+            for (const NamedAttribute &attr : getCircuitAttrs(circ))
+                hash = llvm::hash_combine(hash, attr.first.data(), attr.second);
+
+            auto &bucket = canonicals[hash];
+            auto canonical = llvm::find_if(bucket, [&](CircuitOp other) {
+                return getCircuitAttrs(other) == getCircuitAttrs(circ) &&
+                       StructuralEquivalence().isEquivalent(other.getBody(), circ.getBody());
+            });
+            if (canonical == bucket.end()) {
+                bucket.push_back(circ);
+                continue;
+            }
+            replacements[circ.getName()] = canonical->getName().str();
+            merged.insert(circ.getName());
+            numMergedCircuits++;
+        }
+    }
+
+    // point all calls and circuit values at the canonical circuits, in one walk over the module
+    void replaceReferences(ModuleOp module, const llvm::StringMap<std::string> &replacements) {
+        MLIRContext *context = &getContext();
+        auto replace = [&](Operation *op, StringRef callee) {
+            auto it = replacements.find(callee);
+            if (it == replacements.end())
+                return;
+            op->setAttr("circref", FlatSymbolRefAttr::get(it->second, context));
+            numReplacedReferences++;
+        };
+        module.walk([&](Operation *op) {
+            if (auto call = dyn_cast<CallCircOp>(op))
+                replace(op, call.circref());
+            else if (auto getval = dyn_cast<CircuitValueOp>(op))
+                replace(op, getval.circref());
+        });
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        merged.clear();
+
+        // circuits which only differ in the callees that were merged are identical once their
+        // references are replaced, so repeat until no more circuits are merged
+        bool changed = true;
+        while (changed) {
+            llvm::StringMap<std::string> replacements;
+            findDuplicates(module, replacements);
+            changed = !replacements.empty();
+            if (changed)
+                replaceReferences(module, replacements);
+        }
+        // the merged circuits are left unused for StripUnusedCircuitPass, which has to recount
+        // the references
+    }
+
+private:
+    // circuits replaced by an identical one, they are no longer referenced
+    llvm::StringSet<> merged;
+
+    Statistic numMergedCircuits{this, "merged-circuits", "Number of circuits replaced by a structurally identical one"};
+    Statistic numReplacedReferences{this, "replaced-references", "Number of calls and circuit values redirected to the merged circuit"};
+};
+
+std::unique_ptr<Pass> quantum::createCircuitDeduplicationPass() {
+    return std::make_unique<CircuitDeduplicationPass>();
+}
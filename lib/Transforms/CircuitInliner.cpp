@@ -23,6 +23,8 @@
 #include "mlir/Interfaces/SideEffectInterfaces.h"
 #include "InliningUtils.h"
 #include "Passes.h"
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
 #include "llvm/ADT/SCCIterator.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Parallel.h"
@@ -391,11 +393,168 @@ struct Inliner : public InlinerInterface {
   /// The current set of call instructions to consider for inlining.
   SmallVector<ResolvedCall, 8> calls;
 
+  /// The number of calls considered for and actually inlined, for the pass
+  /// statistics.
+  unsigned numConsidered = 0;
+  unsigned numInlined = 0;
+
   /// The callgraph being operated on.
   CallGraph &cg;
 };
 } // namespace
 
+//===----------------------------------------------------------------------===//
+// Inline Cost Model
+//===----------------------------------------------------------------------===//
+
+/// Returns true if the given type represents a quantum operation that has not
+/// been applied yet.
+static bool isHeldOpType(Type type) {
+  return type.isa<quantum::U1Type>() || type.isa<quantum::U2Type>() ||
+         type.isa<quantum::COpType>() || type.isa<quantum::CircType>() ||
+         type.isa<quantumssa::U1Type>() || type.isa<quantumssa::U2Type>() ||
+         type.isa<quantumssa::COpType>() || type.isa<quantumssa::CircType>();
+}
+
+/// Returns the cost of a single operation: applied gates and calls count as
+/// one, and applied meta-operations additionally count the depth of the
+/// modifier chain they apply.
+static unsigned getOpCost(Operation *op) {
+  bool isGate = op->hasTrait<OpTrait::UnitaryTrait>() ||
+                op->hasTrait<OpTrait::MetaOpTrait>();
+  if (!isGate && !isa<CallOpInterface>(op))
+    return 0;
+  if (llvm::any_of(op->getResultTypes(), isHeldOpType))
+    return 0;
+  if (!op->hasTrait<OpTrait::MetaOpTrait>())
+    return 1;
+
+  unsigned depth = 1;
+  Operation *held = op->getOperand(0).getDefiningOp();
+  while (held && held->hasTrait<OpTrait::MetaOpTrait>()) {
+    ++depth;
+    held = held->getOperand(0).getDefiningOp();
+  }
+  return 1 + depth;
+}
+
+/// Returns true if the given op applies the adjoint of the circuit `circRef`.
+static bool isAdjointApplyOf(Operation *op, SymbolRefAttr circRef) {
+  auto apply = dyn_cast_or_null<quantumssa::ApplyCircOp>(op);
+  if (!apply)
+    return false;
+  auto adj = dyn_cast_or_null<quantumssa::AdjointOp>(
+      apply.circval().getDefiningOp());
+  if (!adj)
+    return false;
+  auto getval = dyn_cast_or_null<quantumssa::CircuitValueOp>(
+      adj.heldOp().getDefiningOp());
+  return getval && getval.circrefAttr() == circRef;
+}
+
+/// Returns true if the call can be cancelled against an adjoint invocation of
+/// the same circuit (see CircuitCancelBw/Fw), which inlining would prevent.
+static bool enablesCircuitCancel(Operation *call) {
+  auto circCall = dyn_cast<quantumssa::CallCircOp>(call);
+  if (!circCall)
+    return false;
+  SymbolRefAttr circRef = circCall.circrefAttr();
+
+  for (Value arg : circCall.args())
+    if (isAdjointApplyOf(arg.getDefiningOp(), circRef))
+      return true;
+  for (Operation *user : circCall.getOperation()->getUsers())
+    if (isAdjointApplyOf(user, circRef))
+      return true;
+  return false;
+}
+
+/// Returns true if the quantum state flowing into or out of the call is
+/// connected to a gate, so that inlining likely exposes peephole cancellations
+/// between the gates at the call site and those at the callee boundary.
+static bool exposesGateCancel(Operation *call) {
+  auto isQuantumGate = [](Operation *op) {
+    return op && (op->hasTrait<OpTrait::UnitaryTrait>() ||
+                  op->hasTrait<OpTrait::MetaOpTrait>());
+  };
+  for (Value arg : call->getOperands())
+    if (arg.getType().isa<quantumssa::QstateType>() ||
+        arg.getType().isa<quantumssa::RstateType>())
+      if (isQuantumGate(arg.getDefiningOp()))
+        return true;
+  return llvm::any_of(call->getUsers(), isQuantumGate);
+}
+
+namespace {
+/// This class decides which calls are profitable to inline, based on the gate
+/// cost of the callee, the cancellation opportunities at the call site, and a
+/// growth budget for the number of gates in the module.
+class InlineCostModel {
+public:
+  InlineCostModel(Operation *module, unsigned threshold, unsigned growthBudget)
+      : threshold(threshold), limitGrowth(growthBudget != 0) {
+    if (!limitGrowth)
+      return;
+    uint64_t moduleCost = 0;
+    module->walk([&](Operation *op) { moduleCost += getOpCost(op); });
+    remainingBudget = std::max<uint64_t>(moduleCost, 1) * growthBudget / 100;
+  }
+
+  /// Returns true if inlining the given call is profitable and within budget.
+  bool isProfitable(ResolvedCall &resolvedCall, bool inlineInPlace) {
+    if (!threshold && !limitGrowth)
+      return true;
+
+    // A call that cancels out with its adjoint is better left alone.
+    Operation *call = resolvedCall.call.getOperation();
+    if (enablesCircuitCancel(call))
+      return false;
+
+    unsigned cost = getCost(resolvedCall.targetNode);
+    unsigned effectiveCost = exposesGateCancel(call) ? cost / 2 : cost;
+    if (threshold && effectiveCost > threshold)
+      return false;
+
+    // Inlining the last use of a callee in place doesn't grow the module.
+    return inlineInPlace || !limitGrowth || cost <= remainingBudget;
+  }
+
+  /// Update the budget & cached costs after the given call was inlined.
+  void recordInlined(ResolvedCall &resolvedCall, bool inlineInPlace) {
+    if (limitGrowth && !inlineInPlace)
+      remainingBudget -= getCost(resolvedCall.targetNode);
+    costs.erase(resolvedCall.sourceNode);
+  }
+
+  /// Invalidate the cached cost of a node whose body was modified.
+  void invalidate(CallGraphNode *node) { costs.erase(node); }
+
+private:
+  /// Returns the cost of the body of the given callgraph node.
+  unsigned getCost(CallGraphNode *node) {
+    auto it = costs.find(node);
+    if (it != costs.end())
+      return it->second;
+
+    unsigned cost = 0;
+    node->getCallableRegion()->walk(
+        [&](Operation *op) { cost += getOpCost(op); });
+    costs[node] = cost;
+    return cost;
+  }
+
+  /// The cached costs of callgraph nodes.
+  DenseMap<CallGraphNode *, unsigned> costs;
+
+  /// The maximum cost of a callee to be inlined, 0 if unlimited.
+  unsigned threshold;
+
+  /// Whether the module growth is limited, and the remaining gate budget.
+  bool limitGrowth;
+  uint64_t remainingBudget = 0;
+};
+} // end anonymous namespace
+
 /// Returns true if the given call should be inlined.
 static bool shouldInline(ResolvedCall &resolvedCall) {
   // Don't allow inlining terminator calls. We currently don't support this
@@ -413,10 +572,15 @@ static bool shouldInline(ResolvedCall &resolvedCall) {
   return true;
 }
 
-/// Attempt to inline calls within the given scc. This function returns
-/// success if any calls were inlined, failure otherwise.
-static LogicalResult inlineCallsInSCC(Inliner &inliner, CGUseList &useList,
-                                      CallGraphSCC &currentSCC) {
+/// Attempt to inline calls within the given scc. Calls are only collected from
+/// the nodes in `changedNodes`, as the calls of all other nodes were already
+/// considered in a previous iteration. On return, `changedNodes` holds the
+/// nodes that received inlined code. This function returns success if any
+/// calls were inlined, failure otherwise.
+static LogicalResult
+inlineCallsInSCC(Inliner &inliner, CGUseList &useList, CallGraphSCC &currentSCC,
+                 InlineCostModel &costModel,
+                 SmallPtrSetImpl<CallGraphNode *> &changedNodes) {
   CallGraph &cg = inliner.cg;
   auto &calls = inliner.calls;
 
@@ -430,20 +594,29 @@ static LogicalResult inlineCallsInSCC(Inliner &inliner, CGUseList &useList,
     if (node->isExternal())
       continue;
 
-    // Don't collect calls if the node is already dead.
+    // Don't collect calls if the node is already dead, or if it hasn't
+    // changed since its calls were last collected.
     if (useList.isDead(node))
       deadNodes.push_back(node);
-    else
+    else if (changedNodes.count(node))
       collectCallOps(*node->getCallableRegion(), node, cg, calls,
                      /*traverseNestedCGNodes=*/false);
   }
+  changedNodes.clear();
 
   // Try to inline each of the call operations. Don't cache the end iterator
   // here as more calls may be added during inlining.
   bool inlinedAnyCalls = false;
   for (unsigned i = 0; i != calls.size(); ++i) {
     ResolvedCall it = calls[i];
-    bool doInline = shouldInline(it);
+
+    // If this is the last call to the target node and the node is discardable,
+    // then inline it in-place and delete the node if successful.
+    bool inlineInPlace = useList.hasOneUseAndDiscardable(it.targetNode);
+    ++inliner.numConsidered;
+
+    bool doInline =
+        shouldInline(it) && costModel.isProfitable(it, inlineInPlace);
     CallOpInterface call = it.call;
     LLVM_DEBUG({
       if (doInline)
@@ -455,10 +628,6 @@ static LogicalResult inlineCallsInSCC(Inliner &inliner, CGUseList &useList,
       continue;
     Region *targetRegion = it.targetNode->getCallableRegion();
 
-    // If this is the last call to the target node and the node is discardable,
-    // then inline it in-place and delete the node if successful.
-    bool inlineInPlace = useList.hasOneUseAndDiscardable(it.targetNode);
-
     LogicalResult inlineResult = quantum::inlineCall(
         inliner, call, cast<CallableOpInterface>(targetRegion->getParentOp()),
         targetRegion, /*shouldCloneInlinedRegion=*/!inlineInPlace);
@@ -467,8 +636,13 @@ static LogicalResult inlineCallsInSCC(Inliner &inliner, CGUseList &useList,
       continue;
     }
     inlinedAnyCalls = true;
+    ++inliner.numInlined;
+    changedNodes.insert(it.sourceNode);
+    costModel.recordInlined(it, inlineInPlace);
 
     // If the inlining was successful, Merge the new uses into the source node.
+    // The use list is updated incrementally from the resolved call, without
+    // walking the source node again.
     useList.dropCallUses(it.sourceNode, call.getOperation(), cg);
     useList.mergeUsesAfterInlining(it.targetNode, it.sourceNode);
 
@@ -490,11 +664,14 @@ static LogicalResult inlineCallsInSCC(Inliner &inliner, CGUseList &useList,
   return success(inlinedAnyCalls);
 }
 
-/// Canonicalize the nodes within the given SCC with the given set of
-/// canonicalization patterns.
-static void canonicalizeSCC(CallGraph &cg, CGUseList &useList,
-                            CallGraphSCC &currentSCC, MLIRContext *context,
-                            const OwningRewritePatternList &canonPatterns) {
+/// Canonicalize the nodes within the given SCC that received inlined code with
+/// the given set of canonicalization patterns.
+static void
+canonicalizeSCC(CallGraph &cg, CGUseList &useList, CallGraphSCC &currentSCC,
+                MLIRContext *context,
+                const OwningRewritePatternList &canonPatterns,
+                InlineCostModel &costModel,
+                const SmallPtrSetImpl<CallGraphNode *> &changedNodes) {
   // Collect the sets of nodes to canonicalize.
   SmallVector<CallGraphNode *, 4> nodesToCanonicalize;
   for (auto *node : currentSCC) {
@@ -502,6 +679,10 @@ static void canonicalizeSCC(CallGraph &cg, CGUseList &useList,
     if (node->isExternal())
       continue;
 
+    // Nodes that didn't receive any inlined code are left untouched.
+    if (!changedNodes.count(node))
+      continue;
+
     // Don't canonicalize nodes with children. Nodes with children
     // require special handling as we may remove the node during
     // canonicalization. In the future, we should be able to handle this
@@ -547,9 +728,12 @@ static void canonicalizeSCC(CallGraph &cg, CGUseList &useList,
       applyPatternsAndFoldGreedily(*node->getCallableRegion(), canonPatterns);
   }
 
-  // Recompute the uses held by each of the nodes.
-  for (CallGraphNode *node : nodesToCanonicalize)
+  // Recompute the uses held by each of the canonicalized nodes, as patterns may
+  // have added or removed symbol references.
+  for (CallGraphNode *node : nodesToCanonicalize) {
     useList.recomputeUses(node, cg);
+    costModel.invalidate(node);
+  }
 }
 
 //===----------------------------------------------------------------------===//
@@ -558,6 +742,12 @@ static void canonicalizeSCC(CallGraph &cg, CGUseList &useList,
 
 namespace {
 struct CircuitInlinerPass : public InlinerBase<CircuitInlinerPass> {
+  CircuitInlinerPass() = default;
+  CircuitInlinerPass(const quantum::CircuitInlinerOptions &options) {
+    inlineThreshold = options.threshold;
+    growthBudget = options.growthBudget;
+  }
+
   void runOnOperation() override;
 
   /// Attempt to inline calls within the given scc, and run canonicalizations
@@ -565,7 +755,8 @@ struct CircuitInlinerPass : public InlinerBase<CircuitInlinerPass> {
   /// the inlining of newly devirtualized calls.
   void inlineSCC(Inliner &inliner, CGUseList &useList, CallGraphSCC &currentSCC,
                  MLIRContext *context,
-                 const OwningRewritePatternList &canonPatterns);
+                 const OwningRewritePatternList &canonPatterns,
+                 InlineCostModel &costModel);
 };
 } // end anonymous namespace
 
@@ -591,31 +782,43 @@ void CircuitInlinerPass::runOnOperation() {
   // Run the inline transform in post-order over the SCCs in the callgraph.
   Inliner inliner(context, cg);
   CGUseList useList(getOperation(), cg);
+  InlineCostModel costModel(getOperation(), inlineThreshold, growthBudget);
   runTransformOnCGSCCs(cg, [&](CallGraphSCC &scc) {
-    inlineSCC(inliner, useList, scc, context, canonPatterns);
+    inlineSCC(inliner, useList, scc, context, canonPatterns, costModel);
   });
 
+  numConsideredCalls += inliner.numConsidered;
+  numInlinedCalls += inliner.numInlined;
+  numErasedCallables += inliner.deadNodes.size();
+
   // After inlining, make sure to erase any callables proven to be dead.
   inliner.eraseDeadCallables();
 }
 
 void CircuitInlinerPass::inlineSCC(Inliner &inliner, CGUseList &useList,
                             CallGraphSCC &currentSCC, MLIRContext *context,
-                            const OwningRewritePatternList &canonPatterns) {
+                            const OwningRewritePatternList &canonPatterns,
+                            InlineCostModel &costModel) {
   // If we successfully inlined any calls, run some simplifications on the
   // nodes of the scc. Continue attempting to inline until we reach a fixed
   // point, or a maximum iteration count. We canonicalize here as it may
   // devirtualize new calls, as well as give us a better cost model.
+  // Only the nodes changed by the previous iteration are revisited.
   unsigned iterationCount = 0;
-  while (succeeded(inlineCallsInSCC(inliner, useList, currentSCC))) {
+  SmallPtrSet<CallGraphNode *, 4> changedNodes(currentSCC.begin(),
+                                               currentSCC.end());
+  while (succeeded(inlineCallsInSCC(inliner, useList, currentSCC, costModel,
+                                    changedNodes))) {
     // If we aren't allowing simplifications or the max iteration count was
     // reached, then bail out early.
     if (disableCanonicalization || ++iterationCount >= maxInliningIterations)
       break;
-    canonicalizeSCC(inliner.cg, useList, currentSCC, context, canonPatterns);
+    canonicalizeSCC(inliner.cg, useList, currentSCC, context, canonPatterns,
+                    costModel, changedNodes);
   }
 }
 
-std::unique_ptr<Pass> mlir::quantum::createCircuitInlinerPass() {
-  return std::make_unique<CircuitInlinerPass>();
+std::unique_ptr<Pass> mlir::quantum::createCircuitInlinerPass(
+    const CircuitInlinerOptions &options) {
+  return std::make_unique<CircuitInlinerPass>(options);
 }
@@ -0,0 +1,106 @@
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "CircuitSchedule.h"
+
+#include <algorithm>
+
+using namespace mlir;
+using namespace mlir::quantum;
+using namespace mlir::quantumssa;
+
+namespace {
+
+bool isQState(Type ty) {
+    return ty.isa<QstateType>() || ty.isa<RstateType>();
+}
+
+int64_t getIndex(ArrayAttr idxs, unsigned i) {
+    return idxs[i].cast<IntegerAttr>().getInt();
+}
+
+} // end anonymous namespace
+
+bool quantum::isScheduleBarrier(Operation *op) {
+    if (op->getNumRegions() || op->isKnownTerminator())
+        return true;
+    // calls and applied meta ops execute whole circuits
+    if (isa<CallCircOp>(op) || isa<ApplyCircOp>(op) || isa<ControlOp>(op) || isa<AdjointOp>(op))
+        return llvm::any_of(op->getResultTypes(), isQState);
+    return !isa<QuantumSSADialect>(op->getDialect()) && !MemoryEffectOpInterface::hasNoEffect(op);
+}
+
+SmallVector<int64_t, 1> WireSchedule::getTimes(Value state) const {
+    auto it = times.find(state);
+    if (it != times.end())
+        return it->second;
+    // states defined before the segment are available from its start
+    auto regType = state.getType().dyn_cast<RstateType>();
+    int64_t size = regType && regType.getNumQubits() ? *regType.getNumQubits() : 1;
+    return SmallVector<int64_t, 1>(size, 0);
+}
+
+int64_t WireSchedule::getStart(Operation *op) const {
+    int64_t start = 0;
+    for (Value operand : op->getOperands()) {
+        if (!isQState(operand.getType()))
+            continue;
+        SmallVector<int64_t, 1> available = getTimes(operand);
+        // extractions only wait for the extracted qubits
+        if (auto extr = dyn_cast<ExtractOp>(op)) {
+            if (extr.const_idx() && extr.reg().getType().cast<RstateType>().getNumQubits()) {
+                for (unsigned i = 0, e = extr.qbs().size(); i < e; i++)
+                    start = std::max(start, available[getIndex(*extr.const_idx(), i)]);
+                continue;
+            }
+        }
+        for (int64_t time : available)
+            start = std::max(start, time);
+    }
+    return start;
+}
+
+int64_t WireSchedule::schedule(Operation *op, int64_t latency) {
+    // register bookkeeping moves qubits between states without occupying them
+    if (auto extr = dyn_cast<ExtractOp>(op)) {
+        SmallVector<int64_t, 1> available = getTimes(extr.reg());
+        auto idxs = extr.const_idx();
+        if (idxs && extr.reg().getType().cast<RstateType>().getNumQubits()) {
+            SmallVector<int64_t, 4> positions;
+            for (unsigned i = 0, e = extr.qbs().size(); i < e; i++) {
+                positions.push_back(getIndex(*idxs, i));
+                times[extr.qbs()[i]] = {available[positions.back()]};
+            }
+            std::sort(positions.begin(), positions.end());
+            for (auto it = positions.rbegin(), e = positions.rend(); it != e; ++it)
+                available.erase(available.begin() + *it);
+            times[extr.rem()] = available;
+            return getStart(op);
+        }
+    } else if (auto comb = dyn_cast<CombineStatOp>(op)) {
+        SmallVector<int64_t, 1> available = getTimes(comb.reg());
+        if (comb.reg().getType().cast<RstateType>().getNumQubits()) {
+            SmallVector<std::pair<int64_t, int64_t>, 4> inserts;
+            for (unsigned i = 0, e = comb.qbs().size(); i < e; i++)
+                inserts.push_back({getIndex(comb.const_idx(), i), getTimes(comb.qbs()[i]).front()});
+            std::sort(inserts.begin(), inserts.end());
+            for (auto &insert : inserts)
+                available.insert(available.begin() + insert.first, insert.second);
+            times[comb.newreg()] = available;
+            return getStart(op);
+        }
+    }
+
+    int64_t start = getStart(op);
+    int64_t finish = start + latency;
+    for (Value res : op->getResults()) {
+        if (!isQState(res.getType()))
+            continue;
+        SmallVector<int64_t, 1> finished = getTimes(res);
+        std::fill(finished.begin(), finished.end(), finish);
+        times[res] = finished;
+    }
+    depth = std::max(depth, finish);
+    return start;
+}
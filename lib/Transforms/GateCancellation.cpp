@@ -0,0 +1,234 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/Pass/Pass.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+#include "CircuitParallel.h"
+#include "FixedPoint.h"
+
+#include <algorithm>
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Commutation-aware gate cancellation pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+// basis in which a gate acts diagonally on one of its qubit wires, two gates sharing a wire
+// on which both are diagonal in the same basis commute on that wire
+enum class WireBasis { None, Z, X };
+
+// maximum number of use-def steps taken when tracing a wire back from a gate
+constexpr unsigned windowSize = 64;
+
+// position of a wire while tracing it backwards, either a single qubit state (idx < 0)
+// or the qubit at a given position of a register state
+struct WirePos {
+    Value val;
+    int64_t idx;
+};
+
+// get the basis in which an applied gate acts on the wire of its result `resNo`
+WireBasis getWireBasis(Operation *gate, unsigned resNo) {
+    if (isa<RzOp>(gate) || isa<ROp>(gate))
+        return WireBasis::Z;
+    if (isa<XOp>(gate))
+        return WireBasis::X;
+    if (auto cx = dyn_cast<CNotOp>(gate))
+        return (cx.ctrl() && resNo == 0) ? WireBasis::Z : WireBasis::X;
+
+    return WireBasis::None;
+}
+
+// the quantum state operands of a gate, in the same order as the corresponding results
+SmallVector<Value, 2> getStateOperands(Operation *gate) {
+    SmallVector<Value, 2> states;
+    for (Value arg : gate->getOperands())
+        if (arg.getType().isa<QstateType>() || arg.getType().isa<RstateType>())
+            states.push_back(arg);
+    return states;
+}
+
+// gates handled by this pass: hermitian single qubit gates & CX, applied to single qubits
+bool isCancelCandidate(Operation *op) {
+    if (auto h = dyn_cast<HOp>(op))
+        return h.qbs() && h.qbs().getType().isa<QstateType>();
+    if (auto x = dyn_cast<XOp>(op))
+        return x.qbs() && x.qbs().getType().isa<QstateType>();
+    if (auto cx = dyn_cast<CNotOp>(op))
+        return cx.ctrl() && cx.qbs() && cx.qbs().getType().isa<QstateType>();
+
+    return false;
+}
+
+int64_t getIndex(ArrayAttr idxs, unsigned i) {
+    return idxs[i].cast<IntegerAttr>().getInt();
+}
+
+// Trace the wire on operand `wire` of a gate backwards through qubit extractions, insertions,
+// and gates that commute with it. Every gate of the same kind found on the same wire is
+// recorded (closest first) as a possible cancellation partner. The trace stops at the first
+// non-commuting gate, at dynamic register accesses, or when leaving the block of the gate.
+void collectPartners(Operation *gate, unsigned wire, SmallVectorImpl<Operation*> &partners) {
+    Block *block = gate->getBlock();
+    WireBasis basis = getWireBasis(gate, wire);
+    WirePos pos = {getStateOperands(gate)[wire], -1};
+
+    for (unsigned step = 0; step < windowSize; step++) {
+        Operation *def = pos.val.getDefiningOp();
+        if (!def || def->getBlock() != block)
+            return;
+
+        if (auto extr = dyn_cast<ExtractOp>(def)) {
+            if (!extr.const_idx())
+                return;
+            ArrayAttr idxs = *extr.const_idx();
+            unsigned resNo = pos.val.cast<OpResult>().getResultNumber();
+
+            if (pos.idx < 0) {
+                // qubit extracted from the input register
+                pos = {extr.reg(), getIndex(idxs, resNo)};
+            } else {
+                // position in the remainder, skip over the extracted qubits
+                SmallVector<int64_t, 4> removed;
+                for (unsigned i = 0; i < idxs.size(); i++)
+                    removed.push_back(getIndex(idxs, i));
+                std::sort(removed.begin(), removed.end());
+
+                int64_t idx = pos.idx;
+                for (int64_t r : removed)
+                    if (r <= idx)
+                        idx++;
+                pos = {extr.reg(), idx};
+            }
+            continue;
+        }
+
+        if (auto comb = dyn_cast<CombineStatOp>(def)) {
+            ArrayAttr idxs = comb.const_idx();
+            int64_t shift = 0;
+            bool inserted = false;
+            for (unsigned i = 0; i < idxs.size(); i++) {
+                int64_t idx = getIndex(idxs, i);
+                if (idx == pos.idx) {
+                    pos = {comb.qbs()[i], -1};
+                    inserted = true;
+                    break;
+                }
+                if (idx < pos.idx)
+                    shift++;
+            }
+            if (!inserted)
+                pos = {comb.reg(), pos.idx - shift};
+            continue;
+        }
+
+        if (!isa<QuantumSSADialect>(def->getDialect()) || !def->hasTrait<OpTrait::UnitaryTrait>())
+            return;
+
+        unsigned resNo = pos.val.cast<OpResult>().getResultNumber();
+        SmallVector<Value, 2> inputs = getStateOperands(def);
+        if (resNo >= inputs.size())
+            return;
+
+        if (pos.idx < 0 && def->getName() == gate->getName() && resNo == wire)
+            partners.push_back(def);
+
+        // gates applied to a whole register act on every position in the same basis
+        if (basis == WireBasis::None || getWireBasis(def, resNo) != basis)
+            return;
+
+        pos = {inputs[resNo], pos.idx};
+    }
+}
+
+// find a matching gate preceding `gate` such that all gates in between commute with it
+Operation* findPartner(Operation *gate) {
+    SmallVector<Operation*, 4> partners;
+    collectPartners(gate, 0, partners);
+    if (partners.empty() || gate->getNumResults() == 1)
+        return partners.empty() ? nullptr : partners.front();
+
+    // two-qubit gates need the same partner on both wires
+    SmallVector<Operation*, 4> targetPartners;
+    collectPartners(gate, 1, targetPartners);
+    for (Operation *partner : targetPartners)
+        if (llvm::is_contained(partners, partner))
+            return partner;
+
+    return nullptr;
+}
+
+void eraseGate(Operation *gate) {
+    gate->replaceAllUsesWith(getStateOperands(gate));
+    gate->erase();
+}
+
+} // end anonymous namespace
+
+struct CommutationCancelPass : public OperationPass<ModuleOp> {
+    CommutationCancelPass()
+        : OperationPass<ModuleOp>(TypeID::get<CommutationCancelPass>()) {}
+    CommutationCancelPass(const CommutationCancelPass &)
+        : OperationPass<ModuleOp>(TypeID::get<CommutationCancelPass>()) {}
+
+    StringRef getName() const override {
+        return "CommutationCancelPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<CommutationCancelPass>(*this);
+    }
+
+    // single forward sweep over a region, each gate looks for a partner in its wire windows
+    static unsigned cancelGates(Region &region) {
+        unsigned numCancelled = 0;
+        for (Block &block : region) {
+            for (Operation &op : llvm::make_early_inc_range(block)) {
+                for (Region &nested : op.getRegions())
+                    numCancelled += cancelGates(nested);
+
+                if (!isCancelCandidate(&op))
+                    continue;
+
+                if (Operation *partner = findPartner(&op)) {
+                    eraseGate(&op);
+                    eraseGate(partner);
+                    numCancelled++;
+                }
+            }
+        }
+        return numCancelled;
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        SmallVector<CircuitOp, 8> circuits;
+        for (auto circ : module.getOps<CircuitOp>())
+            if (!quantum::isConverged(circ))
+                circuits.push_back(circ);
+        SmallVector<unsigned, 8> cancelled(circuits.size(), 0);
+
+        quantum::forEachCircuitParallel(circuits, [&](size_t index) {
+            cancelled[index] = cancelGates(circuits[index].getBody());
+        });
+
+        for (size_t index = 0; index < circuits.size(); index++) {
+            numCancelledPairs += cancelled[index];
+            if (cancelled[index])
+                quantum::markChanged(circuits[index]);
+        }
+    }
+
+private:
+    Statistic numCancelledPairs{this, "cancelled-pairs", "Number of cancelled gate pairs"};
+};
+
+std::unique_ptr<Pass> quantum::createCommutationCancelPass() {
+    return std::make_unique<CommutationCancelPass>();
+}
@@ -0,0 +1,357 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/Matchers.h"
+#include "mlir/IR/StandardTypes.h"
+#include "mlir/Pass/Pass.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+#include "CircuitParallel.h"
+#include "CircuitAnalysis.h"
+
+#include <complex>
+#include <list>
+#include <cmath>
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Gate fusion pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+using Complex = std::complex<double>;
+
+// dense square matrix in row-major order, bit i of a basis index refers to the i-th qubit
+using Matrix = std::vector<Complex>;
+
+// A sequence of gates acting on a small set of qubit wires, fused into one unitary. `inputs`
+// are the states entering the group, `wires` the current (latest) states leaving it.
+struct FusionGroup {
+    SmallVector<Value, 4> inputs;
+    SmallVector<Value, 4> wires;
+    SmallVector<Operation*, 8> gates;
+    Matrix matrix = {1};
+
+    unsigned getNumQubits() const { return wires.size(); }
+};
+
+// the quantum state operands of a gate, in the same order as the corresponding results
+SmallVector<Value, 2> getStateOperands(Operation *gate) {
+    SmallVector<Value, 2> states;
+    for (Value arg : gate->getOperands())
+        if (arg.getType().isa<QstateType>())
+            states.push_back(arg);
+    return states;
+}
+
+// gates which can be fused: applied to single qubits only, with constant angles
+bool isFusionCandidate(Operation *op) {
+    if (isa<FusedOp>(op))
+        return true;
+    if (!isa<HOp>(op) && !isa<XOp>(op) && !isa<RzOp>(op) && !isa<ROp>(op) &&
+        !isa<CNotOp>(op) && !isa<SwapOp>(op))
+        return false;
+
+    // gates on hold or applied to registers
+    if (getStateOperands(op).size() != op->getNumResults())
+        return false;
+    for (Value res : op->getResults())
+        if (!res.getType().isa<QstateType>())
+            return false;
+
+    if (isa<RzOp>(op) || isa<ROp>(op)) {
+        FloatAttr phi;
+        return matchPattern(op->getOperand(0), m_Constant(&phi));
+    }
+    return true;
+}
+
+// matrix of a fusion candidate on its state operands
+Matrix getGateMatrix(Operation *gate) {
+    const double norm = 1.0 / std::sqrt(2.0);
+    double phi = 0;
+    FloatAttr phiAttr;
+    if ((isa<RzOp>(gate) || isa<ROp>(gate)) && matchPattern(gate->getOperand(0), m_Constant(&phiAttr)))
+        phi = phiAttr.getValueAsDouble();
+
+    if (isa<HOp>(gate))
+        return {norm, norm, norm, -norm};
+    if (isa<XOp>(gate))
+        return {0, 1, 1, 0};
+    if (isa<RzOp>(gate))
+        return {std::polar(1.0, -phi / 2), 0, 0, std::polar(1.0, phi / 2)};
+    if (isa<ROp>(gate))
+        return {1, 0, 0, std::polar(1.0, phi)};
+    // the control is the first operand, i.e. bit 0
+    if (isa<CNotOp>(gate))
+        return {1, 0, 0, 0,
+                0, 0, 0, 1,
+                0, 0, 1, 0,
+                0, 1, 0, 0};
+    if (isa<SwapOp>(gate))
+        return {1, 0, 0, 0,
+                0, 0, 1, 0,
+                0, 1, 0, 0,
+                0, 0, 0, 1};
+
+    auto fused = cast<FusedOp>(gate);
+    SmallVector<double, 32> values;
+    for (APFloat val : fused.matrix().getFloatValues())
+        values.push_back(val.convertToDouble());
+    Matrix matrix(values.size() / 2);
+    for (size_t i = 0; i < matrix.size(); i++)
+        matrix[i] = {values[2 * i], values[2 * i + 1]};
+    return matrix;
+}
+
+// tensor product of `low` (on the lower bits) and `high`
+Matrix kron(const Matrix &low, unsigned numLow, const Matrix &high, unsigned numHigh) {
+    uint64_t dimLow = 1ull << numLow, dimHigh = 1ull << numHigh, dim = dimLow * dimHigh;
+    Matrix res(dim * dim);
+    for (uint64_t ih = 0; ih < dimHigh; ih++)
+        for (uint64_t jh = 0; jh < dimHigh; jh++)
+            for (uint64_t il = 0; il < dimLow; il++)
+                for (uint64_t jl = 0; jl < dimLow; jl++)
+                    res[((ih << numLow) | il) * dim + ((jh << numLow) | jl)] =
+                        high[ih * dimHigh + jh] * low[il * dimLow + jl];
+    return res;
+}
+
+// left-multiply `matrix` (on `numQubits` qubits) by `gate` acting on the qubits `positions`
+void applyGate(Matrix &matrix, unsigned numQubits, const Matrix &gate, ArrayRef<unsigned> positions) {
+    uint64_t dim = 1ull << numQubits, gateDim = 1ull << positions.size();
+    uint64_t gateMask = 0;
+    for (unsigned pos : positions)
+        gateMask |= 1ull << pos;
+
+    // basis index offsets of all states of the gate qubits
+    SmallVector<uint64_t, 32> offsets(gateDim, 0);
+    for (uint64_t a = 0; a < gateDim; a++)
+        for (unsigned i = 0; i < positions.size(); i++)
+            if (a & (1ull << i))
+                offsets[a] |= 1ull << positions[i];
+
+    SmallVector<Complex, 32> col(gateDim);
+    for (uint64_t c = 0; c < dim; c++) {
+        for (uint64_t base = 0; base < dim; base++) {
+            if (base & gateMask)
+                continue;
+            for (uint64_t a = 0; a < gateDim; a++)
+                col[a] = matrix[(base | offsets[a]) * dim + c];
+            for (uint64_t r = 0; r < gateDim; r++) {
+                Complex sum = 0;
+                for (uint64_t a = 0; a < gateDim; a++)
+                    sum += gate[r * gateDim + a] * col[a];
+                matrix[(base | offsets[r]) * dim + c] = sum;
+            }
+        }
+    }
+}
+
+// add the gates of `other` to `group`, both act on disjoint wires and therefore commute
+void mergeGroups(FusionGroup &group, FusionGroup &other) {
+    group.matrix = kron(group.matrix, group.getNumQubits(), other.matrix, other.getNumQubits());
+    group.inputs.append(other.inputs.begin(), other.inputs.end());
+    group.wires.append(other.wires.begin(), other.wires.end());
+    group.gates.append(other.gates.begin(), other.gates.end());
+}
+
+// Greedily fuses consecutive gates of a block into groups on at most `maxQubits` qubits.
+// A group is closed as soon as one of its states is used by anything but a fusable gate,
+// or a gate would extend it beyond the qubit limit.
+class BlockFuser {
+public:
+    BlockFuser(unsigned maxQubits) : maxQubits(maxQubits) {}
+
+    unsigned numFusedGates = 0;
+    unsigned numFusedBlocks = 0;
+
+    void fuseBlock(Block &block) {
+        for (Operation &op : llvm::make_early_inc_range(block)) {
+            if (op.getNumRegions()) {
+                // uses inside nested regions are not tracked, start over inside them
+                closeAll();
+                for (Region &region : op.getRegions())
+                    for (Block &nested : region) {
+                        BlockFuser nestedFuser(maxQubits);
+                        nestedFuser.fuseBlock(nested);
+                        numFusedGates += nestedFuser.numFusedGates;
+                        numFusedBlocks += nestedFuser.numFusedBlocks;
+                    }
+                continue;
+            }
+
+            if (isFusionCandidate(&op) && addGate(&op))
+                continue;
+
+            for (Value arg : op.getOperands())
+                if (FusionGroup *group = owner.lookup(arg))
+                    close(group);
+        }
+        closeAll();
+    }
+
+private:
+    unsigned maxQubits;
+    std::list<FusionGroup> groups;
+    DenseMap<Value, FusionGroup*> owner;
+
+    // try to add a gate to the groups owning its operands, returns false if it doesn't fit
+    bool addGate(Operation *gate) {
+        SmallVector<Value, 2> args = getStateOperands(gate);
+        if (args.size() > maxQubits)
+            return false;
+
+        SmallVector<FusionGroup*, 2> involved;
+        unsigned numQubits = 0;
+        for (Value arg : args) {
+            FusionGroup *group = owner.lookup(arg);
+            if (!group) {
+                numQubits++;
+            } else if (!llvm::is_contained(involved, group)) {
+                involved.push_back(group);
+                numQubits += group->getNumQubits();
+            }
+        }
+
+        if (numQubits > maxQubits) {
+            for (FusionGroup *group : involved)
+                close(group);
+            involved.clear();
+            // the operands now refer to the results of the fused ops
+            args = getStateOperands(gate);
+        }
+
+        // combine the involved groups and the remaining wires into one group
+        FusionGroup *group;
+        if (involved.empty()) {
+            groups.emplace_back();
+            group = &groups.back();
+        } else {
+            group = involved.front();
+        }
+        for (FusionGroup *other : llvm::drop_begin(involved, 1)) {
+            for (Value wire : other->wires)
+                owner[wire] = group;
+            mergeGroups(*group, *other);
+            groups.remove_if([other](const FusionGroup &g) { return &g == other; });
+        }
+        for (Value arg : args) {
+            if (owner.lookup(arg) == group)
+                continue;
+            group->matrix = kron(group->matrix, group->getNumQubits(), {1, 0, 0, 1}, 1);
+            group->inputs.push_back(arg);
+            group->wires.push_back(arg);
+        }
+
+        SmallVector<unsigned, 2> positions;
+        for (Value arg : args)
+            positions.push_back(std::find(group->wires.begin(), group->wires.end(), arg) - group->wires.begin());
+        applyGate(group->matrix, group->getNumQubits(), getGateMatrix(gate), positions);
+
+        for (auto it : llvm::zip(positions, gate->getResults())) {
+            Value &wire = group->wires[std::get<0>(it)];
+            owner.erase(wire);
+            wire = std::get<1>(it);
+            owner[wire] = group;
+        }
+        group->gates.push_back(gate);
+        return true;
+    }
+
+    // replace the gates of a group by a single fused op, placed at the last gate of the group
+    void close(FusionGroup *group) {
+        for (Value wire : group->wires)
+            owner.erase(wire);
+
+        if (group->gates.size() > 1) {
+            Operation *last = group->gates.back();
+            OpBuilder b(last->getContext());
+            b.setInsertionPointAfter(last);
+
+            uint64_t dim = 1ull << group->getNumQubits();
+            SmallVector<double, 32> values;
+            for (Complex val : group->matrix) {
+                values.push_back(val.real());
+                values.push_back(val.imag());
+            }
+            auto matrixType = RankedTensorType::get({(int64_t) dim, (int64_t) dim, 2}, b.getF64Type());
+
+            SmallVector<Type, 4> resTypes(group->getNumQubits(), QstateType::get(b.getContext()));
+            OperationState fusedState(last->getLoc(), FusedOp::getOperationName());
+            FusedOp::build(b, fusedState, resTypes, group->inputs,
+                           DenseElementsAttr::get(matrixType, llvm::makeArrayRef(values)));
+            Operation *fused = b.createOperation(fusedState);
+
+            for (auto it : llvm::zip(group->wires, fused->getResults()))
+                std::get<0>(it).replaceAllUsesWith(std::get<1>(it));
+            for (Operation *gate : llvm::reverse(group->gates))
+                gate->erase();
+
+            numFusedGates += group->gates.size();
+            numFusedBlocks++;
+        }
+
+        groups.remove_if([group](const FusionGroup &g) { return &g == group; });
+    }
+
+    void closeAll() {
+        while (!groups.empty())
+            close(&groups.front());
+    }
+};
+
+} // end anonymous namespace
+
+struct GateFusionPass : public OperationPass<ModuleOp> {
+    GateFusionPass(const quantum::GateFusionOptions &options) :
+        OperationPass<ModuleOp>(TypeID::get<GateFusionPass>()) {
+        maxQubits = options.maxQubits;
+    }
+    GateFusionPass(const GateFusionPass &) :
+        OperationPass<ModuleOp>(TypeID::get<GateFusionPass>()) {}
+
+    StringRef getName() const override {
+        return "GateFusionPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<GateFusionPass>(*this);
+    }
+
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<QuantumSSADialect>();
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        SmallVector<CircuitOp, 8> circuits(module.getOps<CircuitOp>());
+        SmallVector<BlockFuser, 8> fusers(circuits.size(), BlockFuser(maxQubits));
+
+        quantum::forEachCircuitParallel(circuits, [&](size_t index) {
+            for (Block &block : circuits[index].getBody())
+                fusers[index].fuseBlock(block);
+        });
+
+        for (BlockFuser &fuser : fusers) {
+            numFusedGates += fuser.numFusedGates;
+            numFusedBlocks += fuser.numFusedBlocks;
+        }
+
+        markAnalysesPreserved<quantum::CircuitUseAnalysis>();
+    }
+
+private:
+    Option<unsigned> maxQubits{*this, "max-qubits", llvm::cl::desc("Maximum number of qubits of a fused unitary"), llvm::cl::init(3)};
+
+    Statistic numFusedGates{this, "fused-gates", "Number of gates replaced by fused unitaries"};
+    Statistic numFusedBlocks{this, "fused-blocks", "Number of fused unitaries created"};
+};
+
+std::unique_ptr<Pass> quantum::createGateFusionPass(const GateFusionOptions &options) {
+    return std::make_unique<GateFusionPass>(options);
+}
@@ -0,0 +1,211 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+#include "CircuitParallel.h"
+#include "CircuitAnalysis.h"
+#include "CircuitSchedule.h"
+#include "CostModel.h"
+
+#include <algorithm>
+#include <memory>
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Gate scheduling pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+bool isGate(Operation *op) {
+    return isa<HOp>(op) || isa<XOp>(op) || isa<RzOp>(op) || isa<ROp>(op) || isa<CNotOp>(op) || isa<SwapOp>(op);
+}
+
+bool isQState(Type ty) {
+    return ty.isa<QstateType>() || ty.isa<RstateType>();
+}
+
+int64_t getNumCtrls(Operation *gate) {
+    if (auto attr = gate->getAttrOfType<IntegerAttr>("_num_ctrls"))
+        return attr.getInt();
+    return 0;
+}
+
+// the ops of a block between two barriers, followed by the barrier ending them
+struct Segment {
+    SmallVector<Operation*, 16> ops;
+    Operation *end;
+};
+
+struct BlockScheduler {
+    const quantum::CostModel *model;
+    unsigned numHoisted = 0;
+    unsigned numReordered = 0;
+
+    // latency in the scheduled metric, ops which are not applied to qubits take no time
+    int64_t getLatency(Operation *op) {
+        if (!isa<QuantumSSADialect>(op->getDialect()) || !op->getNumResults() ||
+                !isQState(op->getResults().back().getType()))
+            return 0;
+        SmallVector<int64_t, 1> cost;
+        model->getCost(op->getName().stripDialect(), getNumCtrls(op), cost);
+        return cost.front();
+    }
+
+    quantum::WireSchedule scheduleSegment(const Segment &segment) {
+        quantum::WireSchedule schedule;
+        for (Operation *op : segment.ops)
+            if (isa<QuantumSSADialect>(op->getDialect()))
+                schedule.schedule(op, getLatency(op));
+        return schedule;
+    }
+
+    // Move gates at the start of a segment in front of the preceding barrier, if they only
+    // depend on values from before the barrier and fit into the idle time of the previous
+    // segment, so that they run in parallel with it instead of lengthening their own segment.
+    void hoistGates(Segment &prev, Segment &segment) {
+        quantum::WireSchedule schedule = scheduleSegment(prev);
+        // ops which stay behind the barrier, with the barrier itself
+        llvm::SmallPtrSet<Operation*, 16> behind;
+        behind.insert(prev.end);
+
+        SmallVector<Operation*, 16> kept;
+        for (Operation *op : segment.ops) {
+            bool ready = llvm::none_of(op->getOperands(), [&](Value operand) {
+                return behind.count(operand.getDefiningOp());
+            });
+            int64_t latency = getLatency(op);
+            if (isGate(op) && latency && ready && schedule.getStart(op) + latency <= schedule.getDepth()) {
+                op->moveBefore(prev.end);
+                schedule.schedule(op, latency);
+                prev.ops.push_back(op);
+                numHoisted++;
+                continue;
+            }
+            behind.insert(op);
+            kept.push_back(op);
+        }
+        segment.ops = kept;
+    }
+
+    // Order the ops of a segment by their ASAP start time, ties are kept in program order.
+    // An op is never placed before the ops defining its operands, classical ops are placed
+    // right after the latest of them.
+    void reorderSegment(const Segment &segment) {
+        quantum::WireSchedule schedule;
+        llvm::DenseMap<Operation*, int64_t> keys;
+        SmallVector<std::pair<int64_t, Operation*>, 16> order;
+        for (Operation *op : segment.ops) {
+            int64_t key = 0;
+            if (isa<QuantumSSADialect>(op->getDialect()))
+                key = schedule.schedule(op, getLatency(op));
+            for (Value operand : op->getOperands()) {
+                auto it = keys.find(operand.getDefiningOp());
+                if (it != keys.end())
+                    key = std::max(key, it->second);
+            }
+            keys[op] = key;
+            order.push_back({key, op});
+        }
+
+        auto byKey = [](auto &left, auto &right) { return left.first < right.first; };
+        if (std::is_sorted(order.begin(), order.end(), byKey))
+            return;
+        std::stable_sort(order.begin(), order.end(), byKey);
+        for (auto &entry : order)
+            entry.second->moveBefore(segment.end);
+        numReordered++;
+    }
+
+    void scheduleBlock(Block &block) {
+        SmallVector<Segment, 4> segments(1);
+        for (Operation &op : block) {
+            for (Region &nested : op.getRegions())
+                for (Block &nestedBlock : nested)
+                    scheduleBlock(nestedBlock);
+
+            if (!quantum::isScheduleBarrier(&op)) {
+                segments.back().ops.push_back(&op);
+                continue;
+            }
+            segments.back().end = &op;
+            segments.emplace_back();
+        }
+        // every block ends with a terminator, which is a barrier
+        segments.pop_back();
+
+        for (unsigned i = 1, e = segments.size(); i < e; i++)
+            hoistGates(segments[i - 1], segments[i]);
+        for (Segment &segment : segments)
+            reorderSegment(segment);
+    }
+};
+
+} // end anonymous namespace
+
+struct GateSchedulingPass : public OperationPass<ModuleOp> {
+    GateSchedulingPass(const quantum::SchedulingOptions &options) :
+        OperationPass<ModuleOp>(TypeID::get<GateSchedulingPass>()), options(options) {}
+    GateSchedulingPass(const GateSchedulingPass &other) :
+        OperationPass<ModuleOp>(TypeID::get<GateSchedulingPass>()), options(other.options),
+        costModel(other.costModel) {}
+
+    StringRef getName() const override {
+        return "GateSchedulingPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<GateSchedulingPass>(*this);
+    }
+
+    LogicalResult loadCostModel(ModuleOp module) {
+        auto model = quantum::CostModel::load(options.costModel, {options.metric});
+        if (!model) {
+            module.emitError() << llvm::toString(model.takeError());
+            return failure();
+        }
+        costModel = std::make_shared<const quantum::CostModel>(std::move(*model));
+        return success();
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        if (!costModel && failed(loadCostModel(module)))
+            return signalPassFailure();
+
+        SmallVector<CircuitOp, 8> circuits(module.getOps<CircuitOp>());
+        SmallVector<BlockScheduler, 8> schedulers(circuits.size(), BlockScheduler{costModel.get()});
+
+        quantum::forEachCircuitParallel(circuits, [&](size_t index) {
+            for (Block &block : circuits[index].getBody())
+                schedulers[index].scheduleBlock(block);
+        });
+
+        for (BlockScheduler &scheduler : schedulers) {
+            numHoistedGates += scheduler.numHoisted;
+            numReorderedSegments += scheduler.numReordered;
+        }
+
+        // ops are only moved, calls keep referencing the same circuits
+        markAnalysesPreserved<quantum::CircuitUseAnalysis>();
+    }
+
+private:
+    quantum::SchedulingOptions options;
+    // shared with all clones of this pass, read-only once loaded
+    std::shared_ptr<const quantum::CostModel> costModel;
+
+    Statistic numHoistedGates{this, "hoisted-gates", "Number of gates moved into the idle time before a barrier"};
+    Statistic numReorderedSegments{this, "reordered-segments", "Number of circuit segments put into ASAP order"};
+};
+
+std::unique_ptr<Pass> quantum::createGateSchedulingPass(const SchedulingOptions &options) {
+    return std::make_unique<GateSchedulingPass>(options);
+}
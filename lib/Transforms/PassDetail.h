@@ -54,6 +54,11 @@ public:
 protected:
   ::mlir::Pass::Option<bool> disableCanonicalization{*this, "disable-simplify", ::llvm::cl::desc("Disable running simplifications during inlining"), ::llvm::cl::init(false)};
   ::mlir::Pass::Option<unsigned> maxInliningIterations{*this, "max-iterations", ::llvm::cl::desc("Maximum number of iterations when inlining within an SCC"), ::llvm::cl::init(4)};
+  ::mlir::Pass::Option<unsigned> inlineThreshold{*this, "inline-threshold", ::llvm::cl::desc("Maximum gate cost of a callee to be inlined, 0 for no limit"), ::llvm::cl::init(0)};
+  ::mlir::Pass::Option<unsigned> growthBudget{*this, "growth-budget", ::llvm::cl::desc("Maximum growth of the module gate count due to inlining in percent, 0 for no limit"), ::llvm::cl::init(0)};
+  ::mlir::Pass::Statistic numConsideredCalls{this, "considered-calls", "Number of calls considered for inlining"};
+  ::mlir::Pass::Statistic numInlinedCalls{this, "inlined-calls", "Number of inlined calls"};
+  ::mlir::Pass::Statistic numErasedCallables{this, "erased-callables", "Number of circuits erased after being inlined in place"};
 };
 
 } // end namespace mlir
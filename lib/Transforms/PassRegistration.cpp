@@ -0,0 +1,54 @@
+#include "mlir/Pass/Pass.h"
+#include "mlir/Pass/PassRegistry.h"
+
+#include "Passes.h"
+
+using namespace mlir;
+
+void quantum::registerQuantumPasses() {
+    registerPass("convert-mem-to-val",
+                 "Changes op mode from memory to value semantics, by module.",
+                 quantum::createMemToValPass);
+    registerPass("quantum-gate-opt",
+                 "Run the greddy driver on a variety of patterns to optimize quantum gates.",
+                 quantum::createQuantumGateOptimizationPass);
+    registerPass("quantum-commute-cancel",
+                 "Cancel hermitian gate pairs across commuting gates in a single sweep.",
+                 quantum::createCommutationCancelPass);
+    registerPass("quantum-consolidate-regs",
+                 "Consolidate chains of register extractions and insertions in a single sweep.",
+                 quantum::createRegisterConsolidationPass);
+    registerPass("quantum-reuse-qubits",
+                 "Replace qubit allocations by resets of qubits whose lifetime ended.",
+                 quantum::createQubitReusePass);
+    registerPass("quantum-schedule",
+                 "Reorder gates by their ASAP schedule and move them into idle time before barriers.",
+                 [] { return quantum::createGateSchedulingPass(); });
+    registerPass("circuit-inline",
+                 "Inline circuit calls",
+                 [] { return quantum::createCircuitInlinerPass(); });
+    registerPass("count-resources",
+                 "Count the quantum resources used in this program.",
+                 [] { return quantum::createResourceCounterPass(); });
+    registerPass("count-resources-summary",
+                 "Count the quantum resources used in this program via closed-form cost summaries.",
+                 [] { return quantum::createResourceCounterPass({/*summarize=*/true}); });
+    registerPass("lower-to-sim",
+                 "Lower quantum operations to calls into the state-vector simulator.",
+                 quantum::createSimulationLoweringPass);
+    registerPass("quantum-fuse-gates",
+                 "Fuse gates on a few qubits into dense unitaries for simulation.",
+                 [] { return quantum::createGateFusionPass(); });
+    registerPass("strip-circ",
+                 "Removed unused circuit definitions.",
+                 quantum::createStripUnusedCircuitPass);
+    registerPass("dedup-circ",
+                 "Merge structurally identical circuits and redirect their uses to one of them.",
+                 quantum::createCircuitDeduplicationPass);
+    registerPass("lower-ctrl",
+                 "Lower controlled circuit calls.",
+                 quantum::createLowerControlledCircuitsPass);
+    registerPass("materialize-adj",
+                 "Create adjoint circuits in reverse gate order and call them in place of adjoint applications.",
+                 quantum::createAdjointMaterializationPass);
+}
@@ -0,0 +1,72 @@
+#include "mlir/Transforms/Passes.h"
+
+#include "QuantumPipeline.h"
+#include "FixedPoint.h"
+
+using namespace mlir;
+using namespace mlir::quantum;
+
+QuantumPipeline::QuantumPipeline(MLIRContext &context, const QuantumPipelineOptions &options)
+    : pm(&context), optPM(&context), lateStagePM(&context),
+      optimize(options.optimize), optRounds(options.optRounds) {
+    if (options.memToVal) {
+        pm.addPass(createMemToValPass());
+        pm.addPass(createRegisterConsolidationPass());
+    }
+    if (options.lowerControls)
+        pm.addPass(createLowerControlledCircuitsPass());
+    // controlled copies of different circuits often end up identical, the duplicates are stripped
+    if (options.dedup)
+        pm.addPass(createCircuitDeduplicationPass());
+    if (options.strip) {
+        pm.addPass(createStripUnusedCircuitPass());
+        pm.addPass(createCanonicalizerPass());
+        pm.addPass(createStripUnusedCircuitPass());
+    }
+    if (options.inlineCircuits)
+        pm.addPass(createCircuitInlinerPass(options.inliner));
+    if (options.strip) {
+        pm.addPass(createStripUnusedCircuitPass());
+        pm.addPass(createCanonicalizerPass());
+        pm.addPass(createStripUnusedCircuitPass());
+    } else {
+        pm.addPass(createCanonicalizerPass());
+    }
+    if (options.optimize) {
+        optPM.addPass(createCommutationCancelPass());
+        optPM.addPass(createQuantumGateOptimizationPass());
+        // cancelled calls can leave circuits unused
+        if (options.strip)
+            optPM.addPass(createStripUnusedCircuitPass());
+        optPM.addPass(createCanonicalizerPass());
+    }
+
+    // after the optimizations, which cancel circuits against their adjoint applications
+    if (options.materializeAdjoints)
+        lateStagePM.addPass(createAdjointMaterializationPass());
+    if (options.reuseQubits)
+        lateStagePM.addPass(createQubitReusePass());
+    if (options.schedule)
+        lateStagePM.addPass(createGateSchedulingPass(options.scheduling));
+    if (options.lowering == QuantumPipelineOptions::Lowering::Simulation) {
+        if (options.fuseQubits)
+            lateStagePM.addPass(createGateFusionPass({options.fuseQubits}));
+        lateStagePM.addPass(createSimulationLoweringPass());
+    } else if (options.lowering == QuantumPipelineOptions::Lowering::ResourceCounting) {
+        lateStagePM.addPass(createResourceCounterPass(options.counting));
+    }
+}
+
+LogicalResult QuantumPipeline::run(ModuleOp module) {
+    if (failed(pm.run(module)))
+        return failure();
+    if (optimize && failed(runToFixedPoint(optPM, module, optRounds)))
+        return failure();
+    return lateStagePM.run(module);
+}
+
+void QuantumPipeline::forEachPassManager(function_ref<void(PassManager &)> fn) {
+    fn(pm);
+    fn(optPM);
+    fn(lateStagePM);
+}
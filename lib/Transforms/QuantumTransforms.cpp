@@ -5,14 +5,23 @@
 #include "mlir/Pass/Pass.h"
 #include "mlir/Dialect/StandardOps/IR/Ops.h"
 #include "mlir/Dialect/SCF/SCF.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 
 #include "QuantumDialect.h"
 #include "QuantumSSADialect.h"
 #include "Passes.h"
+#include "CircuitParallel.h"
+#include "CircuitSpecialization.h"
+#include "CircuitAnalysis.h"
+#include "FixedPoint.h"
 
+#include <atomic>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
+#include <cmath>
 
 using namespace mlir;
 using namespace mlir::quantumssa;
@@ -57,55 +66,182 @@ struct MemToValPass : public OperationPass<ModuleOp> {
         return std::make_unique<MemToValPass>(*this);
     }
 
+    // dialects of the ops created by this pass, loaded by the pass manager before it runs
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<QuantumSSADialect,
+                        StandardOpsDialect,
+                        scf::SCFDialect>();
+    }
+
 private:
-    using value_map = std::unordered_map<Value, Value>;
+    // Qubit state map with nested scopes. Updates made inside a scope are recorded in an undo log
+    // and rolled back once the scope is closed, so that regions can start from the state of the
+    // enclosing region without copying the whole map.
+    class ScopedStateMap {
+    public:
+        Value lookup(Value key) const {
+            return map.lookup(key);
+        }
+
+        void set(Value key, Value val) {
+            record(key);
+            map[key] = val;
+            peakSize = std::max(peakSize, map.size());
+        }
+
+        void erase(Value key) {
+            record(key);
+            map.erase(key);
+        }
+
+        void pushScope() {
+            scopes.push_back(undoLog.size());
+        }
+
+        // largest number of entries held at once, for the pass statistics
+        size_t getPeakSize() const {
+            return peakSize;
+        }
+
+        void popScope() {
+            assert(!scopes.empty() && "No scope to pop!");
+            while (undoLog.size() > scopes.back()) {
+                auto &entry = undoLog.back();
+                if (entry.second)
+                    map[entry.first] = entry.second;
+                else
+                    map.erase(entry.first);
+                undoLog.pop_back();
+            }
+            scopes.pop_back();
+        }
+
+    private:
+        void record(Value key) {
+            if (!scopes.empty())
+                undoLog.push_back({key, map.lookup(key)});
+        }
+
+        DenseMap<Value, Value> map;
+        SmallVector<std::pair<Value, Value>, 32> undoLog;
+        SmallVector<size_t, 8> scopes;
+        size_t peakSize = 0;
+    };
+
+    using value_map = ScopedStateMap;
+    using walk_callback = function_ref<void(Operation*, value_map&, const SmallVectorImpl<Value>&,
+                                            const SmallVectorImpl<Value>&)>;
+
+    // an operation whose nested regions are currently being walked
+    struct WalkFrame {
+        Operation *op;
+        unsigned regionIdx;
+        bool inRegion;
+        Region::iterator blockIt;
+        Block::iterator opIt;
+        SmallVector<Value, 8> uniqueValues;
+        SmallVector<Value, 8> iterArgs;
+    };
+
     OpBuilder *opBuilder;
     // keep a record of the latest qubit state to replace qubit values with
-    value_map globalStateMap;
+    value_map stateMap;
     // temporary storage for newly created circuits
     Operation *circInProg;
+    // qubit values used within each scf op, gathered up front by gatherUniqueValues
+    DenseMap<Operation*, SmallVector<Value, 8>> cfUniqueValues;
+
+    Statistic numVisitedOps{this, "visited-ops", "Number of operations visited during the conversion"};
+    Statistic numConvertedCircuits{this, "converted-circuits", "Number of circuits converted to value semantics"};
+    Statistic peakStateMapSize{this, "peak-state-map-size", "Largest number of qubit states tracked at once"};
+
+    // start walking the regions of op, some ops need preprocessing before their nested ops are visited
+    void enter(Operation *op, SmallVectorImpl<WalkFrame> &stack, walk_callback callback) {
+        stack.push_back(WalkFrame{op, 0, false, {}, {}, {}, {}});
+        WalkFrame &frame = stack.back();
+
+        if (isa<quantum::CircuitOp>(op)) {  // circuit ops need a fully local (empty) inner state
+            stateMap.pushScope();
+            callback(op, stateMap, frame.uniqueValues, frame.iterArgs);
+        } else if (isa<scf::IfOp>(op)) {    // scopes are opened per region
+            frame.uniqueValues = std::move(cfUniqueValues[op]);
+            prepControlFlow(op, *opBuilder, stateMap, frame.uniqueValues, frame.iterArgs);
+        } else if (isa<scf::ForOp>(op)) {   // CF needs a temporary local scope of the outer state
+            stateMap.pushScope();
+            frame.uniqueValues = std::move(cfUniqueValues[op]);
+            prepControlFlow(op, *opBuilder, stateMap, frame.uniqueValues, frame.iterArgs);
+        }
+    }
 
-    void walk(Operation *op, value_map &outerStateMap, SmallVectorImpl<Value> &outerUniqueValues,
-              function_ref<void(Operation*, value_map&, const SmallVectorImpl<Value>&,
-                           const SmallVectorImpl<Value>&)> callback) {
-        // the qubit state mapping and list of values used inside op region needs to be nestable
-        value_map innerStateMap;
-        SmallVector<Value, 8> innerUniqueValues;
-        SmallVector<Value, 8> iterArgs;
+    // perform postorder call -> most ops as they can only be deleted after their nested ops
+    void leave(WalkFrame &frame, const SmallVectorImpl<Value> &outerUniqueValues, walk_callback callback) {
+        Operation *op = frame.op;
         SmallVector<Value, 0> dummy;
 
-        // do not recurse into functions as they do not contain any quantum operations
-        if (isa<FuncOp>(op))
-            return callback(op, innerStateMap, dummy, dummy);
-
-        // some ops need some preprocessing before nested ops are recursed into
-        if (isa<quantum::CircuitOp>(op))  // circuit ops need a fully local (empty) inner state map
-            callback(op, innerStateMap, dummy, dummy);
-        else if (isa<scf::IfOp>(op))      // map is unused here
-            prepControlFlow(op, *opBuilder, innerStateMap, innerUniqueValues, iterArgs);
-        else if (isa<scf::ForOp>(op)) {  // CF needs a temperary local copy of the outer map
-            innerStateMap = outerStateMap;
-            prepControlFlow(op, *opBuilder, innerStateMap, innerUniqueValues, iterArgs);
-        }
-
-        // walk nested operations
-        bool isSCF = isa<scf::ForOp>(op) || isa<scf::IfOp>(op);
-        bool isNesting = isa<quantum::CircuitOp>(op) || isSCF;
-        value_map &mapToUse = isNesting ? innerStateMap : outerStateMap;
-        SmallVectorImpl<Value> &valsToUse = isSCF ? innerUniqueValues : outerUniqueValues;
-        for (auto &region : op->getRegions()) {
-            if (isa<scf::IfOp>(op))       // SCF:If as above, but temp copy between each region
-                innerStateMap = outerStateMap;
-            for (auto &block : region)
-                for (auto &nestedOp : llvm::make_early_inc_range(block))
-                    walk(&nestedOp, mapToUse, innerUniqueValues, callback);
+        if (isa<quantum::CircuitOp>(op)) {
+            finalizeCircuit(op, circInProg);
+            numConvertedCircuits++;
+            stateMap.popScope();
+        } else if (isa<scf::ForOp>(op)) {
+            stateMap.popScope();
+            callback(op, stateMap, frame.uniqueValues, frame.iterArgs);
+        } else if (isa<scf::IfOp>(op)) {
+            callback(op, stateMap, frame.uniqueValues, frame.iterArgs);
+        } else {
+            callback(op, stateMap, outerUniqueValues, dummy);
         }
+    }
 
-        // perform postorder call -> most ops as they can only be deleted after recursing
-        if (isa<quantum::CircuitOp>(op))
-            finalizeCircuit(op, circInProg);
-        else
-            callback(op, outerStateMap, valsToUse, iterArgs);
+    // find the next operation to visit in the regions of the frame, or nullptr if all are done
+    Operation* nextNestedOp(WalkFrame &frame) {
+        bool isIf = isa<scf::IfOp>(frame.op);
+        while (frame.regionIdx < frame.op->getNumRegions()) {
+            Region &region = frame.op->getRegion(frame.regionIdx);
+            if (!frame.inRegion) {
+                if (isIf)     // SCF:If as above, but local scope for each region
+                    stateMap.pushScope();
+                frame.inRegion = true;
+                frame.blockIt = region.begin();
+                if (frame.blockIt != region.end())
+                    frame.opIt = frame.blockIt->begin();
+            }
+
+            while (frame.blockIt != region.end() && frame.opIt == frame.blockIt->end())
+                if (++frame.blockIt != region.end())
+                    frame.opIt = frame.blockIt->begin();
+
+            // advance before returning, the op is likely to be erased
+            if (frame.blockIt != region.end())
+                return &*frame.opIt++;
+
+            if (isIf)
+                stateMap.popScope();
+            frame.inRegion = false;
+            frame.regionIdx++;
+        }
+        return nullptr;
+    }
+
+    // walk all ops nested in root with an explicit stack, in order to keep the state map shared
+    void walk(Operation *root, walk_callback callback) {
+        SmallVector<WalkFrame, 8> stack;
+        SmallVector<Value, 0> dummy;
+
+        enter(root, stack, callback);
+        while (!stack.empty()) {
+            if (Operation *op = nextNestedOp(stack.back())) {
+                // do not recurse into functions as they do not contain any quantum operations
+                if (op->getNumRegions() && !isa<FuncOp>(op))
+                    enter(op, stack, callback);
+                else
+                    callback(op, stateMap, stack.back().uniqueValues, dummy);
+                continue;
+            }
+
+            WalkFrame frame = std::move(stack.back());
+            stack.pop_back();
+            leave(frame, stack.empty() ? dummy : stack.back().uniqueValues, callback);
+        }
     }
 
     static Type convDialectType(Builder &b, Type inType) {
@@ -181,9 +317,9 @@ private:
             if (arg.getType().isa<IndexType>()) {
                 continue;
             } else if (isQData(arg.getType())) {
-                operands.push_back(qbmap[arg]);
+                operands.push_back(qbmap.lookup(arg));
                 qargs.push_back(arg);
-                retTypes.push_back(qbmap[arg].getType());
+                retTypes.push_back(qbmap.lookup(arg).getType());
             } else {
                 operands.push_back(arg);
             }
@@ -283,7 +419,7 @@ private:
 
         auto resIt = newStates.begin();
         for (auto arg : qargs)
-            qbmap[arg] = *resIt++;
+            qbmap.set(arg, *resIt++);
         if (op->getNumResults())
             op->getResult(0).replaceAllUsesWith(newOp->getResult(retTypes.size()-1));
         op->erase();
@@ -306,7 +442,7 @@ private:
         A::build(b, opState, retTypes, operands, attrs);
         Operation *newOp = b.createOperation(opState);
 
-        qbmap[ret] = newOp->getResult(0);
+        qbmap.set(ret, newOp->getResult(0));
         // can't remove the op yet as it's return value is still needed for the qubit map
 
         return newOp;
@@ -316,7 +452,7 @@ private:
         Value arg = op->getOperand(0);
 
         OperationState opState(op->getLoc(), F::getOperationName());
-        F::build(b, opState, {}, {qbmap[arg]}, {});
+        F::build(b, opState, {}, {qbmap.lookup(arg)}, {});
         Operation *newOp = b.createOperation(opState);
 
         qbmap.erase(arg);
@@ -330,12 +466,12 @@ private:
                                                   const ArrayAttr &staticRange) {
         Value arg = op->getOperand(0);
         Value mres = op->getResult(0);
-        SmallVector<Value, 1> operands(1, qbmap[arg]);
+        SmallVector<Value, 1> operands(1, qbmap.lookup(arg));
         SmallVector<Type, 2> retTypes({convDialectType(b, arg.getType()), mres.getType()});
         Operation *extrOp, *combOp;
 
         if (staticRange.size() == 1) {
-            extrOp = buildExtr(b, op, qbmap[arg], range, staticRange);
+            extrOp = buildExtr(b, op, qbmap.lookup(arg), range, staticRange);
             operands[0] = extrOp->getResult(0);
             retTypes[0] = operands[0].getType();
         }
@@ -354,7 +490,7 @@ private:
             combOp = buildComb(b, op, reg, qbs, range, staticRange);
         }
 
-        qbmap[arg] = staticRange.size() == 1 ? combOp->getResult(0) : newOp->getResult(0);
+        qbmap.set(arg, staticRange.size() == 1 ? combOp->getResult(0) : newOp->getResult(0));
         mres.replaceAllUsesWith(newOp->getResult(1));
         op->erase();
 
@@ -369,9 +505,9 @@ private:
 
         for (auto arg : op->getOperands()) {
             if (isQData(arg.getType())) {
-                operands.push_back(qbmap[arg]);
+                operands.push_back(qbmap.lookup(arg));
                 qargs.push_back(arg);
-                resultTypes.push_back(qbmap[arg].getType());
+                resultTypes.push_back(qbmap.lookup(arg).getType());
             } else {
                 operands.push_back(arg);
             }
@@ -401,7 +537,7 @@ private:
 
         auto resIt = newOp->result_begin();
         for (auto arg : qargs)
-            qbmap[arg] = *resIt++;
+            qbmap.set(arg, *resIt++);
         op->erase();
 
         return newOp;
@@ -412,7 +548,7 @@ private:
         SmallVector<Value, 4> states;
         for (auto arg : args) {
             if (isQData(arg.getType()))
-                states.push_back(qbmap[arg]);
+                states.push_back(qbmap.lookup(arg));
         }
 
         OperationState opState(op->getLoc(), T::getOperationName());
@@ -424,30 +560,54 @@ private:
         return newOp;
     }
 
-    static void gatherUniqueValues(Operation *op, std::unordered_set<Value> &valueSet) {
-        for (auto &region : op->getRegions()) {
-            for (auto &childOp : region.getOps()) {
-                for (auto arg : childOp.getOperands())
+    // Collect the qdata operands of all ops nested in each scf op, in order of first use, with a
+    // single walk over root: an scf op passes its values on to the enclosing scf op once all of its
+    // nested ops are done, so that no op is scanned again for every level of nesting.
+    static void gatherUniqueValues(Operation *root, DenseMap<Operation*, SmallVector<Value, 8>> &cfValues) {
+        // ops still to visit, with a flag for the end of an scf op once its nested ops are visited
+        SmallVector<std::pair<Operation*, bool>, 32> worklist;
+        SmallVector<llvm::SetVector<Value>, 8> openSets;
+        auto pushNested = [&](Operation *op) {
+            for (Region &region : llvm::reverse(op->getRegions()))
+                for (Block &block : llvm::reverse(region.getBlocks()))
+                    for (Operation &nested : llvm::reverse(block.getOperations()))
+                        worklist.push_back({&nested, false});
+        };
+
+        pushNested(root);
+        while (!worklist.empty()) {
+            Operation *op;
+            bool done;
+            std::tie(op, done) = worklist.pop_back_val();
+            if (done) {
+                llvm::SetVector<Value> values = openSets.pop_back_val();
+                if (!openSets.empty())
+                    openSets.back().insert(values.begin(), values.end());
+                cfValues[op] = values.takeVector();
+                continue;
+            }
+
+            if (!openSets.empty())
+                for (Value arg : op->getOperands())
                     if (isQData(arg.getType()))
-                        valueSet.insert(arg);
-                gatherUniqueValues(&childOp, valueSet);
+                        openSets.back().insert(arg);
+            if (isa<scf::ForOp>(op) || isa<scf::IfOp>(op)) {
+                openSets.emplace_back();
+                worklist.push_back({op, true});
             }
+            pushNested(op);
         }
     }
 
     static void prepControlFlow(Operation *op, OpBuilder &b, value_map &qbmap,
                                 SmallVectorImpl<Value> &uniqueValues,
                                 SmallVectorImpl<Value> &iterArgs) {
-        std::unordered_set<Value> valueSet;
-        gatherUniqueValues(op, valueSet);
-        uniqueValues.append(valueSet.begin(), valueSet.end());
-
         if (isa<scf::ForOp>(op)) {
             SmallVector<Type, 4> iterTypes;
             iterTypes.reserve(uniqueValues.size());
             iterArgs.reserve(uniqueValues.size());
             for (auto arg : uniqueValues)
-                iterArgs.push_back(qbmap[arg]);
+                iterArgs.push_back(qbmap.lookup(arg));
             for (auto arg : iterArgs)
                 iterTypes.push_back(arg.getType());
 
@@ -457,7 +617,7 @@ private:
             auto argIt = uniqueValues.begin();
             for (auto blockArg : op->getRegion(0).getArguments())
                 if (isQSSAData(blockArg.getType()))
-                    qbmap[*argIt++] = blockArg;
+                    qbmap.set(*argIt++, blockArg);
         } else {
             // prep if/else regions: since we are returning values from the IfOp,
             // we always need atleast a yield statement in the else region
@@ -492,15 +652,17 @@ public:
         // the op builder can create new ops and types for us
         OpBuilder b(module->getContext());
         this->opBuilder = &b;
-        SmallVector<Value, 0> dummy;
+        cfUniqueValues.clear();
+        gatherUniqueValues(module, cfUniqueValues);
 
-        walk(module, globalStateMap, dummy,
+        walk(module,
         [this, &b] (Operation *op, value_map &qbmap,
                             const SmallVectorImpl<Value> &uniqueValues,
                             const SmallVectorImpl<Value> &iterArgs) {
             #ifdef DEBUG
                 op->dump();
             #endif
+            numVisitedOps++;
 
             // nothing to do for operations outside the Quantum dialect
             if (!isa<quantum::QuantumDialect>(op->getDialect()) &&
@@ -585,7 +747,7 @@ public:
                 // add new block argument values to the local storage
                 for (unsigned i = 0; i < newCirc.getNumArguments(); i++) {
                     if (isQData(circ.getArgument(i).getType()))
-                        qbmap[circ.getArgument(i)] = newCirc.getArgument(i);
+                        qbmap.set(circ.getArgument(i), newCirc.getArgument(i));
                 }
 
             } else if (isa<quantum::CircuitValueOp>(op)) {
@@ -615,7 +777,7 @@ public:
 
                 auto resIt = newOp->getResults().begin();
                 for (auto arg : uniqueValues) {
-                    qbmap[arg] = *resIt++;
+                    qbmap.set(arg, *resIt++);
                 }
 
                 op->erase();
@@ -640,7 +802,7 @@ public:
 
                 auto resIt = newOp->getResults().begin();
                 for (auto arg : uniqueValues) {
-                    qbmap[arg] = *resIt++;
+                    qbmap.set(arg, *resIt++);
                 }
 
                 op->erase();
@@ -661,6 +823,7 @@ public:
                 }
             #endif
         });
+        peakStateMapSize.updateMax(stateMap.getPeakSize());
 
         // at the very end, remove all allocation ops as their values are no longer needed
         module->walk([](quantum::AllocOp alloc) {
@@ -1250,7 +1413,9 @@ public:
 // general rewrite pattern that cancels two successive hermitian ops
 struct HermitianCancel : public RewritePattern {
     // Constructor: benefit = "how much computation" the transformation saves
-    HermitianCancel(PatternBenefit benefit) : RewritePattern(benefit, MatchAnyOpTypeTag()) {}
+    // one instance is registered per hermitian op, see insertHermitianPatterns
+    HermitianCancel(StringRef rootName, PatternBenefit benefit, MLIRContext *context)
+        : RewritePattern(rootName, benefit, context) {}
 
     // match an op if it has the hermitian trait
     LogicalResult matchAndRewrite(Operation *op, PatternRewriter &rewriter) const override {
@@ -1359,7 +1524,9 @@ struct AdjointCancelBw : public OpRewritePattern<AdjointOp> {
 
 struct AdjointCancelFw : public RewritePattern {
     // Constructor: benefit = "how much computation" the transformation saves
-    AdjointCancelFw(PatternBenefit benefit) : RewritePattern(benefit, MatchAnyOpTypeTag()) {}
+    // one instance is registered per hermitian or meta op, see insertHermitianPatterns
+    AdjointCancelFw(StringRef rootName, PatternBenefit benefit, MLIRContext *context)
+        : RewritePattern(rootName, benefit, context) {}
 
     // Match (heldOp - adjoint - op) pattern
     LogicalResult match(Operation *op) const override {
@@ -1436,6 +1603,21 @@ struct AdjointCancelFw : public RewritePattern {
     }
 };
 
+// register the op-agnostic cancellation patterns only on the ops they can match, rather than
+// have the greedy driver try them on every operation
+void insertHermitianPatterns(OwningRewritePatternList &patterns, MLIRContext *context) {
+    StringRef hermitianOps[] = {HOp::getOperationName(), XOp::getOperationName(),
+                                CNotOp::getOperationName(), SwapOp::getOperationName()};
+    StringRef metaOps[] = {ControlOp::getOperationName(), AdjointOp::getOperationName()};
+
+    for (StringRef name : hermitianOps) {
+        patterns.insert<HermitianCancel>(name, 2, context);
+        patterns.insert<AdjointCancelFw>(name, 2, context);
+    }
+    for (StringRef name : metaOps)
+        patterns.insert<AdjointCancelFw>(name, 2, context);
+}
+
 struct CircuitCancelBw : public OpRewritePattern<ApplyCircOp> {
     // Constructor: benefit = "how much computation" the transformation saves
     CircuitCancelBw(MLIRContext *context) : OpRewritePattern<ApplyCircOp>(context, /*benefit=*/5) {}
@@ -1582,33 +1764,106 @@ struct CircuitCancelFw : public OpRewritePattern<CallCircOp> {
     }
 };
 
-// two successive rotation gates can be combined together and their angles added
+// rotation angles are only folded modulo the period of the gate, which for RZ is 4π since
+// RZ(2π) = -I would be observable as a relative phase once the rotation is controlled
+double getRotationPeriod(Operation *rot) {
+    return isa<RzOp>(rot) ? 4 * M_PI : 2 * M_PI;
+}
+
+// sum up all constant angles at compile time, collecting the non-constant ones in `dynAngles`
+double foldConstAngles(ArrayRef<Value> angles, double period, SmallVectorImpl<Value> &dynAngles) {
+    double cst = 0;
+    for (Value phi : angles) {
+        FloatAttr phiAttr;
+        if (matchPattern(phi, m_Constant(&phiAttr)))
+            cst += phiAttr.getValueAsDouble();
+        else
+            dynAngles.push_back(phi);
+    }
+
+    cst = std::fmod(cst, period);
+    if (cst < 0)
+        cst += period;
+    if (cst < 1e-12 || period - cst < 1e-12)
+        cst = 0;
+
+    return cst;
+}
+
+// build the sum of a folded constant angle and any number of non-constant angles
+Value buildAngleSum(PatternRewriter &rewriter, Location loc, Type type, double cst,
+                    ArrayRef<Value> dynAngles) {
+    Value sum = nullptr;
+    if (cst != 0 || dynAngles.empty()) {
+        OperationState cstState(loc, ConstantOp::getOperationName());
+        ConstantOp::build(rewriter, cstState, rewriter.getFloatAttr(type, cst));
+        sum = rewriter.createOperation(cstState)->getResult(0);
+    }
+
+    for (Value phi : dynAngles) {
+        if (!sum) {
+            sum = phi;
+            continue;
+        }
+        OperationState addState(loc, AddFOp::getOperationName());
+        AddFOp::build(rewriter, addState, sum, phi);
+        sum = rewriter.createOperation(addState)->getResult(0);
+    }
+
+    return sum;
+}
+
+// a chain of successive rotation gates is combined into a single rotation by the sum of the
+// angles, constant angles are folded and rotations by a zero angle are removed entirely
 template<class R> struct FoldRotation : public OpRewritePattern<R> {
     // Constructor: benefit = "how much computation" the transformation saves
     FoldRotation(MLIRContext *context) : OpRewritePattern<R>(context, /*benefit=*/1) {}
 
-    // match (rz - rz) pattern
-    LogicalResult matchAndRewrite(R op2, PatternRewriter &rewriter) const override {
-        if (!op2.qbs())
+    // match (rz - rz - ... - rz) pattern at the last rotation of the chain
+    LogicalResult matchAndRewrite(R op, PatternRewriter &rewriter) const override {
+        if (!op.qbs())
             return failure();
 
-        R op1 = dyn_cast_or_null<R>(op2.qbs().getDefiningOp());
-        if (!op1)
-            return failure();
+        // the chain is merged at once from its end, skip any rotation in the middle
+        if (op.res().hasOneUse()) {
+            R next = dyn_cast<R>(*op.res().getUsers().begin());
+            if (next && next.qbs() == op.res() && next.getParentRegion() == op.getParentRegion())
+                return failure();
+        }
 
-        if (op1.getParentRegion() != op2.getParentRegion())
+        SmallVector<R, 4> chain = {op};
+        while (R prev = dyn_cast_or_null<R>(chain.back().qbs().getDefiningOp())) {
+            if (!prev.qbs() || prev.getParentRegion() != op.getParentRegion())
+                break;
+            chain.push_back(prev);
+        }
+
+        SmallVector<Value, 4> angles, dynAngles;
+        for (R rot : chain)
+            angles.push_back(rot.phi());
+        double cst = foldConstAngles(angles, getRotationPeriod(op), dynAngles);
+
+        // a lone rotation is only rewritten if it can be removed
+        bool isIdentity = cst == 0 && dynAngles.empty();
+        if (chain.size() == 1 && !isIdentity)
             return failure();
 
-        rewriter.setInsertionPoint(op1);
-        OperationState addState(op1.getLoc(), AddFOp::getOperationName());
-        AddFOp::build(rewriter, addState, op1.phi(), op2.phi());
-        Operation *addOp = rewriter.createOperation(addState);
+        Value input = chain.back().qbs();
+        if (isIdentity) {
+            rewriter.replaceOp(op, input);
+        } else {
+            rewriter.setInsertionPoint(op);
+            Value phi = buildAngleSum(rewriter, op.getLoc(), op.phi().getType(), cst, dynAngles);
 
-        rewriter.startRootUpdate(op2);
-        op2.setOperand(0, addOp->getResult(0)); // phi1 + phi2
-        op2.setOperand(1, op1.qbs());
-        rewriter.finalizeRootUpdate(op2);
-        rewriter.eraseOp(op1);
+            rewriter.startRootUpdate(op);
+            op.setOperand(0, phi);
+            op.setOperand(1, input);
+            rewriter.finalizeRootUpdate(op);
+        }
+
+        // remaining rotations of the chain, each one only used by its erased successor
+        for (R rot : llvm::drop_begin(chain, 1))
+            rewriter.eraseOp(rot);
 
         return success();
     }
@@ -1655,13 +1910,14 @@ struct FoldControlledRotations : public OpRewritePattern<ControlOp> {
         Value phi1 = rot1->getOperand(0);
         Value phi2 = rot2->getOperand(0);
 
+        SmallVector<Value, 2> dynAngles;
+        double cst = foldConstAngles({phi1, phi2}, getRotationPeriod(rot1), dynAngles);
+
         rewriter.setInsertionPoint(rot1);
-        OperationState addState(rot1->getLoc(), AddFOp::getOperationName());
-        AddFOp::build(rewriter, addState, phi1, phi2);
-        Operation *addOp = rewriter.createOperation(addState);
+        Value phi = buildAngleSum(rewriter, rot1->getLoc(), phi1.getType(), cst, dynAngles);
 
         rewriter.startRootUpdate(rot1);
-        rot1->setOperand(0, addOp->getResult(0)); // phi1 + phi2
+        rot1->setOperand(0, phi); // phi1 + phi2
         rewriter.finalizeRootUpdate(rot1);
 
         // replace all of the second chain with return values of the first
@@ -1763,11 +2019,61 @@ struct FoldCircVal : public OpRewritePattern<CircuitValueOp> {
     }
 };
 
+// The circuits changed by counted patterns in this thread, while a ChangeTracker is active. A
+// circuit is only ever optimized by a single thread, so the set needs no synchronization.
+thread_local llvm::SmallPtrSetImpl<Operation*> *changedCircuits = nullptr;
+
+// collects the circuits changed by counted patterns in this thread during its lifetime
+struct ChangeTracker {
+    ChangeTracker(llvm::SmallPtrSetImpl<Operation*> &changed) : previous(changedCircuits) {
+        changedCircuits = &changed;
+    }
+    ~ChangeTracker() {
+        changedCircuits = previous;
+    }
+
+    llvm::SmallPtrSetImpl<Operation*> *previous;
+};
+
+// Wraps a pattern to count how often it was applied, for the pass statistics, and to record the
+// circuit it changed. The counter is shared by all threads applying the pattern.
+class CountedPattern : public RewritePattern {
+public:
+    CountedPattern(RewritePattern *pattern, std::atomic<unsigned> *counter, MLIRContext *context)
+        : RewritePattern(pattern->getRootKind()->getStringRef(), pattern->getBenefit(), context),
+          pattern(pattern), counter(counter) {}
+
+    LogicalResult matchAndRewrite(Operation *op, PatternRewriter &rewriter) const override {
+        // the op may be erased by the rewrite
+        Operation *circ = changedCircuits ? op->getParentOfType<CircuitOp>().getOperation() : nullptr;
+        if (failed(pattern->matchAndRewrite(op, rewriter)))
+            return failure();
+        ++*counter;
+        if (circ)
+            changedCircuits->insert(circ);
+        return success();
+    }
+
+private:
+    std::unique_ptr<RewritePattern> pattern;
+    std::atomic<unsigned> *counter;
+};
+
+// move the patterns of a list into another, counting their applications
+void insertCounted(OwningRewritePatternList &patterns, OwningRewritePatternList &&source,
+                   std::atomic<unsigned> &counter, MLIRContext *context) {
+    for (auto &pattern : source) {
+        assert(pattern->getRootKind() && "Counted patterns need a root operation!");
+        patterns.insert<CountedPattern>(pattern.release(), &counter, context);
+    }
+}
+
 struct QuantumGateOptimizationPass : public OperationPass<ModuleOp> {
     QuantumGateOptimizationPass()
         : OperationPass<ModuleOp>(TypeID::get<QuantumGateOptimizationPass>()) {}
-    QuantumGateOptimizationPass(const QuantumGateOptimizationPass &)
-        : OperationPass<ModuleOp>(TypeID::get<QuantumGateOptimizationPass>()) {}
+    QuantumGateOptimizationPass(const QuantumGateOptimizationPass &other)
+        : OperationPass<ModuleOp>(TypeID::get<QuantumGateOptimizationPass>()),
+          patterns(other.patterns) {}
 
     StringRef getName() const override {
         return "QuantumGateOptimizationPass";
@@ -1777,21 +2083,116 @@ struct QuantumGateOptimizationPass : public OperationPass<ModuleOp> {
         return std::make_unique<QuantumGateOptimizationPass>(*this);
     }
 
-    void runOnOperation() override {
-        MLIRContext &context = getContext();
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<StandardOpsDialect>();
+    }
 
-        OwningRewritePatternList patterns;
-        patterns.insert<HermitianCancel>(2);
-        patterns.insert<AdjointCancelBw>(&context);
-        patterns.insert<AdjointCancelFw>(2);
-        patterns.insert<CircuitCancelBw>(&context);
-        patterns.insert<CircuitCancelFw>(&context);
-        patterns.insert<FoldRotation<RzOp>>(&context);
-        patterns.insert<FoldRotation<ROp>>(&context);
-        patterns.insert<FoldControlledRotations>(&context);
+    // optimize the circuits that haven't converged yet, adding the ones that changed to `changed`
+    void optimizeCircuits(ModuleOp module, const OwningRewritePatternList &patterns,
+                          llvm::SmallPtrSetImpl<Operation*> &changed) {
+        SmallVector<CircuitOp, 8> circuits;
+        for (auto circ : module.getOps<CircuitOp>())
+            if (!quantum::isConverged(circ))
+                circuits.push_back(circ);
+
+        SmallVector<unsigned, 8> circuitChanged(circuits.size(), false);
+        quantum::forEachCircuitParallel(circuits, [&](size_t index) {
+            llvm::SmallPtrSet<Operation*, 1> local;
+            ChangeTracker tracker(local);
+            applyPatternsAndFoldGreedily(circuits[index].getBody(), patterns);
+            circuitChanged[index] = !local.empty();
+        });
+        for (size_t index = 0; index < circuits.size(); index++)
+            if (circuitChanged[index])
+                changed.insert(circuits[index]);
+    }
 
-        applyPatternsAndFoldGreedily(getOperation(), patterns);
+    // build the pattern lists once, they are shared with all clones of this pass
+    void buildPatterns(MLIRContext *context) {
+        auto sets = std::make_shared<PatternSets>();
+        sets->context = context;
+
+        // patterns that only look at ops within a single circuit
+        OwningRewritePatternList hermitian, adjoint, rotation, ctrlRotation, circuit;
+        insertHermitianPatterns(hermitian, context);
+        adjoint.insert<AdjointCancelBw>(context);
+        rotation.insert<FoldRotation<RzOp>>(context);
+        rotation.insert<FoldRotation<ROp>>(context);
+        ctrlRotation.insert<FoldControlledRotations>(context);
+        insertCounted(sets->circuitPatterns, std::move(hermitian), sets->counts[HermitianCancels], context);
+        insertCounted(sets->circuitPatterns, std::move(adjoint), sets->counts[AdjointCancels], context);
+        insertCounted(sets->circuitPatterns, std::move(rotation), sets->counts[RotationFolds], context);
+        insertCounted(sets->circuitPatterns, std::move(ctrlRotation), sets->counts[CtrlRotationFolds], context);
+
+        // patterns that need to inspect the called circuits
+        circuit.insert<CircuitCancelBw>(context);
+        circuit.insert<CircuitCancelFw>(context);
+        insertCounted(sets->modulePatterns, std::move(circuit), sets->counts[CircuitCancels], context);
+
+        patterns = sets;
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        if (!patterns || patterns->context != &getContext())
+            buildPatterns(&getContext());
+
+        // the counters are shared with clones of this pass, only attribute the changes of this run
+        unsigned countsBefore[NumPatternGroups];
+        for (unsigned i = 0; i < NumPatternGroups; i++)
+            countsBefore[i] = patterns->counts[i];
+        // Circuits changed by any pattern are reported to the fixed-point driver. Rotation folds
+        // replace ops by new ones, so the op count of a changed circuit may stay the same. Changes
+        // by folding alone are not reported, the greedy driver folds until nothing changes.
+        llvm::SmallPtrSet<Operation*, 8> changed;
+        optimizeCircuits(module, patterns->circuitPatterns, changed);
+        {
+            ChangeTracker tracker(changed);
+            applyPatternsAndFoldGreedily(module, patterns->modulePatterns);
+        }
+        // cancelled circuit calls can expose new local optimizations
+        optimizeCircuits(module, patterns->circuitPatterns, changed);
+        // quantum ops outside of circuits are optimized along with the whole module, which
+        // revisits the circuits serially, so this is only done if there are any
+        if (hasTopLevelQuantumOps(module)) {
+            ChangeTracker tracker(changed);
+            applyPatternsAndFoldGreedily(module, patterns->circuitPatterns);
+        }
+
+        for (unsigned i = 0; i < NumPatternGroups; i++)
+            *patternStats[i] += patterns->counts[i] - countsBefore[i];
+        for (Operation *circ : changed)
+            quantum::markChanged(circ);
     }
+
+    static bool hasTopLevelQuantumOps(ModuleOp module) {
+        return llvm::any_of(*module.getBody(), [](Operation &op) {
+            return !isa<CircuitOp>(op) && !isa<FuncOp>(op) &&
+                   (isa<QuantumSSADialect>(op.getDialect()) || op.getNumRegions());
+        });
+    }
+
+private:
+    enum PatternGroup {
+        HermitianCancels, AdjointCancels, RotationFolds, CtrlRotationFolds, CircuitCancels,
+        NumPatternGroups
+    };
+
+    struct PatternSets {
+        MLIRContext *context;
+        OwningRewritePatternList circuitPatterns;
+        OwningRewritePatternList modulePatterns;
+        mutable std::atomic<unsigned> counts[NumPatternGroups] = {};
+    };
+    std::shared_ptr<const PatternSets> patterns;
+
+    Statistic numHermitianCancels{this, "hermitian-cancel", "Number of cancelled hermitian gate pairs"};
+    Statistic numAdjointCancels{this, "adjoint-cancel", "Number of ops cancelled against their adjoint"};
+    Statistic numRotationFolds{this, "rotation-fold", "Number of merged rotation gates"};
+    Statistic numCtrlRotationFolds{this, "ctrl-rotation-fold", "Number of merged controlled rotation gates"};
+    Statistic numCircuitCancels{this, "circuit-cancel", "Number of cancelled circuit call pairs"};
+    Statistic *patternStats[NumPatternGroups] = {&numHermitianCancels, &numAdjointCancels, &numRotationFolds,
+                                                 &numCtrlRotationFolds, &numCircuitCancels};
 };
 
 struct StripUnusedCircuitPass : public OperationPass<ModuleOp> {
@@ -1808,20 +2209,31 @@ struct StripUnusedCircuitPass : public OperationPass<ModuleOp> {
         return std::make_unique<StripUnusedCircuitPass>(*this);
     }
 
+private:
+    Statistic numStrippedCircuits{this, "stripped-circuits", "Number of removed circuit definitions"};
+
+public:
     void runOnOperation() override {
         ModuleOp module = getOperation();
-        OpBuilder b(module.getContext());
-
-        for (auto &block : module.getBodyRegion()) {
-            for (auto &op : llvm::make_early_inc_range(block)) {
-                if (auto circ = dyn_cast<CircuitOp>(op)) {
-                    if (circ.symbolKnownUseEmpty(module) && circ.getName() != "mlir_main"
-                                                         && circ.getName() != "main")
-                        circ.erase();
-                }
-            }
+        auto &uses = getAnalysis<quantum::CircuitUseAnalysis>();
+
+        // circuits only referenced by stripped circuits are unused as well, revisit them
+        std::vector<std::string> worklist;
+        for (auto circ : module.getOps<CircuitOp>())
+            worklist.push_back(circ.getName().str());
+        while (!worklist.empty()) {
+            std::string name = worklist.back();
+            worklist.pop_back();
+            CircuitOp circ = uses.lookup(name);
+            if (!circ || uses.getNumUses(name) || name == "mlir_main" || name == "main")
+                continue;
+            for (std::string &unused : uses.erase(circ))
+                worklist.push_back(unused);
+            numStrippedCircuits++;
         }
 
+        // the use counts were updated along with the stripped circuits
+        markAnalysesPreserved<quantum::CircuitUseAnalysis>();
     }
 };
 
@@ -1839,11 +2251,22 @@ struct LowerControlledCircuitsPass : public OperationPass<ModuleOp> {
         return std::make_unique<LowerControlledCircuitsPass>(*this);
     }
 
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<QuantumSSADialect,
+                        StandardOpsDialect>();
+    }
+
 private:
     std::unordered_set<std::string> alreadyTraversed;
+    quantum::CircuitSpecializationCache specializations;
+    quantum::CircuitUseAnalysis *circuits;
     Operation *main;
     SmallVector<Value, 4> currentCtrls;
 
+    Statistic numSpecHits{this, "spec-cache-hits", "Number of reused controlled circuit specializations"};
+    Statistic numSpecMisses{this, "spec-cache-misses", "Number of controlled circuit specializations looked up in the module"};
+    Statistic numSpecialized{this, "specialized-circuits", "Number of controlled circuit specializations created"};
+
     void makeControlled(OpBuilder &b, Operation* &op, Value &ctrls) {
         assert(ctrls.getType().isa<QstateType>() || ctrls.getType().isa<RstateType>());
 
@@ -2030,7 +2453,7 @@ private:
                 op = adj.heldOp().getDefiningOp();
                 foundAdj = true;
             } else if (auto getval = dyn_cast<CircuitValueOp>(op)) {
-                circuit = SymbolTable::lookupNearestSymbolFrom(op, getval.circref());
+                circuit = circuits->lookup(getval.circref()).getOperation();
                 assert(circuit && "Could not resolve symbol!");
             } else {
                 llvm_unreachable("Unknown op in apply chain!");
@@ -2162,7 +2585,14 @@ private:
         StringAttr circName = circ->getAttrOfType<StringAttr>(SymbolTable::getSymbolAttrName());
         std::string newCircName = llvm::join<ArrayRef<StringRef>>(
             {circName.getValue(), std::to_string(ctrlsVec.size())}, "_lc");
-        Operation *newCirc = SymbolTable::lookupNearestSymbolFrom(call, newCircName);
+        Operation *newCirc = specializations.lookup(circName.getValue(), ctrlsVec.size(), false);
+        if (newCirc) {
+            numSpecHits++;
+        } else {
+            // might still exist from a previous run of the pass
+            numSpecMisses++;
+            newCirc = circuits->lookup(newCircName).getOperation();
+        }
         if (newCirc) {
             auto ftypeIt = cast<CircuitOp>(newCirc).getType().getInputs().take_back(ctrlsVec.size()).begin();
             for (auto ctrl : ctrlsVec)
@@ -2171,9 +2601,7 @@ private:
 
         // if it doesn't already exist, we create it
         if (!newCirc) {
-            newCirc = circ->clone();
-            CircuitOp newCircOp = cast<CircuitOp>(newCirc);
-            newCircOp.setAttr(SymbolTable::getSymbolAttrName(), b.getStringAttr(newCircName));
+            numSpecialized++;
             auto arrayIn = cast<CircuitOp>(circ).getType().getInputs();
             auto arrayRe = cast<CircuitOp>(circ).getType().getResults();
             SmallVector<Type, 8> argTypes(arrayIn.begin(), arrayIn.end());
@@ -2181,15 +2609,22 @@ private:
             for (auto ctrl : ctrlsVec) {
                 argTypes.push_back(ctrl.ctrls().getType());
                 resTypes.push_back(ctrl.ctrls().getType());
-                newCircOp.front().insertArgument(newCircOp.front().getNumArguments(),
-                    ctrl.ctrls().getType());
             }
-            newCircOp.setType(b.getFunctionType(argTypes, resTypes));
+            // the signature is set while copying, control ops are inserted by propControls below
+            TypeAttr newType = TypeAttr::get(b.getFunctionType(argTypes, resTypes));
+            newCirc = quantum::cloneSpecialized(circ, newCircName, [&](Operation *op, NamedAttrList &attrs) {
+                if (op == circ)
+                    attrs.set(CircuitOp::getTypeAttrName(), newType);
+            });
+            CircuitOp newCircOp = cast<CircuitOp>(newCirc);
+            for (auto ctrl : ctrlsVec)
+                newCircOp.front().addArgument(ctrl.ctrls().getType());
             currentCtrls.clear();
             for (auto cqbs : newCircOp.getArguments().take_back(ctrlsVec.size()))
                 currentCtrls.push_back(cqbs);
             b.setInsertionPointAfter(circ);
             b.insert(newCirc);
+            circuits->insert(newCircOp);
 
             // propagate controls TODO
             propControls(b, newCirc);
@@ -2200,6 +2635,7 @@ private:
             for (auto cqbs : currentCtrls)
                 term->insertOperands(term->getNumOperands(), cqbs);
         }
+        specializations.insert(circName.getValue(), ctrlsVec.size(), false, newCirc);
 
         // replace call to point to new circuit
         SmallVector<Value, 8> operands(call.getOperands().drop_front());
@@ -2255,8 +2691,7 @@ private:
             for (auto &block : region) {
                 for (auto &nestedOp : llvm::make_early_inc_range(block)) {
                     if (auto call = dyn_cast<CallCircOp>(nestedOp)) {
-                        Operation *calledCirc = SymbolTable::lookupNearestSymbolFrom(
-                            call, call.circref());
+                        Operation *calledCirc = circuits->lookup(call.circref()).getOperation();
                         assert(calledCirc && "Unresolved direct circuit call!");
                         walkCallTree(b, calledCirc);
                     } else if (auto apply = dyn_cast<ApplyCircOp>(nestedOp)) {
@@ -2284,8 +2719,13 @@ public:
     void runOnOperation() override {
         ModuleOp module = getOperation();
         OpBuilder b(module.getContext());
+        alreadyTraversed.clear();
+        specializations.clear();
+        // the new specializations are registered with the analysis, but the calls they
+        // replace are not, so it isn't preserved
+        circuits = &getAnalysis<quantum::CircuitUseAnalysis>();
 
-        main = module.lookupSymbol("mlir_main");
+        main = circuits->lookup("mlir_main").getOperation();
         assert(main && "Need circuit entry point!");
         walkCallTree(b, main);
     }
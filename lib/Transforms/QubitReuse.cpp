@@ -0,0 +1,128 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+#include "CircuitParallel.h"
+#include "CircuitAnalysis.h"
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Qubit reuse pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+// number of qubits held by a state, 0 for registers of dynamic size
+int64_t getNumQubits(Type ty) {
+    if (ty.isa<QstateType>())
+        return 1;
+    if (auto regType = ty.dyn_cast<RstateType>())
+        return regType.getNumQubits() ? *regType.getNumQubits() : 0;
+    return 0;
+}
+
+// A state ends the lifetime of its qubits if it is never used again, or only deallocated.
+// In value semantics this is known as soon as the state is defined, which can be long before
+// the corresponding free op.
+bool isDeadState(Value state) {
+    if (state.use_empty())
+        return true;
+    if (!state.hasOneUse())
+        return false;
+    Operation *user = *state.getUsers().begin();
+    return (isa<FreeOp>(user) || isa<FreeRegOp>(user)) && user->getBlock() == state.getParentBlock();
+}
+
+} // end anonymous namespace
+
+struct QubitReusePass : public OperationPass<ModuleOp> {
+    QubitReusePass()
+        : OperationPass<ModuleOp>(TypeID::get<QubitReusePass>()) {}
+    QubitReusePass(const QubitReusePass &)
+        : OperationPass<ModuleOp>(TypeID::get<QubitReusePass>()) {}
+
+    StringRef getName() const override {
+        return "QubitReusePass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<QubitReusePass>(*this);
+    }
+
+    // Single forward sweep over a region: the dead states seen so far in a block are kept in a
+    // pool per number of qubits, and an allocation of the same size is replaced by a reset of
+    // the most recently killed state. States don't outlive their block, so neither does the pool.
+    static unsigned reuseQubits(OpBuilder &b, Region &region) {
+        unsigned numReused = 0;
+        for (Block &block : region) {
+            llvm::DenseMap<int64_t, SmallVector<Value, 4>> deadStates;
+            SmallVector<Operation*, 8> deadFrees;
+
+            for (Operation &op : llvm::make_early_inc_range(block)) {
+                for (Region &nested : op.getRegions())
+                    numReused += reuseQubits(b, nested);
+
+                if (isa<AllocOp>(op) || isa<AllocRegOp>(op)) {
+                    Value alloc = op.getResult(0);
+                    auto it = deadStates.find(getNumQubits(alloc.getType()));
+                    if (it == deadStates.end() || it->second.empty())
+                        continue;
+
+                    Value state = it->second.pop_back_val();
+                    if (!state.use_empty())
+                        deadFrees.push_back(*state.getUsers().begin());
+
+                    b.setInsertionPoint(&op);
+                    OperationState resetState(op.getLoc(), ResetOp::getOperationName());
+                    ResetOp::build(b, resetState, alloc.getType(), state);
+                    alloc.replaceAllUsesWith(b.createOperation(resetState)->getResult(0));
+                    op.erase();
+                    numReused++;
+                    continue;
+                }
+
+                for (Value res : op.getResults()) {
+                    int64_t numQubits = getNumQubits(res.getType());
+                    if (numQubits && isDeadState(res))
+                        deadStates[numQubits].push_back(res);
+                }
+            }
+
+            // the states of reused qubits are now consumed by the reset instead
+            for (Operation *free : deadFrees)
+                free->erase();
+        }
+        return numReused;
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        MLIRContext *context = &getContext();
+        SmallVector<CircuitOp, 8> circuits(module.getOps<CircuitOp>());
+        SmallVector<unsigned, 8> reused(circuits.size(), 0);
+
+        quantum::forEachCircuitParallel(circuits, [&](size_t index) {
+            OpBuilder b(context);
+            reused[index] = reuseQubits(b, circuits[index].getBody());
+        });
+
+        for (unsigned n : reused)
+            numReusedAllocs += n;
+
+        // allocations don't reference any circuit
+        markAnalysesPreserved<quantum::CircuitUseAnalysis>();
+    }
+
+private:
+    Statistic numReusedAllocs{this, "reused-allocs", "Number of allocations replaced by a reset of a dead state"};
+};
+
+std::unique_ptr<Pass> quantum::createQubitReusePass() {
+    return std::make_unique<QubitReusePass>();
+}
@@ -0,0 +1,309 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/Pass/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+#include "CircuitParallel.h"
+#include "CircuitAnalysis.h"
+
+#include <algorithm>
+#include <memory>
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Register access consolidation pass
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+// Content of a register state at some point of an extract/combine chain, relative to the
+// register that entered the chain (the base). Every position either still holds the qubit at
+// a position of the base register, or a qubit state that was inserted by a combine.
+struct RegisterView {
+    struct Entry {
+        // position in the base register, or -1 for an inserted qubit
+        int64_t basePos;
+        Value qubit;
+    };
+
+    Value base;
+    int64_t baseSize;
+    SmallVector<Entry, 8> entries;
+    // qubits extracted from base positions whose state is used outside the chain
+    llvm::DenseMap<Value, int64_t> pending;
+    // the extract/combine ops of the chain in program order
+    SmallVector<Operation*, 8> ops;
+};
+
+int64_t getIndex(ArrayAttr idxs, unsigned i) {
+    return idxs[i].cast<IntegerAttr>().getInt();
+}
+
+bool isStaticReg(Value reg) {
+    return reg.getType().cast<RstateType>().getNumQubits().hasValue();
+}
+
+// register accesses tracked by a view: constant index extractions & insertions on static registers
+bool isStaticAccess(Operation *op) {
+    if (auto extr = dyn_cast<ExtractOp>(op))
+        return extr.const_idx() && isStaticReg(extr.reg());
+    if (auto comb = dyn_cast<CombineStatOp>(op))
+        return isStaticReg(comb.reg());
+    return false;
+}
+
+Value getAccessedReg(Operation *op) {
+    return op->getOperand(0);
+}
+
+Value getResultReg(Operation *op) {
+    return op->getResults().back();
+}
+
+// whether the register state produced by a chain op is only consumed by the next access of the chain
+bool continuesChain(Operation *op) {
+    Value reg = getResultReg(op);
+    if (!reg.hasOneUse())
+        return false;
+    Operation *user = *reg.getUsers().begin();
+    return user->getBlock() == op->getBlock() && isStaticAccess(user) && getAccessedReg(user) == reg;
+}
+
+void applyExtract(RegisterView &view, ExtractOp extr) {
+    ArrayAttr idxs = *extr.const_idx();
+    SmallVector<int64_t, 4> positions;
+    for (unsigned i = 0, e = idxs.size(); i < e; i++) {
+        int64_t pos = getIndex(idxs, i);
+        RegisterView::Entry &entry = view.entries[pos];
+        Value qb = extr.qbs()[i];
+        // previously inserted states are forwarded to the users of the extracted qubit
+        if (entry.basePos < 0)
+            qb.replaceAllUsesWith(entry.qubit);
+        else
+            view.pending[qb] = entry.basePos;
+        positions.push_back(pos);
+    }
+    if (positions.empty())
+        return;
+
+    // Indices refer to the register before the extraction. The remaining entries are compacted in
+    // a single pass starting at the first extracted position, so that an access costs at most
+    // O(width) instead of O(width) per extracted qubit.
+    std::sort(positions.begin(), positions.end());
+    auto next = positions.begin();
+    int64_t out = positions.front();
+    for (int64_t pos = positions.front(), e = view.entries.size(); pos < e; pos++) {
+        if (next != positions.end() && *next == pos)
+            ++next;
+        else
+            view.entries[out++] = view.entries[pos];
+    }
+    view.entries.resize(out);
+}
+
+void applyCombine(RegisterView &view, CombineStatOp comb) {
+    ArrayAttr idxs = comb.const_idx();
+    SmallVector<std::pair<int64_t, Value>, 4> inserts;
+    for (unsigned i = 0, e = idxs.size(); i < e; i++)
+        inserts.push_back({getIndex(idxs, i), comb.qbs()[i]});
+
+    // Indices refer to the combined register. The entries are filled back to front in a single
+    // pass, which moves every entry behind the first insertion once and stops there.
+    std::sort(inserts.begin(), inserts.end(),
+              [](auto &left, auto &right) { return left.first < right.first; });
+    int64_t src = view.entries.size() - 1;
+    view.entries.resize(view.entries.size() + inserts.size());
+    auto next = inserts.rbegin();
+    for (int64_t pos = view.entries.size() - 1; next != inserts.rend(); pos--) {
+        if (next->first != pos) {
+            view.entries[pos] = view.entries[src--];
+            continue;
+        }
+        RegisterView::Entry entry = {-1, next->second};
+        // an untouched qubit returned to the register it came from is back to its base position
+        auto it = view.pending.find(next->second);
+        if (it != view.pending.end() && next->second.hasOneUse()) {
+            entry = {it->second, nullptr};
+            view.pending.erase(it);
+        }
+        view.entries[pos] = entry;
+        ++next;
+    }
+}
+
+// Replace a chain by at most one extract from the base register, placed at the start of the
+// chain, and one combine of the final register state, placed at the end of the chain.
+// Returns the number of removed ops.
+unsigned materialize(OpBuilder &b, RegisterView &view) {
+    Operation *first = view.ops.front();
+    Operation *last = view.ops.back();
+    if (view.ops.size() == 1)
+        return 0;
+
+    // base qubits that keep their relative order remain in the register, all others are extracted
+    SmallVector<bool, 8> kept(view.baseSize, false);
+    int64_t lastKept = -1;
+    for (auto &entry : view.entries) {
+        if (entry.basePos > lastKept) {
+            kept[entry.basePos] = true;
+            lastKept = entry.basePos;
+        }
+    }
+
+    SmallVector<int64_t, 8> extracted;
+    for (int64_t pos = 0; pos < view.baseSize; pos++)
+        if (!kept[pos])
+            extracted.push_back(pos);
+
+    Value reg = view.base;
+    llvm::DenseMap<int64_t, Value> baseQubits;
+    if (!extracted.empty()) {
+        b.setInsertionPoint(first);
+        SmallVector<Type, 9> resTypes(extracted.size(), b.getType<QstateType>());
+        resTypes.push_back(b.getType<RstateType>(view.baseSize - (int64_t) extracted.size()));
+        OperationState state(first->getLoc(), ExtractOp::getOperationName());
+        ExtractOp::build(b, state, resTypes, view.base,
+                         b.getNamedAttr("const_idx", b.getI64ArrayAttr(extracted)));
+        Operation *extr = b.createOperation(state);
+        for (unsigned i = 0, e = extracted.size(); i < e; i++)
+            baseQubits[extracted[i]] = extr->getResult(i);
+        reg = getResultReg(extr);
+
+        for (auto &qb : view.pending)
+            qb.first.replaceAllUsesWith(baseQubits.lookup(qb.second));
+    }
+
+    SmallVector<int64_t, 8> positions;
+    SmallVector<Value, 9> operands = {reg};
+    for (int64_t pos = 0, e = view.entries.size(); pos < e; pos++) {
+        auto &entry = view.entries[pos];
+        if (entry.basePos >= 0 && kept[entry.basePos])
+            continue;
+        positions.push_back(pos);
+        operands.push_back(entry.basePos >= 0 ? baseQubits.lookup(entry.basePos) : entry.qubit);
+    }
+
+    if (!positions.empty()) {
+        // all inserted states are operands of the chain, so they are defined before its end
+        b.setInsertionPoint(last);
+        OperationState state(last->getLoc(), CombineStatOp::getOperationName());
+        CombineStatOp::build(b, state, b.getType<RstateType>((int64_t) view.entries.size()), operands,
+                             b.getNamedAttr("const_idx", b.getI64ArrayAttr(positions)));
+        reg = getResultReg(b.createOperation(state));
+    }
+
+    getResultReg(last).replaceAllUsesWith(reg);
+    for (auto it = view.ops.rbegin(), e = view.ops.rend(); it != e; ++it)
+        (*it)->erase();
+
+    return view.ops.size() - !extracted.empty() - !positions.empty();
+}
+
+// cancel a dynamic extraction that is immediately reinserted at the same indices
+bool cancelDynAccess(CombineDynOp comb) {
+    auto extr = dyn_cast_or_null<ExtractOp>(comb.reg().getDefiningOp());
+    if (!extr || extr.const_idx() || extr.getOperation()->getBlock() != comb.getOperation()->getBlock())
+        return false;
+    if (extr.qbs().size() != comb.qbs().size() || !llvm::equal(extr.qbs(), comb.qbs()) ||
+            !llvm::equal(extr.dyn_idx(), comb.dyn_idx()))
+        return false;
+
+    comb.newreg().replaceAllUsesWith(extr.reg());
+    comb.erase();
+    extr.erase();
+    return true;
+}
+
+} // end anonymous namespace
+
+struct RegisterConsolidationPass : public OperationPass<ModuleOp> {
+    RegisterConsolidationPass()
+        : OperationPass<ModuleOp>(TypeID::get<RegisterConsolidationPass>()) {}
+    RegisterConsolidationPass(const RegisterConsolidationPass &)
+        : OperationPass<ModuleOp>(TypeID::get<RegisterConsolidationPass>()) {}
+
+    StringRef getName() const override {
+        return "RegisterConsolidationPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<RegisterConsolidationPass>(*this);
+    }
+
+    // single forward sweep over a region, every register access is visited once
+    static unsigned consolidate(OpBuilder &b, Region &region) {
+        unsigned numRemoved = 0;
+        for (Block &block : region) {
+            // views of the chains in flight, by their current register state
+            llvm::DenseMap<Value, std::unique_ptr<RegisterView>> views;
+
+            for (Operation &op : llvm::make_early_inc_range(block)) {
+                for (Region &nested : op.getRegions())
+                    numRemoved += consolidate(b, nested);
+
+                if (auto comb = dyn_cast<CombineDynOp>(op)) {
+                    numRemoved += 2 * cancelDynAccess(comb);
+                    continue;
+                }
+                if (!isStaticAccess(&op))
+                    continue;
+
+                Value reg = getAccessedReg(&op);
+                std::unique_ptr<RegisterView> view;
+                auto it = views.find(reg);
+                if (it != views.end()) {
+                    view = std::move(it->second);
+                    views.erase(it);
+                } else {
+                    view = std::make_unique<RegisterView>();
+                    view->base = reg;
+                    view->baseSize = *reg.getType().cast<RstateType>().getNumQubits();
+                    for (int64_t pos = 0; pos < view->baseSize; pos++)
+                        view->entries.push_back({pos, nullptr});
+                }
+
+                view->ops.push_back(&op);
+                if (auto extr = dyn_cast<ExtractOp>(op))
+                    applyExtract(*view, extr);
+                else
+                    applyCombine(*view, cast<CombineStatOp>(op));
+
+                if (continuesChain(&op))
+                    views[getResultReg(&op)] = std::move(view);
+                else
+                    numRemoved += materialize(b, *view);
+            }
+        }
+        return numRemoved;
+    }
+
+    void runOnOperation() override {
+        ModuleOp module = getOperation();
+        MLIRContext *context = &getContext();
+        SmallVector<CircuitOp, 8> circuits(module.getOps<CircuitOp>());
+        SmallVector<unsigned, 8> removed(circuits.size(), 0);
+
+        quantum::forEachCircuitParallel(circuits, [&](size_t index) {
+            OpBuilder b(context);
+            removed[index] = consolidate(b, circuits[index].getBody());
+        });
+
+        for (unsigned n : removed)
+            numRemovedOps += n;
+
+        // register accesses don't reference any circuit
+        markAnalysesPreserved<quantum::CircuitUseAnalysis>();
+    }
+
+private:
+    Statistic numRemovedOps{this, "removed-ops", "Number of removed extract/combine ops"};
+};
+
+std::unique_ptr<Pass> quantum::createRegisterConsolidationPass() {
+    return std::make_unique<RegisterConsolidationPass>();
+}
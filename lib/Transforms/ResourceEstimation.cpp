@@ -6,11 +6,18 @@
 #include "mlir/Dialect/StandardOps/IR/Ops.h"
 #include "mlir/Dialect/SCF/SCF.h"
 #include "mlir/Dialect/Vector/VectorOps.h"
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+#include "llvm/ADT/StringMap.h"
 
 #include "QuantumDialect.h"
 #include "QuantumSSADialect.h"
 #include "Passes.h"
+#include "CircuitSpecialization.h"
+#include "CircuitAnalysis.h"
+#include "CircuitSchedule.h"
+#include "CostModel.h"
 
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
@@ -28,10 +35,78 @@ bool isGate(Operation *op) {
     return isa<HOp>(op) || isa<XOp>(op) || isa<RzOp>(op) || isa<ROp>(op) || isa<CNotOp>(op) || isa<SwapOp>(op);
 }
 
+bool isQData(Type ty) {
+    return ty.isa<QstateType>() || ty.isa<RstateType>();
+}
+
+bool isDynamicReg(Type ty) {
+    auto regType = ty.dyn_cast<RstateType>();
+    return regType && !regType.getNumQubits();
+}
+
+// whether a gate is applied to qubits, rather than held by a meta op
+bool isAppliedGate(Operation *gate) {
+    return isQData(gate->getResults().back().getType());
+}
+
+bool isFree(ArrayRef<int64_t> cost) {
+    return llvm::all_of(cost, [](int64_t c) { return c == 0; });
+}
+
+// add `factor` times `cost` to `sum`, a cost in every metric of the cost model
+void accumulate(SmallVectorImpl<int64_t> &sum, ArrayRef<int64_t> cost, int64_t factor = 1) {
+    if (sum.size() < cost.size())
+        sum.resize(cost.size(), 0);
+    for (unsigned i = 0, e = cost.size(); i < e; i++)
+        sum[i] += factor * cost[i];
+}
+
+int64_t getNumCtrls(Operation *gate) {
+    if (auto attr = gate->getAttrOfType<IntegerAttr>("_num_ctrls"))
+        return attr.getInt();
+    return 0;
+}
+
+// A loop bound in a cost summary: either a compile-time constant, an argument of the
+// summarized circuit, or a value defined above the summarized loop. Register sizes are
+// bounds as well, either of a register argument of the circuit or of one defined above.
+struct SymOperand {
+    enum Kind { Const, Arg, Val, ArgSize, Size } kind;
+    int64_t cst;
+    unsigned argNo;
+    Value val;
+};
+
+// Number of iterations of a summarized loop, ceildiv(ub - lb, step).
+struct TripCount {
+    SymOperand lb, ub, step;
+};
+
+// Cost contribution executed once per iteration of every loop in `trips`.
+struct CostTerm {
+    SmallVector<TripCount, 2> trips;
+    SmallVector<int64_t, 4> cost;
+};
+
+// Closed-form resource cost of a region: a constant part plus a sum of trip count scaled terms.
+struct CostSummary {
+    SmallVector<int64_t, 4> cost;
+    SmallVector<CostTerm, 4> terms;
+    // no classical side effects, a call with this cost can be dropped entirely
+    bool pure = true;
+};
+
+int64_t getConstTripCount(int64_t lb, int64_t ub, int64_t step) {
+    assert(step > 0 && "Loop step must be positive!");
+    return ub > lb ? (ub - lb + step - 1) / step : 0;
+}
+
 struct ResourceCounterPass : public OperationPass<ModuleOp> {
-    ResourceCounterPass() : OperationPass<ModuleOp>(TypeID::get<ResourceCounterPass>()) {}
-    ResourceCounterPass(const ResourceCounterPass &) :
-        OperationPass<ModuleOp>(TypeID::get<ResourceCounterPass>()) {}
+    ResourceCounterPass(const quantum::ResourceCounterOptions &options) :
+        OperationPass<ModuleOp>(TypeID::get<ResourceCounterPass>()), options(options) {}
+    ResourceCounterPass(const ResourceCounterPass &other) :
+        OperationPass<ModuleOp>(TypeID::get<ResourceCounterPass>()), options(other.options),
+        costModel(other.costModel), foldPatterns(other.foldPatterns), foldContext(other.foldContext) {}
 
     StringRef getName() const override {
         return "ResourceCounterPass";
@@ -41,19 +116,50 @@ struct ResourceCounterPass : public OperationPass<ModuleOp> {
         return std::make_unique<ResourceCounterPass>(*this);
     }
 
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<StandardOpsDialect,
+                        scf::SCFDialect,
+                        vector::VectorDialect>();
+    }
+
 private:
+    quantum::ResourceCounterOptions options;
+    std::shared_ptr<const quantum::CostModel> costModel;
+    unsigned numMetrics;
+    // the cost model metrics, followed by the live and peak qubit counts if tracked
+    unsigned numCounters;
+    // depth metrics are counted per segment of the circuit schedule rather than per gate
+    bool hasDepthMetrics;
+    std::shared_ptr<const OwningRewritePatternList> foldPatterns;
+    MLIRContext *foldContext = nullptr;
     std::unordered_set<std::string> alreadyBuilt;
+    quantum::CircuitSpecializationCache specializations;
+    // symbol lookups while propagating controls, before any circuit is converted
+    quantum::CircuitUseAnalysis *circuits;
+    std::unordered_map<std::string, CostSummary> summaries;
+    std::unordered_set<std::string> unsummarizable;
+    // circuits with classical side effects, directly or in one of their callees
+    std::unordered_set<std::string> impureCircuits;
+    ModuleOp module;
     Operation *main;
-    Value Rcounter;
-    Value Tcounter;
-    Value const0;
-    Value const1;
-    Value const2;
-    Value const3;
-    Value const5;
-    Value const7;
-    Value const14;
-    int nrec;
+    // false while converting code whose cost was already accounted for by a summary
+    bool counting;
+    // current value of each counter
+    SmallVector<Value, 4> counters;
+    // increment constants of the current counting function, created at its entry on first use
+    Block *countingEntry;
+    llvm::DenseMap<int64_t, Value> consts;
+    // size arguments of the dynamic register arguments of the current counting function
+    llvm::DenseMap<Value, Value> regSizeArgs;
+    // slot of each called circuit in the profiling runtime, in the order of the slots
+    std::unordered_map<std::string, int64_t> profileIds;
+    std::vector<std::string> profiledCircuits;
+
+    Statistic numSpecHits{this, "spec-cache-hits", "Number of reused controlled circuit specializations"};
+    Statistic numSpecMisses{this, "spec-cache-misses", "Number of controlled circuit specializations looked up in the module"};
+    Statistic numCallTreeVisits{this, "call-tree-visits", "Number of ops visited while propagating controls through the call tree"};
+    Statistic numConvertedCircuits{this, "converted-circuits", "Number of circuits converted to counting functions"};
+    Statistic numSummarizedCircuits{this, "summarized-circuits", "Number of circuits counted via closed-form cost summaries"};
 
     void initialize(OpBuilder &b, CircuitOp circ) {
         Location loc = circ.front().front().getLoc();
@@ -61,70 +167,166 @@ private:
 
         OperationState countState(loc, ConstantOp::getOperationName());
         ConstantOp::build(b, countState, b.getI64IntegerAttr(0));
-        Rcounter = b.createOperation(countState)->getResult(0);
-        Tcounter = Rcounter;
+        counters.assign(numCounters, b.createOperation(countState)->getResult(0));
 
-        OperationState const0State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const0State, b.getI64IntegerAttr(0));
-        const0 = b.createOperation(const0State)->getResult(0);
+        countingEntry = &circ.front();
+        consts.clear();
+    }
 
-        OperationState const1State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const1State, b.getI64IntegerAttr(1));
-        const1 = b.createOperation(const1State)->getResult(0);
+    Value getConst(OpBuilder &b, int64_t val) {
+        Value &cst = consts[val];
+        if (!cst) {
+            OpBuilder::InsertionGuard guard(b);
+            b.setInsertionPointToStart(countingEntry);
+            cst = createConst(b, countingEntry->getParentOp()->getLoc(), b.getI64IntegerAttr(val));
+        }
+        return cst;
+    }
 
-        OperationState const2State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const2State, b.getI64IntegerAttr(2));
-        const2 = b.createOperation(const2State)->getResult(0);
+    // critical path of each segment of a block in the depth metrics, keyed by the barrier ending it,
+    // where the cost of an applied op in a depth metric is its latency
+    void getSegmentDepths(Block &block, llvm::DenseMap<Operation*, SmallVector<int64_t, 4>> &depths) {
+        SmallVector<quantum::WireSchedule, 2> schedules(numMetrics);
+        SmallVector<int64_t, 4> cost;
+        for (Operation &op : block) {
+            if (quantum::isScheduleBarrier(&op)) {
+                auto &segment = depths[&op];
+                for (unsigned i = 0; i < numMetrics; i++) {
+                    segment.push_back(costModel->isDepthMetric(i) ? schedules[i].getDepth() : 0);
+                    schedules[i].clear();
+                }
+                continue;
+            }
+            if (!isa<QuantumSSADialect>(op.getDialect()))
+                continue;
+
+            bool applied = op.getNumResults() && isQData(op.getResults().back().getType());
+            costModel->getCost(op.getName().stripDialect(), getNumCtrls(&op), cost);
+            for (unsigned i = 0; i < numMetrics; i++)
+                if (costModel->isDepthMetric(i))
+                    schedules[i].schedule(&op, applied ? cost[i] : 0);
+        }
+    }
 
-        OperationState const3State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const3State, b.getI64IntegerAttr(3));
-        const3 = b.createOperation(const3State)->getResult(0);
+    void genDepthInc(OpBuilder &b, Operation *barrier, ArrayRef<int64_t> depths) {
+        b.setInsertionPoint(barrier);
+        for (unsigned i = 0; i < numMetrics; i++)
+            if (depths[i])
+                counters[i] = createBinOp<AddIOp>(b, barrier->getLoc(), counters[i], getConst(b, depths[i]));
+    }
 
-        OperationState const5State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const5State, b.getI64IntegerAttr(5));
-        const5 = b.createOperation(const5State)->getResult(0);
+    // track the number of live qubits and its maximum over the (de)allocation of qubits
+    void genLiveQubitsUpdate(OpBuilder &b, Operation *op, Value qdata, bool alloc) {
+        b.setInsertionPoint(op);
+        Location loc = op->getLoc();
+
+        Value n = getConst(b, 1);
+        if (auto regType = qdata.getType().dyn_cast<RstateType>()) {
+            if (auto numQubits = regType.getNumQubits()) {
+                n = getConst(b, *numQubits);
+            } else {
+                OperationState castState(loc, IndexCastOp::getOperationName());
+                IndexCastOp::build(b, castState, genRegSize(b, loc, qdata), b.getI64Type());
+                n = b.createOperation(castState)->getResult(0);
+            }
+        }
 
-        OperationState const7State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const7State, b.getI64IntegerAttr(7));
-        const7 = b.createOperation(const7State)->getResult(0);
+        Value &live = counters[numMetrics];
+        Value &peak = counters[numMetrics + 1];
+        if (!alloc) {
+            live = createBinOp<SubIOp>(b, loc, live, n);
+            return;
+        }
+        live = createBinOp<AddIOp>(b, loc, live, n);
+        peak = createMax(b, loc, peak, live);
+    }
 
-        OperationState const14State(loc, ConstantOp::getOperationName());
-        ConstantOp::build(b, const14State, b.getI64IntegerAttr(14));
-        const14 = b.createOperation(const14State)->getResult(0);
+    // dynamic register arguments of a counting function come with an index argument holding their size
+    void addRegSizeArgs(OpBuilder &b, CircuitOp circ) {
+        Block &entry = circ.front();
+        unsigned numArgs = entry.getNumArguments();
+        unsigned numSizes = 0;
+        for (unsigned i = 0; i < numArgs; i++) {
+            BlockArgument arg = entry.getArgument(numSizes + i);
+            if (isDynamicReg(arg.getType()))
+                regSizeArgs[arg] = entry.insertArgument(numSizes++, b.getIndexType());
+        }
     }
 
-    void genCounterInc(OpBuilder &b, Operation *op, int64_t n) {
-        Value *incR;
-        Value *incT;
+    // materialize the number of qubits in a register at the current insertion point
+    Value genRegSize(OpBuilder &b, Location loc, Value reg) {
+        if (auto size = reg.getType().cast<RstateType>().getNumQubits())
+            return createConst(b, loc, b.getIndexAttr(*size));
+        if (Value size = regSizeArgs.lookup(reg))
+            return size;
+
+        Operation *def = reg.getDefiningOp();
+        assert(def && "Unknown size of dynamic register argument!");
+        if (auto alloc = dyn_cast<AllocRegOp>(def))
+            return alloc.size();
+        if (auto extr = dyn_cast<ExtractOp>(def))
+            return createBinOp<SubIOp>(b, loc, genRegSize(b, loc, extr.reg()),
+                                       createConst(b, loc, b.getIndexAttr(extr.qbs().size())));
+        if (auto comb = dyn_cast<CombineStatOp>(def))
+            return createBinOp<AddIOp>(b, loc, genRegSize(b, loc, comb.reg()),
+                                       createConst(b, loc, b.getIndexAttr(comb.qbs().size())));
+        if (auto comb = dyn_cast<CombineDynOp>(def))
+            return createBinOp<AddIOp>(b, loc, genRegSize(b, loc, comb.reg()),
+                                       createConst(b, loc, b.getIndexAttr(comb.qbs().size())));
+
+        // the k-th qdata result of gates, casts and calls is the k-th qdata operand passed through
+        unsigned k = 0;
+        for (Value res : def->getResults()) {
+            if (res == reg)
+                break;
+            k += isQData(res.getType());
+        }
+        for (Value operand : def->getOperands())
+            if (isQData(operand.getType()) && !k--)
+                return genRegSize(b, loc, operand);
+        llvm_unreachable("Unknown size of dynamic register!");
+    }
 
-        if (isa<ROp>(op)) {
-            switch (n) {
-                case 0 : incR = &const1; incT = &const0; break;
-                case 1 : incR = &const3; incT = &const0; break;
-                case 2 : incR = &const5; incT = &const14; break;
-                default : llvm_unreachable("Not yet implemented other increment values!");
-            }
-        } else if (isa<HOp>(op)) {
-            switch (n) {
-                case 1 : incR = &const2; incT = &const0; break;
-                default : llvm_unreachable("Not yet implemented other increment values!");
-            }
-        } else if (isa<SwapOp>(op)) {
-            switch (n) {
-                case 1 : incR = &const0; incT = &const7; break;
-                default : llvm_unreachable("Not yet implemented other increment values!");
+    // sizes of the dynamic register arguments passed to a counting function
+    SmallVector<Value, 2> genRegSizeArgs(OpBuilder &b, Location loc, ValueRange args) {
+        SmallVector<Value, 2> sizes;
+        for (Value arg : args)
+            if (isDynamicReg(arg.getType()))
+                sizes.push_back(genRegSize(b, loc, arg));
+        return sizes;
+    }
+
+    // look up the cost of a gate with n controls, returns whether it contributes to the count
+    bool getGateCost(Operation *gate, int64_t n, SmallVectorImpl<int64_t> &cost) {
+        costModel->getCost(gate->getName().stripDialect(), n, cost);
+        return isAppliedGate(gate) && !isFree(cost);
+    }
+
+    void genCounterInc(OpBuilder &b, Operation *op, ArrayRef<int64_t> cost) {
+        b.setInsertionPoint(op);
+        Location loc = op->getLoc();
+
+        // gates on registers are applied to each qubit
+        int64_t factor = 1;
+        Value size;
+        if (auto regType = op->getResults().back().getType().dyn_cast<RstateType>()) {
+            if (auto numQubits = regType.getNumQubits()) {
+                factor = *numQubits;
+            } else {
+                OperationState castState(loc, IndexCastOp::getOperationName());
+                IndexCastOp::build(b, castState, genRegSize(b, loc, op->getOperands().back()), b.getI64Type());
+                size = b.createOperation(castState)->getResult(0);
             }
-        } else {
-            llvm_unreachable("Not yet implemented increments for other ops!");
         }
 
-        b.setInsertionPoint(op);
-        OperationState addState(op->getLoc(), AddIOp::getOperationName());
-        AddIOp::build(b, addState, Rcounter, *incR);
-        Rcounter = b.createOperation(addState)->getResult(0);
-        addState = OperationState(op->getLoc(), AddIOp::getOperationName());
-        AddIOp::build(b, addState, Tcounter, *incT);
-        Tcounter = b.createOperation(addState)->getResult(0);
+        for (unsigned i = 0; i < numMetrics; i++) {
+            if (!cost[i] || costModel->isDepthMetric(i))
+                continue;
+            Value inc = getConst(b, cost[i] * factor);
+            if (size)
+                inc = createBinOp<MulIOp>(b, loc, size, inc);
+            counters[i] = createBinOp<AddIOp>(b, loc, counters[i], inc);
+        }
     }
 
     void stripAdjoint(OpBuilder &b, Operation *adjOp) {
@@ -148,16 +350,17 @@ private:
             resTypes.append(gate->result_type_begin(), gate->result_type_end()-1);
             resTypes.append(adj.result_type_begin(), adj.result_type_end());
 
-            b.setInsertionPoint(adj);
-            Operation *newGate = Operation::create(adj.getLoc(), gate->getName(), resTypes, args, gate->getAttrs());
-            b.insert(newGate);
-
             // add segment sizes
             bool q2 = !!adj.qbs2();
+            NamedAttrList attrs(gate->getAttrs());
             if (isa<CNotOp>(gate) || isa<SwapOp>(gate))
-                newGate->setAttr("operand_segment_sizes", b.getI32VectorAttr({q2, 1}));
+                attrs.set("operand_segment_sizes", b.getI32VectorAttr({q2, 1}));
             else if (isa<ControlOp>(gate))
-                newGate->setAttr("operand_segment_sizes", b.getI32VectorAttr({1, 1, q2, 1}));
+                attrs.set("operand_segment_sizes", b.getI32VectorAttr({1, 1, q2, 1}));
+
+            b.setInsertionPoint(adj);
+            Operation *newGate = Operation::create(adj.getLoc(), gate->getName(), resTypes, args, attrs);
+            b.insert(newGate);
 
             // remove adjoint
             if (q2)
@@ -167,15 +370,24 @@ private:
         }
     }
 
+    // number of qubits in the control operand of a control op
+    int64_t getNumCtrlQubits(ControlOp ctrl) {
+        if (auto regType = ctrl.ctrls().getType().dyn_cast<RstateType>()) {
+            auto size = regType.getNumQubits();
+            assert(size && "Dynamic-size register ctrls not yet implemented!");
+            return *size;
+        }
+        return 1;
+    }
+
     void stripControl(OpBuilder &b, Operation *ctrlOp) {
         ControlOp ctrl = cast<ControlOp>(ctrlOp);
-        assert(ctrl.ctrls().getType().isa<QstateType>() && "Register ctrls not yet implemented!");
         IntegerAttr ctrlAttr = ctrl.getAttrOfType<IntegerAttr>("_num_ctrls");
 
         if (!ctrl.qbs()) { // intermediate control
             // pass through value, ammend num of control qubits attribute (will be used later)
             for (auto op : ctrl.res().getUsers()) {
-                int64_t newCtrlCount = 1;
+                int64_t newCtrlCount = getNumCtrlQubits(ctrl);
                 if (ctrlAttr)
                     newCtrlCount += ctrlAttr.getInt();
                 IntegerAttr opAttr = op->getAttrOfType<IntegerAttr>("_num_ctrls");
@@ -201,20 +413,22 @@ private:
             resTypes.append(gate->result_type_begin(), gate->result_type_end()-1);
             resTypes.append(ctrl.result_type_begin()+1, ctrl.result_type_end());
 
-            b.setInsertionPoint(ctrl);
-            Operation *newGate = Operation::create(ctrl.getLoc(), gate->getName(), resTypes, args, {});
-            b.insert(newGate);
-
             // add segment sizes
             bool q2 = !!ctrl.qbs2();
+            NamedAttrList attrs;
             if (isa<CNotOp>(gate) || isa<SwapOp>(gate))
-                newGate->setAttr("operand_segment_sizes", b.getI32VectorAttr({q2, 1}));
+                attrs.set("operand_segment_sizes", b.getI32VectorAttr({q2, 1}));
 
             // amend number of control qubits attribute
-            int64_t newCtrlCount = 1;
+            int64_t newCtrlCount = getNumCtrlQubits(ctrl);
             if (ctrlAttr)
                 newCtrlCount += ctrlAttr.getInt();
-            newGate->setAttr("_num_ctrls", b.getI64IntegerAttr(newCtrlCount));
+            attrs.set("_num_ctrls", b.getI64IntegerAttr(newCtrlCount));
+
+            // the attributes are complete before the gate is created
+            b.setInsertionPoint(ctrl);
+            Operation *newGate = Operation::create(ctrl.getLoc(), gate->getName(), resTypes, args, attrs);
+            b.insert(newGate);
 
             // remove control
             ctrl.new_ctrls().replaceAllUsesWith(ctrl.ctrls());
@@ -255,7 +469,8 @@ private:
         }
     }
 
-    void updateControlAttr(OpBuilder &b, Operation *gate, int64_t nctrl) {
+    // set the control count of a gate copied into a circuit specialized for nctrl more controls
+    void updateControlAttr(OpBuilder &b, Operation *gate, NamedAttrList &attrs, int64_t nctrl) {
         // no need to control gates in compute/uncompute sections
         if (gate->getAttr("compute") || gate->getAttr("uncompute"))
             return;
@@ -263,21 +478,7 @@ private:
         IntegerAttr attr = gate->getAttrOfType<IntegerAttr>("_num_ctrls");
         if (attr)
             nctrl += attr.getInt();
-        gate->setAttr("_num_ctrls", b.getI64IntegerAttr(nctrl));
-    }
-
-    void propControls(OpBuilder &b, Operation *op, int64_t nctrl) {
-        // walk nested operations
-        for (auto &region : op->getRegions()) {
-            for (auto &block : region) {
-                for (auto &nestedOp : llvm::make_early_inc_range(block)) {
-                    if (isGate(&nestedOp))
-                        updateControlAttr(b, &nestedOp, nctrl);
-                    else if (isa<scf::ForOp>(nestedOp) || isa<scf::IfOp>(nestedOp))
-                        propControls(b, &nestedOp, nctrl);
-                }
-            }
-        }
+        attrs.set("_num_ctrls", b.getI64IntegerAttr(nctrl));
     }
 
     Operation* createControlledCircuit(OpBuilder &b, Operation *circ, Operation *call, int64_t nctrl) {
@@ -285,16 +486,24 @@ private:
         StringAttr circName = circ->getAttrOfType<StringAttr>(SymbolTable::getSymbolAttrName());
         std::string newCircName = llvm::join<ArrayRef<StringRef>>(
             {circName.getValue(), std::to_string(nctrl)}, "_C");
-        Operation *newCirc = SymbolTable::lookupNearestSymbolFrom(call, newCircName);
+        Operation *newCirc = specializations.lookup(circName.getValue(), nctrl, false);
+        if (newCirc) {
+            numSpecHits++;
+        } else {
+            numSpecMisses++;
+            newCirc = circuits->lookup(newCircName).getOperation();
+        }
         if (!newCirc) {
-            newCirc = circ->clone();
-            newCirc->setAttr(SymbolTable::getSymbolAttrName(), b.getStringAttr(newCircName));
+            // controls are propagated to the gates while copying the body
+            newCirc = quantum::cloneSpecialized(circ, newCircName, [&](Operation *op, NamedAttrList &attrs) {
+                if (isGate(op))
+                    updateControlAttr(b, op, attrs, nctrl);
+            });
             b.setInsertionPointAfter(circ);
             b.insert(newCirc);
-
-            // propagate controls
-            propControls(b, newCirc, nctrl);
+            circuits->insert(cast<CircuitOp>(newCirc));
         }
+        specializations.insert(circName.getValue(), nctrl, false, newCirc);
 
         // update call
         ValueRange operands = call->getOperands();
@@ -311,7 +520,7 @@ private:
     }
 
     void walkCallTree(OpBuilder &b, Operation *op, int64_t nctrl) {
-        nrec++;
+        numCallTreeVisits++;
         if (auto circ = dyn_cast<CircuitOp>(op)) {
             if (alreadyBuilt.count(circ.getName().str())) {
                 return;
@@ -322,7 +531,7 @@ private:
             for (auto &block : region) {
                 for (auto &nestedOp : llvm::make_early_inc_range(block)) {
                     if (auto call = dyn_cast<CallCircOp>(nestedOp)) {
-                        Operation *calledCirc = SymbolTable::lookupNearestSymbolFrom(call, call.circref());
+                        Operation *calledCirc = circuits->lookup(call.circref()).getOperation();
 
 
                         int64_t new_nctrl = nctrl;
@@ -336,7 +545,7 @@ private:
                             walkCallTree(b, calledCirc, new_nctrl);
                     } else if (auto apply = dyn_cast<ApplyCircOp>(nestedOp)) {
                         StringRef cref = cast<CircuitValueOp>(apply.circval().getDefiningOp()).circref();
-                        Operation *calledCirc = SymbolTable::lookupNearestSymbolFrom(apply, cref);
+                        Operation *calledCirc = circuits->lookup(cref).getOperation();
                         int64_t new_nctrl = nctrl;
                         if (apply.getAttr("compute") || apply.getAttr("uncompute"))
                             new_nctrl = 0;
@@ -356,62 +565,441 @@ private:
             alreadyBuilt.insert(circ.getName().str());
     }
 
+    //===------------------------------------------------------------------===//
+    // Cost summaries
+    //===------------------------------------------------------------------===//
+
+    // express a loop bound relative to the boundary of the summarized region `root`
+    Optional<SymOperand> resolveOperand(Value v, Region &root) {
+        IntegerAttr cst;
+        if (matchPattern(v, m_Constant<IntegerAttr>(&cst)))
+            return SymOperand{SymOperand::Const, cst.getInt(), 0, nullptr};
+        if (!root.isAncestor(v.getParentRegion()))
+            return SymOperand{SymOperand::Val, 0, 0, v};
+        if (isa<CircuitOp>(root.getParentOp()))
+            if (auto arg = v.dyn_cast<BlockArgument>())
+                if (arg.getOwner() == &root.front())
+                    return SymOperand{SymOperand::Arg, 0, arg.getArgNumber(), nullptr};
+        return llvm::None;
+    }
+
+    // express the number of qubits in a register relative to the boundary of `root`
+    Optional<SymOperand> resolveRegSize(Value reg, Region &root) {
+        if (auto size = reg.getType().cast<RstateType>().getNumQubits())
+            return SymOperand{SymOperand::Const, *size, 0, nullptr};
+        if (!root.isAncestor(reg.getParentRegion()))
+            return SymOperand{SymOperand::Size, 0, 0, reg};
+        if (auto arg = reg.dyn_cast<BlockArgument>()) {
+            if (isa<CircuitOp>(root.getParentOp()) && arg.getOwner() == &root.front())
+                return SymOperand{SymOperand::ArgSize, 0, arg.getArgNumber(), nullptr};
+            return llvm::None;
+        }
+
+        Operation *def = reg.getDefiningOp();
+        if (auto alloc = dyn_cast<AllocRegOp>(def))
+            return resolveOperand(alloc.size(), root);
+        if (isGate(def) && reg == def->getResults().back())
+            return resolveRegSize(def->getOperands().back(), root);
+        return llvm::None;
+    }
+
+    // add `other`, executed `trip` times (if given), to `sum`
+    // operands of `other` are mapped into the current context by `subst`
+    LogicalResult addCost(CostSummary &sum, const CostSummary &other, Optional<TripCount> trip,
+                          function_ref<Optional<SymOperand>(const SymOperand&)> subst) {
+        sum.pure &= other.pure;
+
+        // scale by the constant part of the trip counts, keep the symbolic ones
+        auto addTerm = [&](SmallVector<TripCount, 2> trips, SmallVector<int64_t, 4> cost) {
+            if (isFree(cost))
+                return;
+            SmallVector<TripCount, 2> symTrips;
+            for (auto &tc : trips) {
+                if (tc.lb.kind == SymOperand::Const && tc.ub.kind == SymOperand::Const &&
+                        tc.step.kind == SymOperand::Const) {
+                    int64_t n = getConstTripCount(tc.lb.cst, tc.ub.cst, tc.step.cst);
+                    for (int64_t &c : cost)
+                        c *= n;
+                } else {
+                    symTrips.push_back(tc);
+                }
+            }
+            if (symTrips.empty())
+                accumulate(sum.cost, cost);
+            else
+                sum.terms.push_back(CostTerm{symTrips, cost});
+        };
+
+        SmallVector<TripCount, 2> outer;
+        if (trip)
+            outer.push_back(*trip);
+        addTerm(outer, other.cost);
+
+        for (auto &term : other.terms) {
+            SmallVector<TripCount, 2> trips(outer);
+            for (auto &tc : term.trips) {
+                auto lb = subst(tc.lb), ub = subst(tc.ub), step = subst(tc.step);
+                if (!lb || !ub || !step)
+                    return failure();
+                trips.push_back(TripCount{*lb, *ub, *step});
+            }
+            addTerm(trips, term.cost);
+        }
+        return success();
+    }
+
+    // compute the closed-form cost of a block, fails on data dependent control flow
+    // or loop bounds which are not invariant with respect to `root`
+    LogicalResult summarizeBlock(Block &block, Region &root, CostSummary &sum) {
+        auto identity = [](const SymOperand &op) -> Optional<SymOperand> { return op; };
+
+        if (hasDepthMetrics) {
+            llvm::DenseMap<Operation*, SmallVector<int64_t, 4>> depths;
+            getSegmentDepths(block, depths);
+            for (auto &segment : depths)
+                accumulate(sum.cost, segment.second);
+        }
+
+        for (auto &op : block) {
+            if (isGate(&op)) {
+                CostSummary gateCost;
+                if (!getGateCost(&op, getNumCtrls(&op), gateCost.cost))
+                    continue;
+                // depth metrics are accounted for by the segments of the block
+                for (unsigned i = 0; i < numMetrics; i++)
+                    if (costModel->isDepthMetric(i))
+                        gateCost.cost[i] = 0;
+
+                // gates on registers are applied to each qubit, the size is a trip count [0, size)
+                Value target = op.getResults().back();
+                if (!isDynamicReg(target.getType())) {
+                    int64_t factor = 1;
+                    if (auto regType = target.getType().dyn_cast<RstateType>())
+                        factor = *regType.getNumQubits();
+                    accumulate(sum.cost, gateCost.cost, factor);
+                    continue;
+                }
+                auto size = resolveRegSize(op.getOperands().back(), root);
+                if (!size)
+                    return failure();
+                SymOperand zero{SymOperand::Const, 0, 0, nullptr};
+                SymOperand one{SymOperand::Const, 1, 0, nullptr};
+                if (failed(addCost(sum, gateCost, TripCount{zero, *size, one}, identity)))
+                    return failure();
+            } else if (isa<CallCircOp>(op) || isa<ApplyCircOp>(op)) {
+                StringRef callee;
+                ValueRange args = op.getOperands();
+                if (auto call = dyn_cast<CallCircOp>(op)) {
+                    callee = call.circref();
+                } else {
+                    auto getval = dyn_cast_or_null<CircuitValueOp>(op.getOperand(0).getDefiningOp());
+                    if (!getval)
+                        return failure();
+                    callee = getval.circref();
+                    args = args.drop_front();
+                }
+
+                // when profiling, every call is recorded at its call site
+                const CostSummary *calleeCost = options.profile ? nullptr : getSummary(callee);
+                if (!calleeCost)
+                    return failure();
+                auto subst = [&](const SymOperand &sym) -> Optional<SymOperand> {
+                    if (sym.kind == SymOperand::ArgSize)
+                        return resolveRegSize(args[sym.argNo], root);
+                    if (sym.kind != SymOperand::Arg)
+                        return sym;
+                    return resolveOperand(args[sym.argNo], root);
+                };
+                if (failed(addCost(sum, *calleeCost, llvm::None, subst)))
+                    return failure();
+            } else if (auto forOp = dyn_cast<scf::ForOp>(op)) {
+                CostSummary body;
+                if (failed(summarizeBlock(*forOp.getBody(), root, body)))
+                    return failure();
+                auto lb = resolveOperand(forOp.lowerBound(), root);
+                auto ub = resolveOperand(forOp.upperBound(), root);
+                auto step = resolveOperand(forOp.step(), root);
+                if (!lb || !ub || !step)
+                    return failure();
+                if (failed(addCost(sum, body, TripCount{*lb, *ub, *step}, identity)))
+                    return failure();
+            } else if (isa<scf::IfOp>(op) || isa<ControlOp>(op) || isa<AdjointOp>(op)) {
+                return failure();
+            } else if (options.peakQubits && (isa<AllocOp>(op) || isa<AllocRegOp>(op) ||
+                                             isa<FreeOp>(op) || isa<FreeRegOp>(op))) {
+                // the peak qubit count is not additive, such circuits are counted when executed
+                return failure();
+            } else if (!isa<QuantumSSADialect>(op.getDialect()) && !op.isKnownTerminator() &&
+                       !MemoryEffectOpInterface::hasNoEffect(&op)) {
+                sum.pure = false;
+            }
+        }
+        return success();
+    }
+
+    // compute (or retrieve from the cache) the closed-form cost of a circuit
+    const CostSummary* getSummary(StringRef name) {
+        auto it = summaries.find(name.str());
+        if (it != summaries.end())
+            return &it->second;
+        // without summarization, circuits are counted by their counting function instead
+        if (!options.summarize || unsummarizable.count(name.str()))
+            return nullptr;
+
+        CircuitOp circ = module.lookupSymbol<CircuitOp>(name);
+        if (!circ || circ.getOperation() == main)
+            return nullptr;
+
+        // mark as unsummarizable until done to cut off recursive call chains
+        unsummarizable.insert(name.str());
+        CostSummary cost;
+        if (failed(summarizeBlock(circ.front(), circ.gates(), cost)))
+            return nullptr;
+        unsummarizable.erase(name.str());
+        return &(summaries[name.str()] = cost);
+    }
+
+    const CostSummary* lookupSummary(StringRef name) {
+        auto it = summaries.find(name.str());
+        return it != summaries.end() ? &it->second : nullptr;
+    }
+
+    template <class BinOp>
+    Value createBinOp(OpBuilder &b, Location loc, Value lhs, Value rhs) {
+        OperationState state(loc, BinOp::getOperationName());
+        BinOp::build(b, state, lhs, rhs);
+        return b.createOperation(state)->getResult(0);
+    }
+
+    Value createMax(OpBuilder &b, Location loc, Value lhs, Value rhs) {
+        OperationState cmpState(loc, CmpIOp::getOperationName());
+        CmpIOp::build(b, cmpState, CmpIPredicate::sgt, lhs, rhs);
+        Value cmp = b.createOperation(cmpState)->getResult(0);
+        OperationState selectState(loc, SelectOp::getOperationName());
+        SelectOp::build(b, selectState, cmp, lhs, rhs);
+        return b.createOperation(selectState)->getResult(0);
+    }
+
+    Value createConst(OpBuilder &b, Location loc, Attribute attr) {
+        OperationState state(loc, ConstantOp::getOperationName());
+        ConstantOp::build(b, state, attr);
+        return b.createOperation(state)->getResult(0);
+    }
+
+    Value materialize(OpBuilder &b, Location loc, const SymOperand &op, ValueRange args) {
+        switch (op.kind) {
+            case SymOperand::Const : return createConst(b, loc, b.getIndexAttr(op.cst));
+            case SymOperand::Arg : return args[op.argNo];
+            case SymOperand::Val : return op.val;
+            case SymOperand::ArgSize : return genRegSize(b, loc, args[op.argNo]);
+            case SymOperand::Size : return genRegSize(b, loc, op.val);
+        }
+        llvm_unreachable("Unknown operand kind!");
+    }
+
+    Value genTripCount(OpBuilder &b, Location loc, const TripCount &trip, ValueRange args) {
+        Value lb = materialize(b, loc, trip.lb, args);
+        Value ub = materialize(b, loc, trip.ub, args);
+        Value step = materialize(b, loc, trip.step, args);
+        Value zero = createConst(b, loc, b.getIndexAttr(0));
+        Value one = createConst(b, loc, b.getIndexAttr(1));
+
+        // ceildiv(ub - lb, step), clamped to zero for empty loops
+        Value num = createBinOp<AddIOp>(b, loc, createBinOp<SubIOp>(b, loc, ub, lb),
+                                        createBinOp<SubIOp>(b, loc, step, one));
+        Value count = createBinOp<SignedDivIOp>(b, loc, num, step);
+
+        OperationState cmpState(loc, CmpIOp::getOperationName());
+        CmpIOp::build(b, cmpState, CmpIPredicate::sgt, count, zero);
+        Value pos = b.createOperation(cmpState)->getResult(0);
+        OperationState selState(loc, SelectOp::getOperationName());
+        SelectOp::build(b, selState, pos, count, zero);
+        count = b.createOperation(selState)->getResult(0);
+
+        OperationState castState(loc, IndexCastOp::getOperationName());
+        IndexCastOp::build(b, castState, count, b.getI64Type());
+        return b.createOperation(castState)->getResult(0);
+    }
+
+    // emit counter increments for a summarized cost at the current insertion point
+    void genCostInc(OpBuilder &b, Location loc, const CostSummary &cost, ValueRange args) {
+        for (unsigned i = 0, e = cost.cost.size(); i < e; i++) {
+            if (cost.cost[i])
+                counters[i] = createBinOp<AddIOp>(b, loc, counters[i],
+                                                  createConst(b, loc, b.getI64IntegerAttr(cost.cost[i])));
+        }
+
+        for (auto &term : cost.terms) {
+            Value trips = genTripCount(b, loc, term.trips.front(), args);
+            for (unsigned i = 1; i < term.trips.size(); i++)
+                trips = createBinOp<MulIOp>(b, loc, trips, genTripCount(b, loc, term.trips[i], args));
+
+            for (unsigned i = 0, e = term.cost.size(); i < e; i++) {
+                if (!term.cost[i])
+                    continue;
+                Value inc = createBinOp<MulIOp>(b, loc, trips, createConst(b, loc, b.getI64IntegerAttr(term.cost[i])));
+                counters[i] = createBinOp<AddIOp>(b, loc, counters[i], inc);
+            }
+        }
+    }
+
+    // the loop is left to be counted when executed if its bounds can't be expressed
+    LogicalResult summarizeLoop(scf::ForOp forOp, CostSummary &cost) {
+        Region &root = forOp.getLoopBody();
+        CostSummary body;
+        if (failed(summarizeBlock(*forOp.getBody(), root, body)))
+            return failure();
+
+        auto lb = resolveOperand(forOp.lowerBound(), root);
+        auto ub = resolveOperand(forOp.upperBound(), root);
+        auto step = resolveOperand(forOp.step(), root);
+        if (!lb || !ub || !step)
+            return failure();
+
+        auto identity = [](const SymOperand &op) -> Optional<SymOperand> { return op; };
+        return addCost(cost, body, TripCount{*lb, *ub, *step}, identity);
+    }
+
+    void genRuntimeCall(OpBuilder &b, Location loc, StringRef name, ValueRange args) {
+        // declare the runtime function on first use
+        if (!module.lookupSymbol(name)) {
+            OpBuilder::InsertionGuard guard(b);
+            b.setInsertionPointToStart(module.getBody());
+            OperationState funcState(loc, FuncOp::getOperationName());
+            FuncOp::build(b, funcState, name, b.getFunctionType(args.getTypes(), {}));
+            b.createOperation(funcState);
+        }
+        OperationState callState(loc, CallOp::getOperationName());
+        CallOp::build(b, callState, name, ArrayRef<Type>{}, args);
+        b.createOperation(callState);
+    }
+
+    int64_t getProfileId(StringRef callee) {
+        auto it = profileIds.emplace(callee.str(), profiledCircuits.size());
+        if (it.second)
+            profiledCircuits.push_back(callee.str());
+        return it.first->second;
+    }
+
+    // record a circuit call with its cost, the difference of the counters around it, in the
+    // profiling runtime
+    void genProfileRecord(OpBuilder &b, Location loc, StringRef callee, ArrayRef<Value> before) {
+        if (!options.profile || !counting)
+            return;
+        Value id = getConst(b, getProfileId(callee));
+        genRuntimeCall(b, loc, "qprof_call", id);
+        for (unsigned i = 0; i < numMetrics; i++) {
+            if (counters[i] == before[i])
+                continue;
+            Value delta = createBinOp<SubIOp>(b, loc, counters[i], before[i]);
+            genRuntimeCall(b, loc, "qprof_record", {id, getConst(b, i), delta});
+        }
+    }
+
+    // size the runtime for the profiled circuits on entry of the program, and record their names
+    // and the metrics on the module for the profile output
+    void genProfileInit(OpBuilder &b) {
+        auto mainFunc = module.lookupSymbol<FuncOp>("mlir_main");
+        Block &entry = mainFunc.front();
+        Location loc = mainFunc.getLoc();
+        b.setInsertionPointToStart(&entry);
+        genRuntimeCall(b, loc, "qprof_init",
+                       {createConst(b, loc, b.getI64IntegerAttr(profiledCircuits.size())),
+                        createConst(b, loc, b.getI64IntegerAttr(numMetrics))});
+
+        SmallVector<StringRef, 8> circuits(profiledCircuits.begin(), profiledCircuits.end());
+        SmallVector<StringRef, 4> metrics(costModel->getMetrics().begin(), costModel->getMetrics().end());
+        module.setAttr("qs.profile_circuits", b.getStrArrayAttr(circuits));
+        module.setAttr("qs.profile_metrics", b.getStrArrayAttr(metrics));
+    }
+
+    // replace a circuit call whose cost is summarized by the closed-form increment
+    void convertSummarizedCall(OpBuilder &b, Operation *call, StringRef callee, ValueRange args,
+                               const CostSummary &cost) {
+        b.setInsertionPoint(call);
+        if (counting) {
+            SmallVector<Value, 4> before(counters);
+            genCostInc(b, call->getLoc(), cost, args);
+            genProfileRecord(b, call->getLoc(), callee, before);
+        }
+
+        if (cost.pure) {
+            // nothing left to execute, forward qdata arguments to the call results
+            auto argIt = args.begin();
+            for (auto res : call->getResults()) {
+                while (!(*argIt).getType().isa<QstateType>() && !(*argIt).getType().isa<RstateType>())
+                    argIt++;
+                res.replaceAllUsesWith(*argIt++);
+            }
+        } else {
+            SmallVector<Type, 4> retTypes(call->getResultTypes());
+            OperationState callState(call->getLoc(), CallOp::getOperationName());
+            CallOp::build(b, callState, retTypes, callee, args);
+            Operation *newCallOp = b.createOperation(callState);
+            call->replaceAllUsesWith(newCallOp);
+        }
+        call->erase();
+    }
+
     void convertGates(OpBuilder &b, Operation *gate) {
-        int64_t nctrl = 0;
-        if (auto attr = gate->getAttrOfType<IntegerAttr>("_num_ctrls"))
-            nctrl += attr.getInt();
+        int64_t nctrl = getNumCtrls(gate);
 
-        bool noTarget = false;
         // for now delete all quantum operations, return/yield operation updated with some input
         if (auto h = dyn_cast<HOp>(gate)) {
             if (h.qbs())
                 h.res().replaceAllUsesWith(h.qbs());
-            else
-                noTarget = true;
             assert(h.res().getUses().empty() && "still has uses");
         } else if (auto x = dyn_cast<XOp>(gate)) {
             if (x.qbs())
                 x.res().replaceAllUsesWith(x.qbs());
-            else
-                noTarget = true;
             assert(x.res().getUses().empty() && "still has uses");
         } else if (auto rz = dyn_cast<RzOp>(gate)) {
             if (rz.qbs())
                 rz.res().replaceAllUsesWith(rz.qbs());
-            else
-                noTarget = true;
             assert(rz.res().getUses().empty() && "still has uses");
         } else if (auto r = dyn_cast<ROp>(gate)) {
             if (r.qbs())
                 r.res().replaceAllUsesWith(r.qbs());
-            else
-                noTarget = true;
             assert(r.res().getUses().empty() && "still has uses");
         } else if (auto cx = dyn_cast<CNotOp>(gate)) {
             if (cx.qbs())
                 cx.res().replaceAllUsesWith(cx.qbs());
-            else
-                noTarget = true;
             if (cx.ctrl())
                 cx.new_ctrl().replaceAllUsesWith(cx.ctrl());
             assert(cx.res().getUses().empty() && "still has uses");
         } else if (auto sw = dyn_cast<SwapOp>(gate)) {
             if (sw.qbs())
                 sw.res().replaceAllUsesWith(sw.qbs());
-            else
-                noTarget = true;
             if (sw.qbs2())
                 sw.new_qbs2().replaceAllUsesWith(sw.qbs2());
             assert(sw.res().getUses().empty() && "still has uses");
+        } else if (isa<AllocOp>(gate) || isa<AllocRegOp>(gate)) {
+            if (counting && options.peakQubits)
+                genLiveQubitsUpdate(b, gate, gate->getResult(0), /*alloc=*/true);
+            return;
         } else if (isa<FreeOp>(gate) || isa<FreeRegOp>(gate)) {
             // just delete (at bottom)
+            if (counting && options.peakQubits)
+                genLiveQubitsUpdate(b, gate, gate->getOperand(0), /*alloc=*/false);
+        } else if (auto reset = dyn_cast<ResetOp>(gate)) {
+            reset.res().replaceAllUsesWith(reset.qbs());
         } else if (isa<scf::YieldOp>(gate)) {
             gate->eraseOperands(0, gate->getNumOperands());
-            gate->insertOperands(0, {Rcounter, Tcounter});
+            if (counting && isa<scf::ParallelOp>(gate->getParentOp()))
+                genCounterReductions(b, gate);
+            else if (counting)
+                gate->insertOperands(0, counters);
             return;
         } else if (auto call = dyn_cast<CallCircOp>(gate)) {
-            gate->insertOperands(0, {Rcounter, Tcounter});
-            SmallVector<Type, 6> retTypes(2, b.getI64Type());
+            if (const CostSummary *cost = lookupSummary(call.circref())) {
+                convertSummarizedCall(b, gate, call.circref(), call.getOperands(), *cost);
+                return;
+            }
+            b.setInsertionPoint(gate);
+            SmallVector<Value, 2> sizes = genRegSizeArgs(b, gate->getLoc(), call.getOperands());
+            gate->insertOperands(0, counters);
+            gate->insertOperands(numCounters, sizes);
+            SmallVector<Type, 6> retTypes(numCounters, b.getI64Type());
             for (auto type : gate->getResultTypes())
                 retTypes.push_back(type);
 
@@ -420,26 +1008,38 @@ private:
             CallOp::build(b, callState, retTypes, call.circref(), gate->getOperands());
             Operation *newCallOp = b.createOperation(callState);
 
-            gate->replaceAllUsesWith(newCallOp->getResults().drop_front(2));
+            SmallVector<Value, 4> before(counters);
+            for (unsigned i = 0; i < numCounters; i++)
+                counters[i] = newCallOp->getResult(i);
+            genProfileRecord(b, gate->getLoc(), call.circref(), before);
+            gate->replaceAllUsesWith(newCallOp->getResults().drop_front(numCounters));
             gate->erase();
-            Rcounter = newCallOp->getResult(0);
-            Tcounter = newCallOp->getResult(1);
             return;
         } else if (auto apply = dyn_cast<ApplyCircOp>(gate)) {
-            gate->insertOperands(1, {Rcounter, Tcounter});
-            SmallVector<Type, 6> retTypes(2, b.getI64Type());
+            StringRef callee = cast<CircuitValueOp>(apply.circval().getDefiningOp()).circref();
+            if (const CostSummary *cost = lookupSummary(callee)) {
+                convertSummarizedCall(b, gate, callee, apply.args(), *cost);
+                return;
+            }
+            b.setInsertionPoint(gate);
+            SmallVector<Value, 2> sizes = genRegSizeArgs(b, gate->getLoc(), apply.args());
+            gate->insertOperands(1, counters);
+            gate->insertOperands(1 + numCounters, sizes);
+            SmallVector<Type, 6> retTypes(numCounters, b.getI64Type());
             for (auto type : gate->getResultTypes())
                 retTypes.push_back(type);
 
             b.setInsertionPoint(gate);
             OperationState callState(gate->getLoc(), CallOp::getOperationName());
-            CallOp::build(b, callState, retTypes, cast<CircuitValueOp>(apply.circval().getDefiningOp()).circref(), gate->getOperands().drop_front());
+            CallOp::build(b, callState, retTypes, callee, gate->getOperands().drop_front());
             Operation *newCallOp = b.createOperation(callState);
 
-            gate->replaceAllUsesWith(newCallOp->getResults().drop_front(2));
+            SmallVector<Value, 4> before(counters);
+            for (unsigned i = 0; i < numCounters; i++)
+                counters[i] = newCallOp->getResult(i);
+            genProfileRecord(b, gate->getLoc(), callee, before);
+            gate->replaceAllUsesWith(newCallOp->getResults().drop_front(numCounters));
             gate->erase();
-            Rcounter = newCallOp->getResult(0);
-            Tcounter = newCallOp->getResult(1);
             return;
         } else if (isa<ReturnStateOp>(gate)) {
             // keep original return types for now to keep valid intermediate IR (will be removed in last step)
@@ -451,7 +1051,10 @@ private:
                 else if (arg.getType().isa<RstateType>())
                     reg = arg;
             }
-            SmallVector<Value, 4> retValues({Rcounter, Tcounter});
+            // summarized circuits don't thread the counters
+            SmallVector<Value, 4> retValues;
+            if (counting)
+                retValues.append(counters.begin(), counters.end());
             for (auto type : gate->getOperandTypes()) {
                 if (type.isa<QstateType>())
                     retValues.push_back(qb);
@@ -464,12 +1067,14 @@ private:
             b.setInsertionPoint(gate);
             // if in main, insert print calls for the final counter values
             if (gate->getParentOp() == main) {
-                OperationState printState(gate->getLoc(), vector::PrintOp::getOperationName());
-                vector::PrintOp::build(b, printState, Rcounter);
-                b.createOperation(printState);
-                printState = OperationState(gate->getLoc(), vector::PrintOp::getOperationName());
-                vector::PrintOp::build(b, printState, Tcounter);
-                b.createOperation(printState);
+                SmallVector<Value, 4> printed(counters.begin(), counters.begin() + numMetrics);
+                if (options.peakQubits)
+                    printed.push_back(counters[numMetrics + 1]);
+                for (Value counter : printed) {
+                    OperationState printState(gate->getLoc(), vector::PrintOp::getOperationName());
+                    vector::PrintOp::build(b, printState, counter);
+                    b.createOperation(printState);
+                }
             }
 
             OperationState retState(gate->getLoc(), ReturnOp::getOperationName());
@@ -494,17 +1099,17 @@ private:
             return;
         }
 
-        if ((nctrl || isa<ROp>(gate)) && !noTarget)
-            genCounterInc(b, gate, nctrl);
+        SmallVector<int64_t, 4> cost;
+        if (counting && getGateCost(gate, nctrl, cost))
+            genCounterInc(b, gate, cost);
         gate->erase();
     }
 
-    Operation* convertFor(OpBuilder &b, scf::ForOp op, Value &R, Value &T) {
+    Operation* convertFor(OpBuilder &b, scf::ForOp op, SmallVectorImpl<Value> &results) {
         // setup counters as iteration arguments
         b.setInsertionPoint(op);
         OperationState forState(op.getLoc(), scf::ForOp::getOperationName());
-        scf::ForOp::build(b, forState, op.lowerBound(), op.upperBound(), op.step(),
-                          {Rcounter, Tcounter});
+        scf::ForOp::build(b, forState, op.lowerBound(), op.upperBound(), op.step(), counters);
         Operation *newOp = b.createOperation(forState);
 
         // originally returned qdata values can be replaced by original iter args
@@ -520,25 +1125,130 @@ private:
         while (op.getNumRegionIterArgs())
             op.getBody()->eraseArgument(1);
         newOp->getRegion(0).takeBody(op.getLoopBody());
-        newOp->getRegion(0).front().insertArgument(1, b.getI64Type());
-        newOp->getRegion(0).front().insertArgument(2, b.getI64Type());
+        for (unsigned i = 0; i < numCounters; i++)
+            newOp->getRegion(0).front().insertArgument(1 + i, b.getI64Type());
 
         // region arguments need to be set as current counters before recursing into body
         // index 0 is the loop iteration variable
-        Rcounter = newOp->getRegion(0).getArgument(1);
-        Tcounter = newOp->getRegion(0).getArgument(2);
+        for (unsigned i = 0; i < numCounters; i++)
+            counters[i] = newOp->getRegion(0).getArgument(1 + i);
+
+        op.erase();
+
+        results.assign(newOp->result_begin(), newOp->result_end());
+        return newOp;
+    }
+
+    // the circuit called by a call or apply op, empty if it isn't known statically
+    StringRef getCallee(Operation *op) {
+        if (auto call = dyn_cast<CallCircOp>(op))
+            return call.circref();
+        if (auto getval = dyn_cast_or_null<CircuitValueOp>(op->getOperand(0).getDefiningOp()))
+            return getval.circref();
+        return "";
+    }
+
+    // Find the circuits with classical side effects, before any of them is converted. A circuit is
+    // impure if it has such an op itself, applies a circuit which isn't known statically, or calls
+    // an impure or undefined circuit, which is propagated from the callees to their callers.
+    void findImpureCircuits() {
+        llvm::StringMap<SmallVector<StringRef, 4>> callers;
+        SmallVector<StringRef, 8> worklist;
+        auto markImpure = [&](StringRef name) {
+            if (impureCircuits.insert(name.str()).second)
+                worklist.push_back(name);
+        };
+
+        for (CircuitOp circ : module.getOps<CircuitOp>()) {
+            bool impure = circ.isExternal();
+            circ.getBody().walk([&](Operation *op) {
+                if (isa<CallCircOp>(op) || isa<ApplyCircOp>(op)) {
+                    StringRef callee = getCallee(op);
+                    auto calleeCirc = callee.empty() ? CircuitOp() : module.lookupSymbol<CircuitOp>(callee);
+                    if (calleeCirc)
+                        callers[callee].push_back(circ.getName());
+                    else
+                        impure = true;
+                } else if (!isa<QuantumSSADialect>(op->getDialect()) && !isa<scf::SCFDialect>(op->getDialect()) &&
+                           !op->isKnownTerminator() && !MemoryEffectOpInterface::hasNoEffect(op)) {
+                    impure = true;
+                }
+            });
+            if (impure)
+                markImpure(circ.getName());
+        }
+
+        while (!worklist.empty())
+            for (StringRef caller : callers.lookup(worklist.pop_back_val()))
+                markImpure(caller);
+    }
+
+    // The iterations of a loop can be counted independently if it has no classical side effects,
+    // which need to stay in order, neither itself nor in the circuits it calls. Not so for the live
+    // qubits, their peak is a running maximum, or when profiling, as every call is recorded in
+    // the profiling runtime.
+    bool isParallelizable(scf::ForOp op) {
+        if (options.peakQubits)
+            return false;
+        auto result = op.getLoopBody().walk([&](Operation *nested) {
+            if (isa<CallCircOp>(nested) || isa<ApplyCircOp>(nested)) {
+                StringRef callee = getCallee(nested);
+                if (options.profile || callee.empty() || impureCircuits.count(callee.str()))
+                    return WalkResult::interrupt();
+                return WalkResult::advance();
+            }
+            if (isa<QuantumSSADialect>(nested->getDialect()) || isa<scf::SCFDialect>(nested->getDialect()) ||
+                    MemoryEffectOpInterface::hasNoEffect(nested))
+                return WalkResult::advance();
+            return WalkResult::interrupt();
+        });
+        return !result.wasInterrupted();
+    }
+
+    // count each iteration from zero in a parallel loop, the counts are summed by a reduction
+    Operation* convertParallel(OpBuilder &b, scf::ForOp op, SmallVectorImpl<Value> &results) {
+        b.setInsertionPoint(op);
+        OperationState parState(op.getLoc(), scf::ParallelOp::getOperationName());
+        scf::ParallelOp::build(b, parState, op.lowerBound(), op.upperBound(), op.step(), counters);
+        Operation *newOp = b.createOperation(parState);
+
+        op.replaceAllUsesWith(op.getIterOperands());
+        auto argIt = op.getIterOperands().begin();
+        for (auto arg : op.getBody()->getArguments().drop_front())
+            arg.replaceAllUsesWith(*argIt++);
+
+        while (op.getNumRegionIterArgs())
+            op.getBody()->eraseArgument(1);
+        newOp->getRegion(0).takeBody(op.getLoopBody());
+
+        // the yield of the body is replaced by the reductions of its final counters
+        for (unsigned i = 0; i < numCounters; i++)
+            counters[i] = getConst(b, 0);
 
         op.erase();
 
-        R = newOp->getResult(0);
-        T = newOp->getResult(1);
+        results.assign(newOp->result_begin(), newOp->result_end());
         return newOp;
     }
 
-    Operation* convertIf(OpBuilder &b, scf::IfOp op, Value &R, Value &T) {
+    void genCounterReductions(OpBuilder &b, Operation *yield) {
+        b.setInsertionPoint(yield);
+        for (Value counter : counters) {
+            OperationState reduceState(yield->getLoc(), scf::ReduceOp::getOperationName());
+            scf::ReduceOp::build(b, reduceState, counter, [this](OpBuilder &b, Location loc, Value lhs, Value rhs) {
+                OperationState retState(loc, scf::ReduceReturnOp::getOperationName());
+                scf::ReduceReturnOp::build(b, retState, createBinOp<AddIOp>(b, loc, lhs, rhs));
+                b.createOperation(retState);
+            });
+            b.createOperation(reduceState);
+        }
+    }
+
+    Operation* convertIf(OpBuilder &b, scf::IfOp op, SmallVectorImpl<Value> &results) {
         b.setInsertionPoint(op);
         OperationState ifState(op.getLoc(), scf::IfOp::getOperationName());
-        scf::IfOp::build(b, ifState, {b.getI64Type(), b.getI64Type()}, op.condition(), true);
+        SmallVector<Type, 4> counterTypes(numCounters, b.getI64Type());
+        scf::IfOp::build(b, ifState, counterTypes, op.condition(), true);
         Operation *newOp = b.createOperation(ifState);
 
         // need to replace original qdata return value with some value defined outside the if op
@@ -563,76 +1273,150 @@ private:
         op.replaceAllUsesWith(retVals);
         op.erase();
 
-        R = newOp->getResult(0);
-        T = newOp->getResult(1);
+        results.assign(newOp->result_begin(), newOp->result_end());
+        return newOp;
+    }
+
+    Operation* stripFor(OpBuilder &b, scf::ForOp op) {
+        // loop cost is accounted for elsewhere, only remove qdata iteration arguments
+        b.setInsertionPoint(op);
+        OperationState forState(op.getLoc(), scf::ForOp::getOperationName());
+        scf::ForOp::build(b, forState, op.lowerBound(), op.upperBound(), op.step(), ValueRange());
+        Operation *newOp = b.createOperation(forState);
+
+        op.replaceAllUsesWith(op.getIterOperands());
+        auto argIt = op.getIterOperands().begin();
+        for (auto arg : op.getBody()->getArguments().drop_front())
+            arg.replaceAllUsesWith(*argIt++);
+
+        while (op.getNumRegionIterArgs())
+            op.getBody()->eraseArgument(1);
+        newOp->getRegion(0).takeBody(op.getLoopBody());
+
+        op.erase();
         return newOp;
     }
 
     void walkGates(OpBuilder &b, Operation *op) {
         // temporarily store current counter states to restore between regions of If operations
-        Value R = Rcounter;
-        Value T = Tcounter;
+        SmallVector<Value, 4> saved(counters);
         // walk nested operations
         for (auto &region : op->getRegions()) {
             for (auto &block : region) {
+                // the schedule needs the gates, so it's computed before any of them are converted
+                llvm::DenseMap<Operation*, SmallVector<int64_t, 4>> segmentDepths;
+                if (counting && hasDepthMetrics)
+                    getSegmentDepths(block, segmentDepths);
+
                 for (auto &nestedOp : llvm::make_early_inc_range(block)) {
+                    auto depthIt = segmentDepths.find(&nestedOp);
+                    if (depthIt != segmentDepths.end()) {
+                        genDepthInc(b, &nestedOp, depthIt->second);
+                        segmentDepths.erase(depthIt);
+                    }
+
                     if (isa<QuantumSSADialect>(nestedOp.getDialect()) || isa<scf::YieldOp>(nestedOp)) {
                         convertGates(b, &nestedOp);
                     } else if (auto forOp = dyn_cast<scf::ForOp>(nestedOp)) {
-                        Value newR, newT;
-                        walkGates(b, convertFor(b, forOp, newR, newT));
-                        Rcounter = newR;
-                        Tcounter = newT;
+                        CostSummary cost;
+                        if (!counting) {
+                            walkGates(b, stripFor(b, forOp));
+                        } else if (options.summarize && succeeded(summarizeLoop(forOp, cost))) {
+                            // count the whole loop up front, no need to thread counters through it
+                            b.setInsertionPoint(forOp);
+                            genCostInc(b, forOp.getLoc(), cost, {});
+                            counting = false;
+                            walkGates(b, stripFor(b, forOp));
+                            counting = true;
+                        } else if (isParallelizable(forOp)) {
+                            SmallVector<Value, 4> results;
+                            walkGates(b, convertParallel(b, forOp, results));
+                            counters = results;
+                        } else {
+                            SmallVector<Value, 4> results;
+                            walkGates(b, convertFor(b, forOp, results));
+                            counters = results;
+                        }
                     } else if (auto ifOp = dyn_cast<scf::IfOp>(nestedOp)) {
-                        Value newR, newT;
-                        walkGates(b, convertIf(b, ifOp, newR, newT));
-                        Rcounter = newR;
-                        Tcounter = newT;
+                        assert(counting && "Summarized region with data dependent control flow!");
+                        SmallVector<Value, 4> results;
+                        walkGates(b, convertIf(b, ifOp, results));
+                        counters = results;
                     }
                 }
             }
-            if (isa<scf::IfOp>(op)) {
-                Rcounter = R;
-                Tcounter = T;
-            }
+            if (isa<scf::IfOp>(op))
+                counters = saved;
         }
     }
 
-    void convertCircuit(OpBuilder &b, CircuitOp circ, ModuleOp module) {
+    void convertCircuit(OpBuilder &b, CircuitOp circ, bool summarized) {
         // create function to replace circuit
         b.setInsertionPoint(circ);
 
-        SmallVector<Type, 6> argTypes(2, b.getI64Type());
-        SmallVector<Type, 6> resTypes(2, b.getI64Type());
+        SmallVector<Type, 6> argTypes(numCounters, b.getI64Type());
+        SmallVector<Type, 6> resTypes(numCounters, b.getI64Type());
+        for (auto type : circ.getArgumentTypes())
+            if (isDynamicReg(type))
+                argTypes.push_back(b.getIndexType());
         for (auto type : circ.getArgumentTypes())
             argTypes.push_back(type);
         for (auto type : circ.getCallableResults())
             resTypes.push_back(type);
-        FunctionType funtype = circ.getOperation() == main ? circ.getType()
-                                                           : b.getFunctionType(argTypes, resTypes);
+        bool threaded = circ.getOperation() != main && !summarized;
+        FunctionType funtype = threaded ? b.getFunctionType(argTypes, resTypes) : circ.getType();
 
         OperationState funcState(circ.getLoc(), FuncOp::getOperationName());
         FuncOp::build(b, funcState, circ.getName(), funtype);
         Operation *newfun = b.createOperation(funcState);
 
         newfun->getRegion(0).takeBody(circ.gates());
-        if (circ.getOperation() != main) {
-            newfun->getRegion(0).front().insertArgument((unsigned) 0, b.getI64Type());
-            newfun->getRegion(0).front().insertArgument((unsigned) 1, b.getI64Type());
-            newfun->setAttr("_was_circ", b.getUnitAttr());
+        if (threaded) {
+            for (unsigned i = 0; i < numCounters; i++)
+                newfun->getRegion(0).front().insertArgument(i, b.getI64Type());
         }
+        if (circ.getOperation() != main)
+            newfun->setAttr("_was_circ", b.getUnitAttr());
+        if (summarized)
+            newfun->setAttr("_summarized", b.getUnitAttr());
         circ.erase();
     }
 
+    // the cost model is only loaded once and shared with all clones of this pass
+    LogicalResult loadCostModel() {
+        SmallVector<StringRef, 4> names;
+        StringRef(options.metrics).split(names, ',', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+        std::vector<std::string> metrics;
+        for (StringRef name : names)
+            metrics.push_back(name.trim().str());
+        if (metrics.empty()) {
+            module.emitError() << "no resource metrics selected";
+            return failure();
+        }
+        auto model = quantum::CostModel::load(options.costModel, metrics);
+        if (!model) {
+            module.emitError() << llvm::toString(model.takeError());
+            return failure();
+        }
+        costModel = std::make_shared<const quantum::CostModel>(std::move(*model));
+        return success();
+    }
+
     void fold(ModuleOp &module) {
-        OwningRewritePatternList patterns;
-        ControlOp::getCanonicalizationPatterns(patterns, module.getContext());
-        AdjointOp::getCanonicalizationPatterns(patterns, module.getContext());
-        ApplyCircOp::getCanonicalizationPatterns(patterns, module.getContext());
-        CombineStatOp::getCanonicalizationPatterns(patterns, module.getContext());
-        CombineDynOp::getCanonicalizationPatterns(patterns, module.getContext());
-        CircuitValueOp::getCanonicalizationPatterns(patterns, module.getContext());
-        applyPatternsAndFoldGreedily(module, patterns);
+        // the pattern list is only built once and shared with all clones of this pass
+        MLIRContext *context = module.getContext();
+        if (!foldPatterns || foldContext != context) {
+            auto patterns = std::make_shared<OwningRewritePatternList>();
+            ControlOp::getCanonicalizationPatterns(*patterns, context);
+            AdjointOp::getCanonicalizationPatterns(*patterns, context);
+            ApplyCircOp::getCanonicalizationPatterns(*patterns, context);
+            CombineStatOp::getCanonicalizationPatterns(*patterns, context);
+            CombineDynOp::getCanonicalizationPatterns(*patterns, context);
+            CircuitValueOp::getCanonicalizationPatterns(*patterns, context);
+            foldPatterns = patterns;
+            foldContext = context;
+        }
+        applyPatternsAndFoldGreedily(module, *foldPatterns);
     }
 
     void stripCall(OpBuilder &b, CallOp call) {
@@ -694,18 +1478,26 @@ private:
         }
 
         // make final addition of local counter to input arg
-        Value R = func.getArgument(0);
-        Value T = func.getArgument(1);
+        if (func.getAttr("_summarized"))
+            return;
         for (auto &block : func.getBlocks()) {
             Operation *term = block.getTerminator();
             if (isa<ReturnOp>(term)) {
                 b.setInsertionPoint(term);
-                OperationState addState(term->getLoc(), AddIOp::getOperationName());
-                AddIOp::build(b, addState, R, term->getOperand(0));
-                term->setOperand(0, b.createOperation(addState)->getResult(0));
-                addState = OperationState(term->getLoc(), AddIOp::getOperationName());
-                AddIOp::build(b, addState, T, term->getOperand(1));
-                term->setOperand(1, b.createOperation(addState)->getResult(0));
+                for (unsigned i = 0; i < numMetrics; i++) {
+                    OperationState addState(term->getLoc(), AddIOp::getOperationName());
+                    AddIOp::build(b, addState, func.getArgument(i), term->getOperand(i));
+                    term->setOperand(i, b.createOperation(addState)->getResult(0));
+                }
+                // the local qubit counts are relative to the live qubits on entry
+                if (options.peakQubits) {
+                    Location loc = term->getLoc();
+                    Value liveIn = func.getArgument(numMetrics);
+                    Value peakIn = func.getArgument(numMetrics + 1);
+                    Value peak = createBinOp<AddIOp>(b, loc, liveIn, term->getOperand(numMetrics + 1));
+                    term->setOperand(numMetrics, createBinOp<AddIOp>(b, loc, liveIn, term->getOperand(numMetrics)));
+                    term->setOperand(numMetrics + 1, createMax(b, loc, peakIn, peak));
+                }
             }
         }
     }
@@ -741,9 +1533,24 @@ private:
 
 public:
     void runOnOperation() override {
-        ModuleOp module = getOperation();
+        module = getOperation();
         OpBuilder b(module.getContext());
-        nrec = 0;
+        if (!costModel && failed(loadCostModel()))
+            return signalPassFailure();
+        numMetrics = costModel->getNumMetrics();
+        numCounters = numMetrics + (options.peakQubits ? 2 : 0);
+        hasDepthMetrics = false;
+        for (unsigned i = 0; i < numMetrics; i++)
+            hasDepthMetrics |= costModel->isDepthMetric(i);
+        counting = true;
+        alreadyBuilt.clear();
+        specializations.clear();
+        summaries.clear();
+        unsummarizable.clear();
+        impureCircuits.clear();
+        regSizeArgs.clear();
+        profileIds.clear();
+        profiledCircuits.clear();
 
         // assume all quantum code is within circuit ops
         // start stripping all meta operations from the program
@@ -759,23 +1566,41 @@ public:
         }
 
         // we can propagate controls on circuits starting from program entry point
-        main = module.lookupSymbol("mlir_main");
+        circuits = &getAnalysis<quantum::CircuitUseAnalysis>();
+        main = circuits->lookup("mlir_main").getOperation();
         assert(main && "Need circuit entry point!");
         walkCallTree(b, main, 0);
-        llvm::errs() << "\n -------- nrec = " << nrec << " -------- \n\n";
 
         // TODO: remove unused circuit definitions
 
+        // summaries and side effects need to be complete before any circuit is converted
+        findImpureCircuits();
+        if (options.summarize)
+            for (auto circ : module.getOps<CircuitOp>())
+                getSummary(circ.getName());
+
         // convert gates to resource counter increments, convert circuits to functions
+        // summarized circuits are counted at the call site and don't need any counters
         for (auto &block : module.getBodyRegion()) {
             for (auto &op : llvm::make_early_inc_range(block)) {
                 if (auto circ = dyn_cast<CircuitOp>(op)) {
-                    initialize(b, circ);
+                    bool summarized = lookupSummary(circ.getName());
+                    counting = !summarized;
+                    if (counting)
+                        initialize(b, circ);
+                    if (counting && circ.getOperation() != main)
+                        addRegSizeArgs(b, circ);
                     walkGates(b, &op);
-                    convertCircuit(b, circ, module);
+                    convertCircuit(b, circ, summarized);
+                    numConvertedCircuits++;
+                    if (summarized)
+                        numSummarizedCircuits++;
                 }
             }
         }
+        counting = true;
+        if (options.profile)
+            genProfileInit(b);
 
         fold(module);
 
@@ -801,6 +1626,6 @@ public:
 };
 } // end namespace
 
-std::unique_ptr<Pass> quantum::createResourceCounterPass() {
-    return std::make_unique<ResourceCounterPass>();
+std::unique_ptr<Pass> quantum::createResourceCounterPass(const ResourceCounterOptions &options) {
+    return std::make_unique<ResourceCounterPass>(options);
 }
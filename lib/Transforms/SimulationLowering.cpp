@@ -0,0 +1,519 @@
+#include "mlir/IR/Builders.h"
+#include "mlir/Pass/Pass.h"
+#include "mlir/Dialect/StandardOps/IR/Ops.h"
+#include "mlir/Dialect/SCF/SCF.h"
+
+#include "QuantumDialect.h"
+#include "QuantumSSADialect.h"
+#include "Passes.h"
+
+using namespace mlir;
+using namespace mlir::quantumssa;
+
+
+//===------------------------------------------------------------------------------------------===//
+// Lowering to the state-vector simulator runtime
+//===------------------------------------------------------------------------------------------===//
+
+namespace {
+
+bool isQSSAType(Type ty) {
+    return ty.isa<QstateType>() || ty.isa<RstateType>();
+}
+
+// Lower all QuantumSSA operations to calls into the qsim runtime library (see run-jit/lib).
+// Qubit and register states are replaced by i64 handles, as quantum operations update the
+// simulator state in place. Control modifiers push a frame of control qubits in the runtime
+// for the duration of the controlled operation, so controlled circuits need no specialization.
+struct SimulationLoweringPass : public OperationPass<ModuleOp> {
+    SimulationLoweringPass()
+        : OperationPass<ModuleOp>(TypeID::get<SimulationLoweringPass>()) {}
+    SimulationLoweringPass(const SimulationLoweringPass &)
+        : OperationPass<ModuleOp>(TypeID::get<SimulationLoweringPass>()) {}
+
+    StringRef getName() const override {
+        return "SimulationLoweringPass";
+    }
+
+    std::unique_ptr<Pass> clonePass() const override {
+        return std::make_unique<SimulationLoweringPass>(*this);
+    }
+
+    void getDependentDialects(DialectRegistry &registry) const override {
+        registry.insert<StandardOpsDialect,
+                        scf::SCFDialect>();
+    }
+
+private:
+    ModuleOp module;
+
+    // a lowered quantum operand, with the kind of state it held
+    struct Target {
+        Value handle;
+        bool isReg;
+    };
+
+    Type convertType(OpBuilder &b, Type ty) {
+        return isQSSAType(ty) ? b.getI64Type() : ty;
+    }
+
+    void convertTypes(OpBuilder &b, TypeRange types, SmallVectorImpl<Type> &converted) {
+        for (Type ty : types)
+            converted.push_back(convertType(b, ty));
+    }
+
+    // declare the runtime function on first use
+    void declareRuntimeFunc(OpBuilder &b, Location loc, StringRef name, TypeRange args,
+                            ArrayRef<Type> results) {
+        if (module.lookupSymbol(name))
+            return;
+
+        OpBuilder::InsertionGuard guard(b);
+        b.setInsertionPointToStart(module.getBody());
+        OperationState funcState(loc, FuncOp::getOperationName());
+        FuncOp::build(b, funcState, name, b.getFunctionType(args, results));
+        b.createOperation(funcState);
+    }
+
+    Value createRuntimeCall(OpBuilder &b, Location loc, StringRef name, ValueRange args,
+                            ArrayRef<Type> results = {}) {
+        SmallVector<Type, 2> argTypes(args.getTypes());
+        declareRuntimeFunc(b, loc, name, argTypes, results);
+
+        OperationState callState(loc, CallOp::getOperationName());
+        CallOp::build(b, callState, name, results, args);
+        Operation *call = b.createOperation(callState);
+        return call->getNumResults() ? call->getResult(0) : nullptr;
+    }
+
+    Value createI64(OpBuilder &b, Location loc, int64_t val) {
+        OperationState constState(loc, ConstantOp::getOperationName());
+        ConstantOp::build(b, constState, b.getI64IntegerAttr(val));
+        return b.createOperation(constState)->getResult(0);
+    }
+
+    Value castIndex(OpBuilder &b, Location loc, Value idx, Type ty) {
+        OperationState castState(loc, IndexCastOp::getOperationName());
+        IndexCastOp::build(b, castState, idx, ty);
+        return b.createOperation(castState)->getResult(0);
+    }
+
+    Value negate(OpBuilder &b, Location loc, Value phi) {
+        OperationState negState(loc, NegFOp::getOperationName());
+        NegFOp::build(b, negState, phi);
+        return b.createOperation(negState)->getResult(0);
+    }
+
+    // emit the runtime call for a single gate, rotations are inverted for adjoints
+    LogicalResult emitGate(OpBuilder &b, Location loc, Operation *gate, ArrayRef<Target> targets,
+                           bool adjoint) {
+        StringRef suffix = targets.back().isReg ? "_reg" : "";
+
+        if (isa<HOp>(gate) || isa<XOp>(gate)) {
+            std::string name = (isa<HOp>(gate) ? "qsim_h" : "qsim_x") + suffix.str();
+            createRuntimeCall(b, loc, name, targets[0].handle);
+        } else if (isa<RzOp>(gate) || isa<ROp>(gate)) {
+            Value phi = gate->getOperand(0);
+            if (!phi.getType().isF64())
+                return gate->emitError("simulation only supports f64 rotation angles");
+            if (adjoint)
+                phi = negate(b, loc, phi);
+            std::string name = (isa<RzOp>(gate) ? "qsim_rz" : "qsim_r") + suffix.str();
+            createRuntimeCall(b, loc, name, {targets[0].handle, phi});
+        } else if (isa<CNotOp>(gate)) {
+            std::string name = "qsim_cx" + suffix.str();
+            createRuntimeCall(b, loc, name, {targets[0].handle, targets[1].handle});
+        } else if (isa<SwapOp>(gate)) {
+            createRuntimeCall(b, loc, "qsim_swap", {targets[0].handle, targets[1].handle});
+        } else {
+            return gate->emitError("unsupported operation in simulation lowering");
+        }
+        return success();
+    }
+
+    void beginControl(OpBuilder &b, Location loc, Value ctrls, Type ctrlType) {
+        StringRef name = ctrlType.isa<RstateType>() ? "qsim_ctrl_reg_begin" : "qsim_ctrl_begin";
+        createRuntimeCall(b, loc, name, ctrls);
+    }
+
+    // Apply the held operation `op` to `args` (the full callee operands for circuits, of which
+    // `targets` are the quantum ones), and collect the updated quantum handles in `results`.
+    LogicalResult applyHeld(OpBuilder &b, Location loc, Value op, ArrayRef<Target> targets,
+                            ValueRange args, bool adjoint, SmallVectorImpl<Value> &results) {
+        Operation *def = op.getDefiningOp();
+        if (!def)
+            return emitError(loc, "cannot simulate quantum operation passed as block argument");
+
+        if (auto ctrl = dyn_cast<ControlOp>(def)) {
+            beginControl(b, loc, ctrl.ctrls(), ctrl.new_ctrls().getType());
+            if (failed(applyHeld(b, loc, ctrl.heldOp(), targets, args, adjoint, results)))
+                return failure();
+            createRuntimeCall(b, loc, "qsim_ctrl_end", {});
+            return success();
+        }
+
+        if (auto adj = dyn_cast<AdjointOp>(def))
+            return applyHeld(b, loc, adj.heldOp(), targets, args, !adjoint, results);
+
+        if (auto getval = dyn_cast<CircuitValueOp>(def)) {
+            if (adjoint)
+                return emitError(loc, "simulation of adjoint circuits requires materializing them first (materialize-adj)");
+
+            // all circuits have been converted to functions on handles at this point
+            auto func = module.lookupSymbol<FuncOp>(getval.circref());
+            SmallVector<Type, 4> resTypes(func.getType().getResults());
+
+            OperationState callState(loc, CallOp::getOperationName());
+            CallOp::build(b, callState, getval.circref(), resTypes, args);
+            Operation *call = b.createOperation(callState);
+            results.append(call->result_begin(), call->result_end());
+            return success();
+        }
+
+        if (failed(emitGate(b, loc, def, targets, adjoint)))
+            return failure();
+        for (const Target &t : targets)
+            results.push_back(t.handle);
+        return success();
+    }
+
+    LogicalResult convertExtract(OpBuilder &b, ExtractOp extr) {
+        Location loc = extr.getLoc();
+        Value reg = extr.reg();
+
+        // look up all qubits first, as indices refer to the input register
+        SmallVector<Value, 4> qubits;
+        if (extr.const_idx()) {
+            for (Attribute idx : *extr.const_idx())
+                qubits.push_back(createRuntimeCall(b, loc, "qsim_reg_get",
+                                                   {reg, createI64(b, loc, idx.cast<IntegerAttr>().getInt())},
+                                                   b.getI64Type()));
+        } else {
+            for (Value idx : extr.dyn_idx())
+                qubits.push_back(createRuntimeCall(b, loc, "qsim_reg_get",
+                                                   {reg, castIndex(b, loc, idx, b.getI64Type())},
+                                                   b.getI64Type()));
+        }
+        for (Value q : qubits)
+            createRuntimeCall(b, loc, "qsim_reg_erase", {reg, q});
+
+        for (auto it : llvm::zip(extr.qbs(), qubits))
+            std::get<0>(it).replaceAllUsesWith(std::get<1>(it));
+        extr.rem().replaceAllUsesWith(reg);
+        return success();
+    }
+
+    LogicalResult convertCombine(OpBuilder &b, CombineStatOp comb) {
+        Location loc = comb.getLoc();
+        Value reg = comb.reg();
+
+        // insertion points refer to the final register, so insert in ascending order
+        SmallVector<std::pair<int64_t, Value>, 4> inserts;
+        for (auto it : llvm::zip(comb.const_idx(), comb.qbs()))
+            inserts.emplace_back(std::get<0>(it).cast<IntegerAttr>().getInt(), std::get<1>(it));
+        llvm::sort(inserts, [](const std::pair<int64_t, Value> &lhs,
+                               const std::pair<int64_t, Value> &rhs) {
+            return lhs.first < rhs.first;
+        });
+        for (auto &insert : inserts)
+            createRuntimeCall(b, loc, "qsim_reg_insert",
+                              {reg, createI64(b, loc, insert.first), insert.second});
+
+        comb.newreg().replaceAllUsesWith(reg);
+        return success();
+    }
+
+    LogicalResult convertMeasurement(OpBuilder &b, MeasurementOp meas) {
+        Location loc = meas.getLoc();
+        Value qbs = meas.qbs();
+
+        if (meas.qbs_out().getType().isa<QstateType>()) {
+            Value res = createRuntimeCall(b, loc, "qsim_meas", qbs, b.getI1Type());
+            meas.res().replaceAllUsesWith(res);
+            meas.qbs_out().replaceAllUsesWith(qbs);
+            return success();
+        }
+
+        // measure every qubit of the register into the result memref
+        MemRefType memrefType = meas.res().getType().cast<MemRefType>();
+        Value size = createRuntimeCall(b, loc, "qsim_reg_size", qbs, b.getI64Type());
+        Value sizeIdx = castIndex(b, loc, size, b.getIndexType());
+
+        SmallVector<Value, 1> dynSizes;
+        if (memrefType.isDynamicDim(0))
+            dynSizes.push_back(sizeIdx);
+        OperationState allocState(loc, AllocOp::getOperationName());
+        AllocOp::build(b, allocState, memrefType, dynSizes);
+        Value memref = b.createOperation(allocState)->getResult(0);
+
+        OperationState zeroState(loc, ConstantIndexOp::getOperationName());
+        ConstantIndexOp::build(b, zeroState, 0);
+        Value zero = b.createOperation(zeroState)->getResult(0);
+        OperationState oneState(loc, ConstantIndexOp::getOperationName());
+        ConstantIndexOp::build(b, oneState, 1);
+        Value one = b.createOperation(oneState)->getResult(0);
+
+        OperationState forState(loc, scf::ForOp::getOperationName());
+        scf::ForOp::build(b, forState, zero, sizeIdx, one, ValueRange());
+        auto forOp = cast<scf::ForOp>(b.createOperation(forState));
+
+        OpBuilder::InsertionGuard guard(b);
+        b.setInsertionPointToStart(forOp.getBody());
+        Value idx = castIndex(b, loc, forOp.getInductionVar(), b.getI64Type());
+        Value q = createRuntimeCall(b, loc, "qsim_reg_get", {qbs, idx}, b.getI64Type());
+        Value bit = createRuntimeCall(b, loc, "qsim_meas", q, b.getI1Type());
+        OperationState storeState(loc, StoreOp::getOperationName());
+        StoreOp::build(b, storeState, bit, memref, forOp.getInductionVar());
+        b.createOperation(storeState);
+
+        meas.res().replaceAllUsesWith(memref);
+        meas.qbs_out().replaceAllUsesWith(qbs);
+        return success();
+    }
+
+    void createStore(OpBuilder &b, Location loc, Value val, Value memref, int64_t idx) {
+        OperationState idxState(loc, ConstantIndexOp::getOperationName());
+        ConstantIndexOp::build(b, idxState, idx);
+        Value idxVal = b.createOperation(idxState)->getResult(0);
+        OperationState storeState(loc, StoreOp::getOperationName());
+        StoreOp::build(b, storeState, val, memref, idxVal);
+        b.createOperation(storeState);
+    }
+
+    Value createAlloca(OpBuilder &b, Location loc, int64_t size, Type elementType) {
+        OperationState allocState(loc, AllocaOp::getOperationName());
+        AllocaOp::build(b, allocState, MemRefType::get({size}, elementType));
+        return b.createOperation(allocState)->getResult(0);
+    }
+
+    // fused unitaries pass their qubits & matrix to the runtime as memrefs, with the constant
+    // matrix stored once at function entry so that it isn't rebuilt inside loops
+    LogicalResult convertFused(OpBuilder &b, FusedOp fused) {
+        Location loc = fused.getLoc();
+        int64_t numQubits = fused.qbs().size();
+        if (numQubits > 5)
+            return fused.emitError("simulation only supports fused unitaries on up to 5 qubits");
+
+        Value matrix, qubits;
+        {
+            OpBuilder::InsertionGuard guard(b);
+            b.setInsertionPointToStart(&fused.getParentOfType<FuncOp>().front());
+            DenseElementsAttr matrixAttr = fused.matrix();
+            matrix = createAlloca(b, loc, matrixAttr.getNumElements(), b.getF64Type());
+            int64_t idx = 0;
+            for (APFloat val : matrixAttr.getFloatValues()) {
+                OperationState cstState(loc, ConstantFloatOp::getOperationName());
+                ConstantFloatOp::build(b, cstState, val, b.getF64Type());
+                createStore(b, loc, b.createOperation(cstState)->getResult(0), matrix, idx++);
+            }
+            qubits = createAlloca(b, loc, numQubits, b.getI64Type());
+        }
+
+        for (auto qb : llvm::enumerate(fused.qbs()))
+            createStore(b, loc, qb.value(), qubits, qb.index());
+        createRuntimeCall(b, loc, "qsim_unitary", {qubits, matrix});
+
+        fused.replaceAllUsesWith(fused.qbs());
+        return success();
+    }
+
+    // lower a single quantum operation, `replaced` is cleared for held ops that stay alive
+    LogicalResult convertOp(OpBuilder &b, Operation *op, bool &replaced) {
+        Location loc = op->getLoc();
+        b.setInsertionPoint(op);
+        replaced = true;
+
+        if (isa<AllocOp>(op)) {
+            op->getResult(0).replaceAllUsesWith(createRuntimeCall(b, loc, "qsim_alloc", {},
+                                                                  b.getI64Type()));
+        } else if (auto alloc = dyn_cast<AllocRegOp>(op)) {
+            Value size = alloc.size() ? castIndex(b, loc, alloc.size(), b.getI64Type())
+                                      : createI64(b, loc, (*alloc.static_size()).getSExtValue());
+            alloc.getResult().replaceAllUsesWith(createRuntimeCall(b, loc, "qsim_allocreg", size,
+                                                                   b.getI64Type()));
+        } else if (isa<FreeOp>(op)) {
+            createRuntimeCall(b, loc, "qsim_free", op->getOperand(0));
+        } else if (isa<FreeRegOp>(op)) {
+            createRuntimeCall(b, loc, "qsim_freereg", op->getOperand(0));
+        } else if (auto reset = dyn_cast<ResetOp>(op)) {
+            bool isReg = reset.qbs().getType().isa<RstateType>();
+            createRuntimeCall(b, loc, isReg ? "qsim_resetreg" : "qsim_reset", reset.qbs());
+            reset.res().replaceAllUsesWith(reset.qbs());
+        } else if (isa<CastRegOp>(op)) {
+            op->getResult(0).replaceAllUsesWith(op->getOperand(0));
+        } else if (auto extr = dyn_cast<ExtractOp>(op)) {
+            return convertExtract(b, extr);
+        } else if (auto comb = dyn_cast<CombineStatOp>(op)) {
+            return convertCombine(b, comb);
+        } else if (auto comb = dyn_cast<CombineDynOp>(op)) {
+            // dynamic insertion points are expected in ascending order
+            for (auto it : llvm::zip(comb.dyn_idx(), comb.qbs()))
+                createRuntimeCall(b, loc, "qsim_reg_insert",
+                                  {comb.reg(), castIndex(b, loc, std::get<0>(it), b.getI64Type()),
+                                   std::get<1>(it)});
+            op->getResult(0).replaceAllUsesWith(comb.reg());
+        } else if (auto meas = dyn_cast<MeasurementOp>(op)) {
+            return convertMeasurement(b, meas);
+        } else if (auto ctrl = dyn_cast<ControlOp>(op)) {
+            // the controls of held ops pass through unchanged until the op is applied
+            if (!ctrl.qbs()) {
+                ctrl.new_ctrls().replaceAllUsesWith(ctrl.ctrls());
+                if (ctrl.qbs2())
+                    ctrl.new_qbs2().replaceAllUsesWith(ctrl.qbs2());
+                replaced = false;
+                return success();
+            }
+
+            SmallVector<Target, 2> targets;
+            if (ctrl.qbs2())
+                targets.push_back({ctrl.qbs2(), false});
+            targets.push_back({ctrl.qbs(), ctrl.res().getType().isa<RstateType>()});
+            SmallVector<Value, 2> args, results;
+            for (const Target &t : targets)
+                args.push_back(t.handle);
+
+            beginControl(b, loc, ctrl.ctrls(), ctrl.new_ctrls().getType());
+            if (failed(applyHeld(b, loc, ctrl.heldOp(), targets, args, false, results)))
+                return failure();
+            createRuntimeCall(b, loc, "qsim_ctrl_end", {});
+
+            ctrl.new_ctrls().replaceAllUsesWith(ctrl.ctrls());
+            if (ctrl.qbs2())
+                ctrl.new_qbs2().replaceAllUsesWith(results.front());
+            ctrl.res().replaceAllUsesWith(results.back());
+        } else if (auto adj = dyn_cast<AdjointOp>(op)) {
+            if (!adj.qbs()) {
+                replaced = false;
+                return success();
+            }
+
+            SmallVector<Target, 2> targets;
+            if (adj.qbs2())
+                targets.push_back({adj.qbs2(), false});
+            targets.push_back({adj.qbs(), adj.res().getType().isa<RstateType>()});
+            SmallVector<Value, 2> args, results;
+            for (const Target &t : targets)
+                args.push_back(t.handle);
+
+            if (failed(applyHeld(b, loc, adj.heldOp(), targets, args, true, results)))
+                return failure();
+
+            if (adj.qbs2())
+                adj.new_qbs2().replaceAllUsesWith(results.front());
+            adj.res().replaceAllUsesWith(results.back());
+        } else if (auto apply = dyn_cast<ApplyCircOp>(op)) {
+            SmallVector<Value, 4> results;
+            if (failed(applyHeld(b, loc, apply.circval(), {}, apply.args(), false, results)))
+                return failure();
+            op->replaceAllUsesWith(results);
+        } else if (auto call = dyn_cast<CallCircOp>(op)) {
+            SmallVector<Type, 4> resTypes;
+            convertTypes(b, call.getResultTypes(), resTypes);
+            OperationState callState(loc, CallOp::getOperationName());
+            CallOp::build(b, callState, call.circref(), resTypes, call.args());
+            op->replaceAllUsesWith(b.createOperation(callState)->getResults());
+        } else if (isa<ReturnStateOp>(op)) {
+            OperationState retState(loc, ReturnOp::getOperationName());
+            ReturnOp::build(b, retState, op->getOperands());
+            b.createOperation(retState);
+        } else if (auto fused = dyn_cast<FusedOp>(op)) {
+            return convertFused(b, fused);
+        } else if (op->hasTrait<OpTrait::UnitaryTrait>()) {
+            // gates on hold are applied later through a meta operation
+            if (!isQSSAType(op->getResults().back().getType())) {
+                replaced = false;
+                return success();
+            }
+
+            SmallVector<Target, 2> targets;
+            for (auto it : llvm::zip(op->getOperands().take_back(op->getNumResults()), op->getResults()))
+                targets.push_back({std::get<0>(it), std::get<1>(it).getType().isa<RstateType>()});
+            if (failed(emitGate(b, loc, op, targets, false)))
+                return failure();
+            for (auto it : llvm::zip(op->getResults(), targets))
+                std::get<0>(it).replaceAllUsesWith(std::get<1>(it).handle);
+        } else if (isa<CircuitValueOp>(op)) {
+            replaced = false;
+        } else {
+            return op->emitError("unsupported operation in simulation lowering");
+        }
+        return success();
+    }
+
+    LogicalResult walkOps(OpBuilder &b, Operation *op) {
+        for (auto &region : op->getRegions()) {
+            for (auto &block : region) {
+                for (auto &nestedOp : llvm::make_early_inc_range(block)) {
+                    // qdata carried by control flow is carried as handles instead
+                    if (isa<scf::ForOp>(nestedOp) || isa<scf::IfOp>(nestedOp)) {
+                        for (Value res : nestedOp.getResults())
+                            res.setType(convertType(b, res.getType()));
+                        if (auto forOp = dyn_cast<scf::ForOp>(nestedOp))
+                            for (Value arg : forOp.getRegionIterArgs())
+                                arg.setType(convertType(b, arg.getType()));
+                    }
+
+                    if (isa<QuantumSSADialect>(nestedOp.getDialect())) {
+                        bool replaced;
+                        if (failed(convertOp(b, &nestedOp, replaced)))
+                            return failure();
+                        if (replaced)
+                            nestedOp.erase();
+                    } else if (failed(walkOps(b, &nestedOp))) {
+                        return failure();
+                    }
+                }
+            }
+        }
+        return success();
+    }
+
+    void convertCircuit(OpBuilder &b, CircuitOp circ) {
+        SmallVector<Type, 4> argTypes, resTypes;
+        convertTypes(b, circ.getType().getInputs(), argTypes);
+        convertTypes(b, circ.getType().getResults(), resTypes);
+
+        b.setInsertionPoint(circ);
+        OperationState funcState(circ.getLoc(), FuncOp::getOperationName());
+        FuncOp::build(b, funcState, circ.getName(), b.getFunctionType(argTypes, resTypes));
+        Operation *func = b.createOperation(funcState);
+
+        func->getRegion(0).takeBody(circ.gates());
+        for (BlockArgument arg : func->getRegion(0).getArguments())
+            arg.setType(convertType(b, arg.getType()));
+        circ.erase();
+    }
+
+public:
+    void runOnOperation() override {
+        module = getOperation();
+        OpBuilder b(module.getContext());
+
+        // circuits become functions on handles, so that their bodies can be lowered in place
+        for (auto circ : llvm::make_early_inc_range(module.getOps<CircuitOp>()))
+            convertCircuit(b, circ);
+
+        for (auto func : llvm::make_early_inc_range(module.getOps<FuncOp>()))
+            if (failed(walkOps(b, func)))
+                return signalPassFailure();
+
+        // only ops that were held (and applied through meta ops) are left, users first
+        SmallVector<Operation*, 16> heldOps;
+        module.walk([&](Operation *op) {
+            if (isa<QuantumSSADialect>(op->getDialect()))
+                heldOps.push_back(op);
+        });
+        for (Operation *op : llvm::reverse(heldOps)) {
+            if (!op->use_empty()) {
+                op->emitError("quantum operation still in use after simulation lowering");
+                return signalPassFailure();
+            }
+            op->erase();
+        }
+    }
+};
+} // end anonymous namespace
+
+std::unique_ptr<Pass> quantum::createSimulationLoweringPass() {
+    return std::make_unique<SimulationLoweringPass>();
+}
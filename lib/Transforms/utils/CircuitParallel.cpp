@@ -0,0 +1,29 @@
+#include "mlir/IR/Diagnostics.h"
+#include "mlir/IR/MLIRContext.h"
+#include "llvm/Support/Parallel.h"
+
+#include "CircuitParallel.h"
+
+using namespace mlir;
+using namespace mlir::quantum;
+using namespace mlir::quantumssa;
+
+void quantum::forEachCircuitParallel(ArrayRef<CircuitOp> circuits, function_ref<void(size_t index)> fn) {
+    if (circuits.empty())
+        return;
+
+    MLIRContext *context = circuits.front().getContext();
+    if (!context->isMultithreadingEnabled()) {
+        for (size_t index = 0; index < circuits.size(); index++)
+            fn(index);
+        return;
+    }
+
+    ParallelDiagnosticHandler diagHandler(context);
+    llvm::parallelForEachN(0, circuits.size(), [&](size_t index) {
+        diagHandler.setOrderIDForThread(index);
+        fn(index);
+        // the thread may be reused for another context
+        diagHandler.eraseOrderIDForThread();
+    });
+}
@@ -0,0 +1,73 @@
+#include "mlir/IR/BlockAndValueMapping.h"
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/SymbolTable.h"
+
+#include "CircuitSpecialization.h"
+
+using namespace mlir;
+using namespace mlir::quantum;
+
+namespace {
+
+using AmendFn = llvm::function_ref<void(Operation *op, NamedAttrList &attrs)>;
+
+void cloneRegion(Region &src, Region &dest, BlockAndValueMapping &mapper, AmendFn amendAttrs);
+
+Operation* cloneOp(Operation *op, BlockAndValueMapping &mapper, AmendFn amendAttrs) {
+    OperationState state(op->getLoc(), op->getName());
+    state.operands.reserve(op->getNumOperands());
+    for (Value operand : op->getOperands())
+        state.operands.push_back(mapper.lookupOrDefault(operand));
+    state.types.append(op->result_type_begin(), op->result_type_end());
+    for (Block *succ : op->getSuccessors())
+        state.successors.push_back(mapper.lookupOrDefault(succ));
+    for (unsigned i = 0, e = op->getNumRegions(); i < e; i++)
+        state.addRegion();
+    state.addAttributes(op->getAttrs());
+    amendAttrs(op, state.attributes);
+
+    Operation *clone = Operation::create(state);
+    for (unsigned i = 0, e = op->getNumResults(); i < e; i++)
+        mapper.map(op->getResult(i), clone->getResult(i));
+    for (unsigned i = 0, e = op->getNumRegions(); i < e; i++)
+        cloneRegion(op->getRegion(i), clone->getRegion(i), mapper, amendAttrs);
+    return clone;
+}
+
+void cloneRegion(Region &src, Region &dest, BlockAndValueMapping &mapper, AmendFn amendAttrs) {
+    // blocks first, branches can target any block of the region
+    for (Block &block : src) {
+        Block *newBlock = new Block();
+        for (BlockArgument arg : block.getArguments())
+            mapper.map(arg, newBlock->addArgument(arg.getType()));
+        dest.push_back(newBlock);
+        mapper.map(&block, newBlock);
+    }
+
+    auto newBlockIt = dest.begin();
+    for (Block &block : src) {
+        Block &newBlock = *newBlockIt++;
+        for (Operation &op : block)
+            newBlock.push_back(cloneOp(&op, mapper, amendAttrs));
+    }
+
+    // in a CFG, a value can be used in a block preceding its definition in the region
+    if (!llvm::hasSingleElement(src)) {
+        dest.walk([&](Operation *op) {
+            for (OpOperand &operand : op->getOpOperands())
+                operand.set(mapper.lookupOrDefault(operand.get()));
+        });
+    }
+}
+
+} // end anonymous namespace
+
+Operation* quantum::cloneSpecialized(Operation *circ, StringRef name, AmendFn amendAttrs) {
+    BlockAndValueMapping mapper;
+    StringAttr nameAttr = StringAttr::get(name, circ->getContext());
+    return cloneOp(circ, mapper, [&](Operation *op, NamedAttrList &attrs) {
+        if (op == circ)
+            attrs.set(SymbolTable::getSymbolAttrName(), nameAttr);
+        amendAttrs(op, attrs);
+    });
+}
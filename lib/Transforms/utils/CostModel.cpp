@@ -0,0 +1,146 @@
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "CostModel.h"
+
+#include <algorithm>
+
+using namespace mlir::quantum;
+
+namespace {
+
+llvm::Error makeError(const llvm::Twine &msg) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(), "cost model: " + msg);
+}
+
+struct DefaultCost {
+    const char *gate;
+    // cost with 0, 1, 2 controls and per further control, for R, T, CNOT, T-depth, depth
+    int64_t cost[5][4];
+};
+
+const DefaultCost defaultCosts[] = {
+    {"R",    {{1, 3, 5, 0}, {0, 0, 14, 14}, {0, 2, 14, 12}, {0, 0, 6, 6}, {1, 1, 1, 0}}},
+    // uncontrolled RZ rotations are assumed to be merged into neighbouring R rotations
+    {"RZ",   {{0, 3, 5, 0}, {0, 0, 14, 14}, {0, 2, 14, 12}, {0, 0, 6, 6}, {1, 1, 1, 0}}},
+    {"H",    {{0, 2, 2, 0}, {0, 0, 14, 14}, {0, 1, 13, 12}, {0, 0, 6, 6}, {1, 1, 1, 0}}},
+    {"X",    {{0, 0, 0, 0}, {0, 0, 7, 14},  {0, 1, 6, 12},  {0, 0, 3, 6}, {1, 1, 1, 0}}},
+    // the own control of a CNOT is not included in the control count
+    {"CX",   {{0, 0, 0, 0}, {0, 7, 21, 14}, {1, 6, 18, 12}, {0, 3, 9, 6}, {1, 1, 1, 0}}},
+    {"SWAP", {{0, 0, 0, 0}, {0, 7, 21, 14}, {3, 8, 20, 12}, {0, 3, 9, 6}, {1, 1, 1, 0}}},
+};
+
+} // end anonymous namespace
+
+CostModel CostModel::getDefault() {
+    CostModel model;
+    model.metrics = {"R", "T", "CNOT", "T-depth", "depth"};
+    for (const DefaultCost &entry : defaultCosts) {
+        auto &costs = model.gates[entry.gate];
+        for (auto &metric : entry.cost)
+            costs.push_back({{metric[0], metric[1], metric[2]}, metric[3]});
+    }
+    return model;
+}
+
+llvm::Expected<CostModel> CostModel::parse(llvm::StringRef json) {
+    llvm::Expected<llvm::json::Value> root = llvm::json::parse(json);
+    if (!root)
+        return root.takeError();
+
+    const llvm::json::Object *object = root->getAsObject();
+    const llvm::json::Array *metrics = object ? object->getArray("metrics") : nullptr;
+    const llvm::json::Object *gates = object ? object->getObject("gates") : nullptr;
+    if (!metrics || !gates)
+        return makeError("expected an object with a \"metrics\" array and a \"gates\" object");
+
+    CostModel model;
+    for (const llvm::json::Value &metric : *metrics) {
+        llvm::Optional<llvm::StringRef> name = metric.getAsString();
+        if (!name)
+            return makeError("metric names must be strings");
+        model.metrics.push_back(name->str());
+    }
+
+    // every gate maps metrics to [0 controls, 1 control, 2 controls, per further control]
+    for (const auto &gate : *gates) {
+        const llvm::json::Object *costs = gate.second.getAsObject();
+        if (!costs)
+            return makeError("expected an object of metrics for gate " + gate.first.str());
+
+        auto &gateCosts = model.gates[gate.first.str()];
+        gateCosts.resize(model.metrics.size(), {{0, 0, 0}, 0});
+        for (const auto &cost : *costs) {
+            auto metricIt = std::find(model.metrics.begin(), model.metrics.end(), cost.first.str());
+            if (metricIt == model.metrics.end())
+                return makeError("unknown metric " + cost.first.str() + " for gate " + gate.first.str());
+
+            const llvm::json::Array *values = cost.second.getAsArray();
+            if (!values || values->size() != 4)
+                return makeError("expected 4 costs (0, 1, 2 and each further control) for " +
+                                 cost.first.str() + " of gate " + gate.first.str());
+            int64_t parsed[4];
+            for (unsigned i = 0; i < 4; i++) {
+                llvm::Optional<int64_t> value = (*values)[i].getAsInteger();
+                if (!value)
+                    return makeError("costs must be integers, in " + cost.first.str() + " of gate " +
+                                     gate.first.str());
+                parsed[i] = *value;
+            }
+            gateCosts[metricIt - model.metrics.begin()] = {{parsed[0], parsed[1], parsed[2]}, parsed[3]};
+        }
+    }
+    return std::move(model);
+}
+
+llvm::Expected<CostModel> CostModel::loadFile(llvm::StringRef path) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (std::error_code EC = buffer.getError())
+        return makeError("could not open " + path + ": " + EC.message());
+    return parse((*buffer)->getBuffer());
+}
+
+llvm::Expected<CostModel> CostModel::load(llvm::StringRef path, llvm::ArrayRef<std::string> metrics) {
+    CostModel model = getDefault();
+    if (!path.empty()) {
+        auto loaded = loadFile(path);
+        if (!loaded)
+            return loaded.takeError();
+        model = std::move(*loaded);
+    }
+    if (llvm::Error error = model.selectMetrics(metrics))
+        return std::move(error);
+    return std::move(model);
+}
+
+llvm::Error CostModel::selectMetrics(llvm::ArrayRef<std::string> names) {
+    llvm::SmallVector<unsigned, 4> indices;
+    for (const std::string &name : names) {
+        auto metricIt = std::find(metrics.begin(), metrics.end(), name);
+        if (metricIt == metrics.end())
+            return makeError("unknown metric " + name);
+        indices.push_back(metricIt - metrics.begin());
+    }
+
+    for (auto &gate : gates) {
+        llvm::SmallVector<MetricCost, 4> selected;
+        for (unsigned i : indices)
+            selected.push_back(gate.second[i]);
+        gate.second = std::move(selected);
+    }
+    metrics.assign(names.begin(), names.end());
+    return llvm::Error::success();
+}
+
+void CostModel::getCost(llvm::StringRef gate, int64_t n, llvm::SmallVectorImpl<int64_t> &cost) const {
+    cost.assign(metrics.size(), 0);
+    auto it = gates.find(gate);
+    if (it == gates.end())
+        return;
+
+    int64_t extra = std::max<int64_t>(n - 2, 0);
+    for (unsigned i = 0, e = metrics.size(); i < e; i++) {
+        const MetricCost &metric = it->second[i];
+        cost[i] = metric.controls[n - extra] + extra * metric.extraControl;
+    }
+}
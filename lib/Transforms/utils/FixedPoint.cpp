@@ -0,0 +1,53 @@
+#include "mlir/IR/Attributes.h"
+
+#include "QuantumSSADialect.h"
+#include "FixedPoint.h"
+
+using namespace mlir;
+using namespace mlir::quantum;
+
+static constexpr const char *convergedAttr = "_converged";
+static constexpr const char *changedAttr = "_changed";
+
+bool quantum::isConverged(Operation *circ) {
+    return circ->getAttr(convergedAttr) != nullptr;
+}
+
+void quantum::markChanged(Operation *circ) {
+    circ->setAttr(changedAttr, UnitAttr::get(circ->getContext()));
+}
+
+LogicalResult quantum::runToFixedPoint(PassManager &group, ModuleOp module, unsigned maxRounds,
+                                       unsigned *numRounds) {
+    LogicalResult result = success();
+    unsigned round = 0;
+    while (round < maxRounds) {
+        round++;
+        if (failed(group.run(module))) {
+            result = failure();
+            break;
+        }
+
+        unsigned numChanged = 0;
+        for (auto circ : module.getOps<quantumssa::CircuitOp>()) {
+            if (circ.getAttr(changedAttr)) {
+                circ.removeAttr(changedAttr);
+                circ.removeAttr(convergedAttr);
+                numChanged++;
+            } else {
+                circ.setAttr(convergedAttr, UnitAttr::get(module.getContext()));
+            }
+        }
+        if (!numChanged)
+            break;
+    }
+
+    // the markers are internal to the driver
+    for (auto circ : module.getOps<quantumssa::CircuitOp>()) {
+        circ.removeAttr(convergedAttr);
+        circ.removeAttr(changedAttr);
+    }
+    if (numRounds)
+        *numRounds = round;
+    return result;
+}
@@ -0,0 +1,117 @@
+#include "mlir/IR/Operation.h"
+#include "mlir/Pass/PassInstrumentation.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/JSON.h"
+
+#include "PassReport.h"
+
+using namespace mlir;
+using namespace mlir::quantum;
+
+namespace {
+
+// forwards the pass events of one pass manager to the report
+class PassReportInstrumentation : public PassInstrumentation {
+public:
+    PassReportInstrumentation(PassReport &report, unsigned pipeline)
+        : report(report), pipeline(pipeline) {}
+
+    void runBeforePass(Pass *pass, Operation *op) override {
+        report.beforePass(pipeline, pass, op);
+    }
+
+    void runAfterPass(Pass *pass, Operation *op) override {
+        report.afterPass(pipeline, pass, op, /*failed=*/false);
+    }
+
+    void runAfterPassFailed(Pass *pass, Operation *op) override {
+        report.afterPass(pipeline, pass, op, /*failed=*/true);
+    }
+
+private:
+    PassReport &report;
+    unsigned pipeline;
+};
+
+uint64_t countOps(Operation *root) {
+    uint64_t count = 0;
+    root->walk([&](Operation *) { count++; });
+    return count;
+}
+
+} // end anonymous namespace
+
+void PassReport::instrument(PassManager &pm) {
+    pm.addInstrumentation(std::make_unique<PassReportInstrumentation>(*this, numPipelines++));
+}
+
+void PassReport::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    records.clear();
+    recordIds.clear();
+    startTimes.clear();
+}
+
+void PassReport::beforePass(unsigned pipeline, Pass *pass, Operation *op) {
+    // count outside of the lock, passes on different ops may run in parallel
+    uint64_t numOps = countOps(op);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    PassKey key(pipeline, pass);
+    auto it = recordIds.try_emplace(key, records.size());
+    if (it.second) {
+        records.emplace_back();
+        records.back().name = pass->getName().str();
+    }
+    records[it.first->second].opsBefore += numOps;
+    startTimes[key] = Clock::now();
+}
+
+void PassReport::afterPass(unsigned pipeline, Pass *pass, Operation *op, bool failed) {
+    Clock::time_point end = Clock::now();
+    // the IR may be left in an invalid state by a failed pass
+    uint64_t numOps = failed ? 0 : countOps(op);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    PassKey key(pipeline, pass);
+    PassRecord &record = records[recordIds.lookup(key)];
+    record.runs++;
+    record.failures += failed;
+    record.opsAfter += numOps;
+    record.seconds += std::chrono::duration<double>(end - startTimes.lookup(key)).count();
+    startTimes.erase(key);
+
+    // statistics are accumulated by the pass itself
+    record.statistics.clear();
+#if LLVM_ENABLE_STATS
+    for (Pass::Statistic *stat : pass->getStatistics())
+        record.statistics.push_back({stat->getName(), stat->getValue()});
+#endif
+}
+
+void PassReport::writeJSON(llvm::raw_ostream &os) const {
+    llvm::json::OStream json(os, /*IndentSize=*/2);
+    writeJSON(json);
+    os << "\n";
+}
+
+void PassReport::writeJSON(llvm::json::OStream &json) const {
+    json.object([&] {
+        json.attributeArray("passes", [&] {
+            for (const PassRecord &record : records) {
+                json.object([&] {
+                    json.attribute("name", record.name);
+                    json.attribute("runs", (int64_t) record.runs);
+                    json.attribute("failures", (int64_t) record.failures);
+                    json.attribute("wall-time-ms", record.seconds * 1000);
+                    json.attribute("ops-before", (int64_t) record.opsBefore);
+                    json.attribute("ops-after", (int64_t) record.opsAfter);
+                    json.attributeObject("statistics", [&] {
+                        for (auto &stat : record.statistics)
+                            json.attribute(stat.first, (int64_t) stat.second);
+                    });
+                });
+            }
+        });
+    });
+}
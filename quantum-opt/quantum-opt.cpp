@@ -1,13 +1,20 @@
 /* Create a quantum-opt program to roundtrip IR examples using the quant dialect */
 
+#include "mlir/IR/Diagnostics.h"
 #include "mlir/IR/Dialect.h"
 #include "mlir/IR/MLIRContext.h"
-#include "mlir/InitAllDialects.h"
-#include "mlir/InitAllPasses.h"
+#include "mlir/IR/AsmState.h"
+#include "mlir/Conversion/Passes.h"
+#include "mlir/Dialect/SCF/SCF.h"
+#include "mlir/Dialect/StandardOps/IR/Ops.h"
+#include "mlir/Dialect/Vector/VectorOps.h"
+#include "mlir/Parser.h"
 #include "mlir/Pass/Pass.h"
 #include "mlir/Pass/PassManager.h"
+#include "mlir/Pass/PassRegistry.h"
 #include "mlir/Support/FileUtilities.h"
 #include "mlir/Support/MlirOptMain.h"
+#include "mlir/Transforms/Passes.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/SourceMgr.h"
@@ -16,34 +23,94 @@
 #include "QuantumDialect.h"
 #include "QuantumSSADialect.h"
 #include "Passes.h"
+#include "Bytecode.h"
+#include "PassReport.h"
+
+static llvm::cl::opt<std::string> inputFilename(llvm::cl::Positional, llvm::cl::desc("<input file>"),
+                                                llvm::cl::init("-"));
+static llvm::cl::opt<std::string> outputFilename("o", llvm::cl::desc("Output filename"),
+                                                 llvm::cl::value_desc("filename"), llvm::cl::init("-"));
+static llvm::cl::opt<bool> splitInputFile("split-input-file",
+    llvm::cl::desc("Split the input file into pieces and process each chunk independently"));
+static llvm::cl::opt<bool> verifyDiagnostics("verify-diagnostics",
+    llvm::cl::desc("Check that emitted diagnostics match expected-* lines on the corresponding line"));
+static llvm::cl::opt<bool> verifyPasses("verify-each", llvm::cl::desc("Run the verifier after each transformation pass"),
+                                        llvm::cl::init(true));
+static llvm::cl::opt<bool> allowUnregisteredDialects("allow-unregistered-dialect",
+    llvm::cl::desc("Allow operation with no registered dialects"));
+static llvm::cl::opt<bool> emitBytecode("emit-bytecode", llvm::cl::desc("Write the output module in binary form"));
+static llvm::cl::opt<std::string> passReportFile("pass-report",
+    llvm::cl::desc("Write the run time, op counts and statistics of all passes to a JSON file"),
+    llvm::cl::value_desc("filename"));
+
+// bytecode and pass reports bypass the textual driver, which only handles .mlir files
+// and doesn't expose its pass manager
+mlir::LogicalResult processModule(llvm::raw_ostream &os, std::unique_ptr<llvm::MemoryBuffer> buffer,
+                                  const mlir::PassPipelineCLParser &passPipeline,
+                                  mlir::DialectRegistry &registry) {
+    mlir::MLIRContext context(/*loadAllDialects=*/false);
+    registry.appendTo(context.getDialectRegistry());
+    context.allowUnregisteredDialects(allowUnregisteredDialects);
+
+    llvm::SourceMgr sourceMgr;
+    sourceMgr.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
+    mlir::SourceMgrDiagnosticHandler diagHandler(sourceMgr, &context);
+
+    llvm::MemoryBufferRef input = sourceMgr.getMemoryBuffer(sourceMgr.getMainFileID())->getMemBufferRef();
+    mlir::OwningModuleRef module = mlir::quantum::isBytecode(input) ?
+                                   mlir::quantum::readBytecode(input, &context) :
+                                   mlir::parseSourceFile(sourceMgr, &context);
+    if (!module)
+        return mlir::failure();
+
+    mlir::PassManager pm(&context);
+    pm.enableVerifier(verifyPasses);
+    applyPassManagerCLOptions(pm);
+    mlir::quantum::PassReport report;
+    if (!passReportFile.empty())
+        report.instrument(pm);
+    auto errorHandler = [&](const llvm::Twine &msg) {
+        mlir::emitError(mlir::UnknownLoc::get(&context)) << msg;
+        return mlir::failure();
+    };
+    if (failed(passPipeline.addToPipeline(pm, errorHandler)))
+        return mlir::failure();
+    mlir::LogicalResult result = pm.run(*module);
+
+    if (!passReportFile.empty()) {
+        std::string errorMessage;
+        auto reportFile = mlir::openOutputFile(passReportFile, &errorMessage);
+        if (!reportFile) {
+            llvm::errs() << errorMessage << "\n";
+            return mlir::failure();
+        }
+        report.writeJSON(reportFile->os());
+        reportFile->keep();
+    }
+    if (failed(result))
+        return mlir::failure();
+
+    if (emitBytecode) {
+        mlir::quantum::writeBytecode(*module, os);
+    } else {
+        module->print(os);
+        os << '\n';
+    }
+    return mlir::success();
+}
 
 int main(int argc, char **argv) {
-    mlir::registerAllDialects();
-    mlir::registerAllPasses();
-
-    // Register quantum passes here.
-    mlir::registerPass("convert-mem-to-val",
-                       "Changes op mode from memory to value semantics, by module.",
-                       mlir::quantum::createMemToValPass);
-    mlir::registerPass("quantum-gate-opt",
-                       "Run the greddy driver on a variety of patterns to optimize quantum gates.",
-                       mlir::quantum::createQuantumGateOptimizationPass);
-    mlir::registerPass("circuit-inline",
-                       "Inline circuit calls",
-                       mlir::quantum::createCircuitInlinerPass);
-    mlir::registerPass("count-resources",
-                       "Count the quantum resources used in this program.",
-                       mlir::quantum::createResourceCounterPass);
-    mlir::registerPass("strip-circ",
-                       "Removed unused circuit definitions.",
-                       mlir::quantum::createStripUnusedCircuitPass);
-    mlir::registerPass("lower-ctrl",
-                       "Lower controlled circuit calls.",
-                       mlir::quantum::createLowerControlledCircuitsPass);
-
-    // Below we selectively register all dialects that might show up in the input file.
-    // If blanket registration of all dialects is prefered, use this statement instead:
-    // `registerAllDialects(registry);`
+    llvm::InitLLVM y(argc, argv);
+    // Only the quantum passes and the generic & conversion passes used alongside them are
+    // registered, instead of the passes of every upstream dialect.
+    mlir::quantum::registerQuantumPasses();
+    mlir::registerTransformsPasses();
+    mlir::registerSCFToStandardPass();
+    mlir::registerConvertStandardToLLVMPass();
+    mlir::registerConvertVectorToLLVMPass();
+
+    // Below we selectively register all dialects that might show up in the input file, they are
+    // only loaded into the context once they are used.
     mlir::DialectRegistry registry;
     registry.insert<mlir::StandardOpsDialect>();
     registry.insert<mlir::scf::SCFDialect>();
@@ -51,5 +118,38 @@ int main(int argc, char **argv) {
     registry.insert<mlir::quantum::QuantumDialect>();
     registry.insert<mlir::quantumssa::QuantumSSADialect>();
 
-    return failed(mlir::MlirOptMain(argc, argv, "Quantum optimizer driver\n", registry));
+    mlir::registerAsmPrinterCLOptions();
+    mlir::registerMLIRContextCLOptions();
+    mlir::registerPassManagerCLOptions();
+    mlir::PassPipelineCLParser passPipeline("", "Compiler passes to run");
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Quantum optimizer driver\n");
+
+    std::string errorMessage;
+    auto file = mlir::openInputFile(inputFilename, &errorMessage);
+    if (!file) {
+        llvm::errs() << errorMessage << "\n";
+        return 1;
+    }
+    auto output = mlir::openOutputFile(outputFilename, &errorMessage);
+    if (!output) {
+        llvm::errs() << errorMessage << "\n";
+        return 1;
+    }
+
+    mlir::LogicalResult result = mlir::success();
+    if (emitBytecode || !passReportFile.empty() || mlir::quantum::isBytecode(file->getMemBufferRef())) {
+        if (splitInputFile || verifyDiagnostics) {
+            llvm::errs() << "Bytecode and pass reports cannot be combined with -split-input-file or -verify-diagnostics\n";
+            return 1;
+        }
+        result = processModule(output->os(), std::move(file), passPipeline, registry);
+    } else {
+        result = mlir::MlirOptMain(output->os(), std::move(file), passPipeline, registry, splitInputFile,
+                                   verifyDiagnostics, verifyPasses, allowUnregisteredDialects);
+    }
+    if (failed(result))
+        return 1;
+
+    output->keep();
+    return 0;
 }
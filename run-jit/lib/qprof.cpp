@@ -0,0 +1,170 @@
+/* Resource profiling runtime, called from programs counted with -count-resources -profile */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+namespace {
+
+constexpr int64_t cacheLine = 64;
+constexpr int64_t valuesPerLine = cacheLine / sizeof(int64_t);
+
+// Each thread counts into its own buffer, where the counters of a circuit (the number of calls
+// followed by its cost in each metric) start on a cache line of their own, so that neither
+// threads nor circuits share one. Buffers are only merged when the profile is written.
+//
+// There is a single registry per process, so only one profiled program may run at a time: its
+// qprof_init frees the buffers of all threads, including those of any program still counting.
+// run-jit guarantees this by running JIT-compiled programs one at a time, also in batch mode.
+struct Registry {
+    ~Registry();
+
+    std::mutex mutex;
+    std::vector<int64_t*> buffers;
+    int64_t numCircuits = 0;
+    int64_t numMetrics = 0;
+    // values per circuit, rounded up to whole cache lines
+    int64_t stride = 0;
+    // bumped on every qprof_init, thread buffers of older generations are no longer used
+    std::atomic<int64_t> generation{0};
+    // counts were recorded since the last qprof_dump
+    bool pending = false;
+
+    void release() {
+        for (int64_t *buffer : buffers)
+            free(buffer);
+        buffers.clear();
+    }
+
+    // sum of all thread buffers, without the padding
+    std::vector<int64_t> merge() {
+        std::vector<int64_t> total(numCircuits * (1 + numMetrics), 0);
+        for (int64_t *buffer : buffers)
+            for (int64_t c = 0; c < numCircuits; c++)
+                for (int64_t i = 0; i <= numMetrics; i++)
+                    total[c * (1 + numMetrics) + i] += buffer[c * stride + i];
+        return total;
+    }
+};
+
+Registry &registry() {
+    static Registry r;
+    return r;
+}
+
+thread_local int64_t *localBuffer = nullptr;
+thread_local int64_t localGeneration = -1;
+
+int64_t *allocBuffer() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    void *buffer = nullptr;
+    size_t size = std::max<int64_t>(r.numCircuits * r.stride, valuesPerLine) * sizeof(int64_t);
+    if (posix_memalign(&buffer, cacheLine, size)) {
+        fputs("qprof: out of memory\n", stderr);
+        abort();
+    }
+    memset(buffer, 0, size);
+    r.buffers.push_back((int64_t*) buffer);
+    r.pending = true;
+    localGeneration = r.generation.load(std::memory_order_relaxed);
+    return localBuffer = (int64_t*) buffer;
+}
+
+int64_t *getCounters(int64_t circ) {
+    Registry &r = registry();
+    int64_t *buffer = localBuffer;
+    if (localGeneration != r.generation.load(std::memory_order_relaxed))
+        buffer = allocBuffer();
+    return buffer + circ * r.stride;
+}
+
+// without a name table only the circuit ids are known, write the remaining counts at exit
+Registry::~Registry() {
+    if (pending) {
+        std::vector<int64_t> total = merge();
+        for (int64_t c = 0; c < numCircuits; c++) {
+            fprintf(stderr, "qprof: circuit %" PRId64 ":", c);
+            for (int64_t i = 0; i <= numMetrics; i++)
+                fprintf(stderr, " %" PRId64, total[c * (1 + numMetrics) + i]);
+            fputc('\n', stderr);
+        }
+    }
+    release();
+}
+
+} // end anonymous namespace
+
+// Start a new profile, dropping the buffers of the previous program. Must not be called while
+// another profiled program is still running (see Registry).
+extern "C" void qprof_init(int64_t numCircuits, int64_t numMetrics) {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.release();
+    r.numCircuits = numCircuits;
+    r.numMetrics = numMetrics;
+    r.stride = (1 + numMetrics + valuesPerLine - 1) / valuesPerLine * valuesPerLine;
+    r.generation++;
+    r.pending = false;
+}
+
+extern "C" void qprof_call(int64_t circ) {
+    getCounters(circ)[0]++;
+}
+
+extern "C" void qprof_record(int64_t circ, int64_t metric, int64_t delta) {
+    getCounters(circ)[1 + metric] += delta;
+}
+
+// Write the merged profile to `path`, one line per called circuit ordered by its cost in the
+// first metric, and reset all counters. A labelled profile is appended below its label.
+extern "C" void qprof_dump(const char *path, const char *label, const char *const *circuits,
+                           int64_t numCircuits, const char *const *metrics, int64_t numMetrics) {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (numCircuits != r.numCircuits || numMetrics != r.numMetrics) {
+        fprintf(stderr, "qprof: profile of %" PRId64 " circuits does not match the program\n", numCircuits);
+        return;
+    }
+
+    FILE *out = fopen(path, label ? "a" : "w");
+    if (!out) {
+        fprintf(stderr, "qprof: cannot open %s\n", path);
+        return;
+    }
+    if (label)
+        fprintf(out, "# %s\n", label);
+
+    std::vector<int64_t> total = r.merge();
+    int64_t width = 1 + numMetrics;
+    std::vector<int64_t> order(numCircuits);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int64_t a, int64_t b) {
+        return numMetrics && total[a * width + 1] > total[b * width + 1];
+    });
+
+    fprintf(out, "%-32s %12s", "circuit", "calls");
+    for (int64_t i = 0; i < numMetrics; i++)
+        fprintf(out, " %12s", metrics[i]);
+    fputc('\n', out);
+    for (int64_t c : order) {
+        if (!total[c * width])
+            continue;
+        fprintf(out, "%-32s", circuits[c]);
+        for (int64_t i = 0; i < width; i++)
+            fprintf(out, " %12" PRId64, total[c * width + i]);
+        fputc('\n', out);
+    }
+    fclose(out);
+
+    for (int64_t *buffer : r.buffers)
+        memset(buffer, 0, r.numCircuits * r.stride * sizeof(int64_t));
+    r.pending = false;
+}
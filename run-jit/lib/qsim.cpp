@@ -0,0 +1,342 @@
+/* State-vector simulator runtime, called from programs lowered with -lower-to-sim */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+namespace {
+
+// state vectors past this size are simulated in parallel, below it threading costs more
+constexpr uint64_t parallelThreshold = 1ull << 14;
+
+// largest dense unitary (from gate fusion) supported by the runtime
+constexpr unsigned maxUnitaryQubits = 5;
+
+struct Simulator {
+    Simulator() {
+        const char *seed = getenv("QSIM_SEED");
+        rng.seed(seed ? strtoull(seed, nullptr, 10) : std::random_device()());
+        const char *limit = getenv("QSIM_MAX_QUBITS");
+        maxQubits = limit ? atoi(limit) : 34;
+        re.assign(1, 1.0);
+        im.assign(1, 0.0);
+    }
+
+    // amplitudes are stored as separate real & imaginary arrays so that the kernels vectorize
+    std::vector<double> re, im;
+    unsigned numQubits = 0;
+    unsigned maxQubits;
+
+    // qubits that were freed again, they are always reset to |0>
+    std::vector<int64_t> freeQubits;
+
+    // registers are lists of qubit ids, handles index into this list
+    std::vector<std::vector<int64_t>> registers;
+    std::vector<int64_t> freeRegisters;
+
+    // one frame per applied control modifier, each holding one or more control qubits
+    std::vector<std::vector<int64_t>> ctrlFrames;
+
+    std::mt19937_64 rng;
+};
+
+Simulator &sim() {
+    static Simulator s;
+    return s;
+}
+
+uint64_t getCtrlMask() {
+    uint64_t mask = 0;
+    for (auto &frame : sim().ctrlFrames)
+        for (int64_t q : frame)
+            mask |= 1ull << q;
+    return mask;
+}
+
+// apply `kernel` to all amplitude pairs (i0, i1) differing in the target bit, where all control
+// bits are set, the state vector is processed in contiguous blocks of 2 * 2^target amplitudes
+template<class K> void forEachPair(int64_t target, uint64_t ctrlMask, K kernel) {
+    Simulator &s = sim();
+    if (ctrlMask & (1ull << target)) {
+        fprintf(stderr, "qsim: qubit %" PRId64 " used as both control and target\n", target);
+        abort();
+    }
+
+    uint64_t stride = 1ull << target;
+    int64_t numBlocks = (int64_t) (s.re.size() >> (target + 1));
+    double *re = s.re.data();
+    double *im = s.im.data();
+
+    #pragma omp parallel for schedule(static) if (s.re.size() >= parallelThreshold)
+    for (int64_t block = 0; block < numBlocks; block++) {
+        uint64_t base = (uint64_t) block << (target + 1);
+        #pragma omp simd
+        for (uint64_t j = 0; j < stride; j++) {
+            uint64_t i0 = base | j;
+            if ((i0 & ctrlMask) == ctrlMask)
+                kernel(re, im, i0, i0 | stride);
+        }
+    }
+}
+
+void applyH(int64_t q) {
+    const double norm = 1.0 / std::sqrt(2.0);
+    forEachPair(q, getCtrlMask(), [norm](double *re, double *im, uint64_t i0, uint64_t i1) {
+        double r0 = re[i0], i0v = im[i0], r1 = re[i1], i1v = im[i1];
+        re[i0] = norm * (r0 + r1);
+        im[i0] = norm * (i0v + i1v);
+        re[i1] = norm * (r0 - r1);
+        im[i1] = norm * (i0v - i1v);
+    });
+}
+
+void applyX(int64_t q, uint64_t ctrlMask) {
+    forEachPair(q, ctrlMask, [](double *re, double *im, uint64_t i0, uint64_t i1) {
+        std::swap(re[i0], re[i1]);
+        std::swap(im[i0], im[i1]);
+    });
+}
+
+// dense unitary on k qubits, `matrix` holds (real, imag) pairs in row-major order, where bit i
+// of a row/column index refers to qubits[i]
+void applyUnitary(const int64_t *qubits, unsigned k, const double *matrix) {
+    Simulator &s = sim();
+    uint64_t ctrlMask = getCtrlMask();
+    uint64_t dim = 1ull << k;
+    if (k > maxUnitaryQubits) {
+        fprintf(stderr, "qsim: unitaries are limited to %u qubits\n", maxUnitaryQubits);
+        abort();
+    }
+
+    // amplitude offsets of all states of the target qubits, relative to a base index
+    uint64_t offsets[1 << maxUnitaryQubits] = {0};
+    for (uint64_t a = 0; a < dim; a++)
+        for (unsigned i = 0; i < k; i++)
+            if (a & (1ull << i))
+                offsets[a] |= 1ull << qubits[i];
+    if (ctrlMask & offsets[dim - 1]) {
+        fprintf(stderr, "qsim: qubit used as both control and target\n");
+        abort();
+    }
+
+    std::vector<int64_t> sorted(qubits, qubits + k);
+    std::sort(sorted.begin(), sorted.end());
+    int64_t numBases = (int64_t) (s.re.size() >> k);
+    double *re = s.re.data();
+    double *im = s.im.data();
+
+    #pragma omp parallel for schedule(static) if (s.re.size() >= parallelThreshold)
+    for (int64_t b = 0; b < numBases; b++) {
+        // spread the bits of b over the non-target positions
+        uint64_t base = b;
+        for (int64_t q : sorted)
+            base = ((base >> q) << (q + 1)) | (base & ((1ull << q) - 1));
+        if ((base & ctrlMask) != ctrlMask)
+            continue;
+
+        double vr[1 << maxUnitaryQubits], vi[1 << maxUnitaryQubits];
+        for (uint64_t a = 0; a < dim; a++) {
+            vr[a] = re[base | offsets[a]];
+            vi[a] = im[base | offsets[a]];
+        }
+        for (uint64_t r = 0; r < dim; r++) {
+            const double *row = matrix + 2 * r * dim;
+            double sr = 0, si = 0;
+            #pragma omp simd reduction(+:sr,si)
+            for (uint64_t a = 0; a < dim; a++) {
+                sr += row[2 * a] * vr[a] - row[2 * a + 1] * vi[a];
+                si += row[2 * a] * vi[a] + row[2 * a + 1] * vr[a];
+            }
+            re[base | offsets[r]] = sr;
+            im[base | offsets[r]] = si;
+        }
+    }
+}
+
+// diagonal gate diag(p0, p1)
+void applyPhase(int64_t q, double phi0, double phi1) {
+    double c0 = std::cos(phi0), s0 = std::sin(phi0);
+    double c1 = std::cos(phi1), s1 = std::sin(phi1);
+    forEachPair(q, getCtrlMask(), [=](double *re, double *im, uint64_t i0, uint64_t i1) {
+        double r0 = re[i0], r1 = re[i1];
+        re[i0] = c0 * r0 - s0 * im[i0];
+        im[i0] = s0 * r0 + c0 * im[i0];
+        re[i1] = c1 * r1 - s1 * im[i1];
+        im[i1] = s1 * r1 + c1 * im[i1];
+    });
+}
+
+void applySwap(int64_t a, int64_t b) {
+    if (a == b)
+        return;
+    // swap the amplitudes of |..1..0..> and |..0..1..>, i.e. an X on b controlled on a differing
+    uint64_t ma = 1ull << a;
+    forEachPair(b, getCtrlMask() | ma, [ma](double *re, double *im, uint64_t i0, uint64_t i1) {
+        uint64_t j = i1 ^ ma;
+        std::swap(re[i0], re[j]);
+        std::swap(im[i0], im[j]);
+    });
+}
+
+bool measure(int64_t q) {
+    Simulator &s = sim();
+    uint64_t mask = 1ull << q;
+    int64_t size = (int64_t) s.re.size();
+    double *re = s.re.data();
+    double *im = s.im.data();
+
+    double p1 = 0;
+    #pragma omp parallel for reduction(+:p1) if (s.re.size() >= parallelThreshold)
+    for (int64_t i = 0; i < size; i++)
+        if (i & mask)
+            p1 += re[i] * re[i] + im[i] * im[i];
+
+    bool one = std::uniform_real_distribution<double>(0, 1)(s.rng) < p1;
+    double norm = 1.0 / std::sqrt(one ? p1 : 1 - p1);
+
+    #pragma omp parallel for if (s.re.size() >= parallelThreshold)
+    for (int64_t i = 0; i < size; i++) {
+        bool keep = ((i & mask) != 0) == one;
+        re[i] = keep ? re[i] * norm : 0;
+        im[i] = keep ? im[i] * norm : 0;
+    }
+    return one;
+}
+
+std::vector<int64_t> &getRegister(int64_t r) {
+    return sim().registers[r];
+}
+
+} // end anonymous namespace
+
+extern "C" int64_t qsim_alloc() {
+    Simulator &s = sim();
+    if (!s.freeQubits.empty()) {
+        int64_t q = s.freeQubits.back();
+        s.freeQubits.pop_back();
+        return q;
+    }
+
+    if (s.numQubits >= s.maxQubits) {
+        fprintf(stderr, "qsim: exceeded the maximum of %u qubits (QSIM_MAX_QUBITS)\n", s.maxQubits);
+        abort();
+    }
+    // the new qubit is the most significant bit, the upper half is zero-initialized for |0>
+    s.re.resize(s.re.size() * 2, 0.0);
+    s.im.resize(s.im.size() * 2, 0.0);
+    return s.numQubits++;
+}
+
+extern "C" void qsim_reset(int64_t q) {
+    if (measure(q))
+        applyX(q, 0);
+}
+
+extern "C" void qsim_free(int64_t q) {
+    // reset to |0> so the qubit can be reused
+    qsim_reset(q);
+    sim().freeQubits.push_back(q);
+}
+
+extern "C" int64_t qsim_allocreg(int64_t n) {
+    Simulator &s = sim();
+    std::vector<int64_t> qubits(n);
+    for (auto &q : qubits)
+        q = qsim_alloc();
+
+    if (!s.freeRegisters.empty()) {
+        int64_t r = s.freeRegisters.back();
+        s.freeRegisters.pop_back();
+        s.registers[r] = std::move(qubits);
+        return r;
+    }
+    s.registers.push_back(std::move(qubits));
+    return s.registers.size() - 1;
+}
+
+extern "C" void qsim_freereg(int64_t r) {
+    for (int64_t q : getRegister(r))
+        qsim_free(q);
+    getRegister(r).clear();
+    sim().freeRegisters.push_back(r);
+}
+
+extern "C" void qsim_resetreg(int64_t r) {
+    for (int64_t q : getRegister(r))
+        qsim_reset(q);
+}
+
+extern "C" int64_t qsim_reg_size(int64_t r) {
+    return getRegister(r).size();
+}
+
+extern "C" int64_t qsim_reg_get(int64_t r, int64_t idx) {
+    return getRegister(r)[idx];
+}
+
+extern "C" void qsim_reg_erase(int64_t r, int64_t q) {
+    auto &reg = getRegister(r);
+    reg.erase(std::find(reg.begin(), reg.end(), q));
+}
+
+extern "C" void qsim_reg_insert(int64_t r, int64_t idx, int64_t q) {
+    auto &reg = getRegister(r);
+    reg.insert(reg.begin() + idx, q);
+}
+
+extern "C" void qsim_ctrl_begin(int64_t q) {
+    sim().ctrlFrames.push_back({q});
+}
+
+extern "C" void qsim_ctrl_reg_begin(int64_t r) {
+    sim().ctrlFrames.push_back(getRegister(r));
+}
+
+extern "C" void qsim_ctrl_end() {
+    sim().ctrlFrames.pop_back();
+}
+
+extern "C" void qsim_h(int64_t q)               { applyH(q); }
+extern "C" void qsim_x(int64_t q)               { applyX(q, getCtrlMask()); }
+extern "C" void qsim_rz(int64_t q, double phi)  { applyPhase(q, -phi / 2, phi / 2); }
+extern "C" void qsim_r(int64_t q, double phi)   { applyPhase(q, 0, phi); }
+extern "C" void qsim_cx(int64_t c, int64_t t)   { applyX(t, getCtrlMask() | (1ull << c)); }
+extern "C" void qsim_swap(int64_t a, int64_t b) { applySwap(a, b); }
+extern "C" bool qsim_meas(int64_t q)            { return measure(q); }
+
+extern "C" void qsim_h_reg(int64_t r) {
+    for (int64_t q : getRegister(r))
+        applyH(q);
+}
+
+extern "C" void qsim_x_reg(int64_t r) {
+    for (int64_t q : getRegister(r))
+        applyX(q, getCtrlMask());
+}
+
+extern "C" void qsim_rz_reg(int64_t r, double phi) {
+    for (int64_t q : getRegister(r))
+        applyPhase(q, -phi / 2, phi / 2);
+}
+
+extern "C" void qsim_r_reg(int64_t r, double phi) {
+    for (int64_t q : getRegister(r))
+        applyPhase(q, 0, phi);
+}
+
+extern "C" void qsim_cx_reg(int64_t c, int64_t r) {
+    for (int64_t q : getRegister(r))
+        applyX(q, getCtrlMask() | (1ull << c));
+}
+
+// fused unitary, called with the expanded descriptors of memref<k x i64> & memref<4^k*2 x f64>
+extern "C" void qsim_unitary(int64_t *qAlloc, int64_t *qAligned, int64_t qOffset, int64_t qSize,
+                             int64_t qStride, double *mAlloc, double *mAligned, int64_t mOffset,
+                             int64_t mSize, int64_t mStride) {
+    applyUnitary(qAligned + qOffset, qSize, mAligned + mOffset);
+}
@@ -6,32 +6,53 @@
 #include "mlir/IR/MLIRContext.h"
 #include "mlir/IR/Module.h"
 #include "mlir/IR/Verifier.h"
-#include "mlir/InitAllDialects.h"
 #include "mlir/Parser.h"
 #include "mlir/Pass/Pass.h"
 #include "mlir/Pass/PassManager.h"
 #include "mlir/Target/LLVMIR.h"
 #include "mlir/Transforms/Passes.h"
-#include "mlir/InitAllDialects.h"
-#include "mlir/InitAllPasses.h"
+#include "mlir/Conversion/SCFToStandard/SCFToStandard.h"
+#include "mlir/Conversion/StandardToLLVM/ConvertStandardToLLVMPass.h"
+#include "mlir/Conversion/VectorToLLVM/ConvertVectorToLLVM.h"
+#include "mlir/Dialect/SCF/SCF.h"
+#include "mlir/Dialect/StandardOps/IR/Ops.h"
+#include "mlir/Dialect/Vector/VectorOps.h"
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
 #include "QuantumDialect.h"
 #include "QuantumSSADialect.h"
 #include "Passes.h"
+#include "Bytecode.h"
+#include "PassReport.h"
+#include "QuantumPipeline.h"
 
 namespace {
 enum Action {
   None,
   DumpMLIRQuant,
+  DumpBytecode,
   DumpMLIRSCF,
   DumpMLIRSTD,
   DumpMLIRLLVM,
@@ -45,9 +66,13 @@ static llvm::cl::opt<std::string> mlirSource(llvm::cl::Positional,
                                              llvm::cl::init("-"),
                                              llvm::cl::value_desc("filename"));
 
+static llvm::cl::opt<std::string> outputFilename("o", llvm::cl::desc("Output filename for binary output"),
+                                                 llvm::cl::init("-"), llvm::cl::value_desc("filename"));
+
 static llvm::cl::opt<enum Action> emitAction("emit",
     llvm::cl::desc("Select the kind of output desired"),
     llvm::cl::values(clEnumValN(DumpMLIRQuant, "mlir-quant", "output the MLIR dump after lowering QuantumSSA")),
+    llvm::cl::values(clEnumValN(DumpBytecode, "bytecode", "output the module after lowering QuantumSSA in binary form")),
     llvm::cl::values(clEnumValN(DumpMLIRSCF, "mlir-scf", "output the MLIR dump after lowering to SCF")),
     llvm::cl::values(clEnumValN(DumpMLIRSTD, "mlir-std", "output the MLIR dump after lowering to std")),
     llvm::cl::values(clEnumValN(DumpMLIRLLVM, "mlir-llvm", "output the MLIR dump after lowering to LLVM")),
@@ -56,75 +81,398 @@ static llvm::cl::opt<enum Action> emitAction("emit",
 
 static llvm::cl::opt<bool> enableOpt("opt", llvm::cl::desc("Enable optimizations"));
 static llvm::cl::opt<bool> lowerControls("lower", llvm::cl::desc("Lower controlled circuit calls"));
+static llvm::cl::opt<bool> dedupCircuits("dedup", llvm::cl::desc("Merge structurally identical circuits"));
+static llvm::cl::opt<bool> materializeAdjoints("adjoints", llvm::cl::desc("Materialize adjoint circuits and call them directly"));
 static llvm::cl::opt<bool> enableInline("inline", llvm::cl::desc("Enable quantum circuit inlining"));
+static llvm::cl::opt<unsigned> inlineThreshold("inline-threshold", llvm::cl::desc("Maximum gate cost of an inlined circuit (0: no limit)"), llvm::cl::init(0));
+static llvm::cl::opt<unsigned> inlineBudget("inline-budget", llvm::cl::desc("Maximum growth of the gate count due to inlining in percent (0: no limit)"), llvm::cl::init(0));
 static llvm::cl::opt<bool> stripCircuit("strip", llvm::cl::desc("Remove unused circuit definitions"));
 static llvm::cl::opt<bool> enableQOpt("qopt", llvm::cl::desc("Enable quantum optimizations"));
+static llvm::cl::opt<unsigned> optRounds("qopt-rounds", llvm::cl::desc("Maximum number of rounds of the quantum optimizations, which stop early once nothing changes"),
+                                         llvm::cl::init(4));
+static llvm::cl::opt<bool> summarizeCounts("summarize", llvm::cl::desc("Count resources via closed-form cost summaries"));
+static llvm::cl::opt<bool> reuseQubits("reuse", llvm::cl::desc("Reuse qubits whose lifetime ended in place of new allocations"));
+static llvm::cl::opt<bool> scheduleGates("schedule", llvm::cl::desc("Reorder gates by their depth schedule and move them into idle time before barriers"));
+static llvm::cl::opt<bool> peakQubits("peak-qubits", llvm::cl::desc("Also count the peak number of live qubits"));
+static llvm::cl::opt<std::string> profileFile("profile", llvm::cl::desc("Write the number of calls and the resources of each circuit to a file"),
+                                              llvm::cl::value_desc("filename"));
+static llvm::cl::opt<std::string> costModelFile("cost-model", llvm::cl::desc("Load the gate decomposition costs used for resource counting from a JSON file"),
+                                                llvm::cl::value_desc("filename"));
+static llvm::cl::opt<std::string> countMetrics("metrics", llvm::cl::desc("Comma separated resource metrics to count and print"),
+                                               llvm::cl::value_desc("metrics"), llvm::cl::init("R,T"));
+static llvm::cl::opt<unsigned> fuseQubits("fuse", llvm::cl::desc("Fuse gates into unitaries on up to n (at most 5) qubits when simulating (0: no fusion)"), llvm::cl::init(0));
+static llvm::cl::opt<bool> simulate("simulate", llvm::cl::desc("Simulate the program on the state-vector simulator instead of counting resources"));
+
+static llvm::cl::opt<bool> streamInput("stream", llvm::cl::desc("Compile the input one top-level operation at a time to bound memory use"));
+
+static llvm::cl::list<std::string> batchInputs("batch", llvm::cl::desc("Compile the given files, or all .mlir and bytecode files in the given directories, concurrently"),
+                                               llvm::cl::ZeroOrMore, llvm::cl::MiscFlags::CommaSeparated,
+                                               llvm::cl::value_desc("inputs"));
+static llvm::cl::opt<std::string> batchOutputDir("batch-output-dir", llvm::cl::desc("Write the output of each batch input to a file in this directory"),
+                                                 llvm::cl::value_desc("directory"));
+static llvm::cl::opt<unsigned> batchThreads("batch-threads", llvm::cl::desc("Number of inputs compiled concurrently (0: number of cores)"),
+                                            llvm::cl::init(0));
+
+static llvm::cl::opt<std::string> passReportFile("pass-report", llvm::cl::desc("Write the run time, op counts and statistics of all passes to a JSON file"),
+                                                  llvm::cl::value_desc("filename"));
+
+static llvm::cl::list<std::string> sharedLibs("shared-libs", llvm::cl::desc("Libraries to link dynamically into the JIT"),
+                                              llvm::cl::ZeroOrMore, llvm::cl::MiscFlags::CommaSeparated);
+static llvm::cl::opt<std::string> objectCacheDir("object-cache", llvm::cl::desc("Directory to cache JIT-compiled objects in"),
+                                                 llvm::cl::value_desc("directory"));
+
+// libraries linked into the JIT, by default the print library (and the simulator when simulating,
+// or the profiling runtime when profiling)
+std::vector<std::string> getSharedLibs() {
+    if (sharedLibs.empty() && simulate)
+        return {PRINTLIB_PATH, QSIM_PATH};
+    if (sharedLibs.empty() && !profileFile.empty())
+        return {PRINTLIB_PATH, QPROF_PATH};
+    if (sharedLibs.empty())
+        return {PRINTLIB_PATH};
+    return std::vector<std::string>(sharedLibs.begin(), sharedLibs.end());
+}
 
-int loadMLIR(mlir::MLIRContext &context, mlir::OwningModuleRef &module) {
+int loadMLIR(llvm::StringRef source, mlir::MLIRContext &context, mlir::OwningModuleRef &module) {
     // Otherwise, the input is '.mlir'.
     llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> fileOrErr =
-        llvm::MemoryBuffer::getFileOrSTDIN(mlirSource);
+        llvm::MemoryBuffer::getFileOrSTDIN(source);
     if (std::error_code EC = fileOrErr.getError()) {
         llvm::errs() << "Could not open input file: " << EC.message() << "\n";
         return -1;
     }
 
+    // Bytecode is recognized by its magic number.
+    if (mlir::quantum::isBytecode((*fileOrErr)->getMemBufferRef())) {
+        module = mlir::quantum::readBytecode((*fileOrErr)->getMemBufferRef(), &context);
+        if (!module) {
+            llvm::errs() << "Error can't load file " << source << "\n";
+            return 3;
+        }
+        return 0;
+    }
+
     // Parse the input mlir.
     llvm::SourceMgr sourceMgr;
     sourceMgr.AddNewSourceBuffer(std::move(*fileOrErr), llvm::SMLoc());
     module = mlir::parseSourceFile(sourceMgr, &context);
     if (!module) {
-        llvm::errs() << "Error can't load file " << mlirSource << "\n";
+        llvm::errs() << "Error can't load file " << source << "\n";
         return 3;
     }
     return 0;
 }
 
+// the passes of all pipelines are collected into a single report
+static mlir::quantum::PassReport passReport;
+
+// apply the generic pass manager command line options, and record the passes for the report
+void configurePassManager(mlir::PassManager &pm) {
+    applyPassManagerCLOptions(pm);
+    if (!passReportFile.empty())
+        passReport.instrument(pm);
+}
+
+int writePassReport() {
+    std::error_code EC;
+    llvm::raw_fd_ostream os(passReportFile, EC);
+    if (EC) {
+        llvm::errs() << "Could not open pass report file: " << EC.message() << "\n";
+        return -1;
+    }
+    passReport.writeJSON(os);
+    return 0;
+}
+
+// the options of the quantum pipeline given on the command line
+mlir::quantum::QuantumPipelineOptions getPipelineOptions() {
+    using Lowering = mlir::quantum::QuantumPipelineOptions::Lowering;
+    mlir::quantum::QuantumPipelineOptions options;
+    options.memToVal = emitAction >= Action::DumpMLIRQuant;
+    options.lowerControls = lowerControls;
+    options.dedup = dedupCircuits;
+    options.strip = stripCircuit;
+    options.inlineCircuits = enableInline;
+    options.inliner.threshold = inlineThreshold;
+    options.inliner.growthBudget = inlineBudget;
+    options.optimize = enableQOpt;
+    options.optRounds = optRounds;
+    options.materializeAdjoints = materializeAdjoints;
+    options.reuseQubits = reuseQubits;
+    options.schedule = scheduleGates;
+    options.scheduling.costModel = costModelFile;
+    if (emitAction >= Action::DumpMLIRSCF)
+        options.lowering = simulate ? Lowering::Simulation : Lowering::ResourceCounting;
+    options.counting.summarize = summarizeCounts;
+    options.counting.costModel = costModelFile;
+    options.counting.metrics = countMetrics;
+    options.counting.peakQubits = peakQubits;
+    options.counting.profile = !profileFile.empty();
+    options.fuseQubits = fuseQubits;
+    return options;
+}
+
 int loadAndProcessMLIR(mlir::MLIRContext &context, mlir::OwningModuleRef &module) {
-    if (int error = loadMLIR(context, module))
+    if (int error = loadMLIR(mlirSource, context, module))
         return error;
 
-    mlir::PassManager pm(&context);
     // Apply any generic pass manager command line options and run the pipeline.
-    applyPassManagerCLOptions(pm);
+    mlir::quantum::QuantumPipeline pipeline(context, getPipelineOptions());
+    pipeline.forEachPassManager(configurePassManager);
+
+    if (mlir::failed(pipeline.run(*module)))
+        return 4;
+    return 0;
+}
+
+//===------------------------------------------------------------------------------------------===//
+// Streaming compilation
+//===------------------------------------------------------------------------------------------===//
 
-    if (emitAction >= Action::DumpMLIRQuant)
-        pm.addPass(mlir::quantum::createMemToValPass());
-    if (lowerControls)
-        pm.addPass(mlir::quantum::createLowerControlledCircuitsPass());
-    if (stripCircuit) {
-        pm.addPass(mlir::quantum::createStripUnusedCircuitPass());
-        pm.addPass(mlir::createCanonicalizerPass());
-        pm.addPass(mlir::quantum::createStripUnusedCircuitPass());
-    }
-    if (enableInline)
-        pm.addPass(mlir::quantum::createCircuitInlinerPass());
-    if (stripCircuit) {
-        pm.addPass(mlir::quantum::createStripUnusedCircuitPass());
-        pm.addPass(mlir::createCanonicalizerPass());
-        pm.addPass(mlir::quantum::createStripUnusedCircuitPass());
-    } else {
-        pm.addPass(mlir::createCanonicalizerPass());
-    }
-    if (enableQOpt) {
-        pm.addPass(mlir::quantum::createQuantumGateOptimizationPass());
-        pm.addPass(mlir::createCanonicalizerPass());
+// a top-level operation of the input, along with the symbol it defines (if any)
+struct TopLevelChunk {
+    llvm::StringRef text;
+    llvm::StringRef symbol;
+};
+
+// skip a string literal or line comment starting at `pos`, returns the position of its last char
+size_t skipLiteral(llvm::StringRef text, size_t pos) {
+    if (text[pos] == '"') {
+        for (pos++; pos < text.size() && text[pos] != '"'; pos++)
+            if (text[pos] == '\\')
+                pos++;
+        return std::min(pos, text.size() - 1);
     }
-    if (emitAction >= Action::DumpMLIRSCF)
-        pm.addPass(mlir::quantum::createResourceCounterPass());
+    if (text.substr(pos).startswith("//"))
+        return std::min(text.find('\n', pos), text.size()) - 1;
+    return pos;
+}
+
+bool isSymbolChar(char c) {
+    return llvm::isAlnum(c) || c == '_' || c == '$' || c == '.' || c == '-';
+}
+
+// name of the circuit or function defined by a top-level op, empty for any other op
+llvm::StringRef getDefinedSymbol(llvm::StringRef text) {
+    llvm::StringRef rest = text;
+    if (!rest.consume_front("q.circ") && !rest.consume_front("qs.circ") && !rest.consume_front("func"))
+        return "";
+    rest = rest.ltrim();
+    if (!rest.consume_front("@"))
+        return "";
+    return rest.take_while(isSymbolChar);
+}
+
+// Split the input into top-level operations with a lightweight scan over brackets, strings and
+// comments, which ends an operation at the first newline outside of any bracket. Consecutive
+// ops that define no symbol are kept together, as they may share SSA values.
+void splitTopLevelOps(llvm::StringRef text, std::vector<TopLevelChunk> &chunks) {
+    size_t start = llvm::StringRef::npos;
+    int depth = 0;
+
+    auto addChunk = [&](size_t end) {
+        llvm::StringRef op = text.slice(start, end).rtrim();
+        llvm::StringRef symbol = getDefinedSymbol(op);
+        if (symbol.empty() && !chunks.empty() && chunks.back().symbol.empty())
+            chunks.back().text = llvm::StringRef(chunks.back().text.data(), op.end() - chunks.back().text.begin());
+        else
+            chunks.push_back({op, symbol});
+        start = llvm::StringRef::npos;
+    };
+
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '"' || text.substr(i).startswith("//")) {
+            if (c == '"' && start == llvm::StringRef::npos)
+                start = i;
+            i = skipLiteral(text, i);
+            continue;
+        }
+        if (c == '\n' && depth == 0 && start != llvm::StringRef::npos)
+            addChunk(i);
+        if (llvm::isSpace(c))
+            continue;
+
+        if (start == llvm::StringRef::npos)
+            start = i;
+        if (c == '{' || c == '(' || c == '[')
+            depth++;
+        else if (c == '}' || c == ')' || c == ']')
+            depth--;
+    }
+    if (start != llvm::StringRef::npos)
+        addChunk(text.size());
+
+    // look into an explicit top-level module, whose body is the last bracketed region
+    if (chunks.size() == 1 && chunks.front().text.startswith("module")) {
+        llvm::StringRef module = chunks.front().text;
+        size_t bodyStart = llvm::StringRef::npos;
+        depth = 0;
+        for (size_t i = 0; i < module.size(); i++) {
+            if (module[i] == '"' || module.substr(i).startswith("//")) {
+                i = skipLiteral(module, i);
+            } else if (module[i] == '{' && depth++ == 0) {
+                bodyStart = i + 1;
+            } else if (module[i] == '}') {
+                depth--;
+            }
+        }
+        chunks.clear();
+        if (bodyStart != llvm::StringRef::npos && module.endswith("}"))
+            splitTopLevelOps(module.slice(bodyStart, module.size() - 1), chunks);
+    }
+}
+
+// Declaration of a circuit or function for use in other chunks. Circuits keep their signature
+// with an empty body, as circuits of the input (memory semantics) return no values and their only
+// terminator is implicit. Functions become an external declaration without a body.
+std::string getDeclarationStub(llvm::StringRef text) {
+    bool isFunc = text.startswith("func");
+    if (!text.startswith("q.circ") && !isFunc)
+        return "";
+
+    int depth = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '"' || text.substr(i).startswith("//")) {
+            i = skipLiteral(text, i);
+        } else if (c == '(' || c == '[') {
+            depth++;
+        } else if (c == ')' || c == ']') {
+            depth--;
+        } else if (c == '{' && depth == 0) {
+            // the attribute dictionary precedes the body
+            if (text.take_front(i).rtrim().endswith("attributes")) {
+                depth++;
+                continue;
+            }
+            if (isFunc)
+                return text.take_front(i).rtrim().str();
+            return (text.take_front(i) + "{\n}").str();
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            depth--;
+        }
+    }
+    return "";
+}
+
+void getReferencedSymbols(llvm::StringRef text, llvm::StringSet<> &symbols) {
+    for (size_t pos = text.find('@'); pos != llvm::StringRef::npos; pos = text.find('@', pos + 1))
+        symbols.insert(text.substr(pos + 1).take_while(isSymbolChar));
+}
+
+// Compile the input one top-level op at a time, keeping only circuit and function declarations
+// for cross references, such that peak memory is bounded by the largest op rather than the
+// program. Passes that look into the callees would only see the empty declarations (and e.g.
+// merge them or materialize their empty adjoints), so they are rejected along with the others
+// that need the whole program.
+int processStreaming(mlir::MLIRContext &context) {
+    if (emitAction != Action::DumpMLIRQuant || enableInline || stripCircuit || lowerControls ||
+            dedupCircuits || materializeAdjoints) {
+        llvm::errs() << "Streaming compilation only supports -emit=mlir-quant without "
+                        "whole-program passes (-inline, -strip, -lower, -dedup, -adjoints)\n";
+        return -1;
+    }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> fileOrErr =
+        llvm::MemoryBuffer::getFileOrSTDIN(mlirSource);
+    if (std::error_code EC = fileOrErr.getError()) {
+        llvm::errs() << "Could not open input file: " << EC.message() << "\n";
+        return -1;
+    }
+
+    std::vector<TopLevelChunk> chunks;
+    splitTopLevelOps((*fileOrErr)->getBuffer(), chunks);
+
+    llvm::StringMap<std::string> stubs;
+    for (const TopLevelChunk &chunk : chunks) {
+        std::string stub = getDeclarationStub(chunk.text);
+        if (!stub.empty())
+            stubs[chunk.symbol] = std::move(stub);
+    }
+
+    mlir::quantum::QuantumPipeline pipeline(context, getPipelineOptions());
+    pipeline.forEachPassManager(configurePassManager);
+
+    llvm::errs() << "module {\n";
+    for (const TopLevelChunk &chunk : chunks) {
+        // declarations follow the op itself, so that its line numbers are kept in diagnostics
+        std::string source = chunk.text.str() + "\n";
+        llvm::StringSet<> referenced;
+        getReferencedSymbols(chunk.text, referenced);
+        llvm::SmallVector<llvm::StringRef, 8> declared;
+        for (auto &entry : referenced) {
+            auto stub = stubs.find(entry.getKey());
+            if (stub != stubs.end() && entry.getKey() != chunk.symbol) {
+                source += stub->second + "\n";
+                declared.push_back(stub->getKey());
+            }
+        }
+
+        llvm::SourceMgr sourceMgr;
+        sourceMgr.AddNewSourceBuffer(llvm::MemoryBuffer::getMemBufferCopy(source, mlirSource),
+                                     llvm::SMLoc());
+        mlir::OwningModuleRef module = mlir::parseSourceFile(sourceMgr, &context);
+        if (!module) {
+            llvm::errs() << "Error can't load file " << mlirSource << "\n";
+            return 3;
+        }
+        if (mlir::failed(pipeline.run(*module)))
+            return 4;
+
+        for (llvm::StringRef name : declared)
+            if (mlir::Operation *decl = module->lookupSymbol(name))
+                decl->erase();
+        for (mlir::Operation &op : module->getBody()->without_terminator()) {
+            op.print(llvm::errs());
+            llvm::errs() << "\n";
+        }
+    }
+    llvm::errs() << "}\n";
+    return 0;
+}
+
+// lower the classical program left after resource counting or simulation lowering, separate from the quantum pipeline
+// so that lowering can be skipped when the compiled object is already cached
+void buildLoweringPipeline(mlir::PassManager &pm) {
     if (emitAction >= Action::DumpMLIRSTD)
         pm.addPass(mlir::createLowerToCFGPass());
     if (emitAction >= Action::DumpMLIRLLVM) {
         pm.addPass(mlir::createConvertVectorToLLVMPass());
         pm.addPass(mlir::createLowerToLLVMPass());
     }
+}
 
-    if (mlir::failed(pm.run(*module)))
+int lowerMLIR(mlir::MLIRContext &context, mlir::ModuleOp module) {
+    mlir::PassManager pm(&context);
+    configurePassManager(pm);
+    buildLoweringPipeline(pm);
+
+    if (mlir::failed(pm.run(module)))
         return 4;
     return 0;
 }
 
-int dumpLLVMIR(mlir::ModuleOp module) {
+// path of the cached object for a module, keyed on a hash of the module and the opt level
+std::string getCachedObjectPath(mlir::ModuleOp module) {
+    std::string moduleStr;
+    llvm::raw_string_ostream os(moduleStr);
+    module.print(os);
+    os.flush();
+
+    llvm::MD5 hasher;
+    llvm::MD5::MD5Result hash;
+    hasher.update(moduleStr);
+    hasher.final(hash);
+
+    llvm::SmallString<128> path(objectCacheDir);
+    llvm::sys::path::append(path, hash.digest() + (enableOpt ? "-O3.o" : "-O0.o"));
+    return std::string(path.str());
+}
+
+int dumpLLVMIR(mlir::ModuleOp module, llvm::raw_ostream &os = llvm::errs()) {
     // Convert the module to LLVM IR in a new LLVM IR context.
     llvm::LLVMContext llvmContext;
     auto llvmModule = mlir::translateModuleToLLVMIR(module, llvmContext);
@@ -145,11 +493,74 @@ int dumpLLVMIR(mlir::ModuleOp module) {
         llvm::errs() << "Failed to optimize LLVM IR " << err << "\n";
         return -1;
     }
-    llvm::errs() << *llvmModule << "\n";
+    os << *llvmModule << "\n";
     return 0;
 }
 
-int runJit(mlir::ModuleOp module) {
+// JIT-compiled programs print to stdout, so concurrently compiled programs are run one at a time.
+// The profiling runtime relies on this as well, its counters are shared by the whole process and
+// reset by every profiled program on entry.
+static std::mutex invocationMutex;
+
+// print the name of a batch input ahead of its output
+void printInvocationHeader(llvm::StringRef label) {
+    if (label.empty())
+        return;
+    llvm::outs() << "// " << label << "\n";
+    llvm::outs().flush();
+}
+
+// write the profile collected by the profiling runtime while running the module, batch inputs
+// are appended to the profile below their label
+void writeProfile(mlir::ModuleOp module, llvm::StringRef label) {
+    using DumpFn = void (*)(const char*, const char*, const char *const*, int64_t, const char *const*, int64_t);
+    std::string error;
+    auto lib = llvm::sys::DynamicLibrary::getPermanentLibrary(QPROF_PATH, &error);
+    auto dump = (DumpFn) lib.getAddressOfSymbol("qprof_dump");
+    if (!dump) {
+        llvm::errs() << "Could not load the profiling runtime: " << error << "\n";
+        return;
+    }
+
+    auto getNames = [&](llvm::StringRef attrName, std::vector<std::string> &names) {
+        if (auto array = module.getAttrOfType<mlir::ArrayAttr>(attrName))
+            for (auto name : array.getAsRange<mlir::StringAttr>())
+                names.push_back(name.getValue().str());
+    };
+    std::vector<std::string> circuits, metrics;
+    getNames("qs.profile_circuits", circuits);
+    getNames("qs.profile_metrics", metrics);
+    std::vector<const char*> circuitNames, metricNames;
+    for (const std::string &name : circuits)
+        circuitNames.push_back(name.c_str());
+    for (const std::string &name : metrics)
+        metricNames.push_back(name.c_str());
+
+    std::string labelStr = label.str();
+    dump(profileFile.c_str(), label.empty() ? nullptr : labelStr.c_str(), circuitNames.data(),
+         circuitNames.size(), metricNames.data(), metricNames.size());
+}
+
+// Store the compiled object of the engine in the cache. The object is written to a temporary file
+// next to its final path and renamed into place, so that other processes running the same module
+// never load a partially written object.
+void storeCachedObject(mlir::ExecutionEngine &engine, llvm::StringRef objectPath) {
+    int fd;
+    llvm::SmallString<128> tmpPath;
+    if (std::error_code EC = llvm::sys::fs::createUniqueFile(objectPath + ".%%%%%%.tmp", fd, tmpPath)) {
+        llvm::errs() << "Could not write to the object cache: " << EC.message() << "\n";
+        return;
+    }
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+
+    engine.dumpToObjectFile(tmpPath);
+    uint64_t size = 0;
+    if (llvm::sys::fs::file_size(tmpPath, size) || !size ||
+            llvm::sys::fs::rename(tmpPath, objectPath))
+        llvm::sys::fs::remove(tmpPath);
+}
+
+int runJit(mlir::ModuleOp module, llvm::StringRef objectPath, llvm::StringRef label = "") {
     // Initialize LLVM targets.
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
@@ -158,61 +569,405 @@ int runJit(mlir::ModuleOp module) {
     auto optPipeline = mlir::makeOptimizingTransformer(
         /*optLevel=*/enableOpt ? 3 : 0, /*sizeLevel=*/0, /*targetMachine=*/nullptr);
 
-    // Create an MLIR execution engine. The execution engine eagerly JIT-compiles the module.
-    auto maybeEngine = mlir::ExecutionEngine::create(
-        module, optPipeline, llvm::None, {"/home/dave/QCompile/run-jit/lib/printlib.so"});
+    // Create an MLIR execution engine.
+    std::vector<std::string> libs = getSharedLibs();
+    llvm::SmallVector<llvm::StringRef, 4> libPaths(libs.begin(), libs.end());
+    auto maybeEngine = mlir::ExecutionEngine::create(module, optPipeline, llvm::None, libPaths);
     assert(maybeEngine && "failed to construct an execution engine");
     auto &engine = maybeEngine.get();
 
+    // Store the compiled object for later runs of the same module. The module is only compiled
+    // once a symbol is looked up, so the object cache is still empty before that.
+    if (!objectPath.empty()) {
+        auto entry = engine->lookup("main");
+        if (!entry) {
+            llvm::errs() << "JIT compilation failed " << entry.takeError() << "\n";
+            return -1;
+        }
+        storeCachedObject(*engine, objectPath);
+    }
+
     // Invoke the JIT-compiled function.
+    std::lock_guard<std::mutex> lock(invocationMutex);
+    printInvocationHeader(label);
     auto invocationResult = engine->invoke("main");
+    fflush(stdout);
     if (invocationResult) {
         llvm::errs() << "JIT invocation failed\n";
         return -1;
     }
+    if (!profileFile.empty() && !simulate)
+        writeProfile(module, label);
 
     return 0;
 }
 
+// a module loaded from the object cache, along with the JIT holding it
+struct CachedObject {
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    void (*mainFn)(void **) = nullptr;
+};
 
-int main(int argc, char **argv) {
-    mlir::registerAllDialects();
-    mlir::registerAllPasses();
-
-    // Register quantum passes here.
-    mlir::registerPass("convert-mem-to-val",
-                       "Changes op mode from memory to value semantics, by module.",
-                       mlir::quantum::createMemToValPass);
-    mlir::registerPass("quantum-gate-opt",
-                       "Run the greddy driver on a variety of patterns to optimize quantum gates.",
-                       mlir::quantum::createQuantumGateOptimizationPass);
-    mlir::registerPass("circuit-inline",
-                       "Inline circuit calls",
-                       mlir::quantum::createCircuitInlinerPass);
-    mlir::registerPass("count-resources",
-                       "Count the quantum resources used in this program.",
-                       mlir::quantum::createResourceCounterPass);
-
-    // Below we selectively register all dialects that might show up in the input file.
-    // If blanket registration of all dialects is prefered, use this statement instead:
-    // `registerAllDialects(registry);`
-    mlir::MLIRContext context(/*loadAllDialects=*/false);
-    context.getOrLoadDialect<mlir::StandardOpsDialect>();
-    context.getOrLoadDialect<mlir::scf::SCFDialect>();
-    context.getOrLoadDialect<mlir::vector::VectorDialect>();
-    context.getOrLoadDialect<mlir::quantum::QuantumDialect>();
-    context.getOrLoadDialect<mlir::quantumssa::QuantumSSADialect>();
+// Load a previously compiled module from the object cache, skipping lowering & codegen. A missing
+// object, or one that can't be loaded, is a cache miss and the module is compiled instead.
+bool loadCachedObject(llvm::StringRef objectPath, CachedObject &object) {
+    auto objectOrErr = llvm::MemoryBuffer::getFile(objectPath);
+    if (objectOrErr.getError())
+        return false;
 
-    mlir::registerAsmPrinterCLOptions();
-    mlir::registerMLIRContextCLOptions();
-    mlir::registerPassManagerCLOptions();
+    // Initialize LLVM targets.
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
 
-    llvm::cl::ParseCommandLineOptions(argc, argv, "Quantum compiler\n");
+    auto jitOrErr = llvm::orc::LLJITBuilder().create();
+    if (!jitOrErr) {
+        llvm::consumeError(jitOrErr.takeError());
+        return false;
+    }
+    auto &jit = *jitOrErr;
+
+    // resolve symbols from the shared libraries & the host process, as the execution engine does
+    llvm::orc::JITDylib &mainJD = jit->getMainJITDylib();
+    char prefix = jit->getDataLayout().getGlobalPrefix();
+    for (const std::string &lib : getSharedLibs()) {
+        auto generator = llvm::orc::DynamicLibrarySearchGenerator::Load(lib.c_str(), prefix);
+        if (!generator) {
+            llvm::consumeError(generator.takeError());
+            return false;
+        }
+        mainJD.addGenerator(std::move(*generator));
+    }
+    auto processGenerator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix);
+    if (!processGenerator) {
+        llvm::consumeError(processGenerator.takeError());
+        return false;
+    }
+    mainJD.addGenerator(std::move(*processGenerator));
+
+    if (auto err = jit->addObjectFile(std::move(*objectOrErr))) {
+        llvm::consumeError(std::move(err));
+        return false;
+    }
+
+    // the execution engine invokes "main" through its packed "_mlir_main" wrapper
+    auto mainSym = jit->lookup("_mlir_main");
+    if (!mainSym) {
+        llvm::consumeError(mainSym.takeError());
+        return false;
+    }
+    object.mainFn = reinterpret_cast<void (*)(void **)>(mainSym->getAddress());
+    object.jit = std::move(jit);
+    return true;
+}
+
+int runCachedObject(CachedObject &object, llvm::StringRef label = "") {
+    void *args[1] = {nullptr};
+    std::lock_guard<std::mutex> lock(invocationMutex);
+    printInvocationHeader(label);
+    object.mainFn(args);
+    fflush(stdout);
+
+    return 0;
+}
+
+
+//===------------------------------------------------------------------------------------------===//
+// Batch compilation
+//===------------------------------------------------------------------------------------------===//
+
+// expand directories into the .mlir and bytecode files they contain, in a deterministic order
+int collectBatchInputs(std::vector<std::string> &inputs) {
+    for (const std::string &input : batchInputs) {
+        if (!llvm::sys::fs::is_directory(input)) {
+            inputs.push_back(input);
+            continue;
+        }
+
+        std::vector<std::string> files;
+        std::error_code EC;
+        for (llvm::sys::fs::directory_iterator it(input, EC), end; it != end && !EC; it.increment(EC)) {
+            llvm::StringRef ext = llvm::sys::path::extension(it->path());
+            if (ext == ".mlir" || ext == ".qirb")
+                files.push_back(it->path());
+        }
+        if (EC) {
+            llvm::errs() << "Could not read input directory " << input << ": " << EC.message() << "\n";
+            return -1;
+        }
+        llvm::sort(files);
+        inputs.insert(inputs.end(), files.begin(), files.end());
+    }
+    return 0;
+}
+
+// outputs are either written to a file per input, or printed in one piece
+static std::mutex outputMutex;
+
+// the extension of the output file of each input, none if the inputs are run
+llvm::StringRef getBatchOutputExt() {
+    if (emitAction == Action::DumpBytecode)
+        return ".qirb";
+    if (emitAction <= Action::DumpMLIRLLVM)
+        return ".mlir";
+    if (emitAction == Action::DumpLLVMIR)
+        return ".ll";
+    return "";
+}
+
+// Name the output file of each input after the input. Inputs with the same name (from different
+// directories, or with different extensions) are told apart by a number, in input order. An output
+// is never written over one of the inputs, which happens with the output directory of an earlier
+// batch as input.
+int getBatchOutputPaths(llvm::ArrayRef<std::string> inputs, std::vector<std::string> &outputs) {
+    llvm::StringRef ext = getBatchOutputExt();
+    if (batchOutputDir.empty() || ext.empty()) {
+        outputs.assign(inputs.size(), "");
+        return 0;
+    }
+
+    std::vector<llvm::sys::fs::UniqueID> inputIDs;
+    for (const std::string &input : inputs) {
+        llvm::sys::fs::UniqueID id;
+        if (!llvm::sys::fs::getUniqueID(input, id))
+            inputIDs.push_back(id);
+    }
+
+    llvm::StringSet<> names;
+    for (const std::string &input : inputs) {
+        llvm::StringRef stem = llvm::sys::path::stem(input);
+        std::string name = (stem + ext).str();
+        for (unsigned n = 1; !names.insert(name).second; n++)
+            name = (stem + "." + llvm::Twine(n) + ext).str();
+
+        llvm::SmallString<128> path(batchOutputDir);
+        llvm::sys::path::append(path, name);
+        llvm::sys::fs::UniqueID id;
+        if (!llvm::sys::fs::getUniqueID(path, id) && llvm::is_contained(inputIDs, id)) {
+            llvm::errs() << "Output file " << path << " would overwrite an input\n";
+            return -1;
+        }
+        outputs.push_back(path.str().str());
+    }
+    return 0;
+}
+
+// write the output of an input to its output file, or print it if it has none
+int writeBatchOutput(llvm::StringRef input, llvm::StringRef output, llvm::function_ref<int(llvm::raw_ostream &)> write) {
+    if (output.empty()) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        llvm::errs() << "// " << input << "\n";
+        return write(llvm::errs());
+    }
+
+    std::error_code EC;
+    llvm::raw_fd_ostream os(output, EC);
+    if (EC) {
+        llvm::errs() << "Could not open output file " << output << ": " << EC.message() << "\n";
+        return -1;
+    }
+    return write(os);
+}
+
+// a worker compiles inputs one after the other, reusing its pass managers
+struct BatchWorker {
+    BatchWorker(mlir::MLIRContext &context)
+        : quantumPipeline(context, getPipelineOptions()), loweringPM(&context) {
+        quantumPipeline.forEachPassManager(configurePassManager);
+        configurePassManager(loweringPM);
+        buildLoweringPipeline(loweringPM);
+    }
+
+    mlir::quantum::QuantumPipeline quantumPipeline;
+    mlir::PassManager loweringPM;
+};
+
+// Loading a dialect into the context isn't synchronized, so the dialects the passes of the workers
+// depend on are loaded before any worker starts, the pass managers then find them loaded already.
+void loadDependentDialects(mlir::MLIRContext &context, llvm::ArrayRef<std::unique_ptr<BatchWorker>> workers) {
+    mlir::DialectRegistry dependentDialects;
+    for (const std::unique_ptr<BatchWorker> &worker : workers) {
+        worker->quantumPipeline.forEachPassManager([&](mlir::PassManager &pm) {
+            pm.getDependentDialects(dependentDialects);
+        });
+        worker->loweringPM.getDependentDialects(dependentDialects);
+    }
+    dependentDialects.loadAll(&context);
+}
+
+// Workers compiling identical modules share a cached object, the first one compiles and stores it
+// while holding the lock of its path, the others wait and then load it instead of compiling it
+// again (or reading a partially written object).
+static std::mutex cachedObjectLocksMutex;
+static llvm::StringMap<std::unique_ptr<std::mutex>> cachedObjectLocks;
+
+std::mutex &getCachedObjectLock(llvm::StringRef objectPath) {
+    std::lock_guard<std::mutex> lock(cachedObjectLocksMutex);
+    std::unique_ptr<std::mutex> &objectLock = cachedObjectLocks[objectPath];
+    if (!objectLock)
+        objectLock = std::make_unique<std::mutex>();
+    return *objectLock;
+}
+
+int processBatchInput(mlir::MLIRContext &context, BatchWorker &worker, llvm::StringRef input,
+                      llvm::StringRef output) {
+    mlir::OwningModuleRef module;
+    if (int error = loadMLIR(input, context, module))
+        return error;
+    if (mlir::failed(worker.quantumPipeline.run(*module)))
+        return 4;
+
+    if (emitAction == Action::DumpBytecode) {
+        return writeBatchOutput(input, output, [&](llvm::raw_ostream &os) {
+            mlir::quantum::writeBytecode(*module, os);
+            return 0;
+        });
+    }
+
+    std::string objectPath;
+    std::unique_lock<std::mutex> objectLock;
+    if (emitAction == Action::RunJIT && !objectCacheDir.empty() && profileFile.empty()) {
+        objectPath = getCachedObjectPath(*module);
+        objectLock = std::unique_lock<std::mutex>(getCachedObjectLock(objectPath));
+        CachedObject cached;
+        if (loadCachedObject(objectPath, cached))
+            return runCachedObject(cached, input);
+    }
+
+    if (mlir::failed(worker.loweringPM.run(*module)))
+        return 4;
+
+    if (emitAction <= Action::DumpMLIRLLVM) {
+        return writeBatchOutput(input, output, [&](llvm::raw_ostream &os) {
+            module->print(os);
+            os << "\n";
+            return 0;
+        });
+    }
+    if (emitAction == Action::DumpLLVMIR) {
+        return writeBatchOutput(input, output, [&](llvm::raw_ostream &os) {
+            return dumpLLVMIR(*module, os);
+        });
+    }
+    return runJit(*module, objectPath, input);
+}
+
+// compile many independent inputs concurrently in a single context
+int processBatch(mlir::MLIRContext &context) {
+    if (streamInput) {
+        llvm::errs() << "Batch compilation can't be combined with streaming\n";
+        return -1;
+    }
+    if (emitAction == Action::None) {
+        llvm::errs() << "No action specified (parsing only?), use -emit=<action>\n";
+        return -1;
+    }
+    if (emitAction == Action::DumpBytecode && batchOutputDir.empty()) {
+        llvm::errs() << "Bytecode output of batch compilation needs -batch-output-dir\n";
+        return -1;
+    }
+
+    std::vector<std::string> inputs;
+    if (int error = collectBatchInputs(inputs))
+        return error;
+    if (!batchOutputDir.empty()) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(batchOutputDir)) {
+            llvm::errs() << "Could not create output directory: " << EC.message() << "\n";
+            return -1;
+        }
+    }
+    std::vector<std::string> outputs;
+    if (int error = getBatchOutputPaths(inputs, outputs))
+        return error;
+    if (!objectCacheDir.empty()) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(objectCacheDir)) {
+            llvm::errs() << "Could not create object cache: " << EC.message() << "\n";
+            return -1;
+        }
+    }
+    // the profile of each input is appended to the file
+    if (!profileFile.empty()) {
+        std::error_code EC;
+        llvm::raw_fd_ostream profile(profileFile, EC);
+        if (EC) {
+            llvm::errs() << "Could not open profile file: " << EC.message() << "\n";
+            return -1;
+        }
+    }
+
+    // target initialization isn't thread-safe, do it before any worker starts
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency(batchThreads);
+    unsigned numWorkers = std::min<size_t>(strategy.compute_thread_count(), inputs.size());
+    std::vector<std::unique_ptr<BatchWorker>> workers;
+    for (unsigned i = 0; i < numWorkers; i++)
+        workers.push_back(std::make_unique<BatchWorker>(context));
+    // the parser and bytecode reader of each worker load the dialects of the input on first use,
+    // so all input dialects are loaded up front as well
+    context.getDialectRegistry().loadAll(&context);
+    loadDependentDialects(context, workers);
+
+    std::atomic<size_t> nextInput(0);
+    std::vector<int> results(inputs.size(), 0);
+    llvm::ThreadPool pool(strategy);
+    for (auto &worker : workers) {
+        pool.async([&, worker = worker.get()] {
+            for (size_t i = nextInput++; i < inputs.size(); i = nextInput++)
+                results[i] = processBatchInput(context, *worker, inputs[i], outputs[i]);
+        });
+    }
+    pool.wait();
+
+    int result = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (results[i]) {
+            llvm::errs() << "Failed to compile " << inputs[i] << "\n";
+            result = results[i];
+        }
+    }
+    return result;
+}
+
+// run the pipeline selected on the command line
+int processInput(mlir::MLIRContext &context) {
+    if (!batchInputs.empty())
+        return processBatch(context);
+    if (streamInput)
+        return processStreaming(context);
 
     mlir::OwningModuleRef module;
     if (int error = loadAndProcessMLIR(context, module))
         return error;
 
+    if (emitAction == Action::DumpBytecode) {
+        std::error_code EC;
+        llvm::raw_fd_ostream os(outputFilename, EC);
+        if (EC) {
+            llvm::errs() << "Could not open output file: " << EC.message() << "\n";
+            return -1;
+        }
+        mlir::quantum::writeBytecode(*module, os);
+        return 0;
+    }
+
+    // Repeated runs of the same resource counting program can reuse the compiled object.
+    // Profiles need the circuit names of the module, so profiled programs are always compiled.
+    std::string objectPath;
+    if (emitAction == Action::RunJIT && !objectCacheDir.empty() && profileFile.empty()) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(objectCacheDir)) {
+            llvm::errs() << "Could not create object cache: " << EC.message() << "\n";
+            return -1;
+        }
+        objectPath = getCachedObjectPath(*module);
+        CachedObject cached;
+        if (loadCachedObject(objectPath, cached))
+            return runCachedObject(cached);
+    }
+
+    if (int error = lowerMLIR(context, *module))
+        return error;
+
     // If we aren't exporting to non-mlir, then we are done.
     if (emitAction <= Action::DumpMLIRLLVM) {
         module->dump();
@@ -225,8 +980,33 @@ int main(int argc, char **argv) {
 
     // Otherwise, we must be running the jit.
     if (emitAction == Action::RunJIT)
-        return runJit(*module);
+        return runJit(*module, objectPath);
 
     llvm::errs() << "No action specified (parsing only?), use -emit=<action>\n";
     return -1;
 }
+
+
+int main(int argc, char **argv) {
+    mlir::registerAsmPrinterCLOptions();
+    mlir::registerMLIRContextCLOptions();
+    mlir::registerPassManagerCLOptions();
+
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Quantum compiler\n");
+
+    // The pipelines are built directly, so no passes need to be registered. Only the dialects that
+    // may show up in the input are registered, and loaded once the parser encounters them (or
+    // before the workers start in batch mode). Dialects introduced by the pipeline (e.g. LLVM) are
+    // loaded by the passes that produce them.
+    mlir::MLIRContext context(/*loadAllDialects=*/false);
+    context.getDialectRegistry().insert<mlir::StandardOpsDialect,
+                                        mlir::scf::SCFDialect,
+                                        mlir::vector::VectorDialect,
+                                        mlir::quantum::QuantumDialect,
+                                        mlir::quantumssa::QuantumSSADialect>();
+
+    int result = processInput(context);
+    if (!passReportFile.empty() && writePassReport())
+        return -1;
+    return result;
+}
@@ -0,0 +1,54 @@
+# Run a tool on a test input and compare its output against the `// CHECK: <line>` comments of the
+# input, which have to match whole output lines in the given order. Runs of whitespace compare
+# equal, so that table columns need not be aligned in the comments.
+#
+#   cmake -DTOOL=<tool> -DINPUT=<file> [-DARGS=<args>] [-DOUTPUT_FILE=<file>] [-DPREFIX=<prefix>]
+#         -P CheckOutput.cmake
+#
+# With OUTPUT_FILE, the file written by the tool is checked instead of its standard output. A
+# different PREFIX allows checking several outputs against the same input.
+
+cmake_minimum_required(VERSION 3.16)
+
+if(NOT PREFIX)
+    set(PREFIX CHECK)
+endif()
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+
+execute_process(COMMAND ${TOOL} ${args} ${INPUT}
+                RESULT_VARIABLE result
+                OUTPUT_VARIABLE output)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${INPUT}: ${TOOL} ${ARGS} failed: ${result}")
+endif()
+if(OUTPUT_FILE)
+    file(READ ${OUTPUT_FILE} output)
+endif()
+
+string(REGEX REPLACE "\n" ";" lines "${output}")
+list(LENGTH lines numLines)
+set(index 0)
+
+file(STRINGS ${INPUT} checks REGEX "// ${PREFIX}: ")
+if(NOT checks)
+    message(FATAL_ERROR "${INPUT}: no ${PREFIX} lines")
+endif()
+foreach(check IN LISTS checks)
+    string(REGEX REPLACE ".*// ${PREFIX}: " "" expected "${check}")
+    string(REGEX REPLACE "[ \t]+" " " expected "${expected}")
+    string(STRIP "${expected}" expected)
+
+    set(found FALSE)
+    while(NOT found AND index LESS numLines)
+        list(GET lines ${index} line)
+        math(EXPR index "${index} + 1")
+        string(REGEX REPLACE "[ \t]+" " " line "${line}")
+        string(STRIP "${line}" line)
+        if(line STREQUAL expected)
+            set(found TRUE)
+        endif()
+    endwhile()
+    if(NOT found)
+        message(FATAL_ERROR "${INPUT}: expected \"${expected}\" in the output:\n${output}")
+    endif()
+endforeach()
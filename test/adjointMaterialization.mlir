@@ -0,0 +1,66 @@
+// Adjoint materialization, run via `quantum-opt -materialize-adj`. Both applications of the
+// adjoint of @prep become calls to @prep_adj, which is created once: X, CX, RZ(-0.5), H on the
+// qubits in reverse order, with the extracted qubit inserted back into the register at the end.
+// @prep_adj in turn calls @rot_adj, the adjoint of @rot. Every adjoint is marked with the name of
+// its circuit (adjoint_of). @flip_adj is an unrelated circuit, so the adjoint of @flip is created
+// as @flip_adj_1. The adjoint of @wrapper is kept, as it passes a circuit value to @ignore.
+qs.circ @rot(%phi : f64, %q : !qs.qstate) -> !qs.qstate {
+    %q1 = qs.R(%phi) %q : f64, !qs.qstate -> !qs.qstate
+    qs.return %q1 : !qs.qstate
+}
+
+qs.circ @prep(%r : !qs.rstate<2>) -> !qs.rstate<2> {
+    %phi = constant 0.5 : f64
+    %a, %r1 = qs.extract %r[0] : !qs.rstate<2> -> !qs.qstate, !qs.rstate<1>
+    %a1 = qs.H %a : !qs.qstate -> !qs.qstate
+    %a2 = qs.RZ(%phi) %a1 : f64, !qs.qstate -> !qs.qstate
+    %a3, %r2 = qs.CX %a2, %r1 : !qs.qstate, !qs.rstate<1> -> !qs.qstate, !qs.rstate<1>
+    %a4 = qs.call @rot(%phi, %a3) : f64, !qs.qstate -> !qs.qstate
+    %r3 = qs.X %r2 : !qs.rstate<1> -> !qs.rstate<1>
+    %r4 = qs.scombine %r3 [0], %a4 : !qs.rstate<1>, !qs.qstate -> !qs.rstate<2>
+    qs.return %r4 : !qs.rstate<2>
+}
+
+qs.circ @flip(%q : !qs.qstate) -> !qs.qstate {
+    %q1 = qs.X %q : !qs.qstate -> !qs.qstate
+    %q2 = qs.H %q1 : !qs.qstate -> !qs.qstate
+    qs.return %q2 : !qs.qstate
+}
+
+qs.circ @flip_adj(%q : !qs.qstate) -> !qs.qstate {
+    %q1 = qs.H %q : !qs.qstate -> !qs.qstate
+    qs.return %q1 : !qs.qstate
+}
+
+qs.circ @ignore(%c : !qs.circ, %q : !qs.qstate) -> !qs.qstate {
+    %q1 = qs.H %q : !qs.qstate -> !qs.qstate
+    qs.return %q1 : !qs.qstate
+}
+
+qs.circ @wrapper(%q : !qs.qstate) -> !qs.qstate {
+    %c = qs.getval @flip -> !qs.circ
+    %q1 = qs.call @ignore(%c, %q) : !qs.circ, !qs.qstate -> !qs.qstate
+    qs.return %q1 : !qs.qstate
+}
+
+%r = qs.allocreg(2) -> !qs.rstate<2>
+%r1 = qs.call @prep(%r) : !qs.rstate<2> -> !qs.rstate<2>
+
+%prep = qs.getval @prep -> !qs.circ
+%prepAdj = qs.adj %prep : !qs.circ -> !qs.circ
+%r2 = qs.apply %prepAdj(%r1) : !qs.circ(!qs.rstate<2> -> !qs.rstate<2>)
+%r3 = qs.apply %prepAdj(%r2) : !qs.circ(!qs.rstate<2> -> !qs.rstate<2>)
+
+// two adjoints cancel, a call to @prep
+%prepAdj2 = qs.adj %prepAdj : !qs.circ -> !qs.circ
+%r4 = qs.apply %prepAdj2(%r3) : !qs.circ(!qs.rstate<2> -> !qs.rstate<2>)
+
+%q = qs.alloc -> !qs.qstate
+%q1 = qs.call @flip_adj(%q) : !qs.qstate -> !qs.qstate
+%flip = qs.getval @flip -> !qs.circ
+%flipAdj = qs.adj %flip : !qs.circ -> !qs.circ
+%q2 = qs.apply %flipAdj(%q1) : !qs.circ(!qs.qstate -> !qs.qstate)
+
+%wrapper = qs.getval @wrapper -> !qs.circ
+%wrapperAdj = qs.adj %wrapper : !qs.circ -> !qs.circ
+%q3 = qs.apply %wrapperAdj(%q2) : !qs.circ(!qs.qstate -> !qs.qstate)
@@ -0,0 +1,45 @@
+// Circuit deduplication, run via `quantum-opt -dedup-circ -strip-circ`. @stage1 and @stage2 are
+// identical up to the names of their values, so the call to @stage2 is redirected to @stage1.
+// @layer2 then only differs from @layer1 by the callee that was merged and is merged as well in
+// the second round. @other applies its gates in a different order and is kept. Expect only
+// @stage1, @layer1, @other and the entry code to be left after stripping.
+qs.circ @stage1(%q : !qs.qstate) -> !qs.qstate {
+    %phi = constant 0.5 : f64
+    %q1 = qs.H %q : !qs.qstate -> !qs.qstate
+    %q2 = qs.RZ(%phi) %q1 : f64, !qs.qstate -> !qs.qstate
+    qs.return %q2 : !qs.qstate
+}
+
+qs.circ @stage2(%a : !qs.qstate) -> !qs.qstate {
+    %angle = constant 0.5 : f64
+    %a1 = qs.H %a : !qs.qstate -> !qs.qstate
+    %a2 = qs.RZ(%angle) %a1 : f64, !qs.qstate -> !qs.qstate
+    qs.return %a2 : !qs.qstate
+}
+
+qs.circ @other(%q : !qs.qstate) -> !qs.qstate {
+    %phi = constant 0.5 : f64
+    %q1 = qs.RZ(%phi) %q : f64, !qs.qstate -> !qs.qstate
+    %q2 = qs.H %q1 : !qs.qstate -> !qs.qstate
+    qs.return %q2 : !qs.qstate
+}
+
+qs.circ @layer1(%q : !qs.qstate) -> !qs.qstate {
+    %q1 = qs.call @stage1(%q) : !qs.qstate -> !qs.qstate
+    %q2 = qs.X %q1 : !qs.qstate -> !qs.qstate
+    qs.return %q2 : !qs.qstate
+}
+
+qs.circ @layer2(%q : !qs.qstate) -> !qs.qstate {
+    %q1 = qs.call @stage2(%q) : !qs.qstate -> !qs.qstate
+    %q2 = qs.X %q1 : !qs.qstate -> !qs.qstate
+    qs.return %q2 : !qs.qstate
+}
+
+%q = qs.alloc -> !qs.qstate
+%q1 = qs.call @layer1(%q) : !qs.qstate -> !qs.qstate
+%q2 = qs.call @layer2(%q1) : !qs.qstate -> !qs.qstate
+%q3 = qs.call @other(%q2) : !qs.qstate -> !qs.qstate
+
+%layer = qs.getval @layer2 -> !qs.circ
+%q4 = qs.apply %layer(%q3) : !qs.circ(!qs.qstate -> !qs.qstate)
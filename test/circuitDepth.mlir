@@ -0,0 +1,22 @@
+// Circuit depth, run via `run-jit -emit=jit -metrics=T,depth`. The call to @layer is a barrier,
+// so the depth is 2 (H, CX) + 2 (@layer) + 1 (X) = 5. With `-schedule`, the X on %c is moved
+// in front of the call, where %c is idle, and the depth drops to 4.
+q.circ @layer(%q: !q.qubit) {
+    q.H %q : !q.qubit
+    q.X %q : !q.qubit
+}
+
+q.circ @mlir_main() {
+    %a = q.alloc -> !q.qubit
+    %b = q.alloc -> !q.qubit
+    %c = q.alloc -> !q.qubit
+    q.H %a : !q.qubit
+    q.CX %a, %b : !q.qubit, !q.qubit
+
+    q.call @layer(%a) : !q.qubit
+    q.X %c : !q.qubit
+
+    q.free %a : !q.qubit
+    q.free %b : !q.qubit
+    q.free %c : !q.qubit
+}
@@ -0,0 +1,28 @@
+// Commutation-aware cancellation, run via `quantum-opt -quantum-commute-cancel`. The pass only
+// visits circuit bodies, so the cases are wrapped in a circuit.
+qs.circ @cases(%r : !qs.rstate<4>) -> (!qs.qstate, !qs.qstate, !qs.qstate, !qs.rstate<1>) {
+    %phi = constant 0.5 : f64
+
+    // H pair separated by gates on other qubits of the register
+    %a, %r1 = qs.extract %r[0] : !qs.rstate<4> -> !qs.qstate, !qs.rstate<3>
+    %a1 = qs.H %a : !qs.qstate -> !qs.qstate
+    %r2 = qs.scombine %r1[0], %a1 : !qs.rstate<3>, !qs.qstate -> !qs.rstate<4>
+    %b, %r3 = qs.extract %r2[1] : !qs.rstate<4> -> !qs.qstate, !qs.rstate<3>
+    %b1 = qs.X %b : !qs.qstate -> !qs.qstate
+    %r4 = qs.scombine %r3[1], %b1 : !qs.rstate<3>, !qs.qstate -> !qs.rstate<4>
+    %a2, %r5 = qs.extract %r4[0] : !qs.rstate<4> -> !qs.qstate, !qs.rstate<3>
+    %a3 = qs.H %a2 : !qs.qstate -> !qs.qstate
+
+    // CX pair separated by a rotation on the control and an X on the target
+    %c, %d, %r6 = qs.extract %r5[1, 2] : !qs.rstate<3> -> !qs.qstate, !qs.qstate, !qs.rstate<1>
+    %c1, %d1 = qs.CX %c, %d : !qs.qstate, !qs.qstate -> !qs.qstate, !qs.qstate
+    %c2 = qs.RZ(%phi) %c1 : f64, !qs.qstate -> !qs.qstate
+    %d2 = qs.X %d1 : !qs.qstate -> !qs.qstate
+    %c3, %d3 = qs.CX %c2, %d2 : !qs.qstate, !qs.qstate -> !qs.qstate, !qs.qstate
+
+    // not cancelled: the H on the target does not commute with CX
+    %d4 = qs.H %d3 : !qs.qstate -> !qs.qstate
+    %c4, %d5 = qs.CX %c3, %d4 : !qs.qstate, !qs.qstate -> !qs.qstate, !qs.qstate
+
+    qs.return %a3, %c4, %d5, %r6 : !qs.qstate, !qs.qstate, !qs.qstate, !qs.rstate<1>
+}
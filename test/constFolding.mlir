@@ -17,3 +17,20 @@
 // merge rotations
 %r3 = qs.R(%phi) %r2 : f64, !qs.rstate<8> -> !qs.rstate<8>
 %r4 = qs.R(%theta) %r3 : f64, !qs.rstate<8> -> !qs.rstate<8>
+
+// rotation chains, inside a circuit like the code the optimizations usually see
+qs.circ @rotationChains(%q : !qs.qstate) -> !qs.qstate {
+    %phi = constant 0.5 : f64
+    %theta = constant 0.3 : f64
+    %pi = constant 3.14159265358979323846 : f64
+
+    // merge a whole rotation chain, folding constant angles
+    %q1 = qs.RZ(%phi) %q : f64, !qs.qstate -> !qs.qstate
+    %q2 = qs.RZ(%pi) %q1 : f64, !qs.qstate -> !qs.qstate
+    %q3 = qs.RZ(%theta) %q2 : f64, !qs.qstate -> !qs.qstate
+
+    // remove rotations whose angle folds to zero
+    %q4 = qs.R(%pi) %q3 : f64, !qs.qstate -> !qs.qstate
+    %q5 = qs.R(%pi) %q4 : f64, !qs.qstate -> !qs.qstate
+    qs.return %q5 : !qs.qstate
+}
@@ -0,0 +1,30 @@
+// Resource estimation of circuits on registers of dynamic size, run via `run-jit -emit=jit` (optionally with
+// `-summarize`). The counts of @layer scale with the register width passed by each caller, without
+// specializing the circuit for every width. Per register qubit: R = 5 + 5 + 1, T = 14 + 28,
+// plus T = 7 per call for the Toffoli. Expect R = 11*8 + 11*5 = 143, T = 42*8 + 42*5 + 2*7 = 560.
+q.circ @layer(%r: !q.qureg<>, %c: !q.qubit, %d: !q.qubit, %e: !q.qubit) {
+    // one doubly and one triply controlled rotation per register qubit
+    %op = q.R(0.5) -> !q.u1
+    %cop = q.ctrl %op, %c : !q.u1, !q.qubit -> !q.cop<1, !q.u1>
+    q.ctrl %cop, %d, %r : !q.cop<1, !q.u1>, !q.qubit, !q.qureg<>
+    %cop2 = q.ctrl %cop, %d : !q.cop<1, !q.u1>, !q.qubit -> !q.cop<2, !q.u1>
+    q.ctrl %cop2, %e, %r : !q.cop<2, !q.u1>, !q.qubit, !q.qureg<>
+    // one uncontrolled rotation per register qubit
+    q.R(0.25) %r : !q.qureg<>
+    // a Toffoli
+    %x = q.X -> !q.u1
+    %cx = q.ctrl %x, %c : !q.u1, !q.qubit -> !q.cop<1, !q.u1>
+    q.ctrl %cx, %d, %e : !q.cop<1, !q.u1>, !q.qubit, !q.qubit
+}
+
+q.circ @mlir_main() {
+    %n = constant 8 : index
+    %m = constant 5 : index
+    %a = q.allocreg(%n) -> !q.qureg<>
+    %b = q.allocreg(%m) -> !q.qureg<>
+    %c = q.alloc -> !q.qubit
+    %d = q.alloc -> !q.qubit
+    %e = q.alloc -> !q.qubit
+    q.call @layer(%a, %c, %d, %e) : !q.qureg<>, !q.qubit, !q.qubit, !q.qubit
+    q.call @layer(%b, %c, %d, %e) : !q.qureg<>, !q.qubit, !q.qubit, !q.qubit
+}
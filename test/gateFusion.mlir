@@ -0,0 +1,21 @@
+// Gate fusion, run via `quantum-opt -quantum-fuse-gates`. The pass only processes circuit bodies,
+// so the cases are wrapped in a circuit.
+qs.circ @cases(%r : !qs.rstate<3>) -> (!qs.qstate, !qs.qstate, !qs.qstate, i1) {
+    %phi = constant 0.5 : f64
+
+    // H, CX and RZ on two qubits fuse into one 4x4 unitary
+    %a, %b, %r1 = qs.extract %r[0, 1] : !qs.rstate<3> -> !qs.qstate, !qs.qstate, !qs.rstate<1>
+    %a1 = qs.H %a : !qs.qstate -> !qs.qstate
+    %a2, %b1 = qs.CX %a1, %b : !qs.qstate, !qs.qstate -> !qs.qstate, !qs.qstate
+    %b2 = qs.RZ(%phi) %b1 : f64, !qs.qstate -> !qs.qstate
+
+    // a third qubit joins the group for max-qubits >= 3
+    %c, %r2 = qs.extract %r1[0] : !qs.rstate<1> -> !qs.qstate, !qs.rstate<0>
+    %b3, %c1 = qs.CX %b2, %c : !qs.qstate, !qs.qstate -> !qs.qstate, !qs.qstate
+
+    // the measurement closes the group
+    %a3, %m = qs.meas %a2 : !qs.qstate -> !qs.qstate, i1
+    %a4 = qs.X %a3 : !qs.qstate -> !qs.qstate
+
+    qs.return %a4, %b3, %c1, %m : !qs.qstate, !qs.qstate, !qs.qstate, i1
+}
@@ -0,0 +1,13 @@
+// Object cache, run twice via `run-jit -emit=jit -simulate -object-cache=<dir>` starting from an
+// empty cache directory. The first run compiles the module and stores its object in the cache, the
+// second run loads the object instead. Both runs print the measurement of the flipped qubit.
+q.circ @main() {
+    %q = q.alloc -> !q.qubit
+    q.X %q : !q.qubit
+    %m = q.meas %q : !q.qubit -> i1
+    %v = zexti %m : i1 to i32
+    vector.print %v : i32
+    q.free %q : !q.qubit
+}
+
+// CHECK: 1
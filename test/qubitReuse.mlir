@@ -0,0 +1,16 @@
+// Qubit reuse, run via `run-jit -emit=jit -reuse -peak-qubits`. Each qubit is freed at the end,
+// but %a is no longer used after the H, so %b takes its place: the peak number of live qubits
+// drops from 3 to 2 (R = 0, T = 0 are printed before the peak).
+q.circ @mlir_main() {
+    %a = q.alloc -> !q.qubit
+    q.H %a : !q.qubit
+
+    %b = q.alloc -> !q.qubit
+    q.X %b : !q.qubit
+    %c = q.alloc -> !q.qubit
+    q.CX %b, %c : !q.qubit, !q.qubit
+
+    q.free %a : !q.qubit
+    q.free %b : !q.qubit
+    q.free %c : !q.qubit
+}
@@ -1,4 +1,4 @@
-// Extract/Combine consolidations
+// Extract/Combine consolidations (-canonicalize or -quantum-consolidate-regs)
 qs.circ @consolidate(%r0 : !qs.rstate<2>) -> !qs.rstate<2> {
 
     %q0_0, %rem0 = qs.extract %r0[0] : !qs.rstate<2> -> !qs.qstate, !qs.rstate<1>
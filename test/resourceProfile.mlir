@@ -0,0 +1,28 @@
+// Per-circuit resource profile, run via `run-jit -emit=jit -profile=<file>`. The totals printed at
+// the end are R = 3 * 3 = 9, the profile lists @layer with 3 calls and R = 9, ahead of @rot with
+// 6 calls and R = 6, as the cost of @layer includes its calls to @rot.
+// PROFILE: circuit calls R
+// PROFILE: layer 3 9
+// PROFILE: rot 6 6
+q.circ @rot(%q: !q.qubit) {
+    q.RZ(0.5) %q : !q.qubit
+}
+
+q.circ @layer(%a: !q.qubit, %b: !q.qubit) {
+    q.call @rot(%a) : !q.qubit
+    q.R(0.25) %b : !q.qubit
+    q.call @rot(%b) : !q.qubit
+}
+
+q.circ @mlir_main() {
+    %a = q.alloc -> !q.qubit
+    %b = q.alloc -> !q.qubit
+    %c0 = constant 0 : index
+    %c1 = constant 1 : index
+    %c3 = constant 3 : index
+    scf.for %i = %c0 to %c3 step %c1 {
+        q.call @layer(%a, %b) : !q.qubit, !q.qubit
+    }
+    q.free %a : !q.qubit
+    q.free %b : !q.qubit
+}
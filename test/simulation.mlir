@@ -0,0 +1,41 @@
+// State-vector simulation, run via `run-jit -emit=jit -simulate` (and with `-fuse=2`). The circuit
+// is deterministic: %a is flipped and copied onto %b by a CNOT, while the two Hadamards on %c
+// cancel out and the Toffoli on %d is not triggered as %c is 0. The measurements are printed as
+// the bits a b c d of a single integer, 0b1100 = 12.
+q.circ @main() {
+    %a = q.alloc -> !q.qubit
+    %b = q.alloc -> !q.qubit
+    %c = q.alloc -> !q.qubit
+    %d = q.alloc -> !q.qubit
+    q.X %a : !q.qubit
+    q.CX %a, %b : !q.qubit, !q.qubit
+    q.H %c : !q.qubit
+    q.H %c : !q.qubit
+    %x = q.X -> !q.u1
+    %cx = q.ctrl %x, %a : !q.u1, !q.qubit -> !q.cop<1, !q.u1>
+    q.ctrl %cx, %c, %d : !q.cop<1, !q.u1>, !q.qubit, !q.qubit
+
+    %ma = q.meas %a : !q.qubit -> i1
+    %mb = q.meas %b : !q.qubit -> i1
+    %mc = q.meas %c : !q.qubit -> i1
+    %md = q.meas %d : !q.qubit -> i1
+    %va = zexti %ma : i1 to i32
+    %vb = zexti %mb : i1 to i32
+    %vc = zexti %mc : i1 to i32
+    %vd = zexti %md : i1 to i32
+    %c2 = constant 2 : i32
+    %r1 = muli %va, %c2 : i32
+    %r2 = addi %r1, %vb : i32
+    %r3 = muli %r2, %c2 : i32
+    %r4 = addi %r3, %vc : i32
+    %r5 = muli %r4, %c2 : i32
+    %r6 = addi %r5, %vd : i32
+    vector.print %r6 : i32
+
+    q.free %a : !q.qubit
+    q.free %b : !q.qubit
+    q.free %c : !q.qubit
+    q.free %d : !q.qubit
+}
+
+// CHECK: 12
@@ -13,6 +13,9 @@
 qs.free %q0_0 : !qs.qstate
 qs.freereg %r0_0 : !qs.rstate<4>
 
+%q1_r = qs.reset %q1_0 : !qs.qstate -> !qs.qstate
+%r1_r = qs.reset %r1_0 : !qs.rstate<> -> !qs.rstate<>
+
 %h = qs.H -> !qs.u1
 %q0_1 = qs.H %q0_0 : !qs.qstate -> !qs.qstate
 %q0_2 = qs.H %q0_0 : !qs.qstate -> !qs.qstate       // state reuse is illegal but not enforced